@@ -25,6 +25,7 @@
 #include "usb_moded-android.h"
 
 #include "usb_moded-config-private.h"
+#include "usb_moded-identity.h"
 #include "usb_moded-log.h"
 #include "usb_moded-mac.h"
 #include "usb_moded-modesetting.h"
@@ -43,7 +44,6 @@
 static bool  android_write_file       (const char *path, const char *text);
 bool         android_in_use           (void);
 static bool  android_probe            (void);
-gchar       *android_get_serial       (void);
 bool         android_init             (void);
 void         android_quit             (void);
 bool         android_set_enabled      (bool enable);
@@ -112,57 +112,6 @@ android_probe(void)
     return android_in_use();
 }
 
-/** Read android serial number from kernel command line
- */
-gchar *
-android_get_serial(void)
-{
-    LOG_REGISTER_CONTEXT;
-
-    static const char path[] = "/proc/cmdline";
-    static const char find[] = "androidboot.serialno=";
-    static const char pbrk[] = " \t\r\n,";
-
-    char   *res  = 0;
-    FILE   *file = 0;
-    size_t  size = 0;
-    char   *data = 0;
-
-    if( !(file = fopen(path, "r")) ) {
-        log_warning("%s: %s: %m", path, "can't open");
-        goto EXIT;
-    }
-
-    if( getline(&data, &size, file) < 0 ) {
-        log_warning("%s: %s: %m", path, "can't read");
-        goto EXIT;
-    }
-
-    char *beg = strstr(data, find);
-    if( !beg ) {
-        log_warning("%s: no serial found", path);
-        goto EXIT;
-    }
-
-    beg += sizeof find - 1;
-    size_t len = strcspn(beg, pbrk);
-    if( len < 1 ) {
-        log_warning("%s: empty serial found", path);
-        goto EXIT;
-    }
-
-    res = g_strndup(beg, len);
-
-EXIT:
-
-    free(data);
-
-    if( file )
-        fclose(file);
-
-    return res;
-}
-
 /** initialize the basic android values
  *
  * @return true if android usb backend is ready for use, false otherwise
@@ -181,11 +130,9 @@ android_init(void)
     android_set_enabled(false);
 
     /* Configure */
-    if( (text = android_get_serial()) )
-    {
-        android_write_file(ANDROID0_SERIAL, text);
-        g_free(text);
-    }
+    const char *serial = identity_get_serial();
+    if( serial )
+        android_write_file(ANDROID0_SERIAL, serial);
 
     text = config_get_android_manufacturer();
     if(text)
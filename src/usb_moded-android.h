@@ -50,7 +50,6 @@
  * ------------------------------------------------------------------------- */
 
 bool   android_in_use           (void);
-gchar *android_get_serial       (void);
 bool   android_init             (void);
 void   android_quit             (void);
 bool   android_set_enabled      (bool enable);
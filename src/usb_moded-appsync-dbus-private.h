@@ -32,6 +32,8 @@
 
 # include <glib.h>
 
+# include <dbus/dbus.h>
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -40,9 +42,11 @@
  * DBUSAPPSYNC
  * ------------------------------------------------------------------------- */
 
-gboolean dbusappsync_init_connection(void);
-gboolean dbusappsync_init           (void);
-void     dbusappsync_cleanup        (void);
-int      dbusappsync_launch_app     (char *launch);
+gboolean         dbusappsync_init_connection  (void);
+gboolean         dbusappsync_init             (void);
+void             dbusappsync_cleanup          (void);
+int              dbusappsync_launch_app       (char *launch);
+DBusPendingCall *dbusappsync_launch_app_begin (const char *launch);
+int              dbusappsync_launch_app_finish(DBusPendingCall *pc, const char *launch);
 
 #endif /* USB_MODED_APPSYNC_DBUS_PRIVATE_H_ */
@@ -50,6 +50,8 @@ gboolean                 dbusappsync_init_connection   (void);
 gboolean                 dbusappsync_init              (void);
 void                     dbusappsync_cleanup           (void);
 int                      dbusappsync_launch_app        (char *launch);
+DBusPendingCall         *dbusappsync_launch_app_begin  (const char *launch);
+int                      dbusappsync_launch_app_finish (DBusPendingCall *pc, const char *launch);
 
 /* ========================================================================= *
  * Data
@@ -385,3 +387,101 @@ int dbusappsync_launch_app(char *launch)
     }
     return ret;
 }
+
+/** Start launching application over dbus without waiting for reply
+ *
+ * @param launch  service name to activate
+ *
+ * @return pending call to pass to #dbusappsync_launch_app_finish(),
+ *         or NULL on failure
+ */
+DBusPendingCall *dbusappsync_launch_app_begin(const char *launch)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusMessage     *req   = NULL;
+    DBusPendingCall *pc    = NULL;
+    dbus_uint32_t    flags = 0;
+
+    if( dbus_connection_ses == 0 )
+    {
+        log_err("could not start '%s': no session bus connection", launch);
+        goto EXIT;
+    }
+
+    req = dbus_message_new_method_call(DBUS_SERVICE_DBUS,
+                                       DBUS_PATH_DBUS,
+                                       DBUS_INTERFACE_DBUS,
+                                       "StartServiceByName");
+    if( !req )
+        goto EXIT;
+
+    if( !dbus_message_append_args(req,
+                                  DBUS_TYPE_STRING, &launch,
+                                  DBUS_TYPE_UINT32, &flags,
+                                  DBUS_TYPE_INVALID) )
+        goto EXIT;
+
+    if( !dbus_connection_send_with_reply(dbus_connection_ses, req, &pc, -1) )
+        pc = NULL;
+
+EXIT:
+    if( req )
+        dbus_message_unref(req);
+
+    if( !pc )
+        log_err("could not start '%s': failed to send request", launch);
+
+    return pc;
+}
+
+/** Wait for application launched over dbus to get started
+ *
+ * The session bus connection is not attached to the mainloop, so the
+ * reply is received by blocking. As all launch requests are sent
+ * before waiting for any of them, the activations proceed in parallel.
+ *
+ * @param pc      pending call from #dbusappsync_launch_app_begin(),
+ *                ownership is transferred
+ * @param launch  service name that was activated
+ *
+ * @return 0 on success, or -1 on failure
+ */
+int dbusappsync_launch_app_finish(DBusPendingCall *pc, const char *launch)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int          ret   = -1; // assume failure
+    DBusMessage *rsp   = NULL;
+    DBusError    error = DBUS_ERROR_INIT;
+
+    if( !pc )
+        goto EXIT;
+
+    dbus_pending_call_block(pc);
+
+    if( !(rsp = dbus_pending_call_steal_reply(pc)) )
+    {
+        log_err("could not start '%s': no reply", launch);
+        goto EXIT;
+    }
+
+    if( dbus_set_error_from_message(&error, rsp) )
+    {
+        log_err("could not start '%s': %s: %s", launch, error.name, error.message);
+        goto EXIT;
+    }
+
+    ret = 0; // success
+
+EXIT:
+    dbus_error_free(&error);
+
+    if( rsp )
+        dbus_message_unref(rsp);
+
+    if( pc )
+        dbus_pending_call_unref(pc);
+
+    return ret;
+}
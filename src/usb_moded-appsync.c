@@ -30,11 +30,16 @@
 #include "usb_moded-appsync.h"
 
 #include "usb_moded.h"
+#include "usb_moded-config-private.h"
+#include "usb_moded-dhcpd.h"
 #include "usb_moded-log.h"
 #include "usb_moded-systemd.h"
+#include "usb_moded-filecache.h"
+#ifdef APP_SYNC_DBUS
+# include "usb_moded-appsync-dbus-private.h"
+#endif
 
 #include <unistd.h>
-#include <glob.h>
 
 /* ========================================================================= *
  * Types
@@ -64,6 +69,24 @@ typedef struct application_t
     int          post;     /**< marker to indicate when to start the app */
 } application_t;
 
+/** Application start / stop request in progress
+ *
+ * Holds copies of relevant application details so that requests can
+ * be made and waited for without holding the appsync lock.
+ */
+typedef struct appsync_launch_t
+{
+    gchar            *al_name;     /**< name of the app */
+    gchar            *al_launch;   /**< dbus launch command/address */
+    bool              al_systemd;  /**< start / stop via systemd */
+    bool              al_skipped;  /**< nothing to do, feign success */
+    bool              al_ok;       /**< request succeeded */
+    systemd_job_t    *al_job;      /**< systemd unit job, or NULL */
+#ifdef APP_SYNC_DBUS
+    DBusPendingCall  *al_pc;       /**< pending dbus activation, or NULL */
+#endif
+} appsync_launch_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -73,7 +96,9 @@ typedef struct application_t
  * ------------------------------------------------------------------------- */
 
 static bool           application_is_valid  (const application_t *self);
-static application_t *application_load      (const char *filename);
+static application_t *application_parse     (GKeyFile *keyfile, const char *filename);
+static gpointer       application_load_cb   (GKeyFile *keyfile, const char *filename);
+static application_t *application_copy      (const application_t *that);
 static void           application_free      (application_t *self);
 static void           application_free_cb   (gpointer self);
 static gint           application_compare_cb(gconstpointer a, gconstpointer b);
@@ -83,7 +108,18 @@ static gint           application_compare_cb(gconstpointer a, gconstpointer b);
  * ------------------------------------------------------------------------- */
 
 static void   applist_free(GList *list);
-static GList *applist_load(const char *conf_dir);
+static GList *applist_load(filecache_t *cache);
+
+/* ------------------------------------------------------------------------- *
+ * APPSYNC_LAUNCH
+ * ------------------------------------------------------------------------- */
+
+static appsync_launch_t *appsync_launch_create   (const application_t *app, bool skip);
+static void              appsync_launch_delete   (appsync_launch_t *self);
+static void              appsync_launch_delete_cb(gpointer self);
+static void              appsync_launch_begin    (appsync_launch_t *self, const char *method);
+static void              appsync_launch_finish   (appsync_launch_t *self);
+static void              appsync_launch_execute  (GPtrArray *launches, const char *method);
 
 /* ------------------------------------------------------------------------- *
  * APPSYNC
@@ -102,7 +138,10 @@ static void     appsync_start_enumerate_usb_timer (void);
 static void     appsync_cancel_enumerate_usb_timer(void);
 static void     appsync_enumerate_usb             (void);
 #endif
-static void     appsync_stop_apps                 (int post);
+static GPtrArray *appsync_collect_launches_locked(const char *mode, int post);
+static int      appsync_mark_launches             (GPtrArray *launches, int post);
+static GPtrArray *appsync_stop_apps_locked        (int post);
+static void     appsync_stop_apps                 (GPtrArray *launches);
 void            appsync_deactivate_pre            (void);
 void            appsync_deactivate_post           (void);
 void            appsync_deactivate_all            (bool force);
@@ -136,6 +175,12 @@ static GList *appsync_apps_curr = NULL;
 static GList *appsync_apps_next = NULL;
 static bool appsync_apps_updated = false;
 
+/** Tracking data for appsync configuration files
+ *
+ * Accessed only from the main thread.
+ */
+static filecache_t *appsync_apps_files = NULL;
+
 #ifdef APP_SYNC_DBUS
 static guint appsync_enumerate_usb_id = 0;
 static struct timeval appsync_sync_tv = {0, 0};
@@ -162,29 +207,21 @@ static bool application_is_valid(const application_t *self)
     return self && self->name && self->mode && (self->systemd || self->launch);
 }
 
-/** Load application object from ini-file
+/** Parse application object from ini-file content
  *
- * @param filename  Path to an ini-file
+ * @param keyfile   Parsed ini-file
+ * @param filename  Path to the ini-file, for diagnostic logging
  *
  * @returns application object pointer, or NULL in case of errors
  */
-static application_t *application_load(const char *filename)
+static application_t *application_parse(GKeyFile *keyfile, const char *filename)
 {
     LOG_REGISTER_CONTEXT;
 
     application_t *self   = NULL;
-    GKeyFile     *keyfile = NULL;
 
     log_debug("loading appsync file: %s", filename);
 
-    if( !(keyfile = g_key_file_new()) )
-        goto cleanup;
-
-    if( !g_key_file_load_from_file(keyfile, filename, G_KEY_FILE_NONE, NULL) ) {
-        log_warning("failed to load appsync file: %s", filename);
-        goto cleanup;
-    }
-
     if( !(self = calloc(1, sizeof *self)) )
         goto cleanup;
 
@@ -207,9 +244,6 @@ static application_t *application_load(const char *filename)
 
 cleanup:
 
-    if(keyfile)
-        g_key_file_free(keyfile);
-
     /* if a minimum set of required elements is not filled in we discard the list_item */
     if( self && !application_is_valid(self) ) {
         log_warning("discarding invalid appsync file: %s", filename);
@@ -220,6 +254,45 @@ cleanup:
     return self;
 }
 
+/** Callback for constructing application objects in file cache
+ *
+ * @param keyfile   Parsed ini-file
+ * @param filename  Path to the ini-file, for diagnostic logging
+ *
+ * @returns application object pointer, or NULL in case of errors
+ */
+static gpointer application_load_cb(GKeyFile *keyfile, const char *filename)
+{
+    return application_parse(keyfile, filename);
+}
+
+/** Make a copy of application object
+ *
+ * Application objects hold activation state, so lists taken in
+ * use must not share objects with the file cache.
+ *
+ * @param that  Application object to copy
+ *
+ * @returns application object pointer, or NULL in case of errors
+ */
+static application_t *application_copy(const application_t *that)
+{
+    LOG_REGISTER_CONTEXT;
+
+    application_t *self = calloc(1, sizeof *self);
+
+    if( self ) {
+        self->name    = g_strdup(that->name);
+        self->mode    = g_strdup(that->mode);
+        self->launch  = g_strdup(that->launch);
+        self->state   = APP_STATE_DONTCARE;
+        self->systemd = that->systemd;
+        self->post    = that->post;
+    }
+
+    return self;
+}
+
 /** Release dynamic memory associated with an application object
  *
  * @param self  Application object, or NULL
@@ -278,44 +351,178 @@ static void applist_free(GList *list)
 
 /** Load a list of application objects
  *
- * @param conf_dir  Path to directory containing ini-files
+ * @param cache  File cache tracking appsync ini-files
  *
  * @returns list of application objects, or
  *          NULL if no files were present / could be loaded
  */
-static GList *applist_load(const char *conf_dir)
+static GList *applist_load(filecache_t *cache)
 {
     LOG_REGISTER_CONTEXT;
 
     GList *list = 0;
-    gchar *pat  = 0;
-    glob_t gb   = {};
 
-    if( !(pat = g_strdup_printf("%s/*.ini", conf_dir)) )
-        goto cleanup;
+    for( GList *iter = filecache_get_objects(cache); iter; iter = iter->next ) {
+        application_t *application = application_copy(iter->data);
+        if( application )
+            list = g_list_prepend(list, application);
+    }
 
-    if( glob(pat, 0, 0, &gb) != 0 ) {
+    if( list ) {
+        /* sort list alphabetically so that start requests for
+         * a mode are always sent and logged in the same order -
+         * note that the apps are not waited for one by one and
+         * can finish starting in any order, so any dependencies
+         * between them must be expressed in systemd units */
+        list = g_list_sort(list, application_compare_cb);
+    }
+    else {
         log_debug("no appsync ini-files found");
-        goto cleanup;
     }
 
-    for( size_t i = 0; i < gb.gl_pathc; ++i ) {
-        application_t *application = application_load(gb.gl_pathv[i]);
-        if( application )
-            list = g_list_append(list, application);
+    return list;
+}
+
+/* ========================================================================= *
+ * APPSYNC_LAUNCH
+ * ========================================================================= */
+
+/** Create application start / stop request
+ *
+ * @param app   Application object
+ * @param skip  true if request should not be made, but treated
+ *              as successful
+ *
+ * @return request object
+ */
+static appsync_launch_t *appsync_launch_create(const application_t *app, bool skip)
+{
+    LOG_REGISTER_CONTEXT;
+
+    appsync_launch_t *self = g_malloc0(sizeof *self);
+
+    self->al_name    = g_strdup(app->name);
+    self->al_launch  = g_strdup(app->launch);
+    self->al_systemd = app->systemd != 0;
+    self->al_skipped = skip;
+
+    return self;
+}
+
+/** Release application start / stop request
+ *
+ * @param self  Request object, or NULL
+ */
+static void appsync_launch_delete(appsync_launch_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self ) {
+        systemd_job_free(self->al_job);
+#ifdef APP_SYNC_DBUS
+        if( self->al_pc ) {
+            dbus_pending_call_cancel(self->al_pc);
+            dbus_pending_call_unref(self->al_pc);
+        }
+#endif
+        g_free(self->al_name);
+        g_free(self->al_launch);
+        g_free(self);
     }
+}
 
-    if( list ) {
-        /* sort list alphabetically so services for a mode
-         * can be run in a certain order */
-        list = g_list_sort(list, application_compare_cb);
+/** GDestroyNotify type object destroy callback
+ *
+ * @param self  Request object as void pointer, or NULL
+ */
+static void appsync_launch_delete_cb(gpointer self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    appsync_launch_delete(self);
+}
+
+/** Send application start / stop request without waiting for completion
+ *
+ * @param self    Request object
+ * @param method  SYSTEMD_START or SYSTEMD_STOP
+ */
+static void appsync_launch_begin(appsync_launch_t *self, const char *method)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self->al_skipped ) {
+        log_debug("dbus app %s ignored", self->al_name);
     }
+    else if( self->al_systemd ) {
+        self->al_job = systemd_job_start(self->al_name, method);
+    }
+#ifdef APP_SYNC_DBUS
+    else if( self->al_launch && !strcmp(method, SYSTEMD_START) ) {
+        self->al_pc = dbusappsync_launch_app_begin(self->al_launch);
+    }
+#endif
+}
 
-cleanup:
-    globfree(&gb);
-    g_free(pat);
+/** Collect application start / stop result
+ *
+ * @param self  Request object
+ */
+static void appsync_launch_finish(appsync_launch_t *self)
+{
+    LOG_REGISTER_CONTEXT;
 
-    return list;
+    if( self->al_skipped ) {
+        /* FIXME: feigning success here allows pre-enum actions
+         *        to be "completed" despite of failures or lack
+         *        of support for installed configuration items.
+         *        Does that make any sense?
+         */
+        self->al_ok = true;
+    }
+    else if( self->al_job ) {
+        self->al_ok = systemd_job_succeeded(self->al_job);
+    }
+#ifdef APP_SYNC_DBUS
+    else if( self->al_pc ) {
+        DBusPendingCall *pc = self->al_pc;
+        self->al_pc = 0;
+        self->al_ok = dbusappsync_launch_app_finish(pc, self->al_launch) == 0;
+    }
+#endif
+}
+
+/** Execute application start / stop requests in parallel
+ *
+ * All requests are sent before waiting for any replies, so the
+ * time taken is determined by the slowest application.
+ *
+ * @param launches  Array of request objects
+ * @param method    SYSTEMD_START or SYSTEMD_STOP
+ *
+ * @note Must be called without holding the appsync lock.
+ */
+static void appsync_launch_execute(GPtrArray *launches, const char *method)
+{
+    LOG_REGISTER_CONTEXT;
+
+    systemd_job_t **jobs  = g_malloc0_n(launches->len + 1, sizeof *jobs);
+    size_t          count = 0;
+
+    for( guint i = 0; i < launches->len; ++i ) {
+        appsync_launch_t *launch = g_ptr_array_index(launches, i);
+        appsync_launch_begin(launch, method);
+        if( launch->al_job )
+            jobs[count++] = launch->al_job;
+    }
+
+    if( count > 0 )
+        systemd_job_wait(jobs, count, SYSTEMD_JOB_TIMEOUT);
+
+    for( guint i = 0; i < launches->len; ++i )
+        appsync_launch_finish(g_ptr_array_index(launches, i));
+
+    g_free(jobs);
 }
 
 /* ========================================================================= *
@@ -363,6 +570,9 @@ void appsync_free_configuration(void)
     }
 
     APPSYNC_LOCKED_LEAVE;
+
+    filecache_delete(appsync_apps_files),
+        appsync_apps_files = 0;
 }
 
 /** Load appsync configuration data
@@ -376,13 +586,33 @@ void appsync_free_configuration(void)
  * and taken in use by calling appsync_switch_configuration() in an
  * apprioriate time - presently when worker thread is executing mode
  * transition and has cleaned up previously active usb mode.
+ *
+ * Only added and modified ini-files are parsed, and if nothing has
+ * changed since the previous load, the current configuration is kept.
+ *
+ * Note: This function should be called only from the main thread.
  */
 void appsync_load_configuration(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    GList *applist = applist_load(usbmoded_get_diag_mode() ?
-                                  CONF_DIR_DIAG_PATH : CONF_DIR_PATH);
+    GList *applist = 0;
+    bool   initial = !appsync_apps_files;
+
+    if( initial ) {
+        gchar *pat = g_strdup_printf("%s/*.ini", usbmoded_get_diag_mode() ?
+                                     CONF_DIR_DIAG_PATH : CONF_DIR_PATH);
+        appsync_apps_files = filecache_create(pat, application_load_cb,
+                                              application_free_cb);
+        g_free(pat);
+    }
+
+    if( !filecache_scan(appsync_apps_files) && !initial ) {
+        log_debug("appsync config unchanged");
+        return;
+    }
+
+    applist = applist_load(appsync_apps_files);
 
     APPSYNC_LOCKED_ENTER;
 
@@ -414,6 +644,91 @@ void appsync_load_configuration(void)
     APPSYNC_LOCKED_LEAVE;
 }
 
+/** Collect applications to launch for given mode
+ *
+ * @param mode  Name of usb-mode
+ * @param post  0=pre-enum apps, or 1=post-enum apps
+ *
+ * @note Assumes that appsync configuration data is already locked.
+ *
+ * @return array of launch requests to pass to #appsync_launch_execute()
+ */
+static GPtrArray *appsync_collect_launches_locked(const char *mode, int post)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GPtrArray *launches = g_ptr_array_new_with_free_func(appsync_launch_delete_cb);
+    bool       dhcpd    = config_get_dhcp_setting(DHCP_BUILTIN_KEY, 0) != 0;
+
+    for( GList *iter = appsync_apps_curr; iter; iter = g_list_next(iter) )
+    {
+        application_t *application = iter->data;
+
+        if( strcmp(application->mode, mode) || application->post != post )
+            continue;
+
+        if( dhcpd && application->systemd &&
+            !strcmp(application->name, DHCPD_EXTERNAL_SERVICE) ) {
+            log_debug("%s replaced by built-in DHCP server",
+                      application->name);
+            application->state = APP_STATE_DONTCARE;
+            continue;
+        }
+
+        log_debug("launching %s-enum-app %s", post ? "post" : "pre",
+                  application->name);
+
+        if( application->systemd ) {
+            g_ptr_array_add(launches,
+                            appsync_launch_create(application, false));
+        }
+        else if( application->launch ) {
+            /* skipping if dbus session bus is not available,
+             * or not compiled in - pre-enum apps are then
+             * considered started anyway */
+            if( appsync_no_dbus && post ) {
+                log_debug("dbus post-enum-app %s ignored", application->name);
+                continue;
+            }
+            g_ptr_array_add(launches,
+                            appsync_launch_create(application,
+                                                  appsync_no_dbus));
+        }
+    }
+
+    return launches;
+}
+
+/** Update bookkeeping after launching applications
+ *
+ * @param launches  Array of executed launch requests
+ * @param post      0=pre-enum apps, or 1=post-enum apps
+ *
+ * @return 0 on succes, or 1 in case of failures
+ */
+static int appsync_mark_launches(GPtrArray *launches, int post)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int ret = 0; // assume success
+
+    APPSYNC_LOCKED_ENTER;
+    for( guint i = 0; i < launches->len; ++i ) {
+        appsync_launch_t *launch = g_ptr_array_index(launches, i);
+        if( launch->al_ok ) {
+            appsync_mark_active_locked(launch->al_name, post);
+        }
+        else {
+            log_err("%s-enum-app %s failed", post ? "post" : "pre",
+                    launch->al_name);
+            ret = 1;
+        }
+    }
+    APPSYNC_LOCKED_LEAVE;
+
+    return ret;
+}
+
 /** Activate pre-enum applications for given mode
  *
  * Starts all configured applications that have matching
@@ -428,6 +743,7 @@ int appsync_activate_pre(const char *mode)
     LOG_REGISTER_CONTEXT;
     int ret = 0; // assume success
     int count = 0;
+    GPtrArray *launches = 0;
 
     log_debug("activate-pre mode=%s", mode);
 
@@ -486,56 +802,20 @@ int appsync_activate_pre(const char *mode)
     appsync_start_enumerate_usb_timer();
 #endif
 
-    /* go through list and launch apps */
-    for( GList *iter = appsync_apps_curr; iter; iter = g_list_next(iter) )
-    {
-        application_t *application = iter->data;
-        if(!strcmp(mode, application->mode))
-        {
-            /* do not launch items marked as post, will be launched after usb is up */
-            if(application->post)
-            {
-                continue;
-            }
-            log_debug("launching pre-enum-app %s", application->name);
-            if(application->systemd)
-            {
-                if(!systemd_control_service(application->name, SYSTEMD_START)) {
-                    log_debug("systemd pre-enum-app %s failed", application->name);
-                    ret = 1;
-                    goto cleanup;
-                }
-                appsync_mark_active_locked(application->name, 0);
-            }
-            else if(application->launch)
-            {
-                /* skipping if dbus session bus is not available,
-                 * or not compiled in */
-                if( appsync_no_dbus ) {
-                    log_debug("dbus pre-enum-app %s ignored", application->name);
-                    /* FIXME: feigning success here allows pre-enum actions
-                     *        to be "completed" despite of failures or lack
-                     *        of support for installed configuration items.
-                     *        Does that make any sense?
-                     */
-                    appsync_mark_active_locked(application->name, 0);
-                    continue;
-                }
-#ifdef APP_SYNC_DBUS
-                if( dbusappsync_launch_app(application->launch) != 0 ) {
-                    log_debug("dbus pre-enum-app %s failed", application->name);
-                    ret = 1;
-                    goto cleanup;
-                }
-                appsync_mark_active_locked(application->name, 0);
-#endif /* APP_SYNC_DBUS */
-            }
-        }
-    }
+    /* collect apps to launch, do not launch items marked as post,
+     * they will be launched after usb is up */
+    launches = appsync_collect_launches_locked(mode, 0);
 
 cleanup:
     APPSYNC_LOCKED_LEAVE;
 
+    /* launch all apps in parallel and wait for the slowest */
+    if( launches ) {
+        appsync_launch_execute(launches, SYSTEMD_START);
+        ret = appsync_mark_launches(launches, 0);
+        g_ptr_array_unref(launches);
+    }
+
     return ret;
 }
 
@@ -553,6 +833,7 @@ int appsync_activate_post(const char *mode)
     LOG_REGISTER_CONTEXT;
 
     int ret = 0; // assume success
+    GPtrArray *launches = 0;
 
     log_debug("activate-post mode=%s", mode);
 
@@ -572,47 +853,20 @@ int appsync_activate_post(const char *mode)
     }
 #endif /* APP_SYNC_DBUS */
 
-    /* go through list and launch apps */
-    for( GList *iter = appsync_apps_curr; iter; iter = g_list_next(iter) )
-    {
-        application_t *application = iter->data;
-
-        if( !strcmp(application->mode, mode) ) {
-            /* launch only items marked as post, others are already running */
-            if(!application->post)
-                continue;
-
-            log_debug("launching post-enum-app %s\n", application->name);
-            if( application->systemd ) {
-                if(!systemd_control_service(application->name, SYSTEMD_START)) {
-                    log_err("systemd post-enum-app %s failed", application->name);
-                    ret = 1;
-                    break;
-                }
-                appsync_mark_active_locked(application->name, 1);
-            }
-            else if( application->launch ) {
-                /* skipping if dbus session bus is not available,
-                 * or not compiled in */
-                if( appsync_no_dbus ) {
-                    log_debug("dbus pre-enum-app %s ignored", application->name);
-                    continue;
-                }
-#ifdef APP_SYNC_DBUS
-                if( dbusappsync_launch_app(application->launch) != 0 ) {
-                    log_err("dbus post-enum-app %s failed", application->name);
-                    ret = 1;
-                    break;
-                }
-                appsync_mark_active_locked(application->name, 1);
-#endif /* APP_SYNC_DBUS */
-            }
-        }
-    }
+    /* collect apps to launch, only items marked as post,
+     * others are already running */
+    launches = appsync_collect_launches_locked(mode, 1);
 
 cleanup:
     APPSYNC_LOCKED_LEAVE;
 
+    /* launch all apps in parallel and wait for the slowest */
+    if( launches ) {
+        appsync_launch_execute(launches, SYSTEMD_START);
+        ret = appsync_mark_launches(launches, 1);
+        g_ptr_array_unref(launches);
+    }
+
     return ret;
 }
 
@@ -759,16 +1013,22 @@ static void appsync_enumerate_usb(void)
 }
 #endif /* APP_SYNC_DBUS */
 
-/* Internal helper for stopping pre/post apps
+/* Internal helper for collecting pre/post apps to stop
+ *
+ * Applications are marked as stopped right away.
  *
  * @param post  0=stop pre-apps, or 1=stop post-apps
  *
  * @note Assumes that appsync configuration data is already locked.
+ *
+ * @return array of stop requests to pass to #appsync_stop_apps()
  */
-static void appsync_stop_apps(int post)
+static GPtrArray *appsync_stop_apps_locked(int post)
 {
     LOG_REGISTER_CONTEXT;
 
+    GPtrArray *launches = g_ptr_array_new_with_free_func(appsync_launch_delete_cb);
+
     for( GList *iter = appsync_apps_curr; iter; iter = g_list_next(iter) )
     {
         application_t *application = iter->data;
@@ -780,8 +1040,8 @@ static void appsync_stop_apps(int post)
                       application->name);
 
             if( application->systemd ) {
-                if( !systemd_control_service(application->name, SYSTEMD_STOP) )
-                    log_debug("Failed to stop %s\n", application->name);
+                g_ptr_array_add(launches,
+                                appsync_launch_create(application, false));
             }
             else if( application->launch ) {
                 // NOP
@@ -790,6 +1050,31 @@ static void appsync_stop_apps(int post)
         }
     }
 
+    return launches;
+}
+
+/* Internal helper for stopping pre/post apps
+ *
+ * All applications are stopped in parallel.
+ *
+ * @param launches  array from #appsync_stop_apps_locked(), ownership
+ *                  is transferred
+ *
+ * @note Must be called without holding the appsync lock.
+ */
+static void appsync_stop_apps(GPtrArray *launches)
+{
+    LOG_REGISTER_CONTEXT;
+
+    appsync_launch_execute(launches, SYSTEMD_STOP);
+
+    for( guint i = 0; i < launches->len; ++i ) {
+        appsync_launch_t *launch = g_ptr_array_index(launches, i);
+        if( !launch->al_ok )
+            log_debug("Failed to stop %s\n", launch->al_name);
+    }
+
+    g_ptr_array_unref(launches);
 }
 
 /** Stop all applications that were started in pre-enum phase
@@ -797,8 +1082,10 @@ static void appsync_stop_apps(int post)
 void appsync_deactivate_pre(void)
 {
     APPSYNC_LOCKED_ENTER;
-    appsync_stop_apps(0);
+    GPtrArray *launches = appsync_stop_apps_locked(0);
     APPSYNC_LOCKED_LEAVE;
+
+    appsync_stop_apps(launches);
 }
 
 /** Stop all applications that were started in post-enum phase
@@ -806,8 +1093,10 @@ void appsync_deactivate_pre(void)
 void appsync_deactivate_post(void)
 {
     APPSYNC_LOCKED_ENTER;
-    appsync_stop_apps(1);
+    GPtrArray *launches = appsync_stop_apps_locked(1);
     APPSYNC_LOCKED_LEAVE;
+
+    appsync_stop_apps(launches);
 }
 
 /** Stop all applications that (could) have been started by usb-moded
@@ -840,11 +1129,8 @@ void appsync_deactivate_all(bool force)
         }
     }
 
-    /* Stop post-apps 1st */
-    appsync_stop_apps(1);
-
-    /* Then pre-apps */
-    appsync_stop_apps(0);
+    GPtrArray *post_apps = appsync_stop_apps_locked(1);
+    GPtrArray *pre_apps  = appsync_stop_apps_locked(0);
 
     /* Do not leave active timers behind */
 #ifdef APP_SYNC_DBUS
@@ -852,4 +1138,10 @@ void appsync_deactivate_all(bool force)
 #endif
 
     APPSYNC_LOCKED_LEAVE;
+
+    /* Stop post-apps 1st */
+    appsync_stop_apps(post_apps);
+
+    /* Then pre-apps */
+    appsync_stop_apps(pre_apps);
 }
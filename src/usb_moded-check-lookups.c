@@ -0,0 +1,888 @@
+/**
+ * @file usb_moded-check-lookups.c
+ *
+ * Check program for measuring configuration lookup latency
+ *
+ * Populates a scratch configuration tree modelled after what is installed
+ * on devices, then times frequently used lookups both with primed caches
+ * and with caches dropped before each call. Results - including number
+ * of heap allocations made - are written to stdout in machine readable
+ * form, and returned values are compared against expected ones.
+ *
+ * The daemon code is linked in with configuration directories pointed
+ * to CHECK_LOOKUPS_ROOT at build time, so that the installed
+ * configuration is neither used nor modified.
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded.h"
+#include "usb_moded-common.h"
+#include "usb_moded-config-private.h"
+#include "usb_moded-dyn-config.h"
+#include "usb_moded-log.h"
+#include "usb_moded-modes.h"
+#include "usb_moded-modules.h"
+#include "usb_moded-snapshot.h"
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef CHECK_LOOKUPS_ROOT
+# error CHECK_LOOKUPS_ROOT must be defined
+#endif
+
+/* Allocations are counted by wrapping glibc malloc functions */
+#ifdef __GLIBC__
+# define CHECK_COUNT_ALLOCS 1
+#endif
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Number of iterations when not given on command line */
+#define CHECK_DEFAULT_COUNT 1000
+
+/** Network address in the scratch configuration */
+#define CHECK_NETWORK_IP    "192.168.2.15"
+
+/** Default mode in the scratch configuration */
+#define CHECK_DEFAULT_MODE  "mtp_mode"
+
+/** Additional user that has a mode setting of its own
+ *
+ * First uid in MIN_ADDITIONAL_USER ... MAX_ADDITIONAL_USER range.
+ */
+#define CHECK_EXTRA_USER    100001
+
+/** Mode setting key for CHECK_EXTRA_USER */
+#define CHECK_EXTRA_KEY     "mode_100001"
+
+/** Mode setting of CHECK_EXTRA_USER */
+#define CHECK_EXTRA_MODE    "pc_suite"
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Scratch configuration file
+ */
+typedef struct check_file_t
+{
+    /** Directory the file is created in */
+    const char *cf_dir;
+
+    /** File name */
+    const char *cf_name;
+
+    /** File content */
+    const char *cf_data;
+} check_file_t;
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Scratch configuration tree
+ *
+ * Content follows configuration shipped for android gadget devices:
+ * several static files where later ones override earlier ones, user
+ * settings in the dynamic file, a set of dynamic modes with options,
+ * a diagnostic mode, and some files that must be ignored.
+ */
+static const check_file_t check_files[] =
+{
+    {
+        USB_MODED_STATIC_CONFIG_DIR, "10-usb-moded-defaults.ini",
+        "# Dynamic modes are limited to sailfish-system group by default,\n"
+        "# this allows mtp_mode for the whole users group\n"
+        "[mode_group]\n"
+        "mtp_mode = users\n"
+    },
+    {
+        USB_MODED_STATIC_CONFIG_DIR, "20-mass-storage.ini",
+        "[mountpoints]\n"
+        "mount=/dev/sdcard\n"
+        "\n"
+        "[altmount]\n"
+        "mount=/run/user/100000/media/sdcard\n"
+        "\n"
+        "[sync]\n"
+        "nofua=1\n"
+    },
+    {
+        USB_MODED_STATIC_CONFIG_DIR, "30-network.ini",
+        "[network]\n"
+        "ip = 192.168.2.1\n"
+        "netmask = 255.255.255.0\n"
+        "interface = rndis0\n"
+        "noroaming = 1\n"
+        "\n"
+        "[dhcp]\n"
+        "range_start = 192.168.2.10\n"
+        "range_end = 192.168.2.20\n"
+        "lease_time = 3600\n"
+        "\n"
+        "[wait]\n"
+        "interface_ms = 3000\n"
+    },
+    {
+        USB_MODED_STATIC_CONFIG_DIR, "40-android.ini",
+        "[android]\n"
+        "iManufacturer = Sailfish\n"
+        "idVendor = 2931\n"
+        "iProduct = Sailfish\n"
+        "idProduct = 0A02\n"
+    },
+    {
+        USB_MODED_STATIC_CONFIG_DIR, "50-mode-groups.ini",
+        "[mode_group]\n"
+        "developer_mode = sailfish-system\n"
+        "connection_sharing = sailfish-system\n"
+    },
+    {
+        USB_MODED_STATIC_CONFIG_DIR, "90-vendor-override.ini",
+        "[network]\n"
+        "ip = " CHECK_NETWORK_IP "\n"
+    },
+    {
+        USB_MODED_DYNAMIC_CONFIG_DIR, "usb-moded.ini",
+        "[usbmode]\n"
+        "mode = " CHECK_DEFAULT_MODE "\n"
+        CHECK_EXTRA_KEY " = " CHECK_EXTRA_MODE "\n"
+        "hide = at_mode\n"
+    },
+    {
+        MODE_DIR_PATH, "mtp_mode-android.ini",
+        "[mode]\n"
+        "name = mtp_mode\n"
+        "module = none\n"
+        "\n"
+        "[options]\n"
+        "sysfs_value = mtp\n"
+    },
+    {
+        MODE_DIR_PATH, "pc_suite-android.ini",
+        "[mode]\n"
+        "name = pc_suite\n"
+        "module = none\n"
+        "\n"
+        "[options]\n"
+        "sysfs_value = ffs\n"
+        "idProduct = 0A07\n"
+    },
+    {
+        MODE_DIR_PATH, "developer_mode-android.ini",
+        "[mode]\n"
+        "name = developer_mode\n"
+        "module = none\n"
+        "network = 1\n"
+        "network_interface = rndis0\n"
+        "appsync = 1\n"
+        "\n"
+        "[options]\n"
+        "# sysfs_value = comma separated list of functions to enable\n"
+        "sysfs_value = rndis\n"
+        "idProduct = 0A02\n"
+        "dhcp_server = 1\n"
+    },
+    {
+        MODE_DIR_PATH, "connection_sharing-android-connman.ini",
+        "[mode]\n"
+        "name = connection_sharing\n"
+        "module = none\n"
+        "\n"
+        "[options]\n"
+        "sysfs_value = rndis\n"
+        "idProduct = 0A02\n"
+        "connman_tethering = /net/connman/technology/gadget\n"
+    },
+    {
+        MODE_DIR_PATH, "mass_storage_android.ini",
+        "[mode]\n"
+        "name = mass_storage\n"
+        "module = none\n"
+        "mass_storage = 1\n"
+    },
+    {
+        MODE_DIR_PATH, "adb_mode.ini",
+        "[mode]\n"
+        "name = adb_mode\n"
+        "module = none\n"
+        "appsync = 1\n"
+        "network = 1\n"
+        "network_interface = rndis0\n"
+        "\n"
+        "[options]\n"
+        "sysfs_value = rndis,adb\n"
+        "android_extra_sysfs_path = /sys/class/android_usb/android0/f_ffs/aliases\n"
+        "android_extra_sysfs_value = adb\n"
+        "idProduct = 0A03\n"
+        "dhcp_server = 1\n"
+    },
+    {
+        MODE_DIR_PATH, "android_acm.ini",
+        "[mode]\n"
+        "name = acm_mode\n"
+        "module = none\n"
+        "\n"
+        "[options]\n"
+        "sysfs_value = acm\n"
+        "android_extra_sysfs_path = /sys/class/android_usb/android/f_acm/acm_transports\n"
+        "android_extra_sysfs_value = tty\n"
+    },
+    {
+        MODE_DIR_PATH, "android_at.ini",
+        "[mode]\n"
+        "name = at_mode\n"
+        "module = none\n"
+        "\n"
+        "[options]\n"
+        "sysfs_value = acm\n"
+        "android_extra_sysfs_path = /sys/class/android_usb/android/f_acm/acm_transports\n"
+        "android_extra_sysfs_value = smd\n"
+    },
+    {
+        MODE_DIR_PATH, "host_mode_jolla.ini",
+        "[mode]\n"
+        "name = host_mode\n"
+        "module = none\n"
+        "\n"
+        "[options]\n"
+        "sysfs_path = /sys/class/power_supply/usb/scope\n"
+        "sysfs_value = 1\n"
+        "sysfs_reset_value = 2\n"
+    },
+    {
+        MODE_DIR_PATH, "diag_mode.ini",
+        "[mode]\n"
+        "name = diag_mode\n"
+        "module = none\n"
+        "appsync = 1\n"
+        "network = 1\n"
+        "network_interface = rndis0\n"
+        "\n"
+        "[options]\n"
+        "sysfs_value = diag,serial,rmnet,qdss,adb,rndis\n"
+        "android_extra_sysfs_path = /sys/class/android_usb/android0/f_diag/clients\n"
+        "android_extra_sysfs_value = diag\n"
+        "android_extra_sysfs_path2 = /sys/class/android_usb/android0/f_serial/transports\n"
+        "android_extra_sysfs_value2 = smd\n"
+        "android_extra_sysfs_path3 = /sys/class/android_usb/android0/f_rmnet/transports\n"
+        "android_extra_sysfs_value3 = qti,bam\n"
+        "android_extra_sysfs_path4 = /sys/class/android_usb/android0/f_qdss/transports\n"
+        "android_extra_sysfs_value4 = qti,bam_dmux\n"
+        "idProduct = 0A04\n"
+    },
+    {
+        /* Not a valid mode - module is missing */
+        MODE_DIR_PATH, "broken_mode.ini",
+        "[mode]\n"
+        "name = broken_mode\n"
+    },
+    {
+        /* Not an ini-file */
+        MODE_DIR_PATH, "README",
+        "[mode]\n"
+        "name = readme_mode\n"
+        "module = none\n"
+    },
+    {
+        DIAG_DIR_PATH, "qa_diagnostic_mode.ini",
+        "[mode]\n"
+        "name = qa_diag_mode\n"
+        "module = none\n"
+        "appsync = 1\n"
+        "network = 0\n"
+        "\n"
+        "[options]\n"
+        "sysfs_value = adb,diag\n"
+        "android_extra_sysfs_path = /sys/class/android_usb/android0/f_diag/clients\n"
+        "android_extra_sysfs_value = diag\n"
+        "idProduct = 0A05\n"
+    },
+};
+
+/** Names of dynamic modes that should get loaded from #check_files */
+static const char * const check_modes[] =
+{
+    "mtp_mode",
+    "pc_suite",
+    "developer_mode",
+    "connection_sharing",
+    "mass_storage",
+    "adb_mode",
+    "acm_mode",
+    "at_mode",
+    "host_mode",
+    "diag_mode",
+};
+
+#ifdef CHECK_COUNT_ALLOCS
+/** Number of heap allocations made */
+static uint64_t check_alloc_count = 0;
+#endif
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * CHECK
+ * ------------------------------------------------------------------------- */
+
+#ifdef CHECK_COUNT_ALLOCS
+void          *malloc                  (size_t size);
+void          *calloc                  (size_t nmemb, size_t size);
+void          *realloc                 (void *ptr, size_t size);
+void           free                    (void *ptr);
+#endif
+static uint64_t check_allocs           (void);
+static int64_t check_now               (void);
+static void    check_report            (const char *lookup, uid_t uid, bool cold, int count, int64_t t_beg, int64_t t_end, uint64_t a_beg, uint64_t a_end);
+static int     check_remove_cb         (const char *path, const struct stat *st, int flag, struct FTW *ftw);
+static void    check_remove_tree       (void);
+static bool    check_write_file        (const char *path, const char *data);
+static bool    check_create_tree       (void);
+static bool    check_parse_count       (const char *arg, int *count);
+static uid_t   check_get_user          (void);
+static bool    check_lookup_conf_string(uid_t uid, int count);
+static gchar  *check_expected_mode     (uid_t uid);
+static bool    check_lookup_mode_string(uid_t uid, int count);
+static bool    check_lookup_mode_list  (uid_t uid, int count);
+static bool    check_lookup_permission (uid_t uid, int count, const char *mode);
+
+/* ------------------------------------------------------------------------- *
+ * MAIN
+ * ------------------------------------------------------------------------- */
+
+int main(int argc, char *argv[]);
+
+/* ========================================================================= *
+ * Functions
+ * ========================================================================= */
+
+#ifdef CHECK_COUNT_ALLOCS
+/* Wrappers for counting allocations made by both usb-moded and glib
+ * code - the actual work is done by the glibc implementation.
+ */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void  __libc_free   (void *ptr);
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&check_alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&check_alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&check_alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+#endif
+
+/** Get number of heap allocations made so far
+ *
+ * @return allocation count, or zero if counting is not supported
+ */
+static uint64_t check_allocs(void)
+{
+#ifdef CHECK_COUNT_ALLOCS
+    return __atomic_load_n(&check_alloc_count, __ATOMIC_RELAXED);
+#else
+    return 0;
+#endif
+}
+
+/** Get monotonic timestamp
+ *
+ * @return time in nanoseconds
+ */
+static int64_t check_now(void)
+{
+    struct timespec ts = { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (int64_t)1000000000 + ts.tv_nsec;
+}
+
+/** Output lookup timing in machine readable form
+ *
+ * @param lookup  name of the measured function
+ * @param uid     user the lookups were made for
+ * @param cold    true if caches were dropped before each call
+ * @param count   number of calls made
+ * @param t_beg   timestamp before the first call [ns]
+ * @param t_end   timestamp after the last call [ns]
+ * @param a_beg   allocation count before the first call
+ * @param a_end   allocation count after the last call
+ */
+static void check_report(const char *lookup, uid_t uid, bool cold, int count,
+                         int64_t t_beg, int64_t t_end,
+                         uint64_t a_beg, uint64_t a_end)
+{
+    int64_t total = t_end - t_beg;
+
+    fprintf(stdout, "lookup=%s uid=%u cache=%s calls=%d total_ns=%" PRId64
+            " per_call_ns=%" PRId64,
+            lookup, (unsigned)uid, cold ? "cold" : "warm", count,
+            total, total / (count ?: 1));
+#ifdef CHECK_COUNT_ALLOCS
+    fprintf(stdout, " allocs=%" PRIu64 " per_call_allocs=%.1f",
+            a_end - a_beg, (double)(a_end - a_beg) / (count ?: 1));
+#else
+    (void)a_beg;
+    (void)a_end;
+#endif
+    fprintf(stdout, "\n");
+}
+
+/** Remove a file or an empty directory, nftw() callback
+ */
+static int check_remove_cb(const char *path, const struct stat *st, int flag,
+                           struct FTW *ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+
+    if( remove(path) == -1 && errno != ENOENT )
+        fprintf(stderr, "%s: can't remove: %m\n", path);
+
+    return 0;
+}
+
+/** Remove scratch configuration tree
+ */
+static void check_remove_tree(void)
+{
+    nftw(CHECK_LOOKUPS_ROOT, check_remove_cb, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/** Write file in scratch configuration tree
+ *
+ * @param path  file path
+ * @param data  file content
+ *
+ * @return true on success, false on failure
+ */
+static bool check_write_file(const char *path, const char *data)
+{
+    GError *err = 0;
+    bool    ack = g_file_set_contents(path, data, -1, &err);
+
+    if( !ack )
+        fprintf(stderr, "%s: can't write: %s\n", path, err->message);
+    g_clear_error(&err);
+
+    return ack;
+}
+
+/** Create scratch configuration tree
+ *
+ * Writes all #check_files, so that lookups need to merge several
+ * static files with dynamic settings, and permission checks need
+ * to evaluate group membership for a realistic set of modes.
+ *
+ * @return true on success, false on failure
+ */
+static bool check_create_tree(void)
+{
+    bool   ack  = false;
+    gchar *path = 0;
+
+    const char * const dirs[] = {
+        USB_MODED_STATIC_CONFIG_DIR,
+        USB_MODED_DYNAMIC_CONFIG_DIR,
+        USB_MODED_SNAPSHOT_DIR,
+        MODE_DIR_PATH,
+        DIAG_DIR_PATH,
+        0
+    };
+
+    check_remove_tree();
+
+    for( size_t i = 0; dirs[i]; ++i ) {
+        if( g_mkdir_with_parents(dirs[i], 0755) == -1 ) {
+            fprintf(stderr, "%s: can't create: %m\n", dirs[i]);
+            goto EXIT;
+        }
+    }
+
+    for( size_t i = 0; i < G_N_ELEMENTS(check_files); ++i ) {
+        g_free(path);
+        path = g_strdup_printf("%s/%s", check_files[i].cf_dir,
+                               check_files[i].cf_name);
+        if( !check_write_file(path, check_files[i].cf_data) )
+            goto EXIT;
+    }
+
+    ack = true;
+
+EXIT:
+    g_free(path);
+
+    return ack;
+}
+
+/** Parse iteration count from command line
+ *
+ * @param arg    command line argument
+ * @param count  where to store the count
+ *
+ * @return true if arg is a positive integer, false otherwise
+ */
+static bool check_parse_count(const char *arg, int *count)
+{
+    char *end = 0;
+
+    errno = 0;
+    long val = strtol(arg, &end, 0);
+
+    if( errno || end == arg || *end || val < 1 || val > INT_MAX )
+        return false;
+
+    *count = (int)val;
+    return true;
+}
+
+/** Get a non-root user for permission checks
+ *
+ * @return uid of the invoking user, or of "nobody" when run as root
+ */
+static uid_t check_get_user(void)
+{
+    uid_t uid = getuid();
+
+    if( uid == 0 ) {
+        struct passwd *pw = getpwnam("nobody");
+        uid = pw ? pw->pw_uid : UID_UNKNOWN;
+    }
+
+    return uid;
+}
+
+/** Measure config_get_conf_string() and check the returned value
+ *
+ * @return true if checks passed, false otherwise
+ */
+static bool check_lookup_conf_string(uid_t uid, int count)
+{
+    bool     ack = true;
+    gchar   *val = 0;
+    int64_t  t_beg, t_end;
+    uint64_t a_beg, a_end;
+
+    g_free(config_get_conf_string(NETWORK_ENTRY, NETWORK_IP_KEY));
+    a_beg = check_allocs();
+    t_beg = check_now();
+    for( int i = 0; i < count; ++i )
+        g_free(config_get_conf_string(NETWORK_ENTRY, NETWORK_IP_KEY));
+    t_end = check_now();
+    a_end = check_allocs();
+    check_report("config_get_conf_string", uid, false, count,
+                 t_beg, t_end, a_beg, a_end);
+
+    a_beg = check_allocs();
+    t_beg = check_now();
+    for( int i = 0; i < count; ++i ) {
+        config_invalidate_settings();
+        g_free(config_get_conf_string(NETWORK_ENTRY, NETWORK_IP_KEY));
+    }
+    t_end = check_now();
+    a_end = check_allocs();
+    check_report("config_get_conf_string", uid, true, count,
+                 t_beg, t_end, a_beg, a_end);
+
+    val = config_get_conf_string(NETWORK_ENTRY, NETWORK_IP_KEY);
+    if( g_strcmp0(val, CHECK_NETWORK_IP) ) {
+        fprintf(stderr, "config_get_conf_string: got %s, expected %s\n",
+                val ?: "(null)", CHECK_NETWORK_IP);
+        ack = false;
+    }
+    g_free(val);
+
+    return ack;
+}
+
+/** Build expected config_get_mode_setting() value from scratch data
+ *
+ * Modes that the user is not permitted to use are reset to MODE_ASK.
+ *
+ * @param uid  user to evaluate the setting for
+ *
+ * @return mode name, release with g_free()
+ */
+static gchar *check_expected_mode(uid_t uid)
+{
+    const char *mode = CHECK_DEFAULT_MODE;
+
+#ifdef SAILFISH_ACCESS_CONTROL
+    if( uid == CHECK_EXTRA_USER )
+        mode = CHECK_EXTRA_MODE;
+#endif
+
+    usbmoded_invalidate_permissions();
+    if( !usbmoded_is_mode_permitted(mode, uid) )
+        mode = MODE_ASK;
+
+    return g_strdup(mode);
+}
+
+/** Measure config_get_mode_setting() and check the returned value
+ *
+ * @return true if checks passed, false otherwise
+ */
+static bool check_lookup_mode_string(uid_t uid, int count)
+{
+    bool     ack  = true;
+    gchar   *want = check_expected_mode(uid);
+    gchar   *warm = 0;
+    gchar   *cold = 0;
+    int64_t  t_beg, t_end;
+    uint64_t a_beg, a_end;
+
+    g_free(config_get_mode_setting(uid));
+    a_beg = check_allocs();
+    t_beg = check_now();
+    for( int i = 0; i < count; ++i )
+        g_free(config_get_mode_setting(uid));
+    t_end = check_now();
+    a_end = check_allocs();
+    check_report("config_get_mode_setting", uid, false, count,
+                 t_beg, t_end, a_beg, a_end);
+
+    a_beg = check_allocs();
+    t_beg = check_now();
+    for( int i = 0; i < count; ++i ) {
+        config_invalidate_settings();
+        g_free(config_get_mode_setting(uid));
+    }
+    t_end = check_now();
+    a_end = check_allocs();
+    check_report("config_get_mode_setting", uid, true, count,
+                 t_beg, t_end, a_beg, a_end);
+
+    /* Cached and freshly evaluated values must match expectation */
+    warm = config_get_mode_setting(uid);
+    usbmoded_invalidate_permissions();
+    config_invalidate_settings();
+    cold = config_get_mode_setting(uid);
+    if( g_strcmp0(warm, want) || g_strcmp0(cold, want) ) {
+        fprintf(stderr, "config_get_mode_setting: cached '%s' / fresh '%s',"
+                " expected '%s'\n", warm ?: "(null)", cold ?: "(null)", want);
+        ack = false;
+    }
+    g_free(cold);
+    g_free(warm);
+    g_free(want);
+
+    return ack;
+}
+
+/** Measure common_get_mode_list() and check cache consistency
+ *
+ * @return true if checks passed, false otherwise
+ */
+static bool check_lookup_mode_list(uid_t uid, int count)
+{
+    bool     ack  = true;
+    gchar   *warm = 0;
+    gchar   *cold = 0;
+    int64_t  t_beg, t_end;
+    uint64_t a_beg, a_end;
+
+    g_free(common_get_mode_list(AVAILABLE_MODES_LIST, uid));
+    a_beg = check_allocs();
+    t_beg = check_now();
+    for( int i = 0; i < count; ++i )
+        g_free(common_get_mode_list(AVAILABLE_MODES_LIST, uid));
+    t_end = check_now();
+    a_end = check_allocs();
+    check_report("common_get_mode_list", uid, false, count,
+                 t_beg, t_end, a_beg, a_end);
+
+    a_beg = check_allocs();
+    t_beg = check_now();
+    for( int i = 0; i < count; ++i ) {
+        common_clear_mode_list_cache();
+        usbmoded_invalidate_permissions();
+        config_invalidate_settings();
+        g_free(common_get_mode_list(AVAILABLE_MODES_LIST, uid));
+    }
+    t_end = check_now();
+    a_end = check_allocs();
+    check_report("common_get_mode_list", uid, true, count,
+                 t_beg, t_end, a_beg, a_end);
+
+    /* Cached and freshly evaluated lists must agree */
+    warm = common_get_mode_list(AVAILABLE_MODES_LIST, uid);
+    common_clear_mode_list_cache();
+    usbmoded_invalidate_permissions();
+    config_invalidate_settings();
+    cold = common_get_mode_list(AVAILABLE_MODES_LIST, uid);
+    if( g_strcmp0(warm, cold) ) {
+        fprintf(stderr, "common_get_mode_list: cached '%s' vs fresh '%s'\n",
+                warm ?: "(null)", cold ?: "(null)");
+        ack = false;
+    }
+    g_free(cold);
+    g_free(warm);
+
+    return ack;
+}
+
+/** Measure usbmoded_is_mode_permitted() and check cache consistency
+ *
+ * @return true if checks passed, false otherwise
+ */
+static bool check_lookup_permission(uid_t uid, int count, const char *mode)
+{
+    bool     ack = true;
+    bool     warm, cold;
+    int64_t  t_beg, t_end;
+    uint64_t a_beg, a_end;
+
+    usbmoded_is_mode_permitted(mode, uid);
+    a_beg = check_allocs();
+    t_beg = check_now();
+    for( int i = 0; i < count; ++i )
+        usbmoded_is_mode_permitted(mode, uid);
+    t_end = check_now();
+    a_end = check_allocs();
+    check_report("usbmoded_is_mode_permitted", uid, false, count,
+                 t_beg, t_end, a_beg, a_end);
+
+    a_beg = check_allocs();
+    t_beg = check_now();
+    for( int i = 0; i < count; ++i ) {
+        usbmoded_invalidate_permissions();
+        config_invalidate_settings();
+        usbmoded_is_mode_permitted(mode, uid);
+    }
+    t_end = check_now();
+    a_end = check_allocs();
+    check_report("usbmoded_is_mode_permitted", uid, true, count,
+                 t_beg, t_end, a_beg, a_end);
+
+    /* Cached and freshly evaluated permissions must agree */
+    warm = usbmoded_is_mode_permitted(mode, uid);
+    usbmoded_invalidate_permissions();
+    config_invalidate_settings();
+    cold = usbmoded_is_mode_permitted(mode, uid);
+    if( warm != cold ) {
+        fprintf(stderr, "usbmoded_is_mode_permitted: cached %d vs fresh %d\n",
+                warm, cold);
+        ack = false;
+    }
+
+    return ack;
+}
+
+int main(int argc, char *argv[])
+{
+    int         exitcode = EXIT_FAILURE;
+    int         count    = CHECK_DEFAULT_COUNT;
+    const char *mode     = 0;
+    GList      *modes    = 0;
+    bool        ack      = true;
+    const uid_t uids[]   = { 0, check_get_user(), CHECK_EXTRA_USER };
+
+    log_init();
+    log_set_name(basename(*argv));
+    log_set_type(LOG_TO_STDERR);
+    log_set_level(LOG_WARNING);
+
+    if( argc > 2 || (argc == 2 && !check_parse_count(argv[1], &count)) ) {
+        fprintf(stderr, "usage: %s [<iterations>]\n", *argv);
+        goto EXIT;
+    }
+
+    if( !check_create_tree() )
+        goto EXIT;
+
+    usbmoded_load_modelist();
+
+    modes = usbmoded_get_modelist();
+    if( g_list_length(modes) != G_N_ELEMENTS(check_modes) ) {
+        fprintf(stderr, "loaded %u modes, expected %u\n",
+                g_list_length(modes), (unsigned)G_N_ELEMENTS(check_modes));
+        goto CLEANUP;
+    }
+
+    for( size_t i = 0; i < G_N_ELEMENTS(check_modes); ++i ) {
+        if( !usbmoded_get_modedata(check_modes[i]) ) {
+            fprintf(stderr, "mode %s was not loaded\n", check_modes[i]);
+            goto CLEANUP;
+        }
+    }
+
+    /* Permission bitmap is indexed by mode, use the last one */
+    mode = ((const modedata_t *)g_list_last(modes)->data)->mode_name;
+
+    fprintf(stdout, "modes=%u iterations=%d\n",
+            (unsigned)G_N_ELEMENTS(check_modes), count);
+
+    for( size_t i = 0; i < G_N_ELEMENTS(uids); ++i ) {
+        if( uids[i] == UID_UNKNOWN )
+            continue;
+        ack &= check_lookup_conf_string(uids[i], count);
+        ack &= check_lookup_mode_string(uids[i], count);
+        ack &= check_lookup_mode_list(uids[i], count);
+        ack &= check_lookup_permission(uids[i], count, mode);
+    }
+
+    fflush(stdout);
+
+    if( ack )
+        exitcode = EXIT_SUCCESS;
+
+CLEANUP:
+    config_quit();
+    common_clear_mode_list_cache();
+    usbmoded_free_modelist();
+    check_remove_tree();
+
+EXIT:
+    return exitcode;
+}
@@ -29,11 +29,14 @@
 #include "usb_moded.h"
 #include "usb_moded-config-private.h"
 #include "usb_moded-dbus-private.h"
+#include "usb_moded-exec.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modes.h"
 #include "usb_moded-worker.h"
 
-#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -55,6 +58,19 @@ typedef struct modemapping_t
     const char *external_mode;
 } modemapping_t;
 
+/** Cached mode list string */
+typedef struct modelistcache_t
+{
+    /** Value of usbmoded_get_modes_generation() when list was made */
+    guint  mc_modes_generation;
+
+    /** Value of config_get_generation() when list was made */
+    guint  mc_config_generation;
+
+    /** Comma separated list of modes */
+    gchar *mc_mode_list;
+} modelistcache_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -71,6 +87,7 @@ const char *cable_state_repr(cable_state_t state);
 
 const char  *common_map_mode_to_hardware         (const char *internal_mode);
 const char  *common_map_mode_to_external         (const char *internal_mode);
+static bool  common_payload_changed              (gchar **prev, const gchar *curr);
 void         common_send_supported_modes_signal  (void);
 void         common_send_available_modes_signal  (void);
 void         common_send_hidden_modes_signal     (void);
@@ -78,15 +95,41 @@ void         common_send_whitelisted_modes_signal(void);
 static void  common_write_to_sysfs_file          (const char *path, const char *text);
 void         common_acquire_wakelock             (const char *wakelock_name);
 void         common_release_wakelock             (const char *wakelock_name);
+static int   common_nap                          (unsigned nap_ms, int event_fd, short events);
+static void  common_drain_fd                     (int fd);
 int          common_system_                      (const char *file, int line, const char *func, const char *command);
-FILE        *common_popen_                       (const char *file, int line, const char *func, const char *command, const char *type);
+static waitres_t common_wait_event               (unsigned tot_ms, int event_fd, unsigned max_nap_ms, bool (*ready_cb)(void *aptr), void *aptr);
 waitres_t    common_wait                         (unsigned tot_ms, bool (*ready_cb)(void *aptr), void *aptr);
+waitres_t    common_wait_fd                      (unsigned tot_ms, int event_fd, bool (*ready_cb)(void *aptr), void *aptr);
+waitres_t    common_wait_paths                   (unsigned tot_ms, const char * const *paths, bool (*ready_cb)(void *aptr), void *aptr);
 bool         common_msleep_                      (const char *file, int line, const char *func, unsigned msec);
 static bool  common_mode_in_list                 (const char *mode, char *const *modes);
 bool         common_modename_is_internal         (const char *modename);
 bool         common_modename_is_static           (const char *modename);
 int          common_valid_mode                   (const char *mode);
+static gchar *common_build_mode_list             (mode_list_type_t type, uid_t uid);
+static void  common_mode_list_cache_free_cb      (gpointer aptr);
 gchar       *common_get_mode_list                (mode_list_type_t type, uid_t uid);
+void         common_clear_mode_list_cache        (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Cached mode lists: (list type, uid) -> modelistcache_t */
+static GHashTable *common_mode_list_cache = 0;
+
+/** Payload of the last supported modes signal sent */
+static gchar *common_supported_modes_sent = 0;
+
+/** Payload of the last available modes signal sent */
+static gchar *common_available_modes_sent = 0;
+
+/** Payload of the last hidden modes signal sent */
+static gchar *common_hidden_modes_sent = 0;
+
+/** Payload of the last whitelisted modes signal sent */
+static gchar *common_whitelisted_modes_sent = 0;
 
 /* ========================================================================= *
  * Functions
@@ -224,47 +267,77 @@ common_map_mode_to_external(const char *internal_mode)
  * DBUS_NOTIFICATIONS
  * ------------------------------------------------------------------------- */
 
+/** Check if signal payload differs from the previously sent one
+ *
+ * @param prev  Pointer to previously sent payload, updated if changed
+ * @param curr  Payload about to be sent
+ *
+ * @return true if signal should be sent, false otherwise
+ */
+static bool common_payload_changed(gchar **prev, const gchar *curr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( *prev && !g_strcmp0(*prev, curr) )
+        return false;
+
+    g_free(*prev), *prev = g_strdup(curr ?: "");
+    return true;
+}
+
 /** Send supported modes signal
+ *
+ * Note: Nothing is sent if the list has not changed since last time.
  */
 void common_send_supported_modes_signal(void)
 {
     LOG_REGISTER_CONTEXT;
 
     gchar *mode_list = common_get_mode_list(SUPPORTED_MODES_LIST, 0);
-    umdbus_send_supported_modes_signal(mode_list);
+    if( common_payload_changed(&common_supported_modes_sent, mode_list) )
+        umdbus_send_supported_modes_signal(mode_list);
     g_free(mode_list);
 }
 
 /** Send available modes signal
+ *
+ * Note: Nothing is sent if the list has not changed since last time.
  */
 void common_send_available_modes_signal(void)
 {
     LOG_REGISTER_CONTEXT;
 
     gchar *mode_list = common_get_mode_list(AVAILABLE_MODES_LIST, 0);
-    umdbus_send_available_modes_signal(mode_list);
+    if( common_payload_changed(&common_available_modes_sent, mode_list) )
+        umdbus_send_available_modes_signal(mode_list);
     g_free(mode_list);
 }
 
 /** Send hidden modes signal
+ *
+ * Note: Nothing is sent if the list has not changed since last time.
  */
 void common_send_hidden_modes_signal(void)
 {
     LOG_REGISTER_CONTEXT;
 
     gchar *mode_list = config_get_hidden_modes();
-    umdbus_send_hidden_modes_signal(mode_list);
+    if( common_payload_changed(&common_hidden_modes_sent, mode_list) )
+        umdbus_send_hidden_modes_signal(mode_list);
     g_free(mode_list);
 }
 
 /** Send whitelisted modes signal
+ *
+ * Note: Nothing is sent if the list has not changed since last time.
  */
 void common_send_whitelisted_modes_signal(void)
 {
     LOG_REGISTER_CONTEXT;
 
     gchar *mode_list = config_get_mode_whitelist();
-    umdbus_send_whitelisted_modes_signal(mode_list);
+    if( common_payload_changed(&common_whitelisted_modes_sent, mode_list) )
+        umdbus_send_whitelisted_modes_signal(mode_list);
     g_free(mode_list);
 }
 
@@ -354,7 +427,69 @@ void common_release_wakelock(const char *wakelock_name)
  * BLOCKING_OPERATION
  * ------------------------------------------------------------------------- */
 
+/** Sleep, but wake up early on event or if worker mode switch gets superseded
+ *
+ * @param nap_ms    maximum time to sleep [ms]
+ * @param event_fd  additional file descriptor to wait for, or -1
+ * @param events    poll events that signal a change in event_fd
+ *
+ * @return 1 if event_fd signaled a change, 0 on timeout / bailout,
+ *         or -1 on errors
+ */
+static int
+common_nap(unsigned nap_ms, int event_fd, short events)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct pollfd pfd[2] = {
+        {
+            .fd     = worker_get_wakeup_fd(),
+            .events = POLLIN,
+        },
+        {
+            .fd     = event_fd,
+            .events = events,
+        },
+    };
+
+    /* Negative fds are ignored by poll() i.e. this can be plain sleep */
+    if( poll(pfd, 2, (int)nap_ms) == -1 ) {
+        if( errno == EINTR )
+            return 0;
+        log_warning("poll failed: %m");
+        return -1;
+    }
+
+    return (pfd[1].revents & (events | POLLERR)) ? 1 : 0;
+}
+
+/** Consume all pending data from non-blocking file descriptor
+ *
+ * Seekable files i.e. sysfs attributes are re-read from the start,
+ * which is needed for re-arming change notifications.
+ *
+ * @param fd  inotify / eventfd / netlink / sysfs file descriptor
+ */
+static void
+common_drain_fd(int fd)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char buf[1024];
+    lseek(fd, 0, SEEK_SET);
+    while( read(fd, buf, sizeof buf) > 0 ) {}
+}
+
 /** Wrapper to give visibility to blocking system() calls usb-moded is making
+ *
+ * Command lines are split into argument vectors and executed directly.
+ * Shell features are not supported - commands that would need them
+ * are rejected instead of being passed to /bin/sh.
+ *
+ * When called from the worker thread, commands are terminated if the
+ * mode switch they are part of gets superseded.
+ *
+ * @return exit code of the command, or -1 if it did not exit normally
  */
 int
 common_system_(const char *file, int line, const char *func,
@@ -362,53 +497,98 @@ common_system_(const char *file, int line, const char *func,
 {
     LOG_REGISTER_CONTEXT;
 
-    int         result      = -1;
-    int         status      = -1;
-    char        exited[32]  = "";
-    char        trapped[32] = "";
-    const char *dumped      = "";
+    static const char shell_chars[] = "|&;<>()$`*?[]#~{}\n";
 
-    log_debug("EXEC %s; from %s:%d: %s()", command, file, line, func);
+    int     result = -1;
+    gchar **split  = 0;
 
-    if( (status = system(command)) == -1 ) {
-        snprintf(exited, sizeof exited, " exec=failed");
+    if( strpbrk(command, shell_chars) ||
+        !g_shell_parse_argv(command, 0, &split, 0) ) {
+        log_err("%s: not a plain command line", command);
+        goto EXIT;
     }
-    else {
-        if( WIFSIGNALED(status) ) {
-            snprintf(trapped, sizeof trapped, " signal=%s",
-                     strsignal(WTERMSIG(status)));
-        }
 
-        if( WCOREDUMP(status) )
-            dumped = " core=dumped";
+    result = exec_run_(file, line, func, (const char * const *)split,
+                       EXEC_DEFAULT_TIMEOUT, 0);
 
-        if( WIFEXITED(status) ) {
-            result = WEXITSTATUS(status);
-            snprintf(exited, sizeof exited, " exit_code=%d", result);
-        }
-    }
-
-    if( result != 0 ) {
-        log_warning("EXEC %s; from %s:%d: %s();%s%s%s result=%d",
-                    command, file, line, func,
-                    exited, trapped, dumped, result);
-    }
+EXIT:
+    g_strfreev(split);
 
     return result;
 }
 
-/** Wrapper to give visibility subprocesses usb-moded is invoking via popen()
+/** Wait for condition, probing it also when event_fd becomes readable
+ *
+ * @param tot_ms      maximum time to wait [ms]
+ * @param event_fd    non-blocking file descriptor to wait for, or -1
+ * @param max_nap_ms  maximum time between probes [ms]
+ * @param ready_cb    condition to wait for, or NULL for plain sleep
+ * @param aptr        argument for ready_cb
+ *
+ * @return WAIT_READY, WAIT_TIMEOUT, or WAIT_FAILED
  */
-FILE *
-common_popen_(const char *file, int line, const char *func,
-                const char *command, const char *type)
+static waitres_t
+common_wait_event(unsigned tot_ms, int event_fd, unsigned max_nap_ms,
+                  bool (*ready_cb)(void *aptr), void *aptr)
 {
     LOG_REGISTER_CONTEXT;
 
-    log_debug("EXEC %s; from %s:%d: %s()",
-              command, file, line, func);
+    waitres_t   res    = WAIT_FAILED;
+    unsigned    nap_ms = 1;
+    short       events = POLLIN;
+    struct stat st;
+
+    /* Sysfs attributes are always readable; changes are signaled
+     * via POLLPRI / POLLERR by attributes that support sysfs_notify() */
+    if( event_fd != -1 && fstat(event_fd, &st) == 0 && S_ISREG(st.st_mode) )
+        events = POLLPRI;
+
+    /* Conditions are probed at increasing intervals, so that quick
+     * state changes get noticed without excessive polling, and sleeps
+     * get interrupted as soon as worker mode switch is superseded.
+     */
+    for( ;; ) {
+        if( ready_cb && ready_cb(aptr) ) {
+            res = WAIT_READY;
+            goto EXIT;
+        }
+
+        if( tot_ms <= 0 ) {
+            res = WAIT_TIMEOUT;
+            goto EXIT;
+        }
+
+        if( worker_bailing_out() ) {
+            log_warning("wait canceled");
+            goto EXIT;
+        }
+
+        if( !ready_cb || nap_ms > max_nap_ms )
+            nap_ms = max_nap_ms;
+        if( nap_ms > tot_ms )
+            nap_ms = tot_ms;
+
+        gint64 started = g_get_monotonic_time();
+
+        int rc = common_nap(nap_ms, event_fd, events);
+        if( rc < 0 )
+            goto EXIT;
 
-    return popen(command, type);
+        gint64 slept_ms = (g_get_monotonic_time() - started) / 1000;
+        tot_ms -= (slept_ms < tot_ms) ? (unsigned)slept_ms : tot_ms;
+
+        if( rc > 0 ) {
+            /* Something happened, probe right away */
+            common_drain_fd(event_fd);
+            nap_ms = 1;
+        }
+        else {
+            nap_ms *= 2;
+        }
+    }
+
+EXIT:
+    return res;
 }
 
 waitres_t
@@ -416,46 +596,82 @@ common_wait(unsigned tot_ms, bool (*ready_cb)(void *aptr), void *aptr)
 {
     LOG_REGISTER_CONTEXT;
 
-    struct timespec ts;
-
-    waitres_t res = WAIT_FAILED;
-
-    for( ;; ) {
-        unsigned nap_ms = (tot_ms > 200) ? 200 : tot_ms;
+    return common_wait_event(tot_ms, -1, 200, ready_cb, aptr);
+}
 
-        ts.tv_sec  = (nap_ms / 1000);
-        ts.tv_nsec = (nap_ms % 1000);
-        ts.tv_nsec *= 1000 * 1000;
+/** Wait for condition, probing it also when event_fd signals a change
+ *
+ * The event_fd can be anything poll() can be used on, e.g. rtnetlink
+ * socket or sysfs attribute file. It must be non-blocking, and in case
+ * of sysfs attribute, already read once so that changes get signaled.
+ *
+ * @param tot_ms    maximum time to wait [ms]
+ * @param event_fd  file descriptor to wait for, or -1
+ * @param ready_cb  condition to wait for
+ * @param aptr      argument for ready_cb
+ *
+ * @return WAIT_READY, WAIT_TIMEOUT, or WAIT_FAILED
+ */
+waitres_t
+common_wait_fd(unsigned tot_ms, int event_fd,
+               bool (*ready_cb)(void *aptr), void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
 
-        for( ;; ) {
-            if( ready_cb && ready_cb(aptr) ) {
-                res = WAIT_READY;
-                goto EXIT;
-            }
+    return common_wait_event(tot_ms, event_fd, (event_fd == -1) ? 200 : 1000,
+                             ready_cb, aptr);
+}
 
-            if( tot_ms <= 0 ) {
-                res = WAIT_TIMEOUT;
-                goto EXIT;
-            }
+/** Wait for condition that depends on content of given directories
+ *
+ * The condition is probed whenever files in the directories are created,
+ * deleted, opened or closed - and at one second intervals as a fallback
+ * for changes that filesystems do not report via inotify.
+ *
+ * If inotify watches can't be set up, this works like common_wait().
+ *
+ * @param tot_ms    maximum time to wait [ms]
+ * @param paths     NULL terminated array of directory paths
+ * @param ready_cb  condition to wait for
+ * @param aptr      argument for ready_cb
+ *
+ * @return WAIT_READY, WAIT_TIMEOUT, or WAIT_FAILED
+ */
+waitres_t
+common_wait_paths(unsigned tot_ms, const char * const *paths,
+                  bool (*ready_cb)(void *aptr), void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
 
-            if( worker_bailing_out() ) {
-                log_warning("wait canceled");
-                goto EXIT;
-            }
+    static const uint32_t mask = (IN_CREATE | IN_DELETE |
+                                  IN_MOVED_FROM | IN_MOVED_TO |
+                                  IN_OPEN | IN_CLOSE |
+                                  IN_DELETE_SELF | IN_MOVE_SELF);
 
-            if( nanosleep(&ts, &ts) == 0 )
-                break;
+    waitres_t res        = WAIT_FAILED;
+    int       fd         = -1;
+    unsigned  max_nap_ms = 200;
 
-            if( errno != EINTR ) {
-                log_warning("wait failed: %m");
-                goto EXIT;
+    if( (fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 ) {
+        log_warning("inotify_init: %m");
+    }
+    else {
+        bool watching = true;
+        for( size_t i = 0; paths && paths[i]; ++i ) {
+            if( inotify_add_watch(fd, paths[i], mask) == -1 ) {
+                log_debug("%s: can't watch: %m", paths[i]);
+                watching = false;
             }
         }
-
-        tot_ms -= nap_ms;
+        if( watching )
+            max_nap_ms = 1000;
     }
 
-EXIT:
+    res = common_wait_event(tot_ms, fd, max_nap_ms, ready_cb, aptr);
+
+    if( fd != -1 )
+        close(fd);
+
     return res;
 }
 
@@ -571,7 +787,7 @@ int common_valid_mode(const char *mode)
  *
  * @return a comma-separated list of modes (MODE_ASK not included as it is not a real mode)
  */
-gchar *common_get_mode_list(mode_list_type_t type, uid_t uid)
+static gchar *common_build_mode_list(mode_list_type_t type, uid_t uid)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -637,3 +853,77 @@ EXIT:
 
     return g_string_free(mode_list_str, false);
 }
+
+/** Type agnostic release modelistcache_t object callback
+ *
+ * @param aptr modelistcache_t object pointer
+ */
+static void common_mode_list_cache_free_cb(gpointer aptr)
+{
+    modelistcache_t *self = aptr;
+
+    g_free(self->mc_mode_list);
+    g_free(self);
+}
+
+/** Get list of usb modes
+ *
+ * Lists are cached and regenerated only when mode data, mode
+ * permissions or configuration have changed since last call.
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @param type The type of list to return. Supported or available.
+ * @param uid  Uid of the process requesting the information;
+ *             this is used to limit allowed modes, 0 returns all
+ *
+ * @return a comma-separated list of modes, release with g_free()
+ */
+gchar *common_get_mode_list(mode_list_type_t type, uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    guint            modes_generation  = usbmoded_get_modes_generation();
+    guint            config_generation = config_get_generation();
+    gint64           key               = ((gint64)type << 32) | uid;
+    modelistcache_t *cached            = 0;
+
+    if( !common_mode_list_cache )
+        common_mode_list_cache = g_hash_table_new_full(g_int64_hash,
+                                                       g_int64_equal,
+                                                       g_free,
+                                                       common_mode_list_cache_free_cb);
+
+    if( !(cached = g_hash_table_lookup(common_mode_list_cache, &key)) ) {
+        gint64 *cache_key = g_new(gint64, 1);
+        *cache_key = key;
+        cached = g_new0(modelistcache_t, 1);
+        g_hash_table_insert(common_mode_list_cache, cache_key, cached);
+    }
+
+    if( !cached->mc_mode_list ||
+        cached->mc_modes_generation != modes_generation ||
+        cached->mc_config_generation != config_generation ) {
+        g_free(cached->mc_mode_list);
+        cached->mc_mode_list         = common_build_mode_list(type, uid);
+        cached->mc_modes_generation  = modes_generation;
+        cached->mc_config_generation = config_generation;
+    }
+
+    return g_strdup(cached->mc_mode_list);
+}
+
+/** Release cached mode lists and signal payloads
+ */
+void common_clear_mode_list_cache(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( common_mode_list_cache )
+        g_hash_table_unref(common_mode_list_cache), common_mode_list_cache = 0;
+
+    g_free(common_supported_modes_sent), common_supported_modes_sent = 0;
+    g_free(common_available_modes_sent), common_available_modes_sent = 0;
+    g_free(common_hidden_modes_sent), common_hidden_modes_sent = 0;
+    g_free(common_whitelisted_modes_sent), common_whitelisted_modes_sent = 0;
+}
@@ -82,20 +82,21 @@ void        common_send_whitelisted_modes_signal(void);
 void        common_acquire_wakelock             (const char *wakelock_name);
 void        common_release_wakelock             (const char *wakelock_name);
 int         common_system_                      (const char *file, int line, const char *func, const char *command);
-FILE       *common_popen_                       (const char *file, int line, const char *func, const char *command, const char *type);
 waitres_t   common_wait                         (unsigned tot_ms, bool (*ready_cb)(void *aptr), void *aptr);
+waitres_t   common_wait_fd                      (unsigned tot_ms, int event_fd, bool (*ready_cb)(void *aptr), void *aptr);
+waitres_t   common_wait_paths                   (unsigned tot_ms, const char * const *paths, bool (*ready_cb)(void *aptr), void *aptr);
 bool        common_msleep_                      (const char *file, int line, const char *func, unsigned msec);
 bool        common_modename_is_internal         (const char *modename);
 bool        common_modename_is_static           (const char *modename);
 int         common_valid_mode                   (const char *mode);
 gchar      *common_get_mode_list                (mode_list_type_t type, uid_t uid);
+void        common_clear_mode_list_cache        (void);
 
 /* ========================================================================= *
  * Macros
  * ========================================================================= */
 
 # define               common_system(command)      common_system_(__FILE__,__LINE__,__FUNCTION__,(command))
-# define               common_popen(command, type) common_popen_(__FILE__,__LINE__,__FUNCTION__,(command),(type))
 # define               common_msleep(msec)         common_msleep_(__FILE__,__LINE__,__FUNCTION__,(msec))
 # define               common_sleep(sec)           common_msleep_(__FILE__,__LINE__,__FUNCTION__,(sec)*1000)
 
@@ -46,10 +46,15 @@
  * Constants
  * ========================================================================= */
 
-# define USB_MODED_STATIC_CONFIG_DIR    "/etc/usb-moded"
+/* Directories can be overridden at build time, e.g. for check programs */
+# ifndef USB_MODED_STATIC_CONFIG_DIR
+#  define USB_MODED_STATIC_CONFIG_DIR    "/etc/usb-moded"
+# endif
 # define USB_MODED_STATIC_CONFIG_FILE   USB_MODED_STATIC_CONFIG_DIR"/usb-moded.ini"
 
-# define USB_MODED_DYNAMIC_CONFIG_DIR    "/var/lib/usb-moded"
+# ifndef USB_MODED_DYNAMIC_CONFIG_DIR
+#  define USB_MODED_DYNAMIC_CONFIG_DIR    "/var/lib/usb-moded"
+# endif
 # define USB_MODED_DYNAMIC_CONFIG_FILE   USB_MODED_DYNAMIC_CONFIG_DIR"/usb-moded.ini"
 
 #ifdef SAILFISH_ACCESS_CONTROL
@@ -57,6 +62,24 @@
 # define MAX_ADDITIONAL_USER 999999
 #endif
 
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Settings value change for config_set_config_settings()
+ */
+typedef struct config_setting_t
+{
+    /** Settings group, e.g. NETWORK_ENTRY */
+    const char *cs_entry;
+
+    /** Settings key, e.g. NETWORK_IP_KEY */
+    const char *cs_key;
+
+    /** Value to set */
+    const char *cs_value;
+} config_setting_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -79,6 +102,7 @@ char                *config_get_conf_string         (const gchar *entry, const g
 gchar               *config_get_user_conf_string    (const gchar *entry, const gchar *base_key, uid_t uid);
 char                *config_get_mode_setting        (uid_t uid);
 set_config_result_t  config_set_config_setting      (const char *entry, const char *key, const char *value);
+set_config_result_t  config_set_config_settings     (const config_setting_t *settings, size_t count, uid_t uid);
 set_config_result_t  config_set_user_config_setting (const char *entry, const char *base_key, const char *value, uid_t uid);
 set_config_result_t  config_set_mode_setting        (const char *mode, uid_t uid);
 set_config_result_t  config_set_hide_mode_setting   (const char *mode);
@@ -91,6 +115,9 @@ char                *config_get_group_for_mode      (const char *mode);
 set_config_result_t  config_set_network_setting     (const char *config, const char *setting);
 char                *config_get_network_setting     (const char *config);
 bool                 config_init                    (void);
+void                 config_quit                    (void);
+void                 config_invalidate_settings     (void);
+guint                config_get_generation          (void);
 char                *config_get_android_manufacturer(void);
 char                *config_get_android_vendor_id   (void);
 char                *config_get_android_product     (void);
@@ -98,6 +125,8 @@ char                *config_get_android_product_id  (void);
 char                *config_get_hidden_modes        (void);
 char                *config_get_mode_whitelist      (void);
 int                  config_is_roaming_not_allowed  (void);
+unsigned             config_get_wait_limit          (const char *key, unsigned def);
+unsigned             config_get_dhcp_setting        (const char *key, unsigned def);
 bool                 config_user_clear              (uid_t uid);
 
 /* ========================================================================= *
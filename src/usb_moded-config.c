@@ -37,19 +37,20 @@
 #include "usb_moded.h"
 #include "usb_moded-control.h"
 #include "usb_moded-dbus-private.h"
+#include "usb_moded-identity.h"
+#include "usb_moded-keyfile.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modes.h"
+#include "usb_moded-network.h"
+#include "usb_moded-snapshot.h"
 #include "usb_moded-worker.h"
 
-#ifdef USE_MER_SSU
-# include "usb_moded-ssu.h"
-#endif
-
 #include <sys/stat.h>
+#include <sys/inotify.h>
 
 #include <unistd.h>
 #include <fcntl.h>
-#include <glob.h>
+#include <pthread.h>
 
 /* ========================================================================= *
  * Prototypes
@@ -81,7 +82,10 @@ static gchar        *config_make_user_key_string     (const gchar *base_key, uid
 gchar               *config_get_user_conf_string     (const gchar *entry, const gchar *base_key, uid_t uid);
 static char         *config_get_kcmdline_string      (const char *entry);
 char                *config_get_mode_setting         (uid_t uid);
+static set_config_result_t config_update_settings   (const config_setting_t *settings, size_t count, bool *changed);
 set_config_result_t  config_set_config_setting       (const char *entry, const char *key, const char *value);
+static bool          config_validate_setting         (const char *entry, const char *key, const char *value, uid_t uid);
+set_config_result_t  config_set_config_settings      (const config_setting_t *settings, size_t count, uid_t uid);
 set_config_result_t  config_set_user_config_setting  (const char *entry, const char *base_key, const char *value, uid_t uid);
 set_config_result_t  config_set_mode_setting         (const char *mode, uid_t uid);
 static char         *config_make_modes_string        (const char *key, const char *mode_name, int include);
@@ -94,20 +98,18 @@ char                *config_get_group_for_mode       (const char *mode);
 #endif
 set_config_result_t  config_set_network_setting      (const char *config, const char *setting);
 char                *config_get_network_setting      (const char *config);
-static void          config_merge_key                (GKeyFile *dest, GKeyFile *srce, const char *grp, const char *key);
-static void          config_merge_group              (GKeyFile *dest, GKeyFile *srce, const char *grp);
-static void          config_merge_data               (GKeyFile *dest, GKeyFile *srce);
 static void          config_purge_data               (GKeyFile *dest, GKeyFile *srce);
 static void          config_purge_empty_groups       (GKeyFile *dest);
-static int           config_glob_error_cb            (const char *path, int err);
-static bool          config_merge_from_file          (GKeyFile *ini, const char *path);
 static void          config_load_static_config       (GKeyFile *ini);
 static bool          config_load_legacy_config       (GKeyFile *ini);
 static void          config_remove_legacy_config     (void);
 static void          config_load_dynamic_config      (GKeyFile *ini);
 static void          config_save_dynamic_config      (GKeyFile *ini);
 bool                 config_init                     (void);
+void                 config_quit                     (void);
 static GKeyFile     *config_get_settings             (void);
+void                 config_invalidate_settings      (void);
+guint                config_get_generation           (void);
 char                *config_get_android_manufacturer (void);
 char                *config_get_android_vendor_id    (void);
 char                *config_get_android_product      (void);
@@ -115,8 +117,128 @@ char                *config_get_android_product_id   (void);
 char                *config_get_hidden_modes         (void);
 char                *config_get_mode_whitelist       (void);
 int                  config_is_roaming_not_allowed   (void);
+static gchar        *config_get_mode_groups          (void);
+unsigned             config_get_wait_limit           (const char *key, unsigned def);
+unsigned             config_get_dhcp_setting         (const char *key, unsigned def);
 bool                 config_user_clear               (uid_t uid);
 
+/* ------------------------------------------------------------------------- *
+ * CONFIG_STORE
+ * ------------------------------------------------------------------------- */
+
+static gchar        *config_store_get_pending        (void);
+static bool          config_store_write_file         (const char *path, const char *data);
+static void          config_store_flush              (void);
+static gboolean      config_store_timer_cb           (gpointer aptr);
+static void          config_store_schedule           (gchar *data);
+
+/* ------------------------------------------------------------------------- *
+ * CONFIG_WATCH
+ * ------------------------------------------------------------------------- */
+
+static bool          config_watch_is_config_file     (const char *name);
+static gboolean      config_watch_input_cb           (GIOChannel *chn, GIOCondition cnd, gpointer aptr);
+static int           config_watch_add_dir            (const char *path);
+static bool          config_watch_start              (void);
+static void          config_watch_stop               (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Merged static and dynamic settings
+ *
+ * Loaded on demand, dropped when changes are made to the
+ * configuration files. Access only while holding #config_mutex.
+ */
+static GKeyFile        *config_settings = 0;
+
+/** Counter for tracking settings changes, see #config_get_generation() */
+static gint             config_generation = 0;
+
+static pthread_mutex_t  config_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define CONFIG_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&config_mutex) != 0 ) { \
+        log_crit("CONFIG LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define CONFIG_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&config_mutex) != 0 ) { \
+        log_crit("CONFIG UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+/** Delay between the last settings change and writing to flash [ms] */
+#define CONFIG_STORE_DELAY_MS 1500
+
+/** Upper limit for delay between retries after failed writes [ms] */
+#define CONFIG_STORE_RETRY_MAX_MS 60000
+
+/** Dynamic settings data not yet written to USB_MODED_DYNAMIC_CONFIG_FILE
+ *
+ * Access only while holding #config_store_mutex.
+ */
+static gchar           *config_store_pending  = 0;
+
+/** Timer identifier for delayed saving of dynamic settings */
+static guint            config_store_timer_id = 0;
+
+/** Delay before retrying failed write, or zero after success [ms] */
+static guint            config_store_retry_ms = 0;
+
+static pthread_mutex_t  config_store_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Mutex for serializing file writes
+ *
+ * Writing is done without holding #config_store_mutex, so that
+ * settings lookups do not need to wait for storage I/O.
+ */
+static pthread_mutex_t  config_store_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define CONFIG_STORE_WRITE_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&config_store_write_mutex) != 0 ) { \
+        log_crit("CONFIG STORE WRITE LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define CONFIG_STORE_WRITE_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&config_store_write_mutex) != 0 ) { \
+        log_crit("CONFIG STORE WRITE UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define CONFIG_STORE_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&config_store_mutex) != 0 ) { \
+        log_crit("CONFIG STORE LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define CONFIG_STORE_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&config_store_mutex) != 0 ) { \
+        log_crit("CONFIG STORE UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+/** inotify file descriptor for tracking config directories */
+static int   config_watch_fd         = -1;
+
+/** inotify watch descriptor for USB_MODED_STATIC_CONFIG_DIR */
+static int   config_watch_static_wd  = -1;
+
+/** inotify watch descriptor for USB_MODED_DYNAMIC_CONFIG_DIR */
+static int   config_watch_dynamic_wd = -1;
+
+/** I/O watch identifier for config_watch_fd */
+static guint config_watch_id         = 0;
+
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
@@ -269,11 +391,10 @@ static int config_get_conf_int(const gchar *entry, const gchar *key)
 {
     LOG_REGISTER_CONTEXT;
 
-    // TODO: use cached values instead of reloading every time?
-    GKeyFile *ini = config_get_settings();
+    CONFIG_LOCKED_ENTER;
     // Note: zero value is returned if key does not exist
-    gint val = g_key_file_get_integer(ini, entry, key, 0);
-    g_key_file_free(ini);
+    gint val = g_key_file_get_integer(config_get_settings(), entry, key, 0);
+    CONFIG_LOCKED_LEAVE;
     //log_debug("key [%s] %s value is: %d\n", entry, key, val);
     return val;
 }
@@ -282,11 +403,10 @@ char *config_get_conf_string(const gchar *entry, const gchar *key)
 {
     LOG_REGISTER_CONTEXT;
 
-    // TODO: use cached values instead of reloading every time?
-    GKeyFile *ini = config_get_settings();
+    CONFIG_LOCKED_ENTER;
     // Note: null value is returned if key does not exist
-    gchar *val = g_key_file_get_string(ini, entry, key, 0);
-    g_key_file_free(ini);
+    gchar *val = g_key_file_get_string(config_get_settings(), entry, key, 0);
+    CONFIG_LOCKED_LEAVE;
     //log_debug("key [%s] %s value is: %s\n", entry, key, val ?: "<null>");
     return val;
 }
@@ -323,78 +443,17 @@ static char * config_get_kcmdline_string(const char *entry)
 {
     LOG_REGISTER_CONTEXT;
 
-    int fd;
-    char cmdLine[1024];
-    char *ret = NULL;
-    int len;
-    gint argc = 0;
-    gchar **argv = NULL;
-    gchar **arg_tokens = NULL, **network_tokens = NULL;
-    GError *optErr = NULL;
-    int i;
-
-    if ((fd = open("/proc/cmdline", O_RDONLY)) < 0)
-    {
-        log_debug("could not read /proc/cmdline");
-        return ret;
-    }
+    /* Kernel command line is parsed just once, see identity_init() */
+    const char *val = 0;
 
-    len = read(fd, cmdLine, sizeof cmdLine - 1);
-    close(fd);
-
-    if (len <= 0)
-    {
-        log_debug("kernel command line was empty");
-        return ret;
-    }
-
-    cmdLine[len] = '\0';
-
-    /* we're looking for a piece of the kernel command line matching this:
-     * ip=192.168.3.100::192.168.3.1:255.255.255.0::usb0:on */
-    if (!g_shell_parse_argv(cmdLine, &argc, &argv, &optErr))
-    {
-        g_error_free(optErr);
-        return ret;
-    }
-
-    /* find the ip token */
-    for (i=0; i < argc; i++)
-    {
-        arg_tokens = g_strsplit(argv[i], "=", 2);
-        if (!g_ascii_strcasecmp(arg_tokens[0], "usb_moded_ip"))
-        {
-            network_tokens = g_strsplit(arg_tokens[1], ":", 7);
-            /* check if it is for the usb or rndis interface */
-            if(g_strrstr(network_tokens[5], "usb")|| (g_strrstr(network_tokens[5], "rndis")))
-            {
-                if(!strcmp(entry, NETWORK_IP_KEY))
-                {
-                    g_free(ret), ret = g_strdup(network_tokens[0]);
-                    log_debug("Command line ip = %s\n", ret);
-                }
-                if(!strcmp(entry, NETWORK_GATEWAY_KEY))
-                {
-                    /* gateway might be empty, so we do not want to return an empty string */
-                    if(strlen(network_tokens[2]) > 2)
-                    {
-                        g_free(ret), ret = g_strdup(network_tokens[2]);
-                        log_debug("Command line gateway = %s\n", ret);
-                    }
-                }
-                if(!strcmp(entry, NETWORK_NETMASK_KEY))
-                {
-                    g_free(ret), ret = g_strdup(network_tokens[3]);
-                    log_debug("Command line netmask = %s\n", ret);
-                }
-            }
-        }
-        g_strfreev(arg_tokens);
-    }
-    g_strfreev(argv);
-    g_strfreev(network_tokens);
+    if( !strcmp(entry, NETWORK_IP_KEY) )
+        val = identity_get_kcmdline_ip();
+    else if( !strcmp(entry, NETWORK_GATEWAY_KEY) )
+        val = identity_get_kcmdline_gw();
+    else if( !strcmp(entry, NETWORK_NETMASK_KEY) )
+        val = identity_get_kcmdline_nm();
 
-    return ret;
+    return g_strdup(val);
 }
 
 char * config_get_mode_setting(uid_t uid)
@@ -424,7 +483,23 @@ EXIT:
     return mode;
 }
 
-set_config_result_t config_set_config_setting(const char *entry, const char *key, const char *value)
+/** Apply settings changes and commit them to dynamic settings file
+ *
+ * All changes are applied on top of single copy of merged static and
+ * dynamic settings, and dynamic settings file is updated at most once.
+ *
+ * If the same value is listed several times, the last one is used.
+ *
+ * Config change signals are sent after the changes have been committed.
+ *
+ * @param settings  array of settings values to set
+ * @param count     number of items in settings array
+ * @param changed   array of count items for storing per item change status
+ *
+ * @return SET_CONFIG_UPDATED if any value changed, SET_CONFIG_UNCHANGED otherwise
+ */
+static set_config_result_t config_update_settings(const config_setting_t *settings,
+                                                  size_t count, bool *changed)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -433,20 +508,41 @@ set_config_result_t config_set_config_setting(const char *entry, const char *key
     GKeyFile *static_ini = g_key_file_new();
     GKeyFile *active_ini = g_key_file_new();
 
-    gchar *prev = 0;
+    gchar **prev = g_new0(gchar *, count + 1);
 
     /* Load static configuration */
     config_load_static_config(static_ini);
 
     /* Merge static and dynamic settings */
-    config_merge_data(active_ini, static_ini);
+    keyfile_merge_data(active_ini, static_ini);
     config_load_dynamic_config(active_ini);
 
-    prev = g_key_file_get_string(active_ini, entry, key, 0);
-    if( g_strcmp0(prev, value) ) {
-        g_key_file_set_string(active_ini, entry, key, value);
-        ret = SET_CONFIG_UPDATED;
-        umdbus_send_config_signal(entry, key, value);
+    /* Evaluate changes against values in effect before the update */
+    for( size_t i = 0; i < count; ++i )
+        prev[i] = g_key_file_get_string(active_ini, settings[i].cs_entry,
+                                        settings[i].cs_key, 0);
+
+    for( size_t i = 0; i < count; ++i ) {
+        changed[i] = false;
+
+        /* Skip values that are overridden later on */
+        bool overridden = false;
+        for( size_t j = i + 1; j < count; ++j ) {
+            if( !g_strcmp0(settings[i].cs_entry, settings[j].cs_entry) &&
+                !g_strcmp0(settings[i].cs_key, settings[j].cs_key) ) {
+                overridden = true;
+                break;
+            }
+        }
+        if( overridden )
+            continue;
+
+        if( g_strcmp0(prev[i], settings[i].cs_value) ) {
+            g_key_file_set_string(active_ini, settings[i].cs_entry,
+                                  settings[i].cs_key, settings[i].cs_value);
+            changed[i] = true;
+            ret = SET_CONFIG_UPDATED;
+        }
     }
 
     /* Filter out dynamic data that matches static values */
@@ -455,13 +551,195 @@ set_config_result_t config_set_config_setting(const char *entry, const char *key
     /* Update data on filesystem if changed */
     config_save_dynamic_config(active_ini);
 
+    for( size_t i = 0; i < count; ++i ) {
+        if( changed[i] && !g_strcmp0(settings[i].cs_entry, MODE_GROUP_ENTRY) )
+            usbmoded_invalidate_permissions();
+    }
+
+    for( size_t i = 0; i < count; ++i ) {
+        if( changed[i] )
+            umdbus_send_config_signal(settings[i].cs_entry,
+                                      settings[i].cs_key,
+                                      settings[i].cs_value);
+    }
+
+    for( size_t i = 0; i < count; ++i )
+        g_free(prev[i]);
     g_free(prev);
+
     g_key_file_free(active_ini);
     g_key_file_free(static_ini);
 
     return ret;
 }
 
+set_config_result_t config_set_config_setting(const char *entry, const char *key, const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const config_setting_t setting = {
+        .cs_entry = entry,
+        .cs_key   = key,
+        .cs_value = value,
+    };
+    bool changed = false;
+
+    return config_update_settings(&setting, 1, &changed);
+}
+
+/** Check whether settings value can be changed via config_set_config_settings()
+ *
+ * @param entry  settings group
+ * @param key    settings key
+ * @param value  value to set
+ * @param uid    user making the change
+ *
+ * @return true if change is allowed, false otherwise
+ */
+static bool config_validate_setting(const char *entry, const char *key,
+                                    const char *value, uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool valid = false;
+
+    if( !entry || !key || !value )
+        goto EXIT;
+
+    if( !strcmp(entry, NETWORK_ENTRY) ) {
+        if( !strcmp(key, NETWORK_IP_KEY) ||
+            !strcmp(key, NETWORK_GATEWAY_KEY) ||
+            !strcmp(key, NETWORK_NETMASK_KEY) )
+            valid = (config_validate_ip(value) == 0);
+        else if( !strcmp(key, NETWORK_INTERFACE_KEY) )
+            valid = true;
+    }
+    else if( !strcmp(entry, MODE_SETTING_ENTRY) ) {
+        if( !strcmp(key, MODE_SETTING_KEY) ) {
+            /* Don't write values that don't exist or are not permitted */
+            valid = (!strcmp(value, MODE_ASK) ||
+                     (!common_valid_mode(value) &&
+                      usbmoded_is_mode_permitted(value, uid)));
+        }
+        else if( !strcmp(key, MODE_HIDE_KEY) ||
+                 !strcmp(key, MODE_WHITELIST_KEY) )
+            valid = true;
+    }
+
+EXIT:
+    return valid;
+}
+
+/** Apply several settings changes at once
+ *
+ * Either all or none of the changes are applied. Dynamic settings file
+ * is written at most once, and follow up actions and signals such as
+ * hidden / whitelisted / available modes change notifications are
+ * issued only once regardless of the number of changed values.
+ *
+ * Mode selection is stored as a setting for the given user.
+ *
+ * @param settings  array of settings values to set
+ * @param count     number of items in settings array
+ * @param uid       user making the change
+ *
+ * @return SET_CONFIG_ERROR if some change is not allowed,
+ *         SET_CONFIG_UPDATED if some value changed, or
+ *         SET_CONFIG_UNCHANGED otherwise
+ */
+set_config_result_t config_set_config_settings(const config_setting_t *settings,
+                                               size_t count, uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    set_config_result_t  ret     = SET_CONFIG_ERROR;
+    config_setting_t    *todo    = 0;
+    gchar              **keys    = 0;
+    bool                *changed = 0;
+
+    bool hidden_changed    = false;
+    bool whitelist_changed = false;
+    bool network_changed   = false;
+
+    if( !settings || count < 1 )
+        goto EXIT;
+
+    todo    = g_new0(config_setting_t, count);
+    keys    = g_new0(gchar *, count + 1);
+    changed = g_new0(bool, count);
+
+    for( size_t i = 0; i < count; ++i ) {
+        const config_setting_t *setting = settings + i;
+
+        if( !config_validate_setting(setting->cs_entry, setting->cs_key,
+                                     setting->cs_value, uid) ) {
+            log_warning("rejected settings change: [%s] %s = %s",
+                        setting->cs_entry ?: "(null)",
+                        setting->cs_key   ?: "(null)",
+                        setting->cs_value ?: "(null)");
+            goto EXIT;
+        }
+
+        todo[i] = *setting;
+
+        if( !strcmp(setting->cs_entry, MODE_SETTING_ENTRY) &&
+            !strcmp(setting->cs_key, MODE_SETTING_KEY) ) {
+            if( (keys[i] = config_make_user_key_string(MODE_SETTING_KEY, uid)) )
+                todo[i].cs_key = keys[i];
+        }
+    }
+
+    if( (ret = config_update_settings(todo, count, changed)) != SET_CONFIG_UPDATED )
+        goto EXIT;
+
+    for( size_t i = 0; i < count; ++i ) {
+        if( !changed[i] )
+            continue;
+
+        if( !strcmp(todo[i].cs_entry, NETWORK_ENTRY) )
+            network_changed = true;
+        else if( !strcmp(todo[i].cs_key, MODE_HIDE_KEY) )
+            hidden_changed = true;
+        else if( !strcmp(todo[i].cs_key, MODE_WHITELIST_KEY) )
+            whitelist_changed = true;
+    }
+
+    if( whitelist_changed ) {
+        uid_t current_user = usbmoded_get_current_user();
+        char *mode_setting = config_get_mode_setting(current_user);
+        if( strcmp(mode_setting, MODE_ASK) && common_valid_mode(mode_setting) )
+            config_set_mode_setting(MODE_ASK, current_user);
+        g_free(mode_setting);
+
+        control_settings_changed();
+    }
+
+    if( hidden_changed ) {
+        common_send_hidden_modes_signal();
+        common_send_supported_modes_signal();
+    }
+
+    if( whitelist_changed )
+        common_send_whitelisted_modes_signal();
+
+    if( hidden_changed || whitelist_changed )
+        common_send_available_modes_signal();
+
+    if( network_changed )
+        network_update();
+
+EXIT:
+    if( keys ) {
+        for( size_t i = 0; i < count; ++i )
+            g_free(keys[i]);
+        g_free(keys);
+    }
+    g_free(changed);
+    g_free(todo);
+
+    return ret;
+}
+
 set_config_result_t config_set_user_config_setting(const char *entry, const char *base_key, const char *value, uid_t uid)
 {
     LOG_REGISTER_CONTEXT;
@@ -612,7 +890,7 @@ set_config_result_t config_set_mode_whitelist(const char *whitelist)
 
         control_settings_changed();
 
-        umdbus_send_whitelisted_modes_signal(whitelist);
+        common_send_whitelisted_modes_signal();
         common_send_available_modes_signal();
     }
 
@@ -656,16 +934,10 @@ set_config_result_t config_set_network_setting(const char *config, const char *s
 {
     LOG_REGISTER_CONTEXT;
 
-    if(!strcmp(config, NETWORK_IP_KEY) || !strcmp(config, NETWORK_GATEWAY_KEY))
-        if(config_validate_ip(setting) != 0)
-            return SET_CONFIG_ERROR;
-
-    if(!strcmp(config, NETWORK_IP_KEY) || !strcmp(config, NETWORK_INTERFACE_KEY) || !strcmp(config, NETWORK_GATEWAY_KEY))
-    {
-        return config_set_config_setting(NETWORK_ENTRY, config, setting);
-    }
+    if( !config_validate_setting(NETWORK_ENTRY, config, setting, 0) )
+        return SET_CONFIG_ERROR;
 
-    return SET_CONFIG_ERROR;
+    return config_set_config_setting(NETWORK_ENTRY, config, setting);
 }
 
 char *config_get_network_setting(const char *config)
@@ -688,7 +960,7 @@ char *config_get_network_setting(const char *config)
 
         /* no interface override specified, let's use the one
          * from the mode config */
-        if( (data = worker_dup_usb_mode_data()) ) {
+        if( (data = worker_ref_usb_mode_data()) ) {
             if( (ret = g_strdup(data->network_interface)) )
                 goto EXIT;
         }
@@ -710,73 +982,11 @@ char *config_get_network_setting(const char *config)
     }
 
 EXIT:
-    modedata_free(data);
+    modedata_unref(data);
 
     return ret;
 }
 
-/**
- * Merge value from one keyfile to another
- *
- * Existing values will be overridden
- *
- * @param dest keyfile to modify
- * @param srce keyfile to merge from
- * @param grp  value group to merge
- * @param key  value key to merge
- */
-static void config_merge_key(GKeyFile *dest, GKeyFile *srce,
-                             const char *grp, const char *key)
-{
-    LOG_REGISTER_CONTEXT;
-
-    gchar *val = g_key_file_get_value(srce, grp, key, 0);
-    if( val ) {
-        //log_debug("[%s] %s = %s", grp, key, val);
-        g_key_file_set_value(dest, grp, key, val);
-        g_free(val);
-    }
-}
-
-/**
- * Merge group of values from one keyfile to another
- *
- * @param dest keyfile to modify
- * @param srce keyfile to merge from
- * @param grp  value group to merge
- */
-static void config_merge_group(GKeyFile *dest, GKeyFile *srce,
-                               const char *grp)
-{
-    LOG_REGISTER_CONTEXT;
-
-    gchar **key = g_key_file_get_keys(srce, grp, 0, 0);
-    if( key ) {
-        for( size_t i = 0; key[i]; ++i )
-            config_merge_key(dest, srce, grp, key[i]);
-        g_strfreev(key);
-    }
-}
-
-/**
- * Merge all groups and values from one keyfile to another
- *
- * @param dest keyfile to modify
- * @param srce keyfile to merge from
- */
-static void config_merge_data(GKeyFile *dest, GKeyFile *srce)
-{
-    LOG_REGISTER_CONTEXT;
-
-    gchar **grp = g_key_file_get_groups(srce, 0);
-
-    if( grp ) {
-        for( size_t i = 0; grp[i]; ++i )
-            config_merge_group(dest, srce, grp[i]);
-        g_strfreev(grp);
-    }
-}
-
 static void config_purge_data(GKeyFile *dest, GKeyFile *srce)
 {
     LOG_REGISTER_CONTEXT;
@@ -824,64 +1034,12 @@ static void config_purge_empty_groups(GKeyFile *dest)
     g_strfreev(group);
 }
 
-/**
- * Callback function for logging errors within glob()
- *
- * @param path path to file/dir where error occurred
- * @param err  errno that occurred
- *
- * @return 0 (= do not stop glob)
- */
-static int config_glob_error_cb(const char *path, int err)
-{
-    LOG_REGISTER_CONTEXT;
-
-    log_debug("%s: glob: %s", path, g_strerror(err));
-    return 0;
-}
-
-static bool config_merge_from_file(GKeyFile *ini, const char *path)
-{
-    LOG_REGISTER_CONTEXT;
-
-    bool      ack = false;
-    GError   *err = 0;
-    GKeyFile *tmp = g_key_file_new();
-
-    if( !g_key_file_load_from_file(tmp, path, 0, &err) ) {
-        log_debug("%s: can't load: %s", path, err->message);
-    } else {
-        //log_debug("processing %s ...", path);
-        config_merge_data(ini, tmp);
-        ack = true;
-    }
-    g_clear_error(&err);
-    g_key_file_free(tmp);
-    return ack;
-}
-
 static void config_load_static_config(GKeyFile *ini)
 {
     LOG_REGISTER_CONTEXT;
 
-    static const char pattern[] = USB_MODED_STATIC_CONFIG_DIR"/*.ini";
-
-    glob_t gb = {};
-
-    if( glob(pattern, 0, config_glob_error_cb, &gb) != 0 )
-        log_debug("no configuration ini-files found");
-
-    /* Seed with default values */
-    g_key_file_set_string(ini, MODE_SETTING_ENTRY, MODE_SETTING_KEY, MODE_ASK);
-
-    /* Override with content from config files */
-    for( size_t i = 0; i < gb.gl_pathc; ++i ) {
-        const char *path = gb.gl_pathv[i];
-        if( strcmp(path, USB_MODED_STATIC_CONFIG_FILE) )
-            config_merge_from_file(ini, path);
-    }
-
-    globfree(&gb);
+    /* Use precompiled snapshot when available, parse ini-files otherwise */
+    snapshot_load_static_config(ini);
 }
 
 static bool config_load_legacy_config(GKeyFile *ini)
@@ -914,7 +1072,7 @@ static bool config_load_legacy_config(GKeyFile *ini)
         goto EXIT;
     }
 
-    if( !config_merge_from_file(ini, USB_MODED_STATIC_CONFIG_FILE) )
+    if( !keyfile_merge_from_file(ini, USB_MODED_STATIC_CONFIG_FILE) )
         goto EXIT;
 
     /* A mode=ask setting in legacy config can be either
@@ -961,9 +1119,24 @@ static void config_load_dynamic_config(GKeyFile *ini)
 {
     LOG_REGISTER_CONTEXT;
 
-    config_merge_from_file(ini, USB_MODED_DYNAMIC_CONFIG_FILE);
+    /* Changes that have not been written yet take precedence */
+    gchar *pending = config_store_get_pending();
+
+    if( pending )
+        keyfile_merge_from_data(ini, pending);
+    else
+        keyfile_merge_from_file(ini, USB_MODED_DYNAMIC_CONFIG_FILE);
+
+    g_free(pending);
 }
 
+/** Schedule saving of dynamic settings
+ *
+ * Actual writing to the filesystem is delayed until there have been
+ * no changes for a while, or usb-moded is exiting.
+ *
+ * @param ini  dynamic settings to save
+ */
 static void config_save_dynamic_config(GKeyFile *ini)
 {
     LOG_REGISTER_CONTEXT;
@@ -974,24 +1147,15 @@ static void config_save_dynamic_config(GKeyFile *ini)
     config_purge_empty_groups(ini);
     current_dta = g_key_file_to_data(ini, 0, 0);
 
-    g_file_get_contents(USB_MODED_DYNAMIC_CONFIG_FILE, &previous_dta, 0, 0);
+    if( !(previous_dta = config_store_get_pending()) )
+        g_file_get_contents(USB_MODED_DYNAMIC_CONFIG_FILE, &previous_dta, 0, 0);
+
     if( g_strcmp0(previous_dta, current_dta) ) {
-        GError *err = 0;
-        if( mkdir(USB_MODED_DYNAMIC_CONFIG_DIR, 0755) == -1 && errno != EEXIST ) {
-            log_err("%s: can't create dir: %m", USB_MODED_DYNAMIC_CONFIG_DIR);
-        }
-        else if( !g_file_set_contents(USB_MODED_DYNAMIC_CONFIG_FILE,
-                                      current_dta, -1, &err) ) {
-            log_err("%s: can't save: %s", USB_MODED_DYNAMIC_CONFIG_FILE,
-                    err->message);
-        }
-        else {
-            log_debug("%s: updated", USB_MODED_DYNAMIC_CONFIG_FILE);
+        config_store_schedule(current_dta),
+            current_dta = 0;
 
-            /* The legacy file is not needed anymore */
-            config_remove_legacy_config();
-        }
-        g_clear_error(&err);
+        /* Pending data is used for lookups until it gets written */
+        config_invalidate_settings();
     }
 
     g_free(current_dta);
@@ -1020,7 +1184,7 @@ bool config_init(void)
     /* Handle legacy settings */
     if( config_load_legacy_config(legacy_ini) ) {
         config_purge_data(legacy_ini, static_ini);
-        config_merge_data(active_ini, legacy_ini);
+        keyfile_merge_data(active_ini, legacy_ini);
     }
 
     /* Load dynamic settings */
@@ -1036,49 +1200,94 @@ bool config_init(void)
     g_key_file_free(static_ini);
     g_key_file_free(legacy_ini);
 
+    /* Track changes made to configuration files */
+    if( !config_watch_start() )
+        log_warning("config file tracking not available");
+
     return ack;
 }
 
-static GKeyFile *config_get_settings(void)
+/** Release resources allocated by config_init()
+ */
+void config_quit(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    GKeyFile *ini = g_key_file_new();
-    config_load_static_config(ini);
-    config_load_dynamic_config(ini);
-    return ini;
+    /* Do not lose settings changes that are still pending */
+    config_store_flush();
+
+    config_watch_stop();
+    config_invalidate_settings();
 }
 
-char * config_get_android_manufacturer(void)
+/** Get merged static and dynamic settings
+ *
+ * Note: Must be called while holding #config_mutex. The returned
+ *       object is owned by the config module and must not be
+ *       modified or released by the caller.
+ *
+ * @return keyfile object with current settings
+ */
+static GKeyFile *config_get_settings(void)
 {
     LOG_REGISTER_CONTEXT;
 
-#ifdef USE_MER_SSU
-    /* If SSU can provide manufacturer name, use it. Otherwise fall
-     * back to using the name specified in configuration files. */
-    char *ssu_name = ssu_get_manufacturer_name();
-    if( ssu_name )
-    {
-        return ssu_name;
-    }
-#else
-    /*Trying use /etc/hw-release to get MANUFACTURER_ID*/
-    GKeyFile *hwReleaseFile;
-    GError *error = NULL;
-
-    // Create a new GKeyFile object and a bitwise list of flags.
-    char *hw_name = NULL;
-    hwReleaseFile = g_key_file_new();
-    if (g_key_file_load_from_file(hwReleaseFile, "/etc/hw-release", G_KEY_FILE_NONE, &error))
-    {
-        hw_name = g_key_file_get_string(hwReleaseFile, NULL, "MANUFACTURER", NULL);
+    if( !config_settings ) {
+        log_debug("loading settings");
+        config_settings = g_key_file_new();
+        config_load_static_config(config_settings);
+        config_load_dynamic_config(config_settings);
     }
+    return config_settings;
+}
 
-    if(hw_name)
-    {
-        return hw_name;
+/** Drop cached settings
+ *
+ * Settings are reloaded from files on the next lookup.
+ */
+void config_invalidate_settings(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    CONFIG_LOCKED_ENTER;
+
+    g_atomic_int_inc(&config_generation);
+
+    if( config_settings ) {
+        log_debug("invalidating cached settings");
+        g_key_file_free(config_settings),
+            config_settings = 0;
     }
-#endif
+
+    CONFIG_LOCKED_LEAVE;
+}
+
+/** Get configuration generation
+ *
+ * The value changes whenever settings might have changed, and can be
+ * used for checking validity of data derived from settings.
+ *
+ * Note: This function is safe to call from any thread.
+ *
+ * @return generation counter value
+ */
+guint config_get_generation(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return (guint)g_atomic_int_get(&config_generation);
+}
+
+char * config_get_android_manufacturer(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* If ssu / hw-release can provide manufacturer name, use it.
+     * Otherwise fall back to using the name specified in
+     * configuration files. */
+    const char *name = identity_get_manufacturer();
+    if( name )
+        return g_strdup(name);
 
     return config_get_conf_string(ANDROID_ENTRY, ANDROID_MANUFACTURER_KEY);
 }
@@ -1094,24 +1303,12 @@ char * config_get_android_product(void)
 {
     LOG_REGISTER_CONTEXT;
 
-#ifdef USE_MER_SSU
-    /* If SSU can provide device model name, use it. Otherwise fall
-     * back to using the name specified in configuration files. */
-    char *ssu_name = ssu_get_product_name();
-    if( ssu_name )
-    {
-        return ssu_name;
-    }
-#else
-    /*Trying use /etc/hw-release to get NAME*/
-    GKeyFile *hwReleaseFile;
-    GError *error = NULL;
-
-    hwReleaseFile = g_key_file_new();
-    if (g_key_file_load_from_file(hwReleaseFile, "/etc/hw-release", G_KEY_FILE_NONE, &error)) {
-        return g_key_file_get_string(hwReleaseFile, NULL, "NAME", NULL);
-    }
-#endif
+    /* If ssu / hw-release can provide device model name, use it.
+     * Otherwise fall back to using the name specified in
+     * configuration files. */
+    const char *name = identity_get_product();
+    if( name )
+        return g_strdup(name);
 
     return config_get_conf_string(ANDROID_ENTRY, ANDROID_PRODUCT_KEY);
 }
@@ -1143,6 +1340,60 @@ int config_is_roaming_not_allowed(void)
     return config_get_conf_int(NETWORK_ENTRY, NO_ROAMING_KEY);
 }
 
+/** Get mode group settings in comparable form
+ *
+ * @return "key=value" lines from MODE_GROUP_ENTRY, release with g_free()
+ */
+static gchar *config_get_mode_groups(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GString *str = g_string_new(0);
+
+    CONFIG_LOCKED_ENTER;
+    GKeyFile *ini  = config_get_settings();
+    gchar   **keys = g_key_file_get_keys(ini, MODE_GROUP_ENTRY, 0, 0);
+    for( size_t i = 0; keys && keys[i]; ++i ) {
+        gchar *val = g_key_file_get_value(ini, MODE_GROUP_ENTRY, keys[i], 0);
+        g_string_append_printf(str, "%s=%s\n", keys[i], val ?: "");
+        g_free(val);
+    }
+    g_strfreev(keys);
+    CONFIG_LOCKED_LEAVE;
+
+    return g_string_free(str, FALSE);
+}
+
+/** Get upper bound for waiting a readiness condition during mode switch
+ *
+ * @param key  settings key in [wait] group, e.g. WAIT_INTERFACE_KEY
+ * @param def  value to use if not configured [ms]
+ *
+ * @return maximum wait time [ms]
+ */
+unsigned config_get_wait_limit(const char *key, unsigned def)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int val = config_get_conf_int(WAIT_ENTRY, key);
+    return (val > 0) ? (unsigned)val : def;
+}
+
+/** Get numeric setting for DHCP server
+ *
+ * @param key  settings key in [dhcp] group, e.g. DHCP_LEASE_TIME_KEY
+ * @param def  value to use if not configured
+ *
+ * @return setting value
+ */
+unsigned config_get_dhcp_setting(const char *key, unsigned def)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int val = config_get_conf_int(DHCP_ENTRY, key);
+    return (val > 0) ? (unsigned)val : def;
+}
+
 /**
  * Remove user configs
  */
@@ -1168,3 +1419,435 @@ bool config_user_clear(uid_t uid)
     g_key_file_free(active_ini);
     return true;
 }
+
+/* ========================================================================= *
+ * CONFIG_STORE
+ * ========================================================================= */
+
+/** Get dynamic settings data that has not been written yet
+ *
+ * Note: This function is safe to call from any thread.
+ *
+ * @return settings data, or NULL if there are no pending changes
+ */
+static gchar *config_store_get_pending(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *data = 0;
+
+    CONFIG_STORE_LOCKED_ENTER;
+    data = g_strdup(config_store_pending);
+    CONFIG_STORE_LOCKED_LEAVE;
+
+    return data;
+}
+
+/** Atomically replace file content
+ *
+ * Data is written to a temporary file that is synced to storage and
+ * then renamed over the original, so that a crash or power loss leaves
+ * either the old or the new content in place - never a truncated file.
+ *
+ * @param path  file to write
+ * @param data  content to write
+ *
+ * @return true on success, false otherwise
+ */
+static bool config_store_write_file(const char *path, const char *data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool    ack  = false;
+    int     fd   = -1;
+    gchar  *temp = g_strdup_printf("%s.tmp", path);
+    gchar  *dir  = g_path_get_dirname(path);
+    size_t  todo = strlen(data);
+
+    if( mkdir(dir, 0755) == -1 && errno != EEXIST ) {
+        log_err("%s: can't create dir: %m", dir);
+        goto EXIT;
+    }
+
+    if( (fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1 ) {
+        log_err("%s: can't open: %m", temp);
+        goto EXIT;
+    }
+
+    while( todo > 0 ) {
+        ssize_t done = write(fd, data, todo);
+        if( done == -1 ) {
+            if( errno == EINTR )
+                continue;
+            log_err("%s: can't write: %m", temp);
+            goto EXIT;
+        }
+        data += done, todo -= done;
+    }
+
+    if( fsync(fd) == -1 ) {
+        log_err("%s: can't sync: %m", temp);
+        goto EXIT;
+    }
+
+    if( close(fd) == -1 ) {
+        fd = -1;
+        log_err("%s: can't close: %m", temp);
+        goto EXIT;
+    }
+    fd = -1;
+
+    if( rename(temp, path) == -1 ) {
+        log_err("%s: can't rename to %s: %m", temp, path);
+        goto EXIT;
+    }
+
+    /* Make the rename itself persistent */
+    if( (fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 ||
+        fsync(fd) == -1 )
+        log_warning("%s: can't sync: %m", dir);
+
+    ack = true;
+
+EXIT:
+    if( fd != -1 )
+        close(fd);
+
+    if( !ack )
+        unlink(temp);
+
+    g_free(dir);
+    g_free(temp);
+
+    return ack;
+}
+
+/** Write pending dynamic settings changes to filesystem
+ *
+ * Note: This function should be called only from the main thread.
+ */
+static void config_store_flush(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool   updated = false;
+    gchar *data    = 0;
+
+    /* Writes must not get reordered */
+    CONFIG_STORE_WRITE_LOCKED_ENTER;
+
+    CONFIG_STORE_LOCKED_ENTER;
+    if( config_store_timer_id ) {
+        g_source_remove(config_store_timer_id),
+            config_store_timer_id = 0;
+    }
+    data = g_strdup(config_store_pending);
+    CONFIG_STORE_LOCKED_LEAVE;
+
+    if( !data )
+        goto EXIT;
+
+    /* Pending data stays visible to lookups until written */
+    updated = config_store_write_file(USB_MODED_DYNAMIC_CONFIG_FILE, data);
+
+    CONFIG_STORE_LOCKED_ENTER;
+    if( updated ) {
+        log_debug("%s: updated", USB_MODED_DYNAMIC_CONFIG_FILE);
+        config_store_retry_ms = 0;
+
+        /* Keep changes that were made during writing */
+        if( !g_strcmp0(config_store_pending, data) )
+            g_free(config_store_pending), config_store_pending = 0;
+    }
+    else {
+        /* Keep the pending data and try again later */
+        config_store_retry_ms = (config_store_retry_ms
+                                 ? MIN(config_store_retry_ms * 2,
+                                       CONFIG_STORE_RETRY_MAX_MS)
+                                 : CONFIG_STORE_DELAY_MS);
+        log_err("%s: can't save settings; retry in %u ms",
+                USB_MODED_DYNAMIC_CONFIG_FILE, config_store_retry_ms);
+        if( !config_store_timer_id )
+            config_store_timer_id = g_timeout_add(config_store_retry_ms,
+                                                  config_store_timer_cb, 0);
+    }
+    CONFIG_STORE_LOCKED_LEAVE;
+
+EXIT:
+    CONFIG_STORE_WRITE_LOCKED_LEAVE;
+
+    g_free(data);
+
+    if( updated ) {
+        /* The legacy file is not needed anymore */
+        config_remove_legacy_config();
+
+        /* Do not wait for inotify to catch up with own changes */
+        config_invalidate_settings();
+    }
+}
+
+static gboolean config_store_timer_cb(gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    CONFIG_STORE_LOCKED_ENTER;
+    config_store_timer_id = 0;
+    CONFIG_STORE_LOCKED_LEAVE;
+
+    config_store_flush();
+
+    return G_SOURCE_REMOVE;
+}
+
+/** Set dynamic settings data to be written after a quiet period
+ *
+ * Every call restarts the delay, so that a burst of changes
+ * results in just one write.
+ *
+ * @param data  settings data, ownership is transferred
+ */
+static void config_store_schedule(gchar *data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    CONFIG_STORE_LOCKED_ENTER;
+
+    g_free(config_store_pending),
+        config_store_pending = data;
+
+    if( config_store_timer_id )
+        g_source_remove(config_store_timer_id);
+    config_store_timer_id = g_timeout_add(CONFIG_STORE_DELAY_MS,
+                                          config_store_timer_cb, 0);
+
+    CONFIG_STORE_LOCKED_LEAVE;
+}
+
+/* ========================================================================= *
+ * CONFIG_WATCH
+ * ========================================================================= */
+
+/** Predicate for: file name is relevant from settings point of view
+ *
+ * Temporary files created by g_file_set_contents() etc are ignored.
+ *
+ * @param name  file name from inotify event
+ *
+ * @return true if file affects settings, false otherwise
+ */
+static bool config_watch_is_config_file(const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return name && g_str_has_suffix(name, ".ini");
+}
+
+/** Handle inotify events from configuration directories
+ *
+ * @param chn   io channel (unused)
+ * @param cnd   io condition
+ * @param aptr  user data (unused)
+ *
+ * @return TRUE to keep the iowatch, or FALSE to disable it
+ */
+static gboolean config_watch_input_cb(GIOChannel *chn, GIOCondition cnd,
+                                      gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)chn;
+    (void)aptr;
+
+    gboolean keep_going = FALSE;
+    bool     changed    = false;
+
+    char buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    if( cnd & ~G_IO_IN ) {
+        log_err("config watch: unexpected io condition: 0x%x", (unsigned)cnd);
+        goto EXIT;
+    }
+
+    for( ;; ) {
+        ssize_t rc = read(config_watch_fd, buf, sizeof buf);
+
+        if( rc == -1 ) {
+            if( errno == EINTR )
+                continue;
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+                break;
+            log_err("config watch: read: %m");
+            goto EXIT;
+        }
+
+        if( rc == 0 ) {
+            log_err("config watch: unexpected eof");
+            goto EXIT;
+        }
+
+        for( char *pos = buf; pos < buf + rc; ) {
+            const struct inotify_event *eve = (void *)pos;
+            pos += sizeof *eve + eve->len;
+
+            if( eve->mask & IN_Q_OVERFLOW ) {
+                changed = true;
+                continue;
+            }
+
+            if( eve->mask & IN_IGNORED ) {
+                /* Watched directory was removed */
+                if( eve->wd == config_watch_static_wd )
+                    config_watch_static_wd = -1;
+                else if( eve->wd == config_watch_dynamic_wd )
+                    config_watch_dynamic_wd = -1;
+                changed = true;
+                continue;
+            }
+
+            if( eve->mask & (IN_DELETE_SELF | IN_MOVE_SELF) ) {
+                changed = true;
+                continue;
+            }
+
+            if( eve->len > 0 && config_watch_is_config_file(eve->name) ) {
+                log_debug("config watch: %s: changed", eve->name);
+                changed = true;
+            }
+        }
+    }
+
+    keep_going = TRUE;
+
+EXIT:
+    if( changed ) {
+        int    roaming_prev = config_is_roaming_not_allowed();
+        gchar *groups_prev  = config_get_mode_groups();
+
+        config_invalidate_settings();
+
+        /* Mode groups can be defined in both static and dynamic
+         * configuration - compare the merged result */
+        gchar *groups_curr = config_get_mode_groups();
+        if( strcmp(groups_prev, groups_curr) )
+            usbmoded_invalidate_permissions();
+        g_free(groups_curr);
+        g_free(groups_prev);
+
+        if( config_is_roaming_not_allowed() != roaming_prev )
+            network_roaming_policy_changed();
+    }
+
+    if( !keep_going ) {
+        log_warning("config watch: disabled");
+        config_watch_id = 0;
+        config_watch_stop();
+    }
+
+    return keep_going;
+}
+
+/** Add inotify watch for configuration directory
+ *
+ * @param path  directory path
+ *
+ * @return watch descriptor, or -1 on failure
+ */
+static int config_watch_add_dir(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const uint32_t mask = (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE |
+                           IN_MOVED_FROM | IN_MOVED_TO |
+                           IN_DELETE_SELF | IN_MOVE_SELF |
+                           IN_ONLYDIR);
+
+    int wd = inotify_add_watch(config_watch_fd, path, mask);
+    if( wd == -1 )
+        log_debug("%s: can't add inotify watch: %m", path);
+    return wd;
+}
+
+/** Start tracking changes made to configuration files
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @return true on success, false otherwise
+ */
+static bool config_watch_start(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool        ack = false;
+    GIOChannel *chn = 0;
+
+    if( config_watch_id )
+        goto SUCCESS;
+
+    if( config_watch_fd == -1 ) {
+        config_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if( config_watch_fd == -1 ) {
+            log_err("inotify_init: %m");
+            goto EXIT;
+        }
+    }
+
+    /* Dynamic config dir gets created on the first settings
+     * change - make sure it exists so that it can be watched. */
+    if( mkdir(USB_MODED_DYNAMIC_CONFIG_DIR, 0755) == -1 && errno != EEXIST )
+        log_debug("%s: can't create dir: %m", USB_MODED_DYNAMIC_CONFIG_DIR);
+
+    if( config_watch_static_wd == -1 )
+        config_watch_static_wd = config_watch_add_dir(USB_MODED_STATIC_CONFIG_DIR);
+
+    if( config_watch_dynamic_wd == -1 )
+        config_watch_dynamic_wd = config_watch_add_dir(USB_MODED_DYNAMIC_CONFIG_DIR);
+
+    if( config_watch_static_wd == -1 && config_watch_dynamic_wd == -1 )
+        goto EXIT;
+
+    if( !(chn = g_io_channel_unix_new(config_watch_fd)) )
+        goto EXIT;
+
+    if( !(config_watch_id = g_io_add_watch(chn,
+                                           G_IO_IN | G_IO_ERR |
+                                           G_IO_HUP | G_IO_NVAL,
+                                           config_watch_input_cb, 0)) )
+        goto EXIT;
+
+SUCCESS:
+    ack = true;
+
+EXIT:
+    if( chn )
+        g_io_channel_unref(chn);
+
+    if( !ack )
+        config_watch_stop();
+
+    return ack;
+}
+
+/** Stop tracking changes made to configuration files
+ */
+static void config_watch_stop(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( config_watch_id ) {
+        g_source_remove(config_watch_id),
+            config_watch_id = 0;
+    }
+
+    if( config_watch_fd != -1 ) {
+        /* Closing inotify fd releases also the watches */
+        close(config_watch_fd),
+            config_watch_fd = -1;
+    }
+
+    config_watch_static_wd  = -1;
+    config_watch_dynamic_wd = -1;
+}
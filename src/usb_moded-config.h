@@ -73,6 +73,15 @@
 # define MODE_HIDE_KEY                  "hide"
 # define MODE_WHITELIST_KEY             "whitelist"
 # define MODE_GROUP_ENTRY               "mode_group"
+# define WAIT_ENTRY                     "wait"
+# define WAIT_INTERFACE_KEY             "interface_ms"
+# define WAIT_UDC_CONFIGURED_KEY        "udc_configured_ms"
+# define WAIT_UMOUNT_KEY                "umount_ms"
+# define DHCP_ENTRY                     "dhcp"
+# define DHCP_BUILTIN_KEY               "builtin"
+# define DHCP_RANGE_START_KEY           "range_start"
+# define DHCP_RANGE_END_KEY             "range_end"
+# define DHCP_LEASE_TIME_KEY            "lease_time"
 
 /* ========================================================================= *
  * Types
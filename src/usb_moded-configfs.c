@@ -23,9 +23,9 @@
 
 #include "usb_moded-configfs.h"
 
-#include "usb_moded-android.h"
 #include "usb_moded-common.h"
 #include "usb_moded-config-private.h"
+#include "usb_moded-identity.h"
 #include "usb_moded-log.h"
 #include "usb_moded-mac.h"
 
@@ -57,6 +57,31 @@
 #define DEFAULT_RNDIS_CTRL_WCEIS         "wceis"
 #define DEFAULT_RNDIS_CTRL_ETHADDR       "ethaddr"
 
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Gadget configuration as last applied by usb-moded
+ *
+ * Used for limiting changes made on mode switch to what actually
+ * differs, so that UDC does not need to be bounced - and host does
+ * not see re-enumeration - when nothing relevant changes.
+ */
+typedef struct configfs_gadget_t
+{
+    /** Functions linked to configuration, in linking order */
+    gchar **cg_functions;
+
+    /** Flag for: cg_functions reflects configuration directory content */
+    bool    cg_functions_known;
+
+    /** Last value written to idVendor, or NULL if not known */
+    gchar  *cg_id_vendor;
+
+    /** Last value written to idProduct, or NULL if not known */
+    gchar  *cg_id_product;
+} configfs_gadget_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -93,6 +118,10 @@ static bool        configfs_read_udc               (char *buff, size_t size);
 #endif // DEAD_CODE
 static bool        configfs_write_udc              (const char *text);
 bool               configfs_set_udc                (bool enable);
+gchar             *configfs_get_udc_state_path     (void);
+static void        configfs_gadget_forget          (void);
+static bool        configfs_gadget_set_id          (gchar **cached, const char *path, const char *id);
+static bool        configfs_gadget_set_functions   (gchar **target);
 bool               configfs_init                   (void);
 void               configfs_quit                   (void);
 bool               configfs_set_charging_mode      (void);
@@ -100,6 +129,7 @@ bool               configfs_set_productid          (const char *id);
 bool               configfs_set_vendorid           (const char *id);
 static const char *configfs_map_function           (const char *func);
 bool               configfs_set_function           (const char *functions);
+void               configfs_prestage_functions     (const char *functions);
 bool               configfs_add_mass_storage_lun   (int lun);
 bool               configfs_remove_mass_storage_lun(int lun);
 bool               configfs_set_mass_storage_attr  (int lun, const char *attr, const char *value);
@@ -128,6 +158,9 @@ static gchar *FUNCTION_MTP             = 0;
 static gchar *RNDIS_CTRL_WCEIS         = 0;
 static gchar *RNDIS_CTRL_ETHADDR       = 0;
 
+/** Currently applied gadget configuration */
+static configfs_gadget_t configfs_gadget = { 0 };
+
 /* ========================================================================= *
  * Settings
  * ========================================================================= */
@@ -745,6 +778,158 @@ configfs_set_udc(bool enable)
     return configfs_write_udc(value);
 }
 
+/** Get path to state attribute of the UDC used by the gadget
+ *
+ * @return path to sysfs file, or NULL if UDC is not known
+ */
+gchar *
+configfs_get_udc_state_path(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar      *path = 0;
+    const char *udc  = configfs_udc_enable_value();
+
+    if( *udc )
+        path = g_strdup_printf("/sys/class/udc/%s/state", udc);
+
+    return path;
+}
+
+/* ------------------------------------------------------------------------- *
+ * GADGET_STATE
+ * ------------------------------------------------------------------------- */
+
+/** Invalidate cached gadget configuration
+ *
+ * Next mode switch will then rewrite everything.
+ */
+static void
+configfs_gadget_forget(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_strfreev(configfs_gadget.cg_functions),
+        configfs_gadget.cg_functions = 0;
+    configfs_gadget.cg_functions_known = false;
+
+    g_free(configfs_gadget.cg_id_vendor),
+        configfs_gadget.cg_id_vendor = 0;
+    g_free(configfs_gadget.cg_id_product),
+        configfs_gadget.cg_id_product = 0;
+}
+
+/** Update vendor / product id if it differs from what was written earlier
+ *
+ * Host sees id changes only after re-enumeration, so UDC is disabled
+ * when an actual change needs to be made.
+ *
+ * @param cached  pointer to cached id value
+ * @param path    id control file path
+ * @param id      id value to write
+ *
+ * @return true if id is now in effect, false otherwise
+ */
+static bool
+configfs_gadget_set_id(gchar **cached, const char *path, const char *id)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    if( *cached && !g_ascii_strcasecmp(*cached, id) ) {
+        log_debug("%s: already set to '%s'", path, id);
+        ack = true;
+        goto EXIT;
+    }
+
+    g_free(*cached), *cached = 0;
+
+    if( !configfs_set_udc(false) )
+        goto EXIT;
+
+    if( !configfs_write_file(path, id) )
+        goto EXIT;
+
+    *cached = g_strdup(id);
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Link functions to gadget configuration, changing only what differs
+ *
+ * Functions that are already linked in the same order are left as is,
+ * functions that follow a difference are unlinked and the rest of the
+ * target functions are linked. If nothing changes, the UDC is left
+ * untouched. Otherwise it is disabled, as kernel does not allow
+ * changing functions of a bound gadget.
+ *
+ * @param target  NULL terminated array of function names to link
+ *
+ * @return true if target configuration is now in effect, false otherwise
+ */
+static bool
+configfs_gadget_set_functions(gchar **target)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool    ack     = false;
+    gchar **current = configfs_gadget.cg_functions;
+    size_t  keep    = 0;
+
+    if( configfs_gadget.cg_functions_known ) {
+        while( current[keep] && target[keep] &&
+               !strcmp(current[keep], target[keep]) )
+            ++keep;
+
+        if( !current[keep] && !target[keep] ) {
+            log_debug("functions unchanged");
+            ack = true;
+            goto EXIT;
+        }
+    }
+
+    if( !configfs_set_udc(false) )
+        goto EXIT;
+
+    /* Until we are done, the configuration directory content is
+     * not what is tracked in configfs_gadget. */
+    configfs_gadget.cg_functions_known = false;
+
+    if( !current ) {
+        if( !configfs_disable_all_functions() )
+            goto EXIT;
+    }
+    else {
+        for( size_t i = g_strv_length(current); i-- > keep; ) {
+            if( !configfs_disable_function(current[i]) )
+                goto EXIT;
+        }
+    }
+
+    for( size_t i = keep; target[i]; ++i ) {
+        if( !configfs_enable_function(target[i]) )
+            goto EXIT;
+    }
+
+    g_strfreev(configfs_gadget.cg_functions),
+        configfs_gadget.cg_functions = g_strdupv(target);
+    configfs_gadget.cg_functions_known = true;
+
+    ack = true;
+
+EXIT:
+    if( !configfs_gadget.cg_functions_known ) {
+        /* Partial failure: rescan on the next attempt */
+        g_strfreev(configfs_gadget.cg_functions),
+            configfs_gadget.cg_functions = 0;
+    }
+
+    return ack;
+}
+
 /** initialize the basic configfs values
  *
  * @return true if configfs backend is ready for use, false otherwise
@@ -782,10 +967,9 @@ configfs_init(void)
         g_free(text);
     }
 
-    if( (text = android_get_serial()) ) {
-        configfs_write_file(GADGET_CTRL_SERIAL, text);
-        g_free(text);
-    }
+    const char *serial = identity_get_serial();
+    if( serial )
+        configfs_write_file(GADGET_CTRL_SERIAL, serial);
 
     /* Prep: charging_only */
     configfs_register_function(FUNCTION_MASS_STORAGE);
@@ -812,6 +996,8 @@ EXIT:
 void
 configfs_quit(void)
 {
+    configfs_gadget_forget();
+
     g_free(GADGET_BASE_DIRECTORY),
         GADGET_BASE_DIRECTORY = 0;
     g_free(GADGET_FUNC_DIRECTORY),
@@ -893,7 +1079,8 @@ configfs_set_productid(const char *id)
             snprintf(str, sizeof str, "0x%04x", num);
             id = str;
         }
-        ack = configfs_write_file(GADGET_CTRL_ID_PRODUCT, id);
+        ack = configfs_gadget_set_id(&configfs_gadget.cg_id_product,
+                                     GADGET_CTRL_ID_PRODUCT, id);
     }
 
     log_debug("CONFIGFS %s(%s) -> %d", __func__, id, ack);
@@ -925,7 +1112,8 @@ configfs_set_vendorid(const char *id)
             id = str;
         }
 
-        ack = configfs_write_file(GADGET_CTRL_ID_VENDOR, id);
+        ack = configfs_gadget_set_id(&configfs_gadget.cg_id_vendor,
+                                     GADGET_CTRL_ID_VENDOR, id);
     }
 
     log_debug("CONFIGFS %s(%s) -> %d", __func__, id, ack);
@@ -951,6 +1139,9 @@ configfs_map_function(const char *func)
 }
 
 /* Set active functions
+ *
+ * Only functions that differ from the current configuration are
+ * touched. UDC is disabled only if something needs to be changed.
  *
  * @param function Comma separated list of function names to
  *                 enable, or NULL to disable all
@@ -962,19 +1153,13 @@ configfs_set_function(const char *functions)
 {
     LOG_REGISTER_CONTEXT;
 
-    bool ack = false;
-
-    gchar **vec = 0;
+    bool       ack    = false;
+    gchar    **vec    = 0;
+    GPtrArray *target = g_ptr_array_new();
 
     if( !configfs_in_use() )
         goto EXIT;
 
-    if( !configfs_set_udc(false) )
-        goto EXIT;
-
-    if( !configfs_disable_all_functions() )
-        goto EXIT;
-
     if( functions ) {
         vec = g_strsplit(functions, ",", 0);
         for( size_t i = 0; vec[i]; ++i ) {
@@ -984,22 +1169,55 @@ configfs_set_function(const char *functions)
             const char *use = configfs_map_function(vec[i]);
             if( !use || !*use )
                 continue;
-            if( !configfs_enable_function(use) )
-                goto EXIT;
+            g_ptr_array_add(target, (gpointer)use);
         }
     }
+    g_ptr_array_add(target, 0);
 
-    /* Leave disabled, so that caller can adjust attributes
+    if( !configfs_gadget_set_functions((gchar **)target->pdata) )
+        goto EXIT;
+
+    /* Leave UDC as is, so that caller can adjust attributes
      * etc before enabling */
 
     ack = true;
 
 EXIT:
     log_debug("CONFIGFS %s(%s) -> %d", __func__, functions, ack);
+    g_ptr_array_free(target, TRUE);
     g_strfreev(vec);
     return ack;
 }
 
+/* Create function instances in advance
+ *
+ * Function directories would be created on demand when functions get
+ * enabled, but doing it already during startup keeps mkdir and the
+ * related kernel side allocations out of mode switch path.
+ *
+ * @param functions Comma separated list of function names
+ */
+void
+configfs_prestage_functions(const char *functions)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar **vec = 0;
+
+    if( !configfs_in_use() || !functions )
+        goto EXIT;
+
+    vec = g_strsplit(functions, ",", 0);
+    for( size_t i = 0; vec[i]; ++i ) {
+        const char *use = configfs_map_function(vec[i]);
+        if( use && *use )
+            configfs_register_function(use);
+    }
+
+EXIT:
+    g_strfreev(vec);
+}
+
 bool
 configfs_add_mass_storage_lun(int lun)
 {
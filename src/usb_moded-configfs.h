@@ -26,6 +26,8 @@
 
 # include <stdbool.h>
 
+# include <glib.h>
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -34,16 +36,18 @@
  * CONFIGFS
  * ------------------------------------------------------------------------- */
 
-bool configfs_in_use                 (void);
-bool configfs_set_udc                (bool enable);
-bool configfs_init                   (void);
-void configfs_quit                   (void);
-bool configfs_set_charging_mode      (void);
-bool configfs_set_productid          (const char *id);
-bool configfs_set_vendorid           (const char *id);
-bool configfs_set_function           (const char *functions);
-bool configfs_add_mass_storage_lun   (int lun);
-bool configfs_remove_mass_storage_lun(int lun);
-bool configfs_set_mass_storage_attr  (int lun, const char *attr, const char *value);
+bool    configfs_in_use                 (void);
+bool    configfs_set_udc                (bool enable);
+gchar  *configfs_get_udc_state_path     (void);
+bool    configfs_init                   (void);
+void    configfs_quit                   (void);
+bool    configfs_set_charging_mode      (void);
+bool    configfs_set_productid          (const char *id);
+bool    configfs_set_vendorid           (const char *id);
+bool    configfs_set_function           (const char *functions);
+void    configfs_prestage_functions     (const char *functions);
+bool    configfs_add_mass_storage_lun   (int lun);
+bool    configfs_remove_mass_storage_lun(int lun);
+bool    configfs_set_mass_storage_attr  (int lun, const char *attr, const char *value);
 
 #endif /* USB_MODED_CONFIGFS_H_ */
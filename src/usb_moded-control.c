@@ -29,6 +29,7 @@
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modes.h"
+#include "usb_moded-systemd.h"
 #include "usb_moded-worker.h"
 
 /* Sanity check, configure should take care of this */
@@ -446,6 +447,12 @@ void control_user_changed(void)
 {
     log_debug("user = %d", (int)usbmoded_get_current_user());
 
+    /* Group memberships might have changed too */
+    usbmoded_invalidate_permissions();
+
+    /* User services are managed by systemd of the new user */
+    systemd_user_changed();
+
     /* We need to mask false positive "user is known and
      * device is unlocked" blib arising from usb-moded
      * getting user change notification before device lock
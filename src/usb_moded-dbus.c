@@ -38,9 +38,11 @@
 #include "usb_moded.h"
 #include "usb_moded-config-private.h"
 #include "usb_moded-control.h"
+#include "usb_moded-exec.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modes.h"
 #include "usb_moded-network.h"
+#include "usb_moded-trace.h"
 
 #include <sys/stat.h>
 
@@ -221,6 +223,9 @@ static void usb_moded_hidden_get_cb              (umdbus_context_t *context);
 static void usb_moded_whitelisted_modes_get_cb   (umdbus_context_t *context);
 static void usb_moded_whitelisted_modes_set_cb   (umdbus_context_t *context);
 static void usb_moded_user_config_clear_cb       (umdbus_context_t *context);
+static void usb_moded_config_batch_set_cb        (umdbus_context_t *context);
+static void usb_moded_transitions_get_cb         (umdbus_context_t *context);
+static void usb_moded_exec_stats_get_cb          (umdbus_context_t *context);
 static void usb_moded_whitelisted_set_cb         (umdbus_context_t *context);
 static void usb_moded_network_set_cb             (umdbus_context_t *context);
 static void usb_moded_network_get_cb             (umdbus_context_t *context);
@@ -248,6 +253,8 @@ static bool                 umdbus_append_basic_entry           (DBusMessageIter
 static bool                 umdbus_append_int32_entry           (DBusMessageIter *iter, const char *key, int val);
 static bool                 umdbus_append_string_entry          (DBusMessageIter *iter, const char *key, const char *val);
 static bool                 umdbus_append_mode_details          (DBusMessage *msg, const char *mode_name);
+static bool                 umdbus_append_transition            (DBusMessageIter *iter, const trace_record_t *rec);
+static bool                 umdbus_append_exec_stats            (DBusMessageIter *iter, const exec_stats_t *stats);
 static void                 umdbus_send_mode_details_signal     (const char *mode_name);
 void                        umdbus_send_target_state_signal     (const char *state_ind);
 void                        umdbus_send_event_signal            (const char *state_ind);
@@ -853,6 +860,124 @@ usb_moded_user_config_clear_cb(umdbus_context_t *context)
     dbus_error_free(&err);
 }
 
+/** Apply several settings changes at once
+ *
+ * Input is an array of (section, key, value) tuples. Either all or none
+ * of the changes are applied.
+ */
+static void
+usb_moded_config_batch_set_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int               ret      = SET_CONFIG_ERROR;
+    uid_t             uid      = umdbus_get_sender_uid(context->sender);
+    GArray           *settings = g_array_new(FALSE, TRUE, sizeof(config_setting_t));
+    DBusMessageIter   body, array, tuple;
+
+    if( !umdbus_parser_init(&body, context->msg) ||
+        !umdbus_parser_get_array(&body, &array) )
+        goto FAIL;
+
+    while( !umdbus_parser_at_end(&array) ) {
+        config_setting_t setting = { 0, 0, 0 };
+
+        if( !umdbus_parser_get_struct(&array, &tuple) ||
+            !umdbus_parser_get_string(&tuple, &setting.cs_entry) ||
+            !umdbus_parser_get_string(&tuple, &setting.cs_key) ||
+            !umdbus_parser_get_string(&tuple, &setting.cs_value) )
+            goto FAIL;
+
+        g_array_append_val(settings, setting);
+    }
+
+    /* error checking is done when setting configuration */
+    ret = config_set_config_settings((config_setting_t *)settings->data,
+                                     settings->len, uid);
+    if( SET_CONFIG_OK(ret) ) {
+        context->rsp = dbus_message_new_method_return(context->msg);
+        goto EXIT;
+    }
+
+FAIL:
+    context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_INVALID_ARGS, context->member);
+
+EXIT:
+    g_array_free(settings, TRUE);
+}
+
+/** Get timing details of recent mode transitions
+ *
+ * Each transition is returned as a dictionary, oldest first.
+ */
+static void
+usb_moded_transitions_get_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    trace_record_t  *records = g_new0(trace_record_t, TRACE_HISTORY_SIZE);
+    guint            count   = trace_get_history(records, TRACE_HISTORY_SIZE);
+    DBusMessageIter  body, array;
+    bool             ack     = true;
+
+    if( !(context->rsp = dbus_message_new_method_return(context->msg)) )
+        goto EXIT;
+
+    dbus_message_iter_init_append(context->rsp, &body);
+
+    if( !umdbus_open_container(&body, &array, DBUS_TYPE_ARRAY, "a{sv}") )
+        goto FAIL;
+
+    for( guint i = 0; ack && i < count; ++i )
+        ack = umdbus_append_transition(&array, records + i);
+
+    if( umdbus_close_container(&body, &array, ack) && ack )
+        goto EXIT;
+
+FAIL:
+    dbus_message_unref(context->rsp);
+    context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_FAILED,
+                                          context->member);
+EXIT:
+    g_free(records);
+}
+
+/** Get statistics of commands executed by usb-moded
+ *
+ * Each program is returned as a dictionary, sorted by name.
+ */
+static void
+usb_moded_exec_stats_get_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    exec_stats_t    *stats = g_new0(exec_stats_t, EXEC_STATS_MAX);
+    guint            count = exec_get_stats(stats, EXEC_STATS_MAX);
+    DBusMessageIter  body, array;
+    bool             ack   = true;
+
+    if( !(context->rsp = dbus_message_new_method_return(context->msg)) )
+        goto EXIT;
+
+    dbus_message_iter_init_append(context->rsp, &body);
+
+    if( !umdbus_open_container(&body, &array, DBUS_TYPE_ARRAY, "a{sv}") )
+        goto FAIL;
+
+    for( guint i = 0; ack && i < count; ++i )
+        ack = umdbus_append_exec_stats(&array, stats + i);
+
+    if( umdbus_close_container(&body, &array, ack) && ack )
+        goto EXIT;
+
+FAIL:
+    dbus_message_unref(context->rsp);
+    context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_FAILED,
+                                          context->member);
+EXIT:
+    g_free(stats);
+}
+
 /** Add usb mode to whitelist
  */
 static void
@@ -1023,6 +1148,17 @@ static const member_info_t usb_moded_members[] =
     ADD_METHOD(USB_MODE_USER_CONFIG_CLEAR,
                usb_moded_user_config_clear_cb,
                "      <arg name=\"uid\" type=\"u\" direction=\"in\"/>\n"),
+    ADD_METHOD(USB_MODE_CONFIG_BATCH_SET,
+               usb_moded_config_batch_set_cb,
+               "      <arg name=\"settings\" type=\"a(sss)\" direction=\"in\"/>\n"),
+    ADD_METHOD(USB_MODE_TRANSITIONS_GET,
+               usb_moded_transitions_get_cb,
+               "      <arg name=\"transitions\" type=\"aa{sv}\" direction=\"out\"/>\n"
+               "      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out0\" value=\"QVariantMapList\"/>\n"),
+    ADD_METHOD(USB_MODE_EXEC_STATS_GET,
+               usb_moded_exec_stats_get_cb,
+               "      <arg name=\"stats\" type=\"aa{sv}\" direction=\"out\"/>\n"
+               "      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out0\" value=\"QVariantMapList\"/>\n"),
     ADD_SIGNAL(USB_MODE_SIGNAL_NAME,
                "      <arg name=\"mode_or_event\" type=\"s\"/>\n"),
     ADD_SIGNAL(USB_MODE_CURRENT_STATE_SIGNAL_NAME,
@@ -1750,6 +1886,101 @@ bailout_message:
     return false;
 }
 
+/** Append mode transition timing details to dbus iterator
+ *
+ * @param iter  Iterator to append data to
+ * @param rec   Mode transition timing details
+ *
+ * @return true on success, false on failure
+ */
+static bool
+umdbus_append_transition(DBusMessageIter *iter, const trace_record_t *rec)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool            ack = false;
+    DBusMessageIter dict;
+    gint64          age = g_get_monotonic_time() / 1000 - rec->tr_started_ms;
+
+    if( !umdbus_open_container(iter, &dict, DBUS_TYPE_ARRAY,
+                               DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                               DBUS_TYPE_STRING_AS_STRING
+                               DBUS_TYPE_VARIANT_AS_STRING
+                               DBUS_DICT_ENTRY_END_CHAR_AS_STRING) )
+        goto EXIT;
+
+    if( !umdbus_append_int32_entry(&dict, "seq", (int)rec->tr_seq) ||
+        !umdbus_append_string_entry(&dict, "from", rec->tr_from) ||
+        !umdbus_append_string_entry(&dict, "to", rec->tr_to) ||
+        !umdbus_append_string_entry(&dict, "result", rec->tr_result) ||
+        !umdbus_append_string_entry(&dict, "outcome",
+                                    trace_outcome_name(rec->tr_outcome)) ||
+        !umdbus_append_int32_entry(&dict, "age_ms",
+                                   (int)MIN(age, G_MAXINT32)) ||
+        !umdbus_append_int32_entry(&dict, "total_ms", rec->tr_total_ms) )
+        goto CLOSE;
+
+    /* Only phases that were actually executed are included */
+    for( int phase = 0; phase < TRACE_PHASE_COUNT; ++phase ) {
+        if( rec->tr_phase_ms[phase] < 0 )
+            continue;
+        gchar *key = g_strdup_printf("%s_ms", trace_phase_name(phase));
+        bool   ok  = umdbus_append_int32_entry(&dict, key, rec->tr_phase_ms[phase]);
+        g_free(key);
+        if( !ok )
+            goto CLOSE;
+    }
+
+    ack = true;
+
+CLOSE:
+    ack = umdbus_close_container(iter, &dict, ack);
+
+EXIT:
+    return ack;
+}
+
+/** Append command execution statistics to dbus iterator
+ *
+ * @param iter   Iterator to append data to
+ * @param stats  Execution statistics of one program
+ *
+ * @return true on success, false on failure
+ */
+static bool
+umdbus_append_exec_stats(DBusMessageIter *iter, const exec_stats_t *stats)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool            ack = false;
+    DBusMessageIter dict;
+
+    if( !umdbus_open_container(iter, &dict, DBUS_TYPE_ARRAY,
+                               DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                               DBUS_TYPE_STRING_AS_STRING
+                               DBUS_TYPE_VARIANT_AS_STRING
+                               DBUS_DICT_ENTRY_END_CHAR_AS_STRING) )
+        goto EXIT;
+
+    if( !umdbus_append_string_entry(&dict, "program", stats->es_name) ||
+        !umdbus_append_int32_entry(&dict, "calls", (int)stats->es_calls) ||
+        !umdbus_append_int32_entry(&dict, "failures", (int)stats->es_failures) ||
+        !umdbus_append_int32_entry(&dict, "total_ms",
+                                   (int)MIN(stats->es_total_ms, G_MAXINT32)) ||
+        !umdbus_append_int32_entry(&dict, "max_ms", stats->es_max_ms) ||
+        !umdbus_append_int32_entry(&dict, "last_ms", stats->es_last_ms) ||
+        !umdbus_append_int32_entry(&dict, "last_exit", stats->es_last_exit) )
+        goto CLOSE;
+
+    ack = true;
+
+CLOSE:
+    ack = umdbus_close_container(iter, &dict, ack);
+
+EXIT:
+    return ack;
+}
+
 /** Send usb_moded target state configuration signal
  *
  * @param mode_name mode name
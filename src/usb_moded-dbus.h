@@ -81,6 +81,9 @@
 # define USB_MODE_AVAILABLE_MODES_FOR_USER   "get_available_modes_for_user" /* returns a comma separated list of modes which are currently available and permitted for user to select */
 # define USB_MODE_TARGET_CONFIG_GET          "get_target_mode_config" /* returns current target mode configuration */
 # define USB_MODE_USER_CONFIG_CLEAR          "clear_config" /* clear config for a user */
+# define USB_MODE_CONFIG_BATCH_SET           "set_config_batch" /* set several (section, key, value) settings at once */
+# define USB_MODE_TRANSITIONS_GET            "get_mode_transitions" /* returns timing details of recent mode transitions */
+# define USB_MODE_EXEC_STATS_GET             "get_exec_stats" /* returns statistics of commands executed by usb_moded */
 
 /**
  * (Transient) states reported by "sig_usb_state_ind" that are not modes.
@@ -0,0 +1,1023 @@
+/**
+ * @file usb_moded-dhcpd.c
+ *
+ * Built-in DHCPv4 server for usb network modes
+ *
+ * Serves addresses from a small pool to the host side of the usb
+ * gadget network interface. Leases are kept only in memory, and
+ * the server socket is handled from the main loop.
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-dhcpd.h"
+
+#include "usb_moded.h"
+#include "usb_moded-log.h"
+
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+#define DHCPD_SERVER_PORT      67
+#define DHCPD_CLIENT_PORT      68
+
+/** Magic cookie that precedes options in DHCP messages */
+#define DHCPD_MAGIC_COOKIE     0x63825363
+
+/** Maximum size of address pool */
+#define DHCPD_MAX_LEASES       253
+
+/** How long offered address is reserved for the client [s] */
+#define DHCPD_OFFER_HOLD       60
+
+/** Minimum length of BOOTP message */
+#define DHCPD_MIN_PACKET       300
+
+/** Maximum number of messages to process per main loop wakeup */
+#define DHCPD_MAX_BATCH        16
+
+/* Option codes */
+#define DHCPD_OPT_PAD          0
+#define DHCPD_OPT_SUBNET_MASK  1
+#define DHCPD_OPT_ROUTER       3
+#define DHCPD_OPT_DNS          6
+#define DHCPD_OPT_REQUESTED_IP 50
+#define DHCPD_OPT_LEASE_TIME   51
+#define DHCPD_OPT_MSG_TYPE     53
+#define DHCPD_OPT_SERVER_ID    54
+#define DHCPD_OPT_RENEWAL_TIME 58
+#define DHCPD_OPT_REBIND_TIME  59
+#define DHCPD_OPT_END          255
+
+/* Message types */
+#define DHCPD_DISCOVER         1
+#define DHCPD_OFFER            2
+#define DHCPD_REQUEST          3
+#define DHCPD_DECLINE          4
+#define DHCPD_ACK              5
+#define DHCPD_NAK              6
+#define DHCPD_RELEASE          7
+#define DHCPD_INFORM           8
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** DHCP message as sent over the wire
+ */
+typedef struct dhcpd_packet_t
+{
+    guint8  dp_op;
+    guint8  dp_htype;
+    guint8  dp_hlen;
+    guint8  dp_hops;
+    guint32 dp_xid;
+    guint16 dp_secs;
+    guint16 dp_flags;
+    guint32 dp_ciaddr;
+    guint32 dp_yiaddr;
+    guint32 dp_siaddr;
+    guint32 dp_giaddr;
+    guint8  dp_chaddr[16];
+    guint8  dp_sname[64];
+    guint8  dp_file[128];
+    guint32 dp_cookie;
+    guint8  dp_options[312];
+} __attribute__((packed)) dhcpd_packet_t;
+
+/** Offset of options in DHCP message */
+#define DHCPD_HEADER_SIZE offsetof(dhcpd_packet_t, dp_options)
+
+/** Options parsed from client message
+ */
+typedef struct dhcpd_request_t
+{
+    int     dr_type;
+    guint32 dr_requested;
+    guint32 dr_server_id;
+} dhcpd_request_t;
+
+/** Address pool entry
+ */
+typedef struct dhcpd_lease_t
+{
+    /** Hardware address of client, all zeros if not leased */
+    guint8  dl_mac[6];
+
+    /** Monotonic time when lease expires [s], or 0 if never used */
+    gint64  dl_expires;
+
+    /** Whether client has confirmed the lease */
+    bool    dl_bound;
+} dhcpd_lease_t;
+
+/** Active server configuration, addresses in host byte order
+ */
+typedef struct dhcpd_config_t
+{
+    char     dc_interface[IF_NAMESIZE];
+    guint32  dc_server;
+    guint32  dc_netmask;
+    guint32  dc_dns[2];
+    int      dc_dns_count;
+    bool     dc_router;
+    guint32  dc_first;
+    guint32  dc_count;
+    unsigned dc_lease_time;
+} dhcpd_config_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * DHCPD
+ * ------------------------------------------------------------------------- */
+
+static gint64        dhcpd_now              (void);
+static const char   *dhcpd_addr_repr        (guint32 addr, char *buf, size_t size);
+static const char   *dhcpd_mac_repr         (const guint8 *mac, char *buf, size_t size);
+static bool          dhcpd_parse_addr       (const char *text, guint32 *addr);
+static int           dhcpd_lease_index      (guint32 addr);
+static guint32       dhcpd_lease_addr       (int index);
+static bool          dhcpd_lease_available  (int index, const guint8 *mac);
+static int           dhcpd_lease_lookup     (const guint8 *mac);
+static int           dhcpd_lease_allocate   (const guint8 *mac, guint32 requested);
+static void          dhcpd_lease_assign     (int index, const guint8 *mac, unsigned duration, bool bound);
+static void          dhcpd_lease_release    (int index);
+static bool          dhcpd_parse_request    (const dhcpd_packet_t *pkt, size_t len, dhcpd_request_t *req);
+static guint8       *dhcpd_add_option       (guint8 *pos, const guint8 *end, int code, const void *data, size_t size);
+static guint8       *dhcpd_add_option_addr  (guint8 *pos, const guint8 *end, int code, guint32 addr);
+static void          dhcpd_send_reply       (const dhcpd_packet_t *pkt, int type, guint32 yiaddr);
+static void          dhcpd_handle_discover  (const dhcpd_packet_t *pkt, const dhcpd_request_t *req);
+static void          dhcpd_handle_request   (const dhcpd_packet_t *pkt, const dhcpd_request_t *req);
+static void          dhcpd_handle_decline   (const dhcpd_packet_t *pkt, const dhcpd_request_t *req);
+static void          dhcpd_handle_release   (const dhcpd_packet_t *pkt, const dhcpd_request_t *req);
+static void          dhcpd_handle_inform    (const dhcpd_packet_t *pkt, const dhcpd_request_t *req);
+static void          dhcpd_handle_packet    (const dhcpd_packet_t *pkt, size_t len);
+static gboolean      dhcpd_input_cb         (GIOChannel *chn, GIOCondition cnd, gpointer aptr);
+static int           dhcpd_open_socket      (const char *interface);
+static void          dhcpd_close_locked     (void);
+bool                 dhcpd_start            (const dhcpd_settings_t *settings);
+void                 dhcpd_stop             (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Server socket, or -1 when not running */
+static int dhcpd_fd = -1;
+
+/** Main loop I/O watch for server socket */
+static guint dhcpd_watch_id = 0;
+
+/** Active configuration */
+static dhcpd_config_t dhcpd_config;
+
+/** Address pool, index 0 corresponds to dhcpd_config.dc_first */
+static dhcpd_lease_t dhcpd_leases[DHCPD_MAX_LEASES];
+
+/** Mutex for accessing server state
+ *
+ * Server is started and stopped from the worker thread,
+ * while messages are handled in the main thread.
+ */
+static pthread_mutex_t dhcpd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define DHCPD_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&dhcpd_mutex) != 0 ) { \
+        log_crit("DHCPD LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define DHCPD_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&dhcpd_mutex) != 0 ) { \
+        log_crit("DHCPD UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+/* ========================================================================= *
+ * DHCPD
+ * ========================================================================= */
+
+/** Get monotonic time stamp used for lease bookkeeping
+ *
+ * @return time [s]
+ */
+static gint64
+dhcpd_now(void)
+{
+    return g_get_monotonic_time() / G_USEC_PER_SEC;
+}
+
+/** Format IPv4 address for logging
+ *
+ * @param addr  address in host byte order
+ * @param buf   buffer to format to
+ * @param size  size of the buffer
+ *
+ * @return buf
+ */
+static const char *
+dhcpd_addr_repr(guint32 addr, char *buf, size_t size)
+{
+    struct in_addr in = { .s_addr = htonl(addr) };
+    return inet_ntop(AF_INET, &in, buf, size) ?: "invalid";
+}
+
+/** Format hardware address for logging
+ *
+ * @param mac   hardware address
+ * @param buf   buffer to format to
+ * @param size  size of the buffer
+ *
+ * @return buf
+ */
+static const char *
+dhcpd_mac_repr(const guint8 *mac, char *buf, size_t size)
+{
+    snprintf(buf, size, "%02x:%02x:%02x:%02x:%02x:%02x",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    return buf;
+}
+
+/** Parse IPv4 address
+ *
+ * @param text  address in dotted quad form
+ * @param addr  where to store address in host byte order
+ *
+ * @return true on success, false on failure
+ */
+static bool
+dhcpd_parse_addr(const char *text, guint32 *addr)
+{
+    struct in_addr in;
+
+    if( !text || inet_pton(AF_INET, text, &in) != 1 )
+        return false;
+
+    *addr = ntohl(in.s_addr);
+    return true;
+}
+
+/** Map address to address pool index
+ *
+ * @param addr  address in host byte order
+ *
+ * @return pool index, or -1 if address is not in the pool
+ */
+static int
+dhcpd_lease_index(guint32 addr)
+{
+    if( addr < dhcpd_config.dc_first ||
+        addr - dhcpd_config.dc_first >= dhcpd_config.dc_count ||
+        addr == dhcpd_config.dc_server )
+        return -1;
+
+    return (int)(addr - dhcpd_config.dc_first);
+}
+
+/** Map address pool index to address
+ *
+ * @param index  pool index
+ *
+ * @return address in host byte order
+ */
+static guint32
+dhcpd_lease_addr(int index)
+{
+    return dhcpd_config.dc_first + (guint32)index;
+}
+
+/** Check if address can be given to a client
+ *
+ * @param index  pool index
+ * @param mac    hardware address of the client
+ *
+ * @return true if the address is free or leased to the client already
+ */
+static bool
+dhcpd_lease_available(int index, const guint8 *mac)
+{
+    if( index < 0 )
+        return false;
+
+    const dhcpd_lease_t *lease = &dhcpd_leases[index];
+
+    if( !memcmp(lease->dl_mac, mac, sizeof lease->dl_mac) )
+        return true;
+
+    return lease->dl_expires <= dhcpd_now();
+}
+
+/** Find address previously given to a client
+ *
+ * @param mac  hardware address of the client
+ *
+ * @return pool index, or -1 if not found
+ */
+static int
+dhcpd_lease_lookup(const guint8 *mac)
+{
+    for( guint32 i = 0; i < dhcpd_config.dc_count; ++i ) {
+        if( !memcmp(dhcpd_leases[i].dl_mac, mac, sizeof dhcpd_leases[i].dl_mac) )
+            return dhcpd_lease_index(dhcpd_lease_addr(i));
+    }
+    return -1;
+}
+
+/** Choose address to offer to a client
+ *
+ * Preference order: address the client had before, address the
+ * client asked for, address that has never been used, address
+ * that expired the longest time ago.
+ *
+ * @param mac        hardware address of the client
+ * @param requested  address requested by the client, or zero
+ *
+ * @return pool index, or -1 if pool is exhausted
+ */
+static int
+dhcpd_lease_allocate(const guint8 *mac, guint32 requested)
+{
+    int    index  = -1;
+    gint64 oldest = dhcpd_now() + 1;
+
+    if( (index = dhcpd_lease_lookup(mac)) != -1 )
+        goto EXIT;
+
+    if( requested ) {
+        index = dhcpd_lease_index(requested);
+        if( index != -1 && dhcpd_lease_available(index, mac) )
+            goto EXIT;
+    }
+
+    index = -1;
+    for( guint32 i = 0; i < dhcpd_config.dc_count; ++i ) {
+        int candidate = dhcpd_lease_index(dhcpd_lease_addr(i));
+        if( candidate == -1 )
+            continue;
+        if( dhcpd_leases[i].dl_expires < oldest ) {
+            oldest = dhcpd_leases[i].dl_expires;
+            index  = candidate;
+        }
+    }
+
+EXIT:
+    return index;
+}
+
+/** Reserve address for a client
+ *
+ * @param index     pool index
+ * @param mac       hardware address of the client
+ * @param duration  reservation duration [s]
+ * @param bound     true if client has confirmed the address
+ */
+static void
+dhcpd_lease_assign(int index, const guint8 *mac, unsigned duration,
+                   bool bound)
+{
+    dhcpd_lease_t *lease = &dhcpd_leases[index];
+
+    memcpy(lease->dl_mac, mac, sizeof lease->dl_mac);
+    lease->dl_expires = dhcpd_now() + duration;
+    lease->dl_bound   = bound;
+}
+
+/** Return address to the pool
+ *
+ * The address is preferred over never used addresses only after
+ * all of those have been handed out.
+ *
+ * @param index  pool index
+ */
+static void
+dhcpd_lease_release(int index)
+{
+    dhcpd_lease_t *lease = &dhcpd_leases[index];
+
+    memset(lease->dl_mac, 0, sizeof lease->dl_mac);
+    lease->dl_expires = MIN(lease->dl_expires, dhcpd_now());
+    lease->dl_bound   = false;
+}
+
+/** Parse options relevant to the server from client message
+ *
+ * @param pkt  received message
+ * @param len  length of received message
+ * @param req  where to store parsed options
+ *
+ * @return true if message is a valid DHCP request, false otherwise
+ */
+static bool
+dhcpd_parse_request(const dhcpd_packet_t *pkt, size_t len,
+                    dhcpd_request_t *req)
+{
+    memset(req, 0, sizeof *req);
+
+    if( len < DHCPD_HEADER_SIZE + 1 )
+        return false;
+
+    if( pkt->dp_op != 1 || pkt->dp_htype != 1 || pkt->dp_hlen != 6 ||
+        ntohl(pkt->dp_cookie) != DHCPD_MAGIC_COOKIE )
+        return false;
+
+    const guint8 *pos = pkt->dp_options;
+    const guint8 *end = (const guint8 *)pkt + len;
+
+    while( pos < end && *pos != DHCPD_OPT_END ) {
+        int code = *pos++;
+
+        if( code == DHCPD_OPT_PAD )
+            continue;
+
+        if( pos >= end || pos + 1 + *pos > end )
+            break;
+
+        size_t        size = *pos++;
+        const guint8 *data = pos;
+        pos += size;
+
+        switch( code ) {
+        case DHCPD_OPT_MSG_TYPE:
+            if( size == 1 )
+                req->dr_type = data[0];
+            break;
+        case DHCPD_OPT_REQUESTED_IP:
+            if( size == 4 )
+                req->dr_requested = (guint32)data[0] << 24 | data[1] << 16 |
+                                    data[2] << 8 | data[3];
+            break;
+        case DHCPD_OPT_SERVER_ID:
+            if( size == 4 )
+                req->dr_server_id = (guint32)data[0] << 24 | data[1] << 16 |
+                                    data[2] << 8 | data[3];
+            break;
+        default:
+            break;
+        }
+    }
+
+    return req->dr_type != 0;
+}
+
+/** Append option to reply message
+ *
+ * @param pos   current position in options area
+ * @param end   end of options area, reserving room for end option
+ * @param code  option code
+ * @param data  option data
+ * @param size  size of option data
+ *
+ * @return position after the option, or pos if there is no room
+ */
+static guint8 *
+dhcpd_add_option(guint8 *pos, const guint8 *end, int code,
+                 const void *data, size_t size)
+{
+    if( pos + 2 + size > end )
+        return pos;
+
+    *pos++ = (guint8)code;
+    *pos++ = (guint8)size;
+    memcpy(pos, data, size);
+    return pos + size;
+}
+
+/** Append IPv4 address option to reply message
+ *
+ * @param pos   current position in options area
+ * @param end   end of options area, reserving room for end option
+ * @param code  option code
+ * @param addr  address in host byte order
+ *
+ * @return position after the option
+ */
+static guint8 *
+dhcpd_add_option_addr(guint8 *pos, const guint8 *end, int code, guint32 addr)
+{
+    guint32 val = htonl(addr);
+    return dhcpd_add_option(pos, end, code, &val, sizeof val);
+}
+
+/** Send reply to client
+ *
+ * @param pkt     message from client
+ * @param type    reply message type
+ * @param yiaddr  address given to client in host byte order, or zero
+ */
+static void
+dhcpd_send_reply(const dhcpd_packet_t *pkt, int type, guint32 yiaddr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    dhcpd_packet_t rsp;
+    memset(&rsp, 0, sizeof rsp);
+
+    rsp.dp_op     = 2;
+    rsp.dp_htype  = pkt->dp_htype;
+    rsp.dp_hlen   = pkt->dp_hlen;
+    rsp.dp_xid    = pkt->dp_xid;
+    rsp.dp_flags  = pkt->dp_flags;
+    rsp.dp_giaddr = pkt->dp_giaddr;
+    rsp.dp_yiaddr = htonl(yiaddr);
+    rsp.dp_cookie = htonl(DHCPD_MAGIC_COOKIE);
+    memcpy(rsp.dp_chaddr, pkt->dp_chaddr, sizeof rsp.dp_chaddr);
+
+    if( type == DHCPD_ACK && !yiaddr )
+        rsp.dp_ciaddr = pkt->dp_ciaddr;
+
+    guint8       *pos  = rsp.dp_options;
+    const guint8 *end  = rsp.dp_options + sizeof rsp.dp_options - 1;
+    guint8        val8 = (guint8)type;
+
+    pos = dhcpd_add_option(pos, end, DHCPD_OPT_MSG_TYPE, &val8, 1);
+    pos = dhcpd_add_option_addr(pos, end, DHCPD_OPT_SERVER_ID,
+                                dhcpd_config.dc_server);
+
+    if( type != DHCPD_NAK ) {
+        if( yiaddr ) {
+            unsigned lease = dhcpd_config.dc_lease_time;
+            pos = dhcpd_add_option_addr(pos, end, DHCPD_OPT_LEASE_TIME, lease);
+            pos = dhcpd_add_option_addr(pos, end, DHCPD_OPT_RENEWAL_TIME,
+                                        lease / 2);
+            pos = dhcpd_add_option_addr(pos, end, DHCPD_OPT_REBIND_TIME,
+                                        lease / 8 * 7);
+        }
+
+        pos = dhcpd_add_option_addr(pos, end, DHCPD_OPT_SUBNET_MASK,
+                                    dhcpd_config.dc_netmask);
+
+        if( dhcpd_config.dc_router )
+            pos = dhcpd_add_option_addr(pos, end, DHCPD_OPT_ROUTER,
+                                        dhcpd_config.dc_server);
+
+        if( dhcpd_config.dc_dns_count > 0 ) {
+            guint32 dns[2];
+            for( int i = 0; i < dhcpd_config.dc_dns_count; ++i )
+                dns[i] = htonl(dhcpd_config.dc_dns[i]);
+            pos = dhcpd_add_option(pos, end, DHCPD_OPT_DNS, dns,
+                                   dhcpd_config.dc_dns_count * sizeof *dns);
+        }
+    }
+
+    *pos++ = DHCPD_OPT_END;
+
+    size_t len = MAX((size_t)(pos - (guint8 *)&rsp), DHCPD_MIN_PACKET);
+
+    /* Client that already has an address gets unicast reply,
+     * others have to be reached via broadcast */
+    struct sockaddr_in sa = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(DHCPD_CLIENT_PORT),
+        .sin_addr.s_addr = htonl(INADDR_BROADCAST),
+    };
+    if( pkt->dp_ciaddr && type != DHCPD_NAK )
+        sa.sin_addr.s_addr = pkt->dp_ciaddr;
+
+    if( sendto(dhcpd_fd, &rsp, len, 0,
+               (struct sockaddr *)&sa, sizeof sa) == -1 )
+        log_warning("dhcpd: send failed: %m");
+}
+
+/** Handle DHCPDISCOVER message
+ *
+ * @param pkt  received message
+ * @param req  options parsed from the message
+ */
+static void
+dhcpd_handle_discover(const dhcpd_packet_t *pkt, const dhcpd_request_t *req)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char mac[32], addr[INET_ADDRSTRLEN];
+    int  index = dhcpd_lease_allocate(pkt->dp_chaddr, req->dr_requested);
+
+    dhcpd_mac_repr(pkt->dp_chaddr, mac, sizeof mac);
+
+    if( index == -1 ) {
+        log_warning("dhcpd: discover from %s: address pool exhausted", mac);
+        return;
+    }
+
+    dhcpd_lease_assign(index, pkt->dp_chaddr, DHCPD_OFFER_HOLD, false);
+
+    log_debug("dhcpd: discover from %s: offering %s", mac,
+              dhcpd_addr_repr(dhcpd_lease_addr(index), addr, sizeof addr));
+    dhcpd_send_reply(pkt, DHCPD_OFFER, dhcpd_lease_addr(index));
+}
+
+/** Handle DHCPREQUEST message
+ *
+ * @param pkt  received message
+ * @param req  options parsed from the message
+ */
+static void
+dhcpd_handle_request(const dhcpd_packet_t *pkt, const dhcpd_request_t *req)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char    mac[32], addr[INET_ADDRSTRLEN];
+    guint32 requested = req->dr_requested ?: ntohl(pkt->dp_ciaddr);
+    int     index     = dhcpd_lease_index(requested);
+
+    dhcpd_mac_repr(pkt->dp_chaddr, mac, sizeof mac);
+    dhcpd_addr_repr(requested, addr, sizeof addr);
+
+    if( req->dr_server_id && req->dr_server_id != dhcpd_config.dc_server ) {
+        /* Client selected another server, drop our offer */
+        int offered = dhcpd_lease_lookup(pkt->dp_chaddr);
+        if( offered != -1 && !dhcpd_leases[offered].dl_bound )
+            dhcpd_lease_release(offered);
+        log_debug("dhcpd: request from %s: for another server", mac);
+        return;
+    }
+
+    if( index == -1 || !dhcpd_lease_available(index, pkt->dp_chaddr) ) {
+        log_debug("dhcpd: request from %s: %s not available", mac, addr);
+        dhcpd_send_reply(pkt, DHCPD_NAK, 0);
+        return;
+    }
+
+    /* Client can hold only one address */
+    int previous = dhcpd_lease_lookup(pkt->dp_chaddr);
+    if( previous != -1 && previous != index )
+        dhcpd_lease_release(previous);
+
+    dhcpd_lease_assign(index, pkt->dp_chaddr, dhcpd_config.dc_lease_time,
+                       true);
+
+    log_debug("dhcpd: request from %s: leased %s", mac, addr);
+    dhcpd_send_reply(pkt, DHCPD_ACK, requested);
+}
+
+/** Handle DHCPDECLINE message
+ *
+ * Client has detected that the address is already in use,
+ * keep it out of circulation for the lease duration.
+ *
+ * @param pkt  received message
+ * @param req  options parsed from the message
+ */
+static void
+dhcpd_handle_decline(const dhcpd_packet_t *pkt, const dhcpd_request_t *req)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const guint8 nobody[6] = { 0 };
+
+    char mac[32], addr[INET_ADDRSTRLEN];
+    int  index = dhcpd_lease_index(req->dr_requested);
+
+    log_warning("dhcpd: decline from %s: %s is in use",
+                dhcpd_mac_repr(pkt->dp_chaddr, mac, sizeof mac),
+                dhcpd_addr_repr(req->dr_requested, addr, sizeof addr));
+
+    if( index != -1 )
+        dhcpd_lease_assign(index, nobody, dhcpd_config.dc_lease_time, false);
+}
+
+/** Handle DHCPRELEASE message
+ *
+ * @param pkt  received message
+ * @param req  options parsed from the message
+ */
+static void
+dhcpd_handle_release(const dhcpd_packet_t *pkt, const dhcpd_request_t *req)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)req;
+
+    char mac[32], addr[INET_ADDRSTRLEN];
+    int  index = dhcpd_lease_index(ntohl(pkt->dp_ciaddr));
+
+    log_debug("dhcpd: release from %s: %s",
+              dhcpd_mac_repr(pkt->dp_chaddr, mac, sizeof mac),
+              dhcpd_addr_repr(ntohl(pkt->dp_ciaddr), addr, sizeof addr));
+
+    if( index != -1 && !memcmp(dhcpd_leases[index].dl_mac, pkt->dp_chaddr,
+                               sizeof dhcpd_leases[index].dl_mac) )
+        dhcpd_lease_release(index);
+}
+
+/** Handle DHCPINFORM message
+ *
+ * Client has configured address by other means and wants
+ * just the network parameters.
+ *
+ * @param pkt  received message
+ * @param req  options parsed from the message
+ */
+static void
+dhcpd_handle_inform(const dhcpd_packet_t *pkt, const dhcpd_request_t *req)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)req;
+
+    char mac[32];
+
+    log_debug("dhcpd: inform from %s",
+              dhcpd_mac_repr(pkt->dp_chaddr, mac, sizeof mac));
+    dhcpd_send_reply(pkt, DHCPD_ACK, 0);
+}
+
+/** Handle message received from client
+ *
+ * @param pkt  received message
+ * @param len  length of received message
+ */
+static void
+dhcpd_handle_packet(const dhcpd_packet_t *pkt, size_t len)
+{
+    LOG_REGISTER_CONTEXT;
+
+    dhcpd_request_t req;
+
+    if( !dhcpd_parse_request(pkt, len, &req) )
+        return;
+
+    /* Only directly attached clients are served */
+    if( pkt->dp_giaddr )
+        return;
+
+    switch( req.dr_type ) {
+    case DHCPD_DISCOVER: dhcpd_handle_discover(pkt, &req); break;
+    case DHCPD_REQUEST:  dhcpd_handle_request(pkt, &req);  break;
+    case DHCPD_DECLINE:  dhcpd_handle_decline(pkt, &req);  break;
+    case DHCPD_RELEASE:  dhcpd_handle_release(pkt, &req);  break;
+    case DHCPD_INFORM:   dhcpd_handle_inform(pkt, &req);   break;
+    default: break;
+    }
+}
+
+/** Handle input from server socket
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @param chn   I/O channel for server socket
+ * @param cnd   reason for wakeup
+ * @param aptr  (unused)
+ *
+ * @return TRUE to keep the watch, FALSE to remove it
+ */
+static gboolean
+dhcpd_input_cb(GIOChannel *chn, GIOCondition cnd, gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    gboolean keep = FALSE;
+    int      fd   = g_io_channel_unix_get_fd(chn);
+
+    DHCPD_LOCKED_ENTER;
+
+    /* Server might have been stopped while waiting for the lock */
+    if( fd != dhcpd_fd )
+        goto EXIT;
+
+    if( cnd & ~G_IO_IN ) {
+        log_err("dhcpd: server socket error");
+        dhcpd_watch_id = 0;
+        goto EXIT;
+    }
+
+    for( int i = 0; i < DHCPD_MAX_BATCH; ++i ) {
+        dhcpd_packet_t pkt;
+        ssize_t rc = recv(fd, &pkt, sizeof pkt, 0);
+
+        if( rc == -1 ) {
+            if( errno != EAGAIN && errno != EINTR )
+                log_warning("dhcpd: receive failed: %m");
+            break;
+        }
+
+        dhcpd_handle_packet(&pkt, (size_t)rc);
+    }
+
+    keep = TRUE;
+
+EXIT:
+    DHCPD_LOCKED_LEAVE;
+
+    return keep;
+}
+
+/** Open server socket bound to network interface
+ *
+ * @param interface  network interface name
+ *
+ * @return socket file descriptor, or -1 on failure
+ */
+static int
+dhcpd_open_socket(const char *interface)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int one = 1;
+    int fd  = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if( fd == -1 ) {
+        log_err("dhcpd: socket: %m");
+        goto EXIT;
+    }
+
+    struct sockaddr_in sa = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(DHCPD_SERVER_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+
+    if( setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof one) == -1 ) {
+        log_err("dhcpd: setsockopt: %m");
+        goto FAIL;
+    }
+
+    if( setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, interface,
+                   strlen(interface) + 1) == -1 ) {
+        log_err("dhcpd: bind to %s: %m", interface);
+        goto FAIL;
+    }
+
+    if( bind(fd, (struct sockaddr *)&sa, sizeof sa) == -1 ) {
+        log_err("dhcpd: bind to port %d: %m", DHCPD_SERVER_PORT);
+        goto FAIL;
+    }
+
+    goto EXIT;
+
+FAIL:
+    close(fd), fd = -1;
+
+EXIT:
+    return fd;
+}
+
+/** Stop serving, but retain leases
+ *
+ * @note Assumes that server state is already locked.
+ */
+static void
+dhcpd_close_locked(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( dhcpd_watch_id )
+        g_source_remove(dhcpd_watch_id), dhcpd_watch_id = 0;
+
+    if( dhcpd_fd != -1 )
+        close(dhcpd_fd), dhcpd_fd = -1;
+}
+
+/** Start serving addresses on network interface
+ *
+ * If the server is already running, it is reconfigured. Leases are
+ * retained as long as the address pool stays the same.
+ *
+ * Note: This function is safe to call from any thread, messages
+ *       are handled in the main thread.
+ *
+ * @param settings  server configuration
+ *
+ * @return true on success, false on failure
+ */
+bool
+dhcpd_start(const dhcpd_settings_t *settings)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool           ack = false;
+    dhcpd_config_t cfg;
+    char           first[INET_ADDRSTRLEN], last[INET_ADDRSTRLEN];
+
+    memset(&cfg, 0, sizeof cfg);
+
+    if( !settings->ds_interface ||
+        strlen(settings->ds_interface) >= sizeof cfg.dc_interface ) {
+        log_err("dhcpd: invalid interface");
+        goto EXIT;
+    }
+    strcpy(cfg.dc_interface, settings->ds_interface);
+
+    if( !dhcpd_parse_addr(settings->ds_address, &cfg.dc_server) ||
+        !dhcpd_parse_addr(settings->ds_netmask, &cfg.dc_netmask) ) {
+        log_err("dhcpd: invalid address %s / netmask %s",
+                settings->ds_address ?: "NULL",
+                settings->ds_netmask ?: "NULL");
+        goto EXIT;
+    }
+
+    if( dhcpd_parse_addr(settings->ds_dns1, &cfg.dc_dns[cfg.dc_dns_count]) )
+        cfg.dc_dns_count += 1;
+    if( dhcpd_parse_addr(settings->ds_dns2, &cfg.dc_dns[cfg.dc_dns_count]) )
+        cfg.dc_dns_count += 1;
+
+    cfg.dc_router     = settings->ds_router;
+    cfg.dc_lease_time = settings->ds_lease_time;
+
+    /* Host numbers must fit in the subnet, excluding the network
+     * and broadcast addresses */
+    guint32 hostmax = ~cfg.dc_netmask;
+    guint32 start   = settings->ds_range_start;
+    guint32 end     = MIN((guint32)settings->ds_range_end, hostmax - 1);
+
+    if( start < 1 || start > end ) {
+        log_err("dhcpd: invalid range %u - %u", settings->ds_range_start,
+                settings->ds_range_end);
+        goto EXIT;
+    }
+
+    cfg.dc_first = (cfg.dc_server & cfg.dc_netmask) | start;
+    cfg.dc_count = MIN(end - start + 1, DHCPD_MAX_LEASES);
+
+    DHCPD_LOCKED_ENTER;
+
+    dhcpd_close_locked();
+
+    if( cfg.dc_first != dhcpd_config.dc_first ||
+        cfg.dc_count != dhcpd_config.dc_count ||
+        cfg.dc_server != dhcpd_config.dc_server ) {
+        log_debug("dhcpd: address pool changed, leases discarded");
+        memset(dhcpd_leases, 0, sizeof dhcpd_leases);
+    }
+
+    dhcpd_config = cfg;
+
+    if( (dhcpd_fd = dhcpd_open_socket(cfg.dc_interface)) != -1 ) {
+        GIOChannel *chn = g_io_channel_unix_new(dhcpd_fd);
+        dhcpd_watch_id = g_io_add_watch(chn,
+                                        G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                        dhcpd_input_cb, 0);
+        g_io_channel_unref(chn);
+        ack = true;
+    }
+
+    DHCPD_LOCKED_LEAVE;
+
+    if( ack )
+        log_debug("dhcpd: serving %s - %s on %s",
+                  dhcpd_addr_repr(cfg.dc_first, first, sizeof first),
+                  dhcpd_addr_repr(cfg.dc_first + cfg.dc_count - 1,
+                                  last, sizeof last),
+                  cfg.dc_interface);
+
+EXIT:
+    return ack;
+}
+
+/** Stop serving addresses
+ *
+ * Leases are retained so that reconnecting host gets the same
+ * address again.
+ *
+ * Note: This function is safe to call from any thread.
+ */
+void
+dhcpd_stop(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DHCPD_LOCKED_ENTER;
+
+    if( dhcpd_fd != -1 )
+        log_debug("dhcpd: stopped serving on %s", dhcpd_config.dc_interface);
+
+    dhcpd_close_locked();
+
+    DHCPD_LOCKED_LEAVE;
+}
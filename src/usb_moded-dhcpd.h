@@ -0,0 +1,78 @@
+/**
+ * @file usb_moded-dhcpd.h
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_DHCPD_H_
+# define USB_MODED_DHCPD_H_
+
+# include <stdbool.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Systemd unit of the external DHCP server the built-in one replaces */
+# define DHCPD_EXTERNAL_SERVICE "udhcpd.service"
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** DHCP server configuration
+ */
+typedef struct dhcpd_settings_t
+{
+    /** Network interface to serve */
+    const char *ds_interface;
+
+    /** Address of the interface, used also as server identifier */
+    const char *ds_address;
+
+    /** Netmask of the network */
+    const char *ds_netmask;
+
+    /** DNS servers to announce, or NULL */
+    const char *ds_dns1;
+    const char *ds_dns2;
+
+    /** Announce server address as router */
+    bool        ds_router;
+
+    /** First and last host number in address pool */
+    unsigned    ds_range_start;
+    unsigned    ds_range_end;
+
+    /** Lease duration [s] */
+    unsigned    ds_lease_time;
+} dhcpd_settings_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * DHCPD
+ * ------------------------------------------------------------------------- */
+
+bool dhcpd_start(const dhcpd_settings_t *settings);
+void dhcpd_stop (void);
+
+#endif /* USB_MODED_DHCPD_H_ */
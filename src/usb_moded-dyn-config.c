@@ -31,7 +31,23 @@
 
 #include "usb_moded-log.h"
 
-#include <glob.h>
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Mode data lookup table
+ */
+struct modetable_t
+{
+    /** Mode data objects, sorted by name */
+    GList      *mt_list;
+
+    /** Mode data objects in lookup table order */
+    GPtrArray  *mt_array;
+
+    /** Mode name -> 1 + position in mt_array lookup table */
+    GHashTable *mt_index;
+};
 
 /* ========================================================================= *
  * Prototypes
@@ -41,38 +57,73 @@
  * MODEDATA
  * ------------------------------------------------------------------------- */
 
-static void        modedata_free_cb(gpointer self);
-void               modedata_free   (modedata_t *self);
-modedata_t        *modedata_copy   (const modedata_t *that);
-static gint        modedata_sort_cb(gconstpointer a, gconstpointer b);
-static modedata_t *modedata_load   (const gchar *filename);
+static void        modedata_unref_cb(gpointer self);
+modedata_t        *modedata_create  (void);
+static void        modedata_free    (modedata_t *self);
+modedata_t        *modedata_ref     (const modedata_t *self);
+void               modedata_unref   (modedata_t *self);
+modedata_t        *modedata_copy    (const modedata_t *that);
+bool               modedata_equal   (const modedata_t *a, const modedata_t *b);
+static gint        modedata_sort_cb (gconstpointer a, gconstpointer b);
+static modedata_t *modedata_parse   (GKeyFile *settingsfile, const gchar *filename);
+static gpointer    modedata_load_cb (GKeyFile *settingsfile, const char *filename);
 
 /* ------------------------------------------------------------------------- *
  * MODELIST
  * ------------------------------------------------------------------------- */
 
-void   modelist_free(GList *modelist);
-GList *modelist_load(bool diag);
+void         modelist_free        (GList *modelist);
+GList       *modelist_load        (bool diag);
+filecache_t *modelist_cache_create(bool diag);
+GList       *modelist_cache_load  (filecache_t *cache);
+
+/* ------------------------------------------------------------------------- *
+ * MODETABLE
+ * ------------------------------------------------------------------------- */
+
+modetable_t      *modetable_create   (GList *modelist);
+void              modetable_free     (modetable_t *self);
+GList            *modetable_get_list (const modetable_t *self);
+int               modetable_get_count(const modetable_t *self);
+int               modetable_get_index(const modetable_t *self, const char *modename);
+const modedata_t *modetable_lookup   (const modetable_t *self, const char *modename);
 
 /* ========================================================================= *
  * MODEDATA
  * ========================================================================= */
 
-/** Type agnostice relase modedata_t object callback
+/** Type agnostice release modedata_t reference callback
  *
  * @param self Object pointer, or NULL
  */
 static void
-modedata_free_cb(gpointer self)
+modedata_unref_cb(gpointer self)
 {
-    modedata_free(self);
+    modedata_unref(self);
+}
+
+/** Allocate empty modedata_t object
+ *
+ * Caller must release the returned object via #modedata_unref().
+ *
+ * @return Object pointer, or NULL
+ */
+modedata_t *
+modedata_create(void)
+{
+    modedata_t *self = calloc(1, sizeof *self);
+
+    if( self )
+        self->refcount = 1;
+
+    return self;
 }
 
 /** Relase modedata_t object
  *
  * @param self Object pointer, or NULL
  */
-void
+static void
 modedata_free(modedata_t *self)
 {
     LOG_REGISTER_CONTEXT;
@@ -101,6 +152,43 @@ modedata_free(modedata_t *self)
     }
 }
 
+/** Acquire modedata_t reference
+ *
+ * Mode data objects are not modified after construction, so
+ * the same object can be shared between main and worker threads.
+ *
+ * Note: This function is safe to call from any thread.
+ *
+ * @param self Object pointer, or NULL
+ *
+ * @return Object pointer, or NULL
+ */
+modedata_t *
+modedata_ref(const modedata_t *self)
+{
+    modedata_t *that = (modedata_t *)self;
+
+    if( that )
+        g_atomic_int_inc(&that->refcount);
+
+    return that;
+}
+
+/** Release modedata_t reference
+ *
+ * The object is released when the last reference is dropped.
+ *
+ * Note: This function is safe to call from any thread.
+ *
+ * @param self Object pointer, or NULL
+ */
+void
+modedata_unref(modedata_t *self)
+{
+    if( self && g_atomic_int_dec_and_test(&self->refcount) )
+        modedata_free(self);
+}
+
 /** Clone modedata_t object
  *
  * @param that Object pointer, or NULL
@@ -115,7 +203,7 @@ modedata_copy(const modedata_t *that)
     if( !that )
         goto EXIT;
 
-    if( !(self = calloc(1, sizeof *self)) )
+    if( !(self = modedata_create()) )
         goto EXIT;
 
     self->mode_name                  = g_strdup(that->mode_name);
@@ -147,6 +235,49 @@ EXIT:
     return self;
 }
 
+/** Compare two mode data objects
+ *
+ * @param a  Object pointer, or NULL
+ * @param b  Object pointer, or NULL
+ *
+ * @return true if all mode properties are equal, false otherwise
+ */
+bool
+modedata_equal(const modedata_t *a, const modedata_t *b)
+{
+    if( a == b )
+        return true;
+
+    if( !a || !b )
+        return false;
+
+    return (!g_strcmp0(a->mode_name, b->mode_name) &&
+            !g_strcmp0(a->mode_module, b->mode_module) &&
+            a->appsync      == b->appsync &&
+            a->network      == b->network &&
+            a->mass_storage == b->mass_storage &&
+            !g_strcmp0(a->network_interface, b->network_interface) &&
+            !g_strcmp0(a->sysfs_path, b->sysfs_path) &&
+            !g_strcmp0(a->sysfs_value, b->sysfs_value) &&
+            !g_strcmp0(a->sysfs_reset_value, b->sysfs_reset_value) &&
+            !g_strcmp0(a->android_extra_sysfs_path, b->android_extra_sysfs_path) &&
+            !g_strcmp0(a->android_extra_sysfs_value, b->android_extra_sysfs_value) &&
+            !g_strcmp0(a->android_extra_sysfs_path2, b->android_extra_sysfs_path2) &&
+            !g_strcmp0(a->android_extra_sysfs_value2, b->android_extra_sysfs_value2) &&
+            !g_strcmp0(a->android_extra_sysfs_path3, b->android_extra_sysfs_path3) &&
+            !g_strcmp0(a->android_extra_sysfs_value3, b->android_extra_sysfs_value3) &&
+            !g_strcmp0(a->android_extra_sysfs_path4, b->android_extra_sysfs_path4) &&
+            !g_strcmp0(a->android_extra_sysfs_value4, b->android_extra_sysfs_value4) &&
+            !g_strcmp0(a->idProduct, b->idProduct) &&
+            !g_strcmp0(a->idVendorOverride, b->idVendorOverride) &&
+            a->nat         == b->nat &&
+            a->dhcp_server == b->dhcp_server
+#ifdef CONNMAN
+            && !g_strcmp0(a->connman_tethering, b->connman_tethering)
+#endif
+            );
+}
+
 /** Callback for sorting mode list alphabetically
  *
  * For use with g_list_sort()
@@ -167,27 +298,22 @@ modedata_sort_cb(gconstpointer a, gconstpointer b)
     return g_strcmp0(aa->mode_name, bb->mode_name);
 }
 
-/** Load mode data from file
+/** Parse mode data from ini-file content
  *
- * @param filename  Path to file from which to read
+ * @param settingsfile  Parsed mode configuration file
+ * @param filename      Path to file, for diagnostic logging
  *
  * @return Mode data object, or NULL
  */
 static modedata_t *
-modedata_load(const gchar *filename)
+modedata_parse(GKeyFile *settingsfile, const gchar *filename)
 {
     LOG_REGISTER_CONTEXT;
 
     modedata_t *self        = NULL;
     bool        success     = false;
-    GKeyFile   *settingsfile = g_key_file_new();
-
-    if( !g_key_file_load_from_file(settingsfile, filename, G_KEY_FILE_NONE, NULL) ) {
-        log_err("%s: can't read mode configuration file", filename);
-        goto EXIT;
-    }
 
-    if( !(self = calloc(1, sizeof *self)) )
+    if( !(self = modedata_create()) )
         goto EXIT;
 
     // [MODE_ENTRY = "mode"]
@@ -259,14 +385,25 @@ modedata_load(const gchar *filename)
     success = true;
 
 EXIT:
-    g_key_file_free(settingsfile);
-
     if( !success )
-        modedata_free(self), self = 0;
+        modedata_unref(self), self = 0;
 
     return self;
 }
 
+/** Callback for constructing mode data objects in file cache
+ *
+ * @param settingsfile  Parsed mode configuration file
+ * @param filename      Path to file, for diagnostic logging
+ *
+ * @return Mode data object, or NULL
+ */
+static gpointer
+modedata_load_cb(GKeyFile *settingsfile, const char *filename)
+{
+    return modedata_parse(settingsfile, filename);
+}
+
 /* ========================================================================= *
  * MODELIST
  * ========================================================================= */
@@ -280,7 +417,7 @@ modelist_free(GList *modelist)
 {
     LOG_REGISTER_CONTEXT;
 
-    g_list_free_full(modelist, modedata_free_cb);
+    g_list_free_full(modelist, modedata_unref_cb);
 }
 
 /** Load mode data files from configuration directory
@@ -295,24 +432,175 @@ modelist_load(bool diag)
 {
     LOG_REGISTER_CONTEXT;
 
-    GList      *modelist = 0;
-    const char *dirpath  = diag ? DIAG_DIR_PATH : MODE_DIR_PATH;
-    gchar      *pattern  = g_strdup_printf("%s/*.ini", dirpath);
-    glob_t      gb       = {};
+    filecache_t *cache    = modelist_cache_create(diag);
+    GList       *modelist = 0;
 
-    if( glob(pattern, 0, 0, &gb) != 0 )
-        log_debug("no mode configuration ini-files found");
+    filecache_scan(cache);
+    modelist = modelist_cache_load(cache);
+    filecache_delete(cache);
 
-    for( size_t i = 0; i < gb.gl_pathc; ++i ) {
-        const char *filepath = gb.gl_pathv[i];
-        log_debug("Read file %s\n", filepath);
-        modedata_t *list_item = modedata_load(filepath);
-        if(list_item)
-            modelist = g_list_append(modelist, list_item);
-    }
+    return modelist;
+}
 
-    globfree(&gb);
+/** Create file cache for tracking mode configuration files
+ *
+ * Use #filecache_scan() to synchronize the cache with the
+ * configuration directory and #modelist_cache_load() to get
+ * the list of currently valid modes.
+ *
+ * @param diag  true to track diagnostic modes, or
+ *              false for normal modes
+ *
+ * @return file cache object, release with #filecache_delete()
+ */
+filecache_t *
+modelist_cache_create(bool diag)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char  *dirpath = diag ? DIAG_DIR_PATH : MODE_DIR_PATH;
+    gchar       *pattern = g_strdup_printf("%s/*.ini", dirpath);
+    filecache_t *cache   = filecache_create(pattern, modedata_load_cb,
+                                            modedata_unref_cb);
     g_free(pattern);
 
+    return cache;
+}
+
+/** Get mode list from mode configuration file cache
+ *
+ * Mode data objects that have not changed since the previous
+ * scan are shared with previously returned lists.
+ *
+ * @param cache  file cache object from #modelist_cache_create()
+ *
+ * @return List of mode data objects sorted by name, or NULL
+ */
+GList *
+modelist_cache_load(filecache_t *cache)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GList *modelist = 0;
+
+    for( GList *iter = filecache_get_objects(cache); iter; iter = iter->next )
+        modelist = g_list_prepend(modelist, modedata_ref(iter->data));
+
     return g_list_sort(modelist, modedata_sort_cb);
 }
+
+/* ========================================================================= *
+ * MODETABLE
+ * ========================================================================= */
+
+/** Create mode data lookup table
+ *
+ * @param modelist  List of mode data objects, as returned by
+ *                  #modelist_load(); ownership is transferred
+ *
+ * @return Lookup table object
+ */
+modetable_t *
+modetable_create(GList *modelist)
+{
+    LOG_REGISTER_CONTEXT;
+
+    modetable_t *self = g_malloc0(sizeof *self);
+
+    self->mt_list  = modelist;
+    self->mt_array = g_ptr_array_new();
+    self->mt_index = g_hash_table_new(g_str_hash, g_str_equal);
+
+    /* In case of duplicate names, the first one is used */
+    for( GList *iter = self->mt_list; iter; iter = g_list_next(iter) ) {
+        modedata_t *data = iter->data;
+        if( g_hash_table_contains(self->mt_index, data->mode_name) )
+            continue;
+        g_ptr_array_add(self->mt_array, data);
+        g_hash_table_insert(self->mt_index, data->mode_name,
+                            GINT_TO_POINTER(self->mt_array->len));
+    }
+
+    return self;
+}
+
+/** Release mode data lookup table
+ *
+ * Mode data objects that have been referenced via #modedata_ref()
+ * remain valid until released via #modedata_unref().
+ *
+ * @param self  Lookup table object, or NULL
+ */
+void
+modetable_free(modetable_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self ) {
+        g_hash_table_unref(self->mt_index);
+        g_ptr_array_free(self->mt_array, TRUE);
+        modelist_free(self->mt_list);
+        g_free(self);
+    }
+}
+
+/** Get list of mode data objects in lookup table
+ *
+ * @param self  Lookup table object, or NULL
+ *
+ * @return List of mode data objects, or NULL
+ */
+GList *
+modetable_get_list(const modetable_t *self)
+{
+    return self ? self->mt_list : 0;
+}
+
+/** Get number of distinct modes in lookup table
+ *
+ * @param self  Lookup table object, or NULL
+ *
+ * @return Number of modes
+ */
+int
+modetable_get_count(const modetable_t *self)
+{
+    return self ? (int)self->mt_array->len : 0;
+}
+
+/** Get position of mode within lookup table
+ *
+ * The position is stable for the lifetime of the lookup table and
+ * can be used for indexing per mode data held elsewhere.
+ *
+ * @param self      Lookup table object, or NULL
+ * @param modename  Name of mode to lookup
+ *
+ * @return Index in 0 ... modetable_get_count()-1 range, or -1
+ */
+int
+modetable_get_index(const modetable_t *self, const char *modename)
+{
+    if( !self || !modename )
+        return -1;
+
+    return GPOINTER_TO_INT(g_hash_table_lookup(self->mt_index, modename)) - 1;
+}
+
+/** Lookup mode data object by name
+ *
+ * @param self      Lookup table object, or NULL
+ * @param modename  Name of mode to lookup
+ *
+ * @return Mode data object, or NULL
+ */
+const modedata_t *
+modetable_lookup(const modetable_t *self, const char *modename)
+{
+    int index = modetable_get_index(self, modename);
+
+    if( index < 0 )
+        return 0;
+
+    return g_ptr_array_index(self->mt_array, index);
+}
@@ -34,13 +34,18 @@
 
 # include <stdbool.h>
 # include <glib.h>
+# include "usb_moded-filecache.h"
 
 /* ========================================================================= *
  * Constants
  * ========================================================================= */
 
-# define MODE_DIR_PATH  "/etc/usb-moded/dyn-modes"
-# define DIAG_DIR_PATH  "/etc/usb-moded/diag"
+# ifndef MODE_DIR_PATH
+#  define MODE_DIR_PATH  "/etc/usb-moded/dyn-modes"
+# endif
+# ifndef DIAG_DIR_PATH
+#  define DIAG_DIR_PATH  "/etc/usb-moded/diag"
+# endif
 
 /* - - - - - - - - - - - - - - - - - - - *
  * [mode] ini-file block
@@ -122,8 +127,13 @@ typedef struct modedata_t
 # ifdef CONNMAN
     gchar *connman_tethering;              /**< Connman's tethering technology path */
 # endif
+    gint   refcount;                       /**< Reference count, see modedata_ref() */
 } modedata_t;
 
+/** Mode name to mode data lookup table
+ */
+typedef struct modetable_t modetable_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -132,14 +142,30 @@ typedef struct modedata_t
  * MODEDATA
  * ------------------------------------------------------------------------- */
 
-void        modedata_free(modedata_t *self);
-modedata_t *modedata_copy(const modedata_t *that);
+modedata_t *modedata_create(void);
+modedata_t *modedata_ref   (const modedata_t *self);
+void        modedata_unref (modedata_t *self);
+modedata_t *modedata_copy  (const modedata_t *that);
+bool        modedata_equal (const modedata_t *a, const modedata_t *b);
 
 /* ------------------------------------------------------------------------- *
  * MODELIST
  * ------------------------------------------------------------------------- */
 
-void   modelist_free(GList *modelist);
-GList *modelist_load(bool diag);
+void         modelist_free        (GList *modelist);
+GList       *modelist_load        (bool diag);
+filecache_t *modelist_cache_create(bool diag);
+GList       *modelist_cache_load  (filecache_t *cache);
+
+/* ------------------------------------------------------------------------- *
+ * MODETABLE
+ * ------------------------------------------------------------------------- */
+
+modetable_t      *modetable_create   (GList *modelist);
+void              modetable_free     (modetable_t *self);
+GList            *modetable_get_list (const modetable_t *self);
+int               modetable_get_count(const modetable_t *self);
+int               modetable_get_index(const modetable_t *self, const char *modename);
+const modedata_t *modetable_lookup   (const modetable_t *self, const char *modename);
 
 #endif /* USB_MODED_DYN_CONFIG_H_ */
@@ -0,0 +1,568 @@
+/**
+ * @file usb_moded-exec.c
+ *
+ * Execution of helper programs
+ *
+ * Commands are executed via posix_spawn() without involving a shell.
+ * Standard output and error are captured, every execution has a time
+ * limit, and when executed from the worker thread the command gets
+ * terminated if the mode switch it is part of gets superseded.
+ *
+ * Execution times and exit codes are collected per program, and can
+ * be queried over D-Bus.
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-exec.h"
+
+#include "usb_moded.h"
+#include "usb_moded-log.h"
+#include "usb_moded-worker.h"
+
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Grace period for terminated command before using SIGKILL [ms] */
+#define EXEC_KILL_DELAY   2000
+
+/** Maximum amount of output to capture per stream [bytes] */
+#define EXEC_OUTPUT_MAX   (64 * 1024)
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * EXEC
+ * ------------------------------------------------------------------------- */
+
+static int    exec_pidfd_open      (pid_t pid);
+static void   exec_close_pipe      (int *pipefd);
+static pid_t  exec_spawn           (const char * const *argv, int *out_fd, int *err_fd);
+static void   exec_read_output     (int *fd, GString *buf);
+static void   exec_signal          (pid_t pid, int sig);
+static int    exec_wait            (pid_t pid, int out_fd, int err_fd, unsigned tot_ms, exec_result_t *res);
+static void   exec_stats_update    (const char *path, int exit_code, gint elapsed_ms);
+static gint   exec_stats_compare_cb(gconstpointer a, gconstpointer b);
+int           exec_run_            (const char *file, int line, const char *func, const char * const *argv, unsigned tot_ms, exec_result_t *res);
+void          exec_result_clear    (exec_result_t *res);
+guint         exec_get_stats       (exec_stats_t *stats, guint count);
+void          exec_quit            (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Environment passed on to executed commands */
+extern char **environ;
+
+/** Execution statistics, program name -> exec_stats_t */
+static GHashTable *exec_stats_lut = 0;
+
+/** Mutex for accessing exec_stats_lut */
+static pthread_mutex_t exec_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define EXEC_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&exec_mutex) != 0 ) { \
+        log_crit("EXEC LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define EXEC_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&exec_mutex) != 0 ) { \
+        log_crit("EXEC UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+/* ========================================================================= *
+ * EXEC
+ * ========================================================================= */
+
+/** Get file descriptor that becomes readable when child process exits
+ *
+ * @param pid  child process id
+ *
+ * @return pidfd, or -1 if not supported by the kernel
+ */
+static int
+exec_pidfd_open(pid_t pid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int fd = -1;
+#ifdef SYS_pidfd_open
+    fd = (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+#endif
+    return fd;
+}
+
+/** Close both ends of a pipe
+ *
+ * @param pipefd  pipe file descriptors
+ */
+static void
+exec_close_pipe(int *pipefd)
+{
+    for( int i = 0; i < 2; ++i ) {
+        if( pipefd[i] != -1 )
+            close(pipefd[i]), pipefd[i] = -1;
+    }
+}
+
+/** Start a command with stdout and stderr redirected to pipes
+ *
+ * The command is executed in its own process group, so that also
+ * possible grandchildren can be terminated.
+ *
+ * @param argv    NULL terminated argument vector, PATH is searched
+ * @param out_fd  where to store non-blocking stdout read fd
+ * @param err_fd  where to store non-blocking stderr read fd
+ *
+ * @return process id, or -1 on failure
+ */
+static pid_t
+exec_spawn(const char * const *argv, int *out_fd, int *err_fd)
+{
+    LOG_REGISTER_CONTEXT;
+
+    pid_t pid    = -1;
+    int   out[2] = { -1, -1 };
+    int   err[2] = { -1, -1 };
+    int   rc;
+
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t          sa;
+    sigset_t                   sigs;
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawnattr_init(&sa);
+
+    /* Close-on-exec is set atomically, so that commands spawned
+     * from other threads can't inherit the pipes */
+    if( pipe2(out, O_CLOEXEC) == -1 || pipe2(err, O_CLOEXEC) == -1 ) {
+        log_err("pipe2: %m");
+        goto EXIT;
+    }
+
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    fcntl(err[0], F_SETFL, O_NONBLOCK);
+
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null",
+                                     O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&fa, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, err[1], STDERR_FILENO);
+
+    /* Undo signal masking done by worker thread */
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&sa, &sigs);
+
+    sigaddset(&sigs, SIGPIPE);
+    sigaddset(&sigs, SIGCHLD);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    posix_spawnattr_setsigdefault(&sa, &sigs);
+
+    posix_spawnattr_setpgroup(&sa, 0);
+    posix_spawnattr_setflags(&sa, POSIX_SPAWN_SETSIGMASK |
+                             POSIX_SPAWN_SETSIGDEF |
+                             POSIX_SPAWN_SETPGROUP);
+
+    rc = posix_spawnp(&pid, argv[0], &fa, &sa, (char * const *)argv, environ);
+    if( rc != 0 ) {
+        log_err("%s: spawn failed: %s", argv[0], strerror(rc));
+        pid = -1;
+        goto EXIT;
+    }
+
+    *out_fd = out[0], out[0] = -1;
+    *err_fd = err[0], err[0] = -1;
+
+EXIT:
+    exec_close_pipe(out);
+    exec_close_pipe(err);
+
+    posix_spawnattr_destroy(&sa);
+    posix_spawn_file_actions_destroy(&fa);
+
+    return pid;
+}
+
+/** Read available output from child process
+ *
+ * @param fd   non-blocking read fd, set to -1 when closed
+ * @param buf  buffer to append data to
+ */
+static void
+exec_read_output(int *fd, GString *buf)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char    tmp[1024];
+    ssize_t rc;
+
+    if( *fd == -1 )
+        goto EXIT;
+
+    while( (rc = read(*fd, tmp, sizeof tmp)) > 0 ) {
+        /* Keep reading to avoid blocking the child, but
+         * drop data that does not fit in the buffer */
+        if( buf->len < EXEC_OUTPUT_MAX )
+            g_string_append_len(buf, tmp,
+                                MIN((gsize)rc, EXEC_OUTPUT_MAX - buf->len));
+    }
+
+    if( rc == 0 || (errno != EAGAIN && errno != EINTR) )
+        close(*fd), *fd = -1;
+
+EXIT:
+    return;
+}
+
+/** Send signal to process group of child process
+ *
+ * @param pid  child process id
+ * @param sig  signal to send
+ */
+static void
+exec_signal(pid_t pid, int sig)
+{
+    if( kill(-pid, sig) == -1 )
+        kill(pid, sig);
+}
+
+/** Wait for child process to exit, capturing its output
+ *
+ * @param pid     child process id
+ * @param out_fd  stdout read fd
+ * @param err_fd  stderr read fd
+ * @param tot_ms  time limit [ms]
+ * @param res     where to store outcome
+ *
+ * @return exit status as returned by waitpid(), or -1 on failure
+ */
+static int
+exec_wait(pid_t pid, int out_fd, int err_fd, unsigned tot_ms,
+          exec_result_t *res)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int      status    = -1;
+    int      pidfd     = exec_pidfd_open(pid);
+    GString *out       = g_string_new(0);
+    GString *err       = g_string_new(0);
+    gint64   now       = g_get_monotonic_time() / 1000;
+    gint64   deadline  = now + tot_ms;
+    gint64   kill_time = 0;
+    bool     termed    = false;
+    bool     killed    = false;
+    unsigned nap_ms    = 1;
+
+    for( ;; ) {
+        pid_t rc = waitpid(pid, &status, WNOHANG);
+
+        if( rc == pid )
+            break;
+
+        if( rc == -1 ) {
+            if( errno == EINTR )
+                continue;
+            log_err("waitpid: %m");
+            status = -1;
+            break;
+        }
+
+        now = g_get_monotonic_time() / 1000;
+
+        if( !termed ) {
+            if( worker_bailing_out() )
+                res->er_canceled = true;
+            else if( now >= deadline )
+                res->er_timeout = true;
+
+            if( res->er_canceled || res->er_timeout ) {
+                exec_signal(pid, SIGTERM);
+                termed    = true;
+                kill_time = now + EXEC_KILL_DELAY;
+            }
+        }
+        else if( !killed && now >= kill_time ) {
+            exec_signal(pid, SIGKILL);
+            killed = true;
+        }
+
+        /* Wakeup fd stays readable after bailing out, so after
+         * termination wait just for the child to exit */
+        struct pollfd pfd[4] = {
+            { .fd = termed ? -1 : worker_get_wakeup_fd(), .events = POLLIN },
+            { .fd = pidfd,  .events = POLLIN },
+            { .fd = out_fd, .events = POLLIN },
+            { .fd = err_fd, .events = POLLIN },
+        };
+
+        /* Without pidfd, poll for child exit at increasing
+         * intervals, so that quick commands do not suffer from
+         * latency */
+        gint64 timeout = (killed ? 1000 :
+                          termed ? kill_time - now :
+                          deadline - now);
+        if( pidfd == -1 ) {
+            timeout = MIN(timeout, nap_ms);
+            if( nap_ms < 64 )
+                nap_ms *= 2;
+        }
+        timeout = CLAMP(timeout, 1, 1000);
+
+        if( poll(pfd, G_N_ELEMENTS(pfd), (int)timeout) == -1 &&
+            errno != EINTR )
+            log_warning("poll failed: %m");
+
+        exec_read_output(&out_fd, out);
+        exec_read_output(&err_fd, err);
+    }
+
+    /* Collect whatever output is still available */
+    exec_read_output(&out_fd, out);
+    exec_read_output(&err_fd, err);
+
+    res->er_stdout = g_string_free(out, FALSE);
+    res->er_stderr = g_string_free(err, FALSE);
+
+    if( pidfd != -1 )
+        close(pidfd);
+    if( out_fd != -1 )
+        close(out_fd);
+    if( err_fd != -1 )
+        close(err_fd);
+
+    return status;
+}
+
+/** Account execution to statistics
+ *
+ * @param path        executed program
+ * @param exit_code   exit code, or -1 if command did not exit
+ * @param elapsed_ms  time taken [ms]
+ */
+static void
+exec_stats_update(const char *path, int exit_code, gint elapsed_ms)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char   *name  = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    exec_stats_t *stats = 0;
+
+    EXEC_LOCKED_ENTER;
+
+    if( !exec_stats_lut )
+        exec_stats_lut = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               0, g_free);
+
+    if( !(stats = g_hash_table_lookup(exec_stats_lut, name)) ) {
+        if( g_hash_table_size(exec_stats_lut) >= EXEC_STATS_MAX )
+            goto EXIT;
+        stats = g_malloc0(sizeof *stats);
+        g_strlcpy(stats->es_name, name, sizeof stats->es_name);
+        g_hash_table_insert(exec_stats_lut, stats->es_name, stats);
+    }
+
+    stats->es_calls     += 1;
+    stats->es_failures  += (exit_code != 0);
+    stats->es_total_ms  += elapsed_ms;
+    stats->es_max_ms     = MAX(stats->es_max_ms, elapsed_ms);
+    stats->es_last_ms    = elapsed_ms;
+    stats->es_last_exit  = exit_code;
+
+EXIT:
+    EXEC_LOCKED_LEAVE;
+}
+
+/** Execute a command and wait for it to finish
+ *
+ * The command is executed directly i.e. without a shell. If
+ * called from the worker thread and the mode switch gets
+ * superseded, the command is terminated.
+ *
+ * Note: This function is safe to call from any thread.
+ *
+ * @param file    source file of the caller
+ * @param line    source line of the caller
+ * @param func    function name of the caller
+ * @param argv    NULL terminated argument vector, PATH is searched
+ * @param tot_ms  time limit [ms], after which the command is terminated
+ * @param res     where to store output and status, or NULL; release
+ *                with #exec_result_clear()
+ *
+ * @return exit code of the command, or -1 if it did not exit normally
+ */
+int
+exec_run_(const char *file, int line, const char *func,
+          const char * const *argv, unsigned tot_ms, exec_result_t *res)
+{
+    LOG_REGISTER_CONTEXT;
+
+    exec_result_t  tmp         = { .er_status = -1 };
+    exec_result_t *out         = res ?: &tmp;
+    int            result      = -1;
+    int            out_fd      = -1;
+    int            err_fd      = -1;
+    gint64         started     = g_get_monotonic_time();
+    gchar         *cmdline     = g_strjoinv(" ", (gchar **)argv);
+    char           exited[32]  = "";
+    char           trapped[32] = "";
+    const char    *dumped      = "";
+
+    *out = (exec_result_t){ .er_status = -1 };
+
+    log_debug("EXEC %s; from %s:%d: %s()", cmdline, file, line, func);
+
+    pid_t pid = exec_spawn(argv, &out_fd, &err_fd);
+    if( pid != -1 )
+        out->er_status = exec_wait(pid, out_fd, err_fd, tot_ms, out);
+
+    gint elapsed_ms = (gint)((g_get_monotonic_time() - started) / 1000);
+
+    if( out->er_status == -1 ) {
+        snprintf(exited, sizeof exited, " exec=failed");
+    }
+    else {
+        if( WIFSIGNALED(out->er_status) ) {
+            snprintf(trapped, sizeof trapped, " signal=%s",
+                     strsignal(WTERMSIG(out->er_status)));
+        }
+
+        if( WCOREDUMP(out->er_status) )
+            dumped = " core=dumped";
+
+        if( WIFEXITED(out->er_status) ) {
+            result = WEXITSTATUS(out->er_status);
+            snprintf(exited, sizeof exited, " exit_code=%d", result);
+        }
+    }
+
+    if( argv[0] )
+        exec_stats_update(argv[0], result, elapsed_ms);
+
+    if( result != 0 ) {
+        log_warning("EXEC %s; from %s:%d: %s();%s%s%s%s result=%d in %d ms",
+                    cmdline, file, line, func,
+                    out->er_timeout ? " timeout" :
+                    out->er_canceled ? " canceled" : "",
+                    exited, trapped, dumped, result, elapsed_ms);
+        if( out->er_stderr && *out->er_stderr )
+            log_warning("EXEC %s; stderr: %s", cmdline, out->er_stderr);
+    }
+    else {
+        log_debug("EXEC %s; done in %d ms", cmdline, elapsed_ms);
+    }
+
+    exec_result_clear(&tmp);
+    g_free(cmdline);
+
+    return result;
+}
+
+/** Release dynamic data held in execution result
+ *
+ * @param res  execution result
+ */
+void
+exec_result_clear(exec_result_t *res)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_free(res->er_stdout), res->er_stdout = 0;
+    g_free(res->er_stderr), res->er_stderr = 0;
+}
+
+/** GCompareFunc for sorting statistics by program name
+ */
+static gint
+exec_stats_compare_cb(gconstpointer a, gconstpointer b)
+{
+    const exec_stats_t *stats_a = a;
+    const exec_stats_t *stats_b = b;
+    return strcmp(stats_a->es_name, stats_b->es_name);
+}
+
+/** Get execution statistics
+ *
+ * Note: This function is safe to call from any thread.
+ *
+ * @param stats  array for storing the statistics, sorted by name
+ * @param count  number of entries that fit in the array
+ *
+ * @return number of entries stored
+ */
+guint
+exec_get_stats(exec_stats_t *stats, guint count)
+{
+    LOG_REGISTER_CONTEXT;
+
+    guint          used = 0;
+    GHashTableIter iter;
+    gpointer       value;
+
+    EXEC_LOCKED_ENTER;
+
+    if( exec_stats_lut ) {
+        g_hash_table_iter_init(&iter, exec_stats_lut);
+        while( used < count && g_hash_table_iter_next(&iter, 0, &value) )
+            stats[used++] = *(exec_stats_t *)value;
+    }
+
+    EXEC_LOCKED_LEAVE;
+
+    qsort(stats, used, sizeof *stats,
+          (int (*)(const void *, const void *))exec_stats_compare_cb);
+
+    return used;
+}
+
+/** Release execution statistics
+ */
+void
+exec_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    EXEC_LOCKED_ENTER;
+    if( exec_stats_lut )
+        g_hash_table_unref(exec_stats_lut), exec_stats_lut = 0;
+    EXEC_LOCKED_LEAVE;
+}
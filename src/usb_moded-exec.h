@@ -0,0 +1,111 @@
+/**
+ * @file usb_moded-exec.h
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_EXEC_H_
+# define USB_MODED_EXEC_H_
+
+# include <stdbool.h>
+# include <glib.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Default time limit for executing a command [ms] */
+# define EXEC_DEFAULT_TIMEOUT  60000
+
+/** Maximum number of programs tracked in execution statistics */
+# define EXEC_STATS_MAX        64
+
+/** Maximum length of program names stored in statistics */
+# define EXEC_NAME_MAX         32
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Outcome of executing a command
+ */
+typedef struct exec_result_t
+{
+    /** Exit status as returned by waitpid(), or -1 if not executed */
+    int     er_status;
+
+    /** Command was terminated because time limit was reached */
+    bool    er_timeout;
+
+    /** Command was terminated because mode switch was superseded */
+    bool    er_canceled;
+
+    /** Captured standard output */
+    gchar  *er_stdout;
+
+    /** Captured standard error */
+    gchar  *er_stderr;
+} exec_result_t;
+
+/** Execution statistics for one program
+ */
+typedef struct exec_stats_t
+{
+    /** Program name, without directory */
+    char    es_name[EXEC_NAME_MAX];
+
+    /** Number of executions */
+    guint   es_calls;
+
+    /** Number of executions that did not exit with zero */
+    guint   es_failures;
+
+    /** Time spent in all executions [ms] */
+    gint64  es_total_ms;
+
+    /** Longest execution [ms] */
+    gint    es_max_ms;
+
+    /** Latest execution [ms] */
+    gint    es_last_ms;
+
+    /** Exit code of latest execution, or -1 if it did not exit */
+    gint    es_last_exit;
+} exec_stats_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * EXEC
+ * ------------------------------------------------------------------------- */
+
+int   exec_run_         (const char *file, int line, const char *func, const char * const *argv, unsigned tot_ms, exec_result_t *res);
+void  exec_result_clear (exec_result_t *res);
+guint exec_get_stats    (exec_stats_t *stats, guint count);
+void  exec_quit         (void);
+
+/* ========================================================================= *
+ * Macros
+ * ========================================================================= */
+
+# define exec_run(argv, tot_ms, res) exec_run_(__FILE__,__LINE__,__FUNCTION__,(argv),(tot_ms),(res))
+
+#endif /* USB_MODED_EXEC_H_ */
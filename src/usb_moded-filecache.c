@@ -0,0 +1,376 @@
+/**
+ * @file usb_moded-filecache.c
+ *
+ * Cache of objects constructed from a set of ini-files
+ *
+ * Keeps track of size, modification time, inode and content hash of
+ * every file matching a glob pattern, so that rescanning only needs to
+ * parse files that have actually been added or changed.
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-filecache.h"
+
+#include "usb_moded-log.h"
+
+#include <sys/stat.h>
+
+#include <string.h>
+#include <glob.h>
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Tracking data for one ini-file
+ */
+typedef struct filecache_entry_t
+{
+    /** Path to ini-file */
+    gchar    *fe_path;
+
+    /** Device and inode the data was read from */
+    dev_t     fe_dev;
+    ino_t     fe_ino;
+
+    /** File size and modification time when data was read */
+    off_t     fe_size;
+    time_t    fe_mtime_sec;
+    long      fe_mtime_nsec;
+
+    /** Checksum of file content */
+    gchar    *fe_hash;
+
+    /** Object constructed from file content, or NULL */
+    gpointer  fe_object;
+} filecache_entry_t;
+
+/** Cache of objects constructed from a set of ini-files
+ */
+struct filecache_t
+{
+    /** Glob pattern for selecting files */
+    gchar             *fc_pattern;
+
+    /** Callback for constructing objects */
+    filecache_load_fn  fc_load_cb;
+
+    /** Callback for releasing objects */
+    GDestroyNotify     fc_free_cb;
+
+    /** File path -> filecache_entry_t lookup table */
+    GHashTable        *fc_entries;
+
+    /** Valid objects in file path order */
+    GList             *fc_objects;
+};
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * FILECACHE_ENTRY
+ * ------------------------------------------------------------------------- */
+
+static filecache_entry_t *filecache_entry_create (const char *path);
+static void               filecache_entry_delete (filecache_entry_t *self, GDestroyNotify free_cb);
+static bool               filecache_entry_matches(const filecache_entry_t *self, const struct stat *st);
+static void               filecache_entry_stamp  (filecache_entry_t *self, const struct stat *st);
+
+/* ------------------------------------------------------------------------- *
+ * FILECACHE
+ * ------------------------------------------------------------------------- */
+
+filecache_t              *filecache_create       (const char *pattern, filecache_load_fn load_cb, GDestroyNotify free_cb);
+void                      filecache_delete       (filecache_t *self);
+static void               filecache_entry_free_cb(gpointer aptr, gpointer user_data);
+static bool               filecache_update_entry (filecache_t *self, const char *path, const struct stat *st);
+bool                      filecache_scan         (filecache_t *self);
+GList                    *filecache_get_objects  (const filecache_t *self);
+
+/* ========================================================================= *
+ * FILECACHE_ENTRY
+ * ========================================================================= */
+
+static filecache_entry_t *
+filecache_entry_create(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    filecache_entry_t *self = g_malloc0(sizeof *self);
+
+    self->fe_path   = g_strdup(path);
+    self->fe_hash   = 0;
+    self->fe_object = 0;
+
+    return self;
+}
+
+static void
+filecache_entry_delete(filecache_entry_t *self, GDestroyNotify free_cb)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self ) {
+        if( self->fe_object )
+            free_cb(self->fe_object);
+        g_free(self->fe_hash);
+        g_free(self->fe_path);
+        g_free(self);
+    }
+}
+
+/** Check if file details match the ones recorded when data was read
+ *
+ * @param self  cache entry
+ * @param st    current file details
+ *
+ * @return true if file is unchanged, false otherwise
+ */
+static bool
+filecache_entry_matches(const filecache_entry_t *self, const struct stat *st)
+{
+    return (self->fe_dev        == st->st_dev &&
+            self->fe_ino        == st->st_ino &&
+            self->fe_size       == st->st_size &&
+            self->fe_mtime_sec  == st->st_mtim.tv_sec &&
+            self->fe_mtime_nsec == st->st_mtim.tv_nsec);
+}
+
+static void
+filecache_entry_stamp(filecache_entry_t *self, const struct stat *st)
+{
+    self->fe_dev        = st->st_dev;
+    self->fe_ino        = st->st_ino;
+    self->fe_size       = st->st_size;
+    self->fe_mtime_sec  = st->st_mtim.tv_sec;
+    self->fe_mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/* ========================================================================= *
+ * FILECACHE
+ * ========================================================================= */
+
+/** Create file cache object
+ *
+ * @param pattern  glob pattern for selecting files
+ * @param load_cb  callback for constructing objects from ini-files
+ * @param free_cb  callback for releasing constructed objects
+ *
+ * @return file cache object, release with #filecache_delete()
+ */
+filecache_t *
+filecache_create(const char *pattern, filecache_load_fn load_cb,
+                 GDestroyNotify free_cb)
+{
+    LOG_REGISTER_CONTEXT;
+
+    filecache_t *self = g_malloc0(sizeof *self);
+
+    self->fc_pattern = g_strdup(pattern);
+    self->fc_load_cb = load_cb;
+    self->fc_free_cb = free_cb;
+    self->fc_entries = g_hash_table_new(g_str_hash, g_str_equal);
+    self->fc_objects = 0;
+
+    return self;
+}
+
+static void
+filecache_entry_free_cb(gpointer aptr, gpointer user_data)
+{
+    filecache_t *cache = user_data;
+
+    filecache_entry_delete(aptr, cache->fc_free_cb);
+}
+
+/** Release file cache object
+ *
+ * @param self  file cache object, or NULL
+ */
+void
+filecache_delete(filecache_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self ) {
+        GList *entries = g_hash_table_get_values(self->fc_entries);
+        g_list_foreach(entries, filecache_entry_free_cb, self);
+        g_list_free(entries);
+        g_hash_table_unref(self->fc_entries);
+        g_list_free(self->fc_objects);
+        g_free(self->fc_pattern);
+        g_free(self);
+    }
+}
+
+/** Bring cache entry up to date with file content
+ *
+ * @param self  file cache object
+ * @param path  path to ini-file
+ * @param st    current file details
+ *
+ * @return true if constructed object changed, false otherwise
+ */
+static bool
+filecache_update_entry(filecache_t *self, const char *path,
+                       const struct stat *st)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool               changed = false;
+    filecache_entry_t *entry   = g_hash_table_lookup(self->fc_entries, path);
+    gchar             *data    = 0;
+    gsize              size    = 0;
+    gchar             *hash    = 0;
+    GKeyFile          *ini     = 0;
+    GError            *err     = 0;
+
+    /* Skip reading if file has not been touched */
+    if( entry && filecache_entry_matches(entry, st) )
+        goto EXIT;
+
+    if( !g_file_get_contents(path, &data, &size, &err) ) {
+        log_warning("%s: can't read: %s", path, err->message);
+        goto EXIT;
+    }
+
+    hash = g_compute_checksum_for_data(G_CHECKSUM_SHA1,
+                                       (const guchar *)data, size);
+
+    if( !entry ) {
+        entry = filecache_entry_create(path);
+        g_hash_table_insert(self->fc_entries, entry->fe_path, entry);
+    }
+    else if( !g_strcmp0(entry->fe_hash, hash) ) {
+        /* Touched, but content is the same */
+        log_debug("%s: unchanged content", path);
+        filecache_entry_stamp(entry, st);
+        goto EXIT;
+    }
+
+    log_debug("%s: parsing", path);
+
+    if( entry->fe_object )
+        self->fc_free_cb(entry->fe_object), entry->fe_object = 0;
+
+    ini = g_key_file_new();
+    if( !g_key_file_load_from_data(ini, data, size, G_KEY_FILE_NONE, &err) )
+        log_err("%s: can't parse: %s", path, err->message);
+    else
+        entry->fe_object = self->fc_load_cb(ini, path);
+
+    filecache_entry_stamp(entry, st);
+    g_free(entry->fe_hash), entry->fe_hash = hash, hash = 0;
+    changed = true;
+
+EXIT:
+    if( ini )
+        g_key_file_free(ini);
+    g_clear_error(&err);
+    g_free(hash);
+    g_free(data);
+
+    return changed;
+}
+
+/** Synchronize cache with ini-files on filesystem
+ *
+ * Only added and modified files are parsed, objects associated
+ * with removed files are released.
+ *
+ * @param self  file cache object
+ *
+ * @return true if any objects were added, changed, or removed
+ */
+bool
+filecache_scan(filecache_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool        changed = false;
+    glob_t      gb      = {};
+    GHashTable *seen    = g_hash_table_new(g_str_hash, g_str_equal);
+
+    g_list_free(self->fc_objects), self->fc_objects = 0;
+
+    if( glob(self->fc_pattern, 0, 0, &gb) != 0 )
+        log_debug("%s: no matching files", self->fc_pattern);
+
+    /* Note: glob() returns sorted results */
+    for( size_t i = 0; i < gb.gl_pathc; ++i ) {
+        const char        *path  = gb.gl_pathv[i];
+        struct stat        st    = {};
+        filecache_entry_t *entry = 0;
+
+        if( stat(path, &st) == -1 ) {
+            log_warning("%s: can't stat: %m", path);
+            continue;
+        }
+
+        if( filecache_update_entry(self, path, &st) )
+            changed = true;
+
+        if( !(entry = g_hash_table_lookup(self->fc_entries, path)) )
+            continue;
+
+        g_hash_table_add(seen, entry->fe_path);
+
+        if( entry->fe_object )
+            self->fc_objects = g_list_prepend(self->fc_objects,
+                                              entry->fe_object);
+    }
+    self->fc_objects = g_list_reverse(self->fc_objects);
+
+    /* Drop entries for files that no longer exist */
+    GHashTableIter iter;
+    gpointer       val;
+    g_hash_table_iter_init(&iter, self->fc_entries);
+    while( g_hash_table_iter_next(&iter, 0, &val) ) {
+        filecache_entry_t *entry = val;
+        if( g_hash_table_contains(seen, entry->fe_path) )
+            continue;
+        log_debug("%s: removed", entry->fe_path);
+        g_hash_table_iter_remove(&iter);
+        if( entry->fe_object )
+            changed = true;
+        filecache_entry_delete(entry, self->fc_free_cb);
+    }
+
+    g_hash_table_unref(seen);
+    globfree(&gb);
+
+    return changed;
+}
+
+/** Get objects constructed from ini-files
+ *
+ * @param self  file cache object
+ *
+ * @return List of objects in file path order. The list and the
+ *         objects are owned by the cache and remain valid until
+ *         the next #filecache_scan() call.
+ */
+GList *
+filecache_get_objects(const filecache_t *self)
+{
+    return self ? self->fc_objects : 0;
+}
@@ -0,0 +1,59 @@
+/**
+ * @file usb_moded-filecache.h
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_FILECACHE_H_
+# define USB_MODED_FILECACHE_H_
+
+# include <stdbool.h>
+# include <glib.h>
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Cache of objects constructed from a set of ini-files
+ */
+typedef struct filecache_t filecache_t;
+
+/** Callback for constructing an object from ini-file content
+ *
+ * @param ini   Parsed ini-file content
+ * @param path  Path to the ini-file, for diagnostic logging
+ *
+ * @return Object pointer, or NULL if content was not valid
+ */
+typedef gpointer (*filecache_load_fn)(GKeyFile *ini, const char *path);
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * FILECACHE
+ * ------------------------------------------------------------------------- */
+
+filecache_t *filecache_create     (const char *pattern, filecache_load_fn load_cb, GDestroyNotify free_cb);
+void         filecache_delete     (filecache_t *self);
+bool         filecache_scan       (filecache_t *self);
+GList       *filecache_get_objects(const filecache_t *self);
+
+#endif /* USB_MODED_FILECACHE_H_ */
@@ -0,0 +1,358 @@
+/**
+ * @file usb_moded-identity.c
+ *
+ * Device identity details that do not change while usb-moded is running
+ *
+ * Kernel command line, ssu and hw-release data is parsed just once,
+ * so that setting up usb gadget does not need to repeat file I/O.
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-identity.h"
+
+#include "usb_moded-log.h"
+
+#ifdef USE_MER_SSU
+# include "usb_moded-ssu.h"
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Device identity details
+ *
+ * Immutable after construction, NULL members mean "not available".
+ */
+typedef struct identity_t
+{
+    /** Serial number, from androidboot.serialno=... */
+    gchar *id_serial;
+
+    /** Manufacturer name, from ssu or hw-release */
+    gchar *id_manufacturer;
+
+    /** Product name, from ssu or hw-release */
+    gchar *id_product;
+
+    /** Network address, from usb_moded_ip=... */
+    gchar *id_kcmdline_ip;
+
+    /** Network gateway, from usb_moded_ip=... */
+    gchar *id_kcmdline_gw;
+
+    /** Network mask, from usb_moded_ip=... */
+    gchar *id_kcmdline_nm;
+} identity_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * IDENTITY
+ * ------------------------------------------------------------------------- */
+
+static void        identity_parse_usb_moded_ip(identity_t *self, const char *val);
+static void        identity_parse_kcmdline    (identity_t *self);
+static void        identity_parse_hw_release  (identity_t *self);
+static identity_t *identity_create            (void);
+static void        identity_delete            (identity_t *self);
+static identity_t *identity_get               (void);
+void               identity_init              (void);
+void               identity_quit              (void);
+const char        *identity_get_serial        (void);
+const char        *identity_get_manufacturer  (void);
+const char        *identity_get_product       (void);
+const char        *identity_get_kcmdline_ip   (void);
+const char        *identity_get_kcmdline_gw   (void);
+const char        *identity_get_kcmdline_nm   (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Identity details, constructed on the first access */
+static identity_t *identity_data = 0;
+
+/* ========================================================================= *
+ * IDENTITY
+ * ========================================================================= */
+
+/** Parse network details from kernel command line
+ *
+ * We're looking for a kernel command line option like:
+ * usb_moded_ip=192.168.3.100::192.168.3.1:255.255.255.0::usb0:on
+ *
+ * @param self  identity object
+ * @param val   value part of usb_moded_ip=...
+ */
+static void
+identity_parse_usb_moded_ip(identity_t *self, const char *val)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar **tokens = g_strsplit(val, ":", 7);
+
+    /* check if it is for the usb or rndis interface */
+    if( g_strv_length(tokens) < 6 )
+        goto EXIT;
+
+    if( !g_strrstr(tokens[5], "usb") && !g_strrstr(tokens[5], "rndis") )
+        goto EXIT;
+
+    g_free(self->id_kcmdline_ip),
+        self->id_kcmdline_ip = g_strdup(tokens[0]);
+    log_debug("Command line ip = %s\n", self->id_kcmdline_ip);
+
+    /* gateway might be empty, so we do not want to return an empty string */
+    if( strlen(tokens[2]) > 2 ) {
+        g_free(self->id_kcmdline_gw),
+            self->id_kcmdline_gw = g_strdup(tokens[2]);
+        log_debug("Command line gateway = %s\n", self->id_kcmdline_gw);
+    }
+
+    g_free(self->id_kcmdline_nm),
+        self->id_kcmdline_nm = g_strdup(tokens[3]);
+    log_debug("Command line netmask = %s\n", self->id_kcmdline_nm);
+
+EXIT:
+    g_strfreev(tokens);
+}
+
+/** Parse relevant options from kernel command line
+ *
+ * @param self  identity object
+ */
+static void
+identity_parse_kcmdline(identity_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const char path[] = "/proc/cmdline";
+
+    gchar   *data = 0;
+    gint     argc = 0;
+    gchar  **argv = 0;
+    GError  *err  = 0;
+
+    if( !g_file_get_contents(path, &data, 0, &err) ) {
+        log_warning("%s: can't read: %s", path, err->message);
+        goto EXIT;
+    }
+
+    if( !g_shell_parse_argv(data, &argc, &argv, &err) ) {
+        log_warning("%s: can't parse: %s", path, err->message);
+        goto EXIT;
+    }
+
+    for( gint i = 0; i < argc; ++i ) {
+        gchar **tokens = g_strsplit(argv[i], "=", 2);
+
+        if( !tokens[0] || !tokens[1] ) {
+            /* not a key=value option */
+        }
+        else if( !g_ascii_strcasecmp(tokens[0], "usb_moded_ip") ) {
+            identity_parse_usb_moded_ip(self, tokens[1]);
+        }
+        else if( !strcmp(tokens[0], "androidboot.serialno") ) {
+            size_t len = strcspn(tokens[1], ",");
+            g_free(self->id_serial),
+                self->id_serial = len ? g_strndup(tokens[1], len) : 0;
+        }
+
+        g_strfreev(tokens);
+    }
+
+    if( !self->id_serial )
+        log_warning("%s: no serial found", path);
+
+EXIT:
+    g_clear_error(&err);
+    g_strfreev(argv);
+    g_free(data);
+}
+
+/** Parse manufacturer and product names from ssu / hw-release
+ *
+ * @param self  identity object
+ */
+static void
+identity_parse_hw_release(identity_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+#ifdef USE_MER_SSU
+    /* If SSU can provide names, use them. Otherwise usb-moded
+     * falls back to using names specified in configuration files. */
+    self->id_manufacturer = ssu_get_manufacturer_name();
+    self->id_product      = ssu_get_product_name();
+#else
+    static const char path[] = "/etc/hw-release";
+
+    GKeyFile *ini = g_key_file_new();
+
+    if( g_key_file_load_from_file(ini, path, G_KEY_FILE_NONE, 0) ) {
+        self->id_manufacturer = g_key_file_get_string(ini, 0, "MANUFACTURER", 0);
+        self->id_product      = g_key_file_get_string(ini, 0, "NAME", 0);
+    }
+
+    g_key_file_free(ini);
+#endif
+}
+
+static identity_t *
+identity_create(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    identity_t *self = g_malloc0(sizeof *self);
+
+    identity_parse_kcmdline(self);
+    identity_parse_hw_release(self);
+
+    log_debug("serial = %s",       self->id_serial       ?: "N/A");
+    log_debug("manufacturer = %s", self->id_manufacturer ?: "N/A");
+    log_debug("product = %s",      self->id_product      ?: "N/A");
+
+    return self;
+}
+
+static void
+identity_delete(identity_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self ) {
+        g_free(self->id_serial);
+        g_free(self->id_manufacturer);
+        g_free(self->id_product);
+        g_free(self->id_kcmdline_ip);
+        g_free(self->id_kcmdline_gw);
+        g_free(self->id_kcmdline_nm);
+        g_free(self);
+    }
+}
+
+/** Get identity details, parse on the first call
+ *
+ * Note: This function is safe to call from any thread.
+ *
+ * @return identity object
+ */
+static identity_t *
+identity_get(void)
+{
+    if( g_once_init_enter(&identity_data) )
+        g_once_init_leave(&identity_data, identity_create());
+
+    return identity_data;
+}
+
+/** Parse identity details
+ *
+ * Should be called on usb-moded startup, before any threads that
+ * might need the details are started.
+ */
+void
+identity_init(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    identity_get();
+}
+
+/** Release identity details
+ *
+ * Note: This function should be called only from the main thread,
+ *       after other threads have been stopped.
+ */
+void
+identity_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    identity_delete(identity_data),
+        identity_data = 0;
+}
+
+/** Get device serial number
+ *
+ * @return serial number string, or NULL if not available
+ */
+const char *
+identity_get_serial(void)
+{
+    return identity_get()->id_serial;
+}
+
+/** Get device manufacturer name
+ *
+ * @return manufacturer name string, or NULL if not available
+ */
+const char *
+identity_get_manufacturer(void)
+{
+    return identity_get()->id_manufacturer;
+}
+
+/** Get device product name
+ *
+ * @return product name string, or NULL if not available
+ */
+const char *
+identity_get_product(void)
+{
+    return identity_get()->id_product;
+}
+
+/** Get network address override from kernel command line
+ *
+ * @return ip address string, or NULL if not available
+ */
+const char *
+identity_get_kcmdline_ip(void)
+{
+    return identity_get()->id_kcmdline_ip;
+}
+
+/** Get network gateway override from kernel command line
+ *
+ * @return gateway address string, or NULL if not available
+ */
+const char *
+identity_get_kcmdline_gw(void)
+{
+    return identity_get()->id_kcmdline_gw;
+}
+
+/** Get network mask override from kernel command line
+ *
+ * @return network mask string, or NULL if not available
+ */
+const char *
+identity_get_kcmdline_nm(void)
+{
+    return identity_get()->id_kcmdline_nm;
+}
@@ -0,0 +1,43 @@
+/**
+ * @file usb_moded-identity.h
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_IDENTITY_H_
+# define USB_MODED_IDENTITY_H_
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * IDENTITY
+ * ------------------------------------------------------------------------- */
+
+void        identity_init            (void);
+void        identity_quit            (void);
+const char *identity_get_serial      (void);
+const char *identity_get_manufacturer(void);
+const char *identity_get_product     (void);
+const char *identity_get_kcmdline_ip (void);
+const char *identity_get_kcmdline_gw (void);
+const char *identity_get_kcmdline_nm (void);
+
+#endif /* USB_MODED_IDENTITY_H_ */
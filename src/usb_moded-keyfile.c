@@ -0,0 +1,170 @@
+/**
+ * @file usb_moded-keyfile.c
+ *
+ * Merging ini-file content into keyfile objects
+ *
+ * Shared by settings handling and the snapshot module, so that
+ * precompiled and directly parsed configuration are guaranteed
+ * to follow the same override rules.
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-keyfile.h"
+
+#include "usb_moded-log.h"
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * KEYFILE
+ * ------------------------------------------------------------------------- */
+
+static void keyfile_merge_key      (GKeyFile *dest, GKeyFile *srce, const char *grp, const char *key);
+static void keyfile_merge_group    (GKeyFile *dest, GKeyFile *srce, const char *grp);
+void        keyfile_merge_data     (GKeyFile *dest, GKeyFile *srce);
+bool        keyfile_merge_from_file(GKeyFile *ini, const char *path);
+bool        keyfile_merge_from_data(GKeyFile *ini, const char *data);
+
+/* ========================================================================= *
+ * KEYFILE
+ * ========================================================================= */
+
+/**
+ * Merge value from one keyfile to another
+ *
+ * Existing values will be overridden
+ *
+ * @param dest keyfile to modify
+ * @param srce keyfile to merge from
+ * @param grp  value group to merge
+ * @param key  value key to merge
+ */
+static void
+keyfile_merge_key(GKeyFile *dest, GKeyFile *srce,
+                  const char *grp, const char *key)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *val = g_key_file_get_value(srce, grp, key, 0);
+    if( val ) {
+        //log_debug("[%s] %s = %s", grp, key, val);
+        g_key_file_set_value(dest, grp, key, val);
+        g_free(val);
+    }
+}
+
+/**
+ * Merge group of values from one keyfile to another
+ *
+ * @param dest keyfile to modify
+ * @param srce keyfile to merge from
+ * @param grp  value group to merge
+ */
+static void
+keyfile_merge_group(GKeyFile *dest, GKeyFile *srce, const char *grp)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar **key = g_key_file_get_keys(srce, grp, 0, 0);
+    if( key ) {
+        for( size_t i = 0; key[i]; ++i )
+            keyfile_merge_key(dest, srce, grp, key[i]);
+        g_strfreev(key);
+    }
+}
+
+/**
+ * Merge all groups and values from one keyfile to another
+ *
+ * @param dest keyfile to modify
+ * @param srce keyfile to merge from
+ */
+void
+keyfile_merge_data(GKeyFile *dest, GKeyFile *srce)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar **grp = g_key_file_get_groups(srce, 0);
+
+    if( grp ) {
+        for( size_t i = 0; grp[i]; ++i )
+            keyfile_merge_group(dest, srce, grp[i]);
+        g_strfreev(grp);
+    }
+}
+
+/**
+ * Merge all groups and values from ini-file to keyfile
+ *
+ * @param ini   keyfile to modify
+ * @param path  ini-file to merge from
+ *
+ * @return true if the file could be parsed, false otherwise
+ */
+bool
+keyfile_merge_from_file(GKeyFile *ini, const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool      ack = false;
+    GError   *err = 0;
+    GKeyFile *tmp = g_key_file_new();
+
+    if( !g_key_file_load_from_file(tmp, path, 0, &err) ) {
+        log_debug("%s: can't load: %s", path, err->message);
+    } else {
+        //log_debug("processing %s ...", path);
+        keyfile_merge_data(ini, tmp);
+        ack = true;
+    }
+    g_clear_error(&err);
+    g_key_file_free(tmp);
+    return ack;
+}
+
+/**
+ * Merge all groups and values from ini-file content to keyfile
+ *
+ * @param ini   keyfile to modify
+ * @param data  ini-file content to merge from
+ *
+ * @return true if the content could be parsed, false otherwise
+ */
+bool
+keyfile_merge_from_data(GKeyFile *ini, const char *data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool      ack = false;
+    GError   *err = 0;
+    GKeyFile *tmp = g_key_file_new();
+
+    if( !g_key_file_load_from_data(tmp, data, -1, 0, &err) ) {
+        log_debug("can't parse: %s", err->message);
+    } else {
+        keyfile_merge_data(ini, tmp);
+        ack = true;
+    }
+    g_clear_error(&err);
+    g_key_file_free(tmp);
+    return ack;
+}
@@ -0,0 +1,41 @@
+/**
+ * @file usb_moded-keyfile.h
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_KEYFILE_H_
+# define USB_MODED_KEYFILE_H_
+
+# include <stdbool.h>
+# include <glib.h>
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * KEYFILE
+ * ------------------------------------------------------------------------- */
+
+void keyfile_merge_data     (GKeyFile *dest, GKeyFile *srce);
+bool keyfile_merge_from_file(GKeyFile *ini, const char *path);
+bool keyfile_merge_from_data(GKeyFile *ini, const char *data);
+
+#endif /* USB_MODED_KEYFILE_H_ */
@@ -31,20 +31,37 @@
 
 #include "usb_moded-modesetting.h"
 
+#include "usb_moded.h"
 #include "usb_moded-android.h"
 #include "usb_moded-appsync.h"
 #include "usb_moded-common.h"
 #include "usb_moded-config-private.h"
 #include "usb_moded-configfs.h"
 #include "usb_moded-dbus-private.h"
+#include "usb_moded-exec.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modules.h"
 #include "usb_moded-network.h"
+#include "usb_moded-trace.h"
 #include "usb_moded-worker.h"
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <mntent.h>
+#include <strings.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Default limit for waiting gadget network interface to appear [ms] */
+#define DEFAULT_WAIT_INTERFACE_MS       3000
+
+/** Default limit for waiting host to configure the gadget [ms] */
+#define DEFAULT_WAIT_UDC_CONFIGURED_MS  2000
+
+/** Default limit for retrying busy unmounts [ms] */
+#define DEFAULT_WAIT_UMOUNT_MS          3000
 
 /* ========================================================================= *
  * Types
@@ -83,6 +100,12 @@ static storage_info_t *modesetting_get_storage_info           (size_t *pcount);
 static bool            modesetting_enter_mass_storage_mode    (const modedata_t *data);
 static int             modesetting_leave_mass_storage_mode    (const modedata_t *data);
 static void            modesetting_report_mass_storage_blocker(const char *mountpoint, int try);
+static void            modesetting_init_mass_storage_lun      (size_t lun);
+static bool            modesetting_unmount_with_retry         (const char *mountpoint);
+static gchar          *modesetting_udc_state_path             (void);
+static bool            modesetting_udc_configured_p           (void *aptr);
+static void            modesetting_wait_udc_configured        (unsigned fallback_ms);
+void                   modesetting_prestage                   (void);
 bool                   modesetting_enter_dynamic_mode         (void);
 void                   modesetting_leave_dynamic_mode         (void);
 void                   modesetting_init                       (void);
@@ -94,6 +117,9 @@ void                   modesetting_quit                       (void);
 
 static GHashTable *tracked_values = 0;
 
+/** Number of mass storage LUNs created during startup */
+static size_t modesetting_prestaged_luns = 0;
+
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
@@ -300,27 +326,24 @@ bool modesetting_is_mounted(const char *mountpoint)
 {
     LOG_REGISTER_CONTEXT;
 
-    char cmd[256];
-    snprintf(cmd, sizeof cmd, "/bin/mountpoint -q '%s'", mountpoint);
-    return common_system(cmd) == 0;
+    const char *argv[] = { "/bin/mountpoint", "-q", mountpoint, 0 };
+    return exec_run(argv, EXEC_DEFAULT_TIMEOUT, 0) == 0;
 }
 
 bool modesetting_mount(const char *mountpoint)
 {
     LOG_REGISTER_CONTEXT;
 
-    char cmd[256];
-    snprintf(cmd, sizeof cmd, "/bin/mount '%s'", mountpoint);
-    return common_system(cmd) == 0;
+    const char *argv[] = { "/bin/mount", mountpoint, 0 };
+    return exec_run(argv, EXEC_DEFAULT_TIMEOUT, 0) == 0;
 }
 
 bool modesetting_unmount(const char *mountpoint)
 {
     LOG_REGISTER_CONTEXT;
 
-    char cmd[256];
-    snprintf(cmd, sizeof cmd, "/bin/umount '%s'", mountpoint);
-    return common_system(cmd) == 0;
+    const char *argv[] = { "/bin/umount", mountpoint, 0 };
+    return exec_run(argv, EXEC_DEFAULT_TIMEOUT, 0) == 0;
 }
 
 static gchar *modesetting_mountdev(const char *mountpoint)
@@ -458,28 +481,9 @@ static bool modesetting_enter_mass_storage_mode(const modedata_t *data)
     for( size_t i = 0 ; i < count; ++i )
     {
         const gchar *mountpnt = info[i].si_mountpoint;
-        for( int tries = 0; ; ) {
-
-            if( !modesetting_is_mounted(mountpnt) ) {
-                log_debug("%s is not mounted", mountpnt);
-                break;
-            }
-
-            if( modesetting_unmount(mountpnt) ) {
-                log_debug("unmounted %s", mountpnt);
-                break;
-            }
-
-            if( ++tries == 3 ) {
-                log_err("failed to unmount %s - giving up", mountpnt);
-                modesetting_report_mass_storage_blocker(mountpnt, 2);
-                umdbus_send_error_signal(UMOUNT_ERROR);
-                goto EXIT;
-            }
-
-            log_warning("failed to unmount %s - wait a bit", mountpnt);
-            modesetting_report_mass_storage_blocker(mountpnt, 1);
-            common_sleep(1);
+        if( !modesetting_unmount_with_retry(mountpnt) ) {
+            umdbus_send_error_signal(UMOUNT_ERROR);
+            goto EXIT;
         }
     }
 
@@ -493,18 +497,22 @@ static bool modesetting_enter_mass_storage_mode(const modedata_t *data)
         android_set_enabled(true);
     }
     else if( configfs_in_use() ) {
-        configfs_set_udc(false);
-        configfs_set_function(0);
+        /* LUNs that were not created during startup can be
+         * added only while gadget is not bound */
+        if( count > modesetting_prestaged_luns ) {
+            configfs_set_udc(false);
+            configfs_set_function(0);
+        }
 
         for( size_t i = 0 ; i < count; ++i ) {
             const gchar *mountdev = info[i].si_mountdevice;
-            if( configfs_add_mass_storage_lun(i) ) {
-                configfs_set_mass_storage_attr(i, "cdrom", "0");
-                configfs_set_mass_storage_attr(i, "nofua", nofua ? "1" : "0");
-                configfs_set_mass_storage_attr(i, "removable", "1");
-                configfs_set_mass_storage_attr(i, "ro", "0");
-                configfs_set_mass_storage_attr(i, "file", mountdev);
+            if( i >= modesetting_prestaged_luns ) {
+                if( !configfs_add_mass_storage_lun(i) )
+                    continue;
+                modesetting_init_mass_storage_lun(i);
             }
+            configfs_set_mass_storage_attr(i, "nofua", nofua ? "1" : "0");
+            configfs_set_mass_storage_attr(i, "file", mountdev);
         }
         configfs_set_function("mass_storage");
         configfs_set_udc(true);
@@ -521,14 +529,14 @@ static bool modesetting_enter_mass_storage_mode(const modedata_t *data)
         {
             log_debug("%s does not exist, unloading and reloading mass_storage\n", tmp);
             modules_unload_module(MODULE_MASS_STORAGE);
-            snprintf(tmp, sizeof tmp, "modprobe %s luns=%zd", MODULE_MASS_STORAGE, count);
-            log_debug("usb-load command = %s", tmp);
-            if( common_system(tmp) != 0 )
+            snprintf(tmp, sizeof tmp, "luns=%zd", count);
+            const char *argv[] = { "modprobe", MODULE_MASS_STORAGE, tmp, 0 };
+            if( exec_run(argv, EXEC_DEFAULT_TIMEOUT, 0) != 0 )
                 goto EXIT;
         }
 
-        /* activate mounts after sleeping 1s to be sure enumeration happened and autoplay will work in windows*/
-        common_sleep(1);
+        /* activate mounts only after enumeration has happened so that autoplay will work in windows */
+        modesetting_wait_udc_configured(1000);
 
         for( size_t i = 0 ; i < count; ++i ) {
             const gchar *mountdev = info[i].si_mountdevice;
@@ -591,19 +599,20 @@ static int modesetting_leave_mass_storage_mode(const modedata_t *data)
     else if( configfs_in_use() ) {
         log_debug("Disable configfs mass storage\n");
         configfs_set_udc(false);
-        configfs_set_function(0);
 
-        // reset lun0, remove the rest altogether
+        // reset lun0 and prestaged luns, remove the rest altogether
         for( size_t i = 0 ; i < count; ++i ) {
             // reset
-            configfs_set_mass_storage_attr(i, "cdrom", "0");
             configfs_set_mass_storage_attr(i, "nofua", "0");
-            configfs_set_mass_storage_attr(i, "removable", "1");
-            configfs_set_mass_storage_attr(i, "ro", "0");
             configfs_set_mass_storage_attr(i, "file", "");
+            if( i < modesetting_prestaged_luns )
+                continue;
+            modesetting_init_mass_storage_lun(i);
             // remove
-            if( i > 0 )
+            if( i > 0 ) {
+                configfs_set_function(0);
                 configfs_remove_mass_storage_lun(i);
+            }
         }
     }
     else if( modules_in_use() ) {
@@ -666,39 +675,247 @@ static void modesetting_report_mass_storage_blocker(const char *mountpoint, int
 {
     LOG_REGISTER_CONTEXT;
 
-    FILE *stream = 0;
-    gchar *lsof_command = 0;
-    int count = 0;
+    const char   *argv[] = { "lsof", mountpoint, 0 };
+    exec_result_t res    = { .er_status = -1 };
 
-    lsof_command = g_strconcat("lsof ", mountpoint, NULL);
+    exec_run(argv, EXEC_DEFAULT_TIMEOUT, &res);
 
-    if( (stream = common_popen(lsof_command, "r")) )
+    if( res.er_stdout )
     {
-        char *text = 0;
-        size_t size = 0;
+        gchar **lines = g_strsplit(res.er_stdout, "\n", 0);
 
-        while( getline(&text, &size, stream) >= 0 )
+        /* skip the first line as it does not contain process info */
+        for( size_t i = 1; lines[i]; ++i )
         {
-            /* skip the first line as it does not contain process info */
-            if(count != 0)
-            {
-                gchar **split = 0;
-                split = g_strsplit((const gchar*)text, " ", 2);
-                log_err("Mass storage blocked by process %s\n", split[0]);
-                umdbus_send_error_signal(split[0]);
-                g_strfreev(split);
-            }
-            count++;
+            if( !*lines[i] )
+                continue;
+
+            gchar **split = 0;
+            split = g_strsplit((const gchar*)lines[i], " ", 2);
+            log_err("Mass storage blocked by process %s\n", split[0]);
+            umdbus_send_error_signal(split[0]);
+            g_strfreev(split);
         }
-        pclose(stream);
-        free(text);
+        g_strfreev(lines);
     }
-    g_free(lsof_command);
+    exec_result_clear(&res);
     if(try == 2)
         log_err("Setting Mass storage blocked. Giving up.\n");
 
 }
 
+/** Unmount filesystem, retrying while it is busy
+ *
+ * There is no event that would signal filesystem becoming unused,
+ * so unmounting is retried with increasing delays until the
+ * configured time limit is reached.
+ *
+ * @param mountpoint  directory to unmount
+ *
+ * @return true if mountpoint is not mounted, false otherwise
+ */
+static bool
+modesetting_unmount_with_retry(const char *mountpoint)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool     ack     = false;
+    unsigned limit   = config_get_wait_limit(WAIT_UMOUNT_KEY,
+                                             DEFAULT_WAIT_UMOUNT_MS);
+    unsigned waited  = 0;
+    unsigned nap     = 50;
+
+    for( int tries = 0; ; ++tries ) {
+        if( !modesetting_is_mounted(mountpoint) ) {
+            log_debug("%s is not mounted", mountpoint);
+            ack = true;
+            break;
+        }
+
+        if( modesetting_unmount(mountpoint) ) {
+            log_debug("unmounted %s", mountpoint);
+            ack = true;
+            break;
+        }
+
+        if( waited >= limit || worker_bailing_out() ) {
+            log_err("failed to unmount %s - giving up", mountpoint);
+            modesetting_report_mass_storage_blocker(mountpoint, 2);
+            break;
+        }
+
+        if( tries == 0 ) {
+            log_warning("failed to unmount %s - wait a bit", mountpoint);
+            modesetting_report_mass_storage_blocker(mountpoint, 1);
+            trace_enter_phase(TRACE_PHASE_WAIT_UMOUNT);
+        }
+
+        nap = MIN(nap, limit - waited);
+        common_msleep(nap);
+        waited += nap;
+        nap = MIN(nap * 2, 500);
+    }
+
+    trace_leave_phase(TRACE_PHASE_WAIT_UMOUNT);
+
+    return ack;
+}
+
+/** Get path to sysfs file holding usb device controller state
+ *
+ * @return path to state file, or NULL if not available
+ */
+static gchar *
+modesetting_udc_state_path(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *path = 0;
+
+    if( android_in_use() )
+        path = g_strdup(ANDROID0_DIRECTORY "/state");
+    else
+        path = configfs_get_udc_state_path();
+
+    if( path && access(path, R_OK) == -1 )
+        g_free(path), path = 0;
+
+    return path;
+}
+
+/** Predicate for: host has configured the gadget
+ *
+ * @param aptr  path to udc state file
+ *
+ * @return true if state is "configured", false otherwise
+ */
+static bool
+modesetting_udc_configured_p(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char *state = modesetting_read_from_file(aptr, 64);
+    bool  ack   = state && !strcasecmp(state, "configured");
+    free(state);
+    return ack;
+}
+
+/** Wait for host to configure the gadget
+ *
+ * Used in places where some time needs to be given for enumeration
+ * to finish. Udc state changes are notified via sysfs, so the wait
+ * ends as soon as the host has selected a configuration. Android
+ * gadget state does not emit notifications and is polled instead.
+ *
+ * If udc state is not available, falls back to fixed delay.
+ *
+ * @param fallback_ms  delay to use when state can't be tracked [ms]
+ */
+static void
+modesetting_wait_udc_configured(unsigned fallback_ms)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *path = modesetting_udc_state_path();
+    int    fd   = -1;
+
+    trace_enter_phase(TRACE_PHASE_WAIT_UDC);
+
+    if( !path ) {
+        common_msleep(fallback_ms);
+        goto EXIT;
+    }
+
+    /* Sysfs change notifications require reading the file first */
+    if( !android_in_use() ) {
+        if( (fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) != -1 ) {
+            char tmp[64];
+            if( read(fd, tmp, sizeof tmp) == -1 )
+                log_warning("%s: read: %m", path);
+        }
+    }
+
+    gint64    started = g_get_monotonic_time();
+    unsigned  limit   = config_get_wait_limit(WAIT_UDC_CONFIGURED_KEY,
+                                              DEFAULT_WAIT_UDC_CONFIGURED_MS);
+    waitres_t res     = common_wait_fd(limit, fd,
+                                       modesetting_udc_configured_p, path);
+
+    log_debug("udc %s after %d ms",
+              res == WAIT_READY ? "configured" : "not configured",
+              (int)((g_get_monotonic_time() - started) / 1000));
+
+EXIT:
+    trace_leave_phase(TRACE_PHASE_WAIT_UDC);
+
+    if( fd != -1 )
+        close(fd);
+    g_free(path);
+}
+
+/** Write mass storage LUN attributes that do not depend on mountpoints
+ *
+ * @param lun  LUN number
+ */
+static void
+modesetting_init_mass_storage_lun(size_t lun)
+{
+    LOG_REGISTER_CONTEXT;
+
+    configfs_set_mass_storage_attr(lun, "cdrom", "0");
+    configfs_set_mass_storage_attr(lun, "removable", "1");
+    configfs_set_mass_storage_attr(lun, "ro", "0");
+}
+
+/** Create gadget functions and LUNs configured modes can need
+ *
+ * Done once during startup, while the gadget is not bound, so that
+ * entering a mode needs to only link functions and enable the UDC,
+ * and the first mode switch after bootup is as fast as later ones.
+ *
+ * Note: This function should be called only from the main thread,
+ *       after usb control backend has been initialized and dynamic
+ *       modes have been loaded.
+ */
+void
+modesetting_prestage(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    size_t          count = 0;
+    storage_info_t *info  = 0;
+
+    if( !configfs_in_use() )
+        goto EXIT;
+
+    /* Charging mode uses mass storage function */
+    configfs_prestage_functions("mass_storage");
+
+    for( GList *iter = usbmoded_get_modelist(); iter; iter = g_list_next(iter) ) {
+        const modedata_t *data = iter->data;
+        configfs_prestage_functions(data->sysfs_value);
+    }
+
+    if( !(info = modesetting_get_storage_info(&count)) )
+        goto EXIT;
+
+    /* LUNs can be added only while gadget is not bound */
+    if( !configfs_set_udc(false) )
+        goto EXIT;
+
+    for( size_t i = 0; i < count; ++i ) {
+        if( !configfs_add_mass_storage_lun(i) )
+            break;
+        modesetting_init_mass_storage_lun(i);
+        modesetting_prestaged_luns = i + 1;
+    }
+
+    log_debug("prestaged %zd mass storage luns", modesetting_prestaged_luns);
+
+EXIT:
+    modesetting_free_storage_info(info);
+}
+
 bool modesetting_enter_dynamic_mode(void)
 {
     LOG_REGISTER_CONTEXT;
@@ -748,10 +965,12 @@ bool modesetting_enter_dynamic_mode(void)
 #ifdef APP_SYNC
     if( data->appsync ) {
         log_debug("Dynamic mode is appsync: do pre actions");
+        trace_enter_phase(TRACE_PHASE_APPSYNC_PRE);
         if( appsync_activate_pre(data->mode_name) != 0 ) {
             log_debug("Appsync failure");
             goto EXIT;
         }
+        trace_leave_phase(TRACE_PHASE_APPSYNC_PRE);
     }
 #endif
 
@@ -759,6 +978,8 @@ bool modesetting_enter_dynamic_mode(void)
      * Configure gadget
      * - - - - - - - - - - - - - - - - - - - */
 
+    trace_enter_phase(TRACE_PHASE_GADGET);
+
     if( configfs_in_use() ) {
         /* Configfs based gadget configuration */
         configfs_set_function(data->sysfs_value);
@@ -792,6 +1013,8 @@ bool modesetting_enter_dynamic_mode(void)
         goto EXIT;
     }
 
+    trace_leave_phase(TRACE_PHASE_GADGET);
+
     /* - - - - - - - - - - - - - - - - - - - *
      * Setup network
      * - - - - - - - - - - - - - - - - - - - */
@@ -800,28 +1023,31 @@ bool modesetting_enter_dynamic_mode(void)
     if(data->network)
     {
         log_debug("Dynamic mode is network");
+        trace_enter_phase(TRACE_PHASE_NETWORK);
 #ifdef DEBIAN
-        char command[256];
+        const char *ifdown[] = { "ifdown", data->network_interface, 0 };
+        const char *ifup[]   = { "ifup",   data->network_interface, 0 };
 
-        g_snprintf(command, sizeof command, "ifdown %s ; ifup %s", data->network_interface, data->network_interface);
-        common_system(command);
+        /* Like "ifdown ; ifup" - failing ifdown does not prevent ifup */
+        exec_run(ifdown, EXEC_DEFAULT_TIMEOUT, 0);
+        exec_run(ifup, EXEC_DEFAULT_TIMEOUT, 0);
 #else
         network_down(data);
-        int error = network_up(data);
-
-        /* In case of failure, retry upto 3 times */
-        for( int i = 0; error && i < 3; ++i ) {
-            log_warning("Retry setting up the network");
-            if( !common_msleep(1000) )
-                break;
-            if( !(error = network_up(data)) )
-                log_warning("Setting up the network succeeded");
-        }
-        if( error ) {
+
+        /* Gadget network interface shows up some time after the
+         * function has been enabled - wait for it instead of
+         * retrying at fixed intervals */
+        trace_enter_phase(TRACE_PHASE_WAIT_INTERFACE);
+        network_wait_interface(config_get_wait_limit(WAIT_INTERFACE_KEY,
+                                                     DEFAULT_WAIT_INTERFACE_MS));
+        trace_leave_phase(TRACE_PHASE_WAIT_INTERFACE);
+
+        if( worker_bailing_out() || network_up(data) != 0 ) {
             log_err("Setting up the network failed");
             goto EXIT;
         }
 #endif /* DEBIAN */
+        trace_leave_phase(TRACE_PHASE_NETWORK);
     }
 
     /* Needs to be called before application post synching so
@@ -831,8 +1057,10 @@ bool modesetting_enter_dynamic_mode(void)
          * service is started based on appsync config - i.e. NOT
          * based on either nat or setting in modedata ...
          */
+        trace_enter_phase(TRACE_PHASE_DHCP);
         if( network_update_udhcpd_config(data) != 0 )
             goto EXIT;
+        trace_leave_phase(TRACE_PHASE_DHCP);
     }
 
     /* - - - - - - - - - - - - - - - - - - - *
@@ -843,9 +1071,11 @@ bool modesetting_enter_dynamic_mode(void)
     if(data->appsync )
     {
         log_debug("Dynamic mode is appsync: do post actions");
-        /* let's sleep for a bit (350ms) to allow interfaces to settle before running postsync */
-        common_msleep(350);
+        trace_enter_phase(TRACE_PHASE_APPSYNC_POST);
+        /* allow host to configure the gadget before running postsync */
+        modesetting_wait_udc_configured(350);
         appsync_activate_post(data->mode_name);
+        trace_leave_phase(TRACE_PHASE_APPSYNC_POST);
     }
 
     /* - - - - - - - - - - - - - - - - - - - *
@@ -855,14 +1085,20 @@ bool modesetting_enter_dynamic_mode(void)
 #ifdef CONNMAN
     if( data->connman_tethering ) {
         log_debug("Dynamic mode is tethering");
+        trace_enter_phase(TRACE_PHASE_TETHERING);
         if( !connman_set_tethering(data->connman_tethering, true) )
             goto EXIT;
+        trace_leave_phase(TRACE_PHASE_TETHERING);
     }
 #endif
 
     ack = true;
 
 EXIT:
+    /* Account time spent in phase that failed */
+    for( int phase = TRACE_PHASE_APPSYNC_PRE; phase <= TRACE_PHASE_TETHERING; ++phase )
+        trace_leave_phase(phase);
+
     if( !ack )
         umdbus_send_error_signal(MODE_SETTING_FAILED);
     return ack;
@@ -45,6 +45,7 @@ int  modesetting_write_to_file_real(const char *file, int line, const char *func
 bool modesetting_is_mounted        (const char *mountpoint);
 bool modesetting_mount             (const char *mountpoint);
 bool modesetting_unmount           (const char *mountpoint);
+void modesetting_prestage          (void);
 bool modesetting_enter_dynamic_mode(void);
 void modesetting_leave_dynamic_mode(void);
 void modesetting_init              (void);
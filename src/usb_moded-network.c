@@ -33,16 +33,23 @@
 
 #include "usb_moded-network.h"
 
+#include "usb_moded-common.h"
 #include "usb_moded-config-private.h"
 #include "usb_moded-control.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modesetting.h"
 #include "usb_moded-worker.h"
 #include "usb_moded-dbus-private.h"
+#include "usb_moded-exec.h"
+#include "usb_moded-rtnl.h"
+#include "usb_moded-dhcpd.h"
+#include "usb_moded-systemd.h"
 
 #include <sys/stat.h>
 
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
 
 /* ========================================================================= *
  * Constants
@@ -52,6 +59,17 @@
 #define UDHCP_CONFIG_DIR        "/run/usb-moded"
 #define UDHCP_CONFIG_LINK       "/etc/udhcpd.conf"
 
+#define NAT_RULES_PATH          "/run/usb-moded/nat.rules"
+#define NAT_FORWARD_CHAIN       "USB_MODED_FORWARD"
+#define NAT_POSTROUTING_CHAIN   "USB_MODED_POSTROUTING"
+
+#define DHCP_DEFAULT_RANGE_START 1
+#define DHCP_DEFAULT_RANGE_END   15
+#define DHCP_DEFAULT_LEASE_TIME  3600
+
+/** Delay for coalescing connection state changes [ms] */
+#define NETWORK_REFRESH_DELAY_MS 250
+
 /* ========================================================================= *
  * Types
  * ========================================================================= */
@@ -67,6 +85,38 @@ typedef struct ipforward_data_t
     char *nat_interface;
 } ipforward_data_t;
 
+/** Network settings applied to the gadget interface */
+typedef struct network_settings_t
+{
+    /** Network interface name */
+    gchar *ns_interface;
+    /** Interface address */
+    gchar *ns_address;
+    /** Netmask of the network */
+    gchar *ns_netmask;
+    /** Default gateway, or NULL */
+    gchar *ns_gateway;
+} network_settings_t;
+
+#ifdef CONNMAN
+/** Cached connman service properties */
+typedef struct connman_service_t
+{
+    /** D-Bus object path */
+    gchar *cs_path;
+    /** Service type, e.g. "cellular" or "wifi" */
+    gchar *cs_type;
+    /** Service state, e.g. "ready" or "online" */
+    gchar *cs_state;
+    /** Address of primary DNS */
+    gchar *cs_dns1;
+    /** Address of secondary DNS */
+    gchar *cs_dns2;
+    /** Network interface name */
+    gchar *cs_interface;
+} connman_service_t;
+#endif
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -82,14 +132,36 @@ static void              ipforward_data_set_dns1         (ipforward_data_t *self
 static void              ipforward_data_set_dns2         (ipforward_data_t *self, const char *dns);
 static void              ipforward_data_set_nat_interface(ipforward_data_t *self, const char *interface);
 
+/* ------------------------------------------------------------------------- *
+ * NETWORK_IPC
+ * ------------------------------------------------------------------------- */
+
+#if defined OFONO || defined CONNMAN
+static bool         network_ipc_call_async            (const char *service, const char *object, const char *interface, const char *method, DBusPendingCallNotifyFunction cb, DBusPendingCall **ppc);
+static void         network_ipc_cancel                (DBusPendingCall **ppc);
+static DBusMessage *network_ipc_get_reply             (DBusPendingCall *pc, const char *what);
+static bool         network_ipc_parse_owner_changed   (DBusMessage *msg, const char *name, const char **owner);
+static bool         network_ipc_parse_property_changed(DBusMessage *msg, const char **key, DBusMessageIter *var);
+#endif
+
 /* ------------------------------------------------------------------------- *
  * OFONO
  * ------------------------------------------------------------------------- */
 
 #ifdef OFONO
-static gchar *ofono_get_default_modem (void);
-static gchar *ofono_get_modem_status  (const char *modem);
-static bool   ofono_get_roaming_status(void);
+static void ofono_status_changed    (const char *status);
+static void ofono_status_query_cb   (DBusPendingCall *pc, void *aptr);
+static void ofono_status_query      (void);
+static void ofono_status_signal     (DBusMessage *msg);
+static void ofono_modem_changed     (const char *modem);
+static void ofono_modems_query_cb   (DBusPendingCall *pc, void *aptr);
+static void ofono_modems_query      (void);
+static void ofono_modems_signal     (DBusMessage *msg, bool added);
+static void ofono_available_changed (const char *owner);
+static void ofono_available_cb      (const char *owner);
+static void ofono_available_query   (void);
+static bool ofono_get_roaming_status(void);
+static void ofono_quit              (void);
 #endif
 
 /* ------------------------------------------------------------------------- *
@@ -97,11 +169,28 @@ static bool   ofono_get_roaming_status(void);
  * ------------------------------------------------------------------------- */
 
 #ifdef CONNMAN
-static bool   connman_technology_set_tethering   (DBusConnection *con, const char *technology, bool on, DBusError *err);
-static gchar *connman_manager_get_service_path   (DBusConnection *con, const char *type);
-static bool   connman_service_get_connection_data(DBusConnection *con, const char *service, ipforward_data_t *ipforward);
-static bool   connman_get_connection_data        (ipforward_data_t *ipforward);
-bool          connman_set_tethering              (const char *technology, bool on);
+static bool                     connman_technology_set_tethering   (DBusConnection *con, const char *technology, bool on, DBusError *err);
+static connman_service_t       *connman_service_create             (const char *path);
+static void                     connman_service_delete             (connman_service_t *self);
+static bool                     connman_service_is_connected       (const connman_service_t *self);
+static void                     connman_service_set_property_locked(connman_service_t *self, const char *key, DBusMessageIter *var);
+static void                     connman_service_update_locked      (connman_service_t *self, DBusMessageIter *array_of_entries);
+static connman_service_t       *connman_services_steal_locked      (const char *path);
+static connman_service_t       *connman_services_find_locked       (const char *path);
+static void                     connman_services_clear_locked      (void);
+static void                     connman_services_update_locked     (DBusMessageIter *array_of_structs);
+static const connman_service_t *connman_services_select_locked     (void);
+static void                     connman_services_changed           (void);
+static void                     connman_services_query_cb          (DBusPendingCall *pc, void *aptr);
+static void                     connman_services_query             (void);
+static void                     connman_services_signal            (DBusMessage *msg);
+static void                     connman_service_signal             (DBusMessage *msg);
+static void                     connman_available_changed          (const char *owner);
+static void                     connman_available_cb               (const char *owner);
+static void                     connman_available_query            (void);
+static bool                     connman_get_connection_data        (ipforward_data_t *ipforward);
+static void                     connman_quit                       (void);
+bool                            connman_set_tethering              (const char *technology, bool on);
 #endif
 
 /* ------------------------------------------------------------------------- *
@@ -116,16 +205,38 @@ static bool legacy_get_connection_data(ipforward_data_t *ipforward);
  * NETWORK
  * ------------------------------------------------------------------------- */
 
+static void  network_settings_clear       (network_settings_t *self);
+static void  network_settings_copy        (network_settings_t *self, const network_settings_t *that);
+static void  network_applied_get          (network_settings_t *settings);
+static void  network_applied_set          (const network_settings_t *settings);
 static bool  network_interface_exists     (char *interface);
 static char *network_get_interface        (const modedata_t *data);
+bool         network_wait_interface       (unsigned tot_ms);
+static bool  network_iptables_restore     (const char *rules);
+static bool  network_nat_chain_hooked     (const char *table, const char *chain, const char *target, bool *cached);
+static void  network_nat_forget_hooks     (void);
 static int   network_setup_ip_forwarding  (const modedata_t *data, ipforward_data_t *ipforward);
 static void  network_cleanup_ip_forwarding(void);
 static int   network_check_udhcpd_symlink (void);
 static int   network_write_udhcpd_config  (const modedata_t *data, ipforward_data_t *ipforward);
+static int   network_start_dhcpd          (const modedata_t *data, ipforward_data_t *ipforward);
+static int   network_update_sharing_locked(const modedata_t *data);
+static void  network_restart_udhcpd       (void);
 int          network_update_udhcpd_config (const modedata_t *data);
 int          network_up                   (const modedata_t *data);
 void         network_down                 (const modedata_t *data);
+static bool  network_reconfigure          (const modedata_t *data);
 void         network_update               (void);
+#if defined OFONO || defined CONNMAN
+static void             *network_refresh_thread_cb(void *aptr);
+static void              network_refresh_join     (void);
+static gboolean          network_refresh_cb       (gpointer aptr);
+static void              network_state_changed    (void);
+static DBusHandlerResult network_dbus_filter_cb   (DBusConnection *con, DBusMessage *msg, void *aptr);
+#endif
+void         network_roaming_policy_changed(void);
+bool         network_start_listener       (void);
+void         network_stop_listener        (void);
 
 /* ========================================================================= *
  * Data
@@ -133,6 +244,140 @@ void         network_update               (void);
 
 static const char default_interface[] = "usb0";
 
+/** Whether POSTROUTING is known to jump to usb-moded NAT chain
+ *
+ * Access only while holding #network_sharing_mutex.
+ */
+static bool network_nat_postrouting_hooked = false;
+
+/** Whether FORWARD is known to jump to usb-moded NAT chain
+ *
+ * Access only while holding #network_sharing_mutex.
+ */
+static bool network_nat_forward_hooked = false;
+
+/** Whether connection sharing has been set up for the current mode
+ *
+ * Access only while holding #network_sharing_mutex.
+ */
+static bool network_sharing_active = false;
+
+/** Mutex for serializing connection sharing updates
+ *
+ * Sharing is set up from the worker thread during mode switch,
+ * and updated from a refresh thread when connection state changes.
+ */
+static pthread_mutex_t network_sharing_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define NETWORK_SHARING_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&network_sharing_mutex) != 0 ) { \
+        log_crit("NETWORK SHARING LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define NETWORK_SHARING_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&network_sharing_mutex) != 0 ) { \
+        log_crit("NETWORK SHARING UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+/** Settings applied by #network_up(), cleared by #network_down()
+ *
+ * Access only while holding #network_applied_mutex.
+ */
+static network_settings_t network_applied = { 0 };
+
+static pthread_mutex_t network_applied_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define NETWORK_APPLIED_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&network_applied_mutex) != 0 ) { \
+        log_crit("NETWORK APPLIED LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define NETWORK_APPLIED_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&network_applied_mutex) != 0 ) { \
+        log_crit("NETWORK APPLIED UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#if defined OFONO || defined CONNMAN
+/** SystemBus connection ref used for ofono / connman tracking */
+static DBusConnection *network_con = 0;
+
+/** Timer for applying connection state changes */
+static guint network_refresh_id = 0;
+
+/** Thread applying connection state changes, accessed from main thread */
+static pthread_t network_refresh_thread_id = 0;
+
+/** Flag for: refresh requested, but not yet picked up by refresh thread
+ *
+ * Access only while holding #network_state_mutex.
+ */
+static bool network_refresh_pending = false;
+
+/** Flag for: refresh thread is running
+ *
+ * Access only while holding #network_state_mutex.
+ */
+static bool network_refresh_running = false;
+
+/** Mutex for accessing cached ofono / connman state
+ *
+ * Cached state is updated in the main thread, and read
+ * from the worker thread during mode switch.
+ */
+static pthread_mutex_t network_state_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define NETWORK_STATE_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&network_state_mutex) != 0 ) { \
+        log_crit("NETWORK STATE LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define NETWORK_STATE_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&network_state_mutex) != 0 ) { \
+        log_crit("NETWORK STATE UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+#endif
+
+#ifdef OFONO
+/** Flag for: ofono is available on system bus */
+static bool ofono_is_available = false;
+
+/** Object path of the default modem, or NULL */
+static gchar *ofono_modem = 0;
+
+/** Cached roaming status of the default modem */
+static bool ofono_roaming = false;
+
+static DBusPendingCall *ofono_available_pc = 0;
+static DBusPendingCall *ofono_modems_pc    = 0;
+static DBusPendingCall *ofono_status_pc    = 0;
+#endif
+
+#ifdef CONNMAN
+/** Flag for: connman is available on system bus */
+static bool connman_is_available = false;
+
+/** Cached connman services, in connman preference order */
+static GPtrArray *connman_services = 0;
+
+/** Summary of connection data last used for change detection */
+static gchar *connman_connection = 0;
+
+static DBusPendingCall *connman_available_pc = 0;
+static DBusPendingCall *connman_services_pc  = 0;
+#endif
+
 /* ========================================================================= *
  * IPFORWARD_DATA
  * ========================================================================= */
@@ -201,440 +446,1116 @@ ipforward_data_set_nat_interface(ipforward_data_t *self, const char *interface)
 }
 
 /* ========================================================================= *
- * OFONO
+ * NETWORK_IPC
  * ========================================================================= */
 
-#ifdef OFONO
+#if defined OFONO || defined CONNMAN
 
-/** Get object path of the 1st modem known to ofono
+/** Make asynchronous method call without arguments
  *
- * Caller must release the returned string with g_free().
+ * @param service    D-Bus name of the service
+ * @param object     D-Bus object path
+ * @param interface  D-Bus interface name
+ * @param method     D-Bus method name
+ * @param cb         Function to call when reply is received
+ * @param ppc        Where to store pending call object
  *
- * @return object path, or NULL
+ * @return true if method call was sent, false otherwise
  */
-
-static gchar *
-ofono_get_default_modem(void)
+static bool
+network_ipc_call_async(const char *service, const char *object,
+                       const char *interface, const char *method,
+                       DBusPendingCallNotifyFunction cb,
+                       DBusPendingCall **ppc)
 {
-    gchar          *modem = 0;
-    DBusConnection *con   = 0;
-    DBusError       err   = DBUS_ERROR_INIT;
-    DBusMessage    *rsp   = 0;
+    LOG_REGISTER_CONTEXT;
 
-    if( !(con = umdbus_get_connection()) )
-        goto EXIT;
+    bool             ack = false;
+    DBusMessage     *req = 0;
+    DBusPendingCall *pc  = 0;
 
-    rsp = umdbus_blocking_call(con,
-                               "org.ofono",
-                               "/",
-                               "org.ofono.Manager",
-                               "GetModems",
-                               &err,
-                               DBUS_TYPE_INVALID);
-    if( !rsp )
+    if( !network_con ) {
+        log_err("not connected to system bus; skip %s.%s query",
+                interface, method);
         goto EXIT;
+    }
 
-    // a(oa{sv}) -> get object path in the first struct in the array
-    DBusMessageIter body;
-    if( umdbus_parser_init(&body, rsp) ) {
-        DBusMessageIter iter_array;
-        if( umdbus_parser_get_array(&body, &iter_array) ) {
-            DBusMessageIter astruct;
-            if( umdbus_parser_get_struct(&iter_array, &astruct) ) {
-                const char *object = 0;
-                if( umdbus_parser_get_object(&astruct, &object) ) {
-                    modem = g_strdup(object);
-                }
-            }
-        }
+    req = dbus_message_new_method_call(service, object, interface, method);
+    if( !req ) {
+        log_err("%s.%s: failed to construct request", interface, method);
+        goto EXIT;
     }
 
-EXIT:
-    if( rsp )
-        dbus_message_unref(rsp);
+    if( !dbus_connection_send_with_reply(network_con, req, &pc, -1) )
+        goto EXIT;
 
-    if( con )
-        dbus_connection_unref(con);
+    if( !pc )
+        goto EXIT;
 
-    dbus_error_free(&err);
+    if( !dbus_pending_call_set_notify(pc, cb, 0, 0) )
+        goto EXIT;
+
+    *ppc = pc, pc = 0;
+    ack = true;
+
+EXIT:
+    if( pc  ) dbus_pending_call_unref(pc);
+    if( req ) dbus_message_unref(req);
 
-    log_warning("default modem = %s", modem ?: "n/a");
+    return ack;
+}
+
+/** Cancel pending asynchronous method call
+ *
+ * @param ppc  Where pending call object is stored
+ */
+static void
+network_ipc_cancel(DBusPendingCall **ppc)
+{
+    LOG_REGISTER_CONTEXT;
 
-    return modem;
+    if( *ppc ) {
+        dbus_pending_call_cancel(*ppc);
+        dbus_pending_call_unref(*ppc), *ppc = 0;
+    }
 }
 
-/** Query modem status from ofono
+/** Get reply message for asynchronous method call
  *
- * Caller must release the returned string with g_free().
+ * Caller must release the returned message with dbus_message_unref().
  *
- * @param modem  D-Bus object path
+ * @param pc    Pending call object
+ * @param what  Method name for logging purposes
  *
- * @return modem status, or NULL
+ * @return non-error reply message, or NULL
  */
-static gchar *
-ofono_get_modem_status(const char *modem)
+static DBusMessage *
+network_ipc_get_reply(DBusPendingCall *pc, const char *what)
 {
-    gchar          *status = 0;
-    DBusConnection *con    = 0;
-    DBusError       err    = DBUS_ERROR_INIT;
-    DBusMessage    *rsp    = 0;
-
-    if( !(con = umdbus_get_connection()) )
-        goto EXIT;
+    LOG_REGISTER_CONTEXT;
 
-    rsp = umdbus_blocking_call(con,
-                               "org.ofono",
-                               modem,
-                               "org.ofono.NetworkRegistration",
-                               "GetProperties",
-                               &err,
-                               DBUS_TYPE_INVALID);
-    if( !rsp )
-        goto EXIT;
+    DBusMessage *rsp = 0;
+    DBusError    err = DBUS_ERROR_INIT;
 
-    DBusMessageIter body;
-    if( umdbus_parser_init(&body, rsp) ) {
-        DBusMessageIter iter_array;
-        if( umdbus_parser_get_array(&body, &iter_array) ) {
-            DBusMessageIter entry;
-            while( umdbus_parser_get_entry(&iter_array, &entry) ) {
-                const char *key = 0;
-                if( !umdbus_parser_get_string(&entry, &key) )
-                    break;
-                if( strcmp(key, "Status") )
-                    continue;
-                DBusMessageIter var;
-                if( !umdbus_parser_get_variant(&entry, &var) )
-                    break;
-                const char *val = 0;
-                if( !umdbus_parser_get_string(&var, &val) )
-                    break;
-                status = g_strdup(val);
-                break;
-            }
-        }
+    if( !(rsp = dbus_pending_call_steal_reply(pc)) ) {
+        log_err("%s: no reply", what);
+    }
+    else if( dbus_set_error_from_message(&err, rsp) ) {
+        log_err("%s: error reply: %s: %s", what, err.name, err.message);
+        dbus_message_unref(rsp), rsp = 0;
     }
-
-EXIT:
-    if( rsp )
-        dbus_message_unref(rsp);
-
-    if( con )
-        dbus_connection_unref(con);
 
     dbus_error_free(&err);
 
-    log_warning("modem status = %s", status ?: "n/a");
-
-    return status;
+    return rsp;
 }
 
-/** Get roaming data from ofono
+/** Parse NameOwnerChanged signal
  *
- * @return true if roaming, false when not (or when ofono is unavailable)
+ * @param msg   D-Bus signal message
+ * @param name  D-Bus name to check
+ * @param owner Where to store new owner
+ *
+ * @return true if the signal is about given name, false otherwise
  */
 static bool
-ofono_get_roaming_status(void)
+network_ipc_parse_owner_changed(DBusMessage *msg, const char *name,
+                                const char **owner)
 {
     LOG_REGISTER_CONTEXT;
 
-    bool roaming = false;
-    gchar *modem = 0;
-    gchar *status = 0;
-
-    if( !(modem = ofono_get_default_modem()) )
-        goto EXIT;
+    bool        ack  = false;
+    DBusError   err  = DBUS_ERROR_INIT;
+    const char *dta  = 0;
+    const char *prev = 0;
+
+    if( !dbus_message_get_args(msg, &err,
+                               DBUS_TYPE_STRING, &dta,
+                               DBUS_TYPE_STRING, &prev,
+                               DBUS_TYPE_STRING, owner,
+                               DBUS_TYPE_INVALID) ) {
+        log_err("failed to parse signal: %s: %s", err.name, err.message);
+    }
+    else if( !strcmp(dta, name) ) {
+        ack = true;
+    }
 
-    if( !(status = ofono_get_modem_status(modem)) )
-        goto EXIT;
+    dbus_error_free(&err);
 
-    if( !strcmp(status, "roaming") )
-        roaming = true;
+    return ack;
+}
 
-EXIT:
-    g_free(status);
-    g_free(modem);
+/** Parse PropertyChanged signal
+ *
+ * @param msg  D-Bus signal message
+ * @param key  Where to store property name
+ * @param var  Where to store iterator for property value
+ *
+ * @return true on success, false otherwise
+ */
+static bool
+network_ipc_parse_property_changed(DBusMessage *msg, const char **key,
+                                   DBusMessageIter *var)
+{
+    LOG_REGISTER_CONTEXT;
 
-    log_warning("modem roaming = %d", roaming);
+    DBusMessageIter body;
 
-    return roaming;
+    return (umdbus_parser_init(&body, msg) &&
+            umdbus_parser_get_string(&body, key) &&
+            umdbus_parser_get_variant(&body, var));
 }
-#endif /* OFONO */
+#endif /* OFONO || CONNMAN */
 
 /* ========================================================================= *
- * CONNMAN
+ * OFONO
  * ========================================================================= */
 
-#ifdef CONNMAN
-# define CONNMAN_SERVICE                "net.connman"
-# define CONNMAN_TECH_INTERFACE         "net.connman.Technology"
-# define CONNMAN_ERROR_ALREADY_ENABLED  "net.connman.Error.AlreadyEnabled"
-# define CONNMAN_ERROR_ALREADY_DISABLED "net.connman.Error.AlreadyDisabled"
+#ifdef OFONO
+# define OFONO_SERVICE                  "org.ofono"
+# define OFONO_MANAGER_INTERFACE        "org.ofono.Manager"
+# define OFONO_NETREG_INTERFACE         "org.ofono.NetworkRegistration"
+# define OFONO_MODEM_ADDED_SIG          "ModemAdded"
+# define OFONO_MODEM_REMOVED_SIG        "ModemRemoved"
+# define OFONO_PROPERTY_CHANGED_SIG     "PropertyChanged"
+
+# define OFONO_NAME_OWNER_CHANGED_MATCH\
+     "type='signal'"\
+     ",interface='"DBUS_INTERFACE_DBUS"'"\
+     ",member='"DBUS_NAME_OWNER_CHANGED_SIG"'"\
+     ",arg0='"OFONO_SERVICE"'"
+
+# define OFONO_MANAGER_MATCH\
+     "type='signal'"\
+     ",sender='"OFONO_SERVICE"'"\
+     ",interface='"OFONO_MANAGER_INTERFACE"'"
+
+# define OFONO_NETREG_MATCH\
+     "type='signal'"\
+     ",sender='"OFONO_SERVICE"'"\
+     ",interface='"OFONO_NETREG_INTERFACE"'"\
+     ",member='"OFONO_PROPERTY_CHANGED_SIG"'"
 
 /* ------------------------------------------------------------------------- *
- * TECHNOLOGY interface
+ * Roaming status
  * ------------------------------------------------------------------------- */
 
-/** Configures tethering for the specified connman technology.
+/** Update cached registration status of the default modem
  *
- * @param con         D-Bus connection
- * @param technology  D-Bus object path
- * @param on          true to enable tethering, false to disable
- * @param err         Where to store D-Bus ipc error
+ * @param status  ofono registration status, or NULL
+ */
+static void
+ofono_status_changed(const char *status)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool roaming = !g_strcmp0(status, "roaming");
+    bool changed = false;
+
+    NETWORK_STATE_LOCKED_ENTER;
+    if( ofono_roaming != roaming ) {
+        ofono_roaming = roaming;
+        changed = true;
+    }
+    NETWORK_STATE_LOCKED_LEAVE;
+
+    if( changed ) {
+        log_debug("modem status = %s -> roaming = %d",
+                  status ?: "n/a", roaming);
+        network_state_changed();
+    }
+}
+
+/** Handle reply to NetworkRegistration.GetProperties query
  *
- * @return true on success, false otherwise
+ * @param pc    Pending call object
+ * @param aptr  (unused)
  */
-static bool
-connman_technology_set_tethering(DBusConnection *con, const char *technology, bool on,
-                                 DBusError *err)
+static void
+ofono_status_query_cb(DBusPendingCall *pc, void *aptr)
 {
     LOG_REGISTER_CONTEXT;
 
-    bool         res = FALSE;
-    DBusMessage *rsp = 0;
-    const char  *key = "Tethering";
-    dbus_bool_t  val = on;
+    (void)aptr;
 
-    rsp = umdbus_blocking_call(con,
-                               CONNMAN_SERVICE,
-                               technology,
-                               CONNMAN_TECH_INTERFACE,
-                               "SetProperty",
-                               err,
-                               DBUS_TYPE_STRING, &key,
-                               DBUS_TYPE_VARIANT,
-                               DBUS_TYPE_BOOLEAN, &val,
-                               DBUS_TYPE_INVALID);
+    const char  *status = 0;
+    DBusMessage *rsp    = network_ipc_get_reply(pc, OFONO_NETREG_INTERFACE
+                                                ".GetProperties");
 
-    if( !rsp ) {
-        if( on ) {
-            if( !g_strcmp0(err->name, CONNMAN_ERROR_ALREADY_ENABLED) )
-                goto SUCCESS;
-        }
-        else {
-            if( !g_strcmp0(err->name, CONNMAN_ERROR_ALREADY_DISABLED) )
-                goto SUCCESS;
+    DBusMessageIter body, iter_array, entry, var;
+    if( umdbus_parser_init(&body, rsp) &&
+        umdbus_parser_get_array(&body, &iter_array) ) {
+        while( umdbus_parser_get_entry(&iter_array, &entry) ) {
+            const char *key = 0;
+            if( !umdbus_parser_get_string(&entry, &key) )
+                break;
+            if( strcmp(key, "Status") )
+                continue;
+            if( umdbus_parser_get_variant(&entry, &var) )
+                umdbus_parser_get_string(&var, &status);
+            break;
         }
-        log_err("%s.%s method call failed: %s: %s",
-                CONNMAN_TECH_INTERFACE, "SetProperty",
-                err->name, err->message);
-        goto FAILURE;
     }
 
-SUCCESS:
-    log_debug("%s tethering %s", technology, on ? "on" : "off");
-    dbus_error_free(err);
-    res = TRUE;
+    ofono_status_changed(status);
 
-FAILURE:
     if( rsp )
         dbus_message_unref(rsp);
 
-    return res;
+    dbus_pending_call_unref(ofono_status_pc),
+        ofono_status_pc = 0;
 }
 
-/* ------------------------------------------------------------------------- *
- * MANAGER interface
- * ------------------------------------------------------------------------- */
+/** Query registration status of the default modem
+ */
+static void
+ofono_status_query(void)
+{
+    LOG_REGISTER_CONTEXT;
 
-/** Get object path for the 1st service matching given type
- *
- * Caller must release the returned string with g_free().
- *
- * @param type  Connman service type string
+    network_ipc_cancel(&ofono_status_pc);
+
+    if( ofono_modem )
+        network_ipc_call_async(OFONO_SERVICE, ofono_modem,
+                               OFONO_NETREG_INTERFACE, "GetProperties",
+                               ofono_status_query_cb, &ofono_status_pc);
+}
+
+/** Handle NetworkRegistration.PropertyChanged signal
  *
- * @return D-Bus object path, or NULL
+ * @param msg  D-Bus signal message
  */
-static gchar *
-connman_manager_get_service_path(DBusConnection *con, const char *type)
+static void
+ofono_status_signal(DBusMessage *msg)
 {
     LOG_REGISTER_CONTEXT;
 
-    gchar          *service = 0;
-    DBusError       err   = DBUS_ERROR_INIT;
-    DBusMessage    *rsp   = 0;
+    const char     *key    = 0;
+    const char     *status = 0;
+    DBusMessageIter var;
 
-    rsp = umdbus_blocking_call(con,
-                               "net.connman",
-                               "/",
-                               "net.connman.Manager",
-                               "GetServices",
-                               &err,
-                               DBUS_TYPE_INVALID);
-    if( !rsp )
+    if( g_strcmp0(dbus_message_get_path(msg), ofono_modem) )
         goto EXIT;
 
-    // a(oa{sv}) -> get object path in the first struct matching given type
-    DBusMessageIter body;
-    if( umdbus_parser_init(&body, rsp) ) {
-        // @ body
-        DBusMessageIter array_of_structs;
-        if( umdbus_parser_get_array(&body, &array_of_structs) ) {
-            // @ array of structs
-            DBusMessageIter astruct;
-            while( umdbus_parser_get_struct(&array_of_structs, &astruct) ) {
-                // @ struct
-                const char *object = 0;
-                if( !umdbus_parser_get_object(&astruct, &object) )
-                    break;
-                DBusMessageIter array_of_entries;
-                if( !umdbus_parser_get_array(&astruct, &array_of_entries) )
-                    break;
-                // @ array of dict entries
-                DBusMessageIter entry;
-                while( umdbus_parser_get_entry(&array_of_entries, &entry) ) {
-                    // @ dict entry
-                    const char *key = 0;
-                    if( !umdbus_parser_get_string(&entry, &key) )
-                        break;
-                    if( strcmp(key, "Type") )
-                        continue;
-                    DBusMessageIter var;
-                    if( !umdbus_parser_get_variant(&entry, &var) )
-                        break;
-                    const char *value = 0;
-                    if( !umdbus_parser_get_string(&var, &value) )
-                        break;
-                    if( strcmp(value, type) )
-                        continue;
-                    service = g_strdup(object);
-                    goto EXIT;
-                }
-            }
-        }
-    }
+    if( !network_ipc_parse_property_changed(msg, &key, &var) )
+        goto EXIT;
 
-EXIT:
-    if( rsp )
-        dbus_message_unref(rsp);
+    if( strcmp(key, "Status") )
+        goto EXIT;
 
-    dbus_error_free(&err);
+    /* Newer status makes pending query obsolete */
+    network_ipc_cancel(&ofono_status_pc);
 
-    log_warning("%s service = %s", type, service ?: "n/a");
+    if( umdbus_parser_get_string(&var, &status) )
+        ofono_status_changed(status);
 
-    return service;
+EXIT:
+    return;
 }
 
-/** Query ipforwarding parameters from connman
- *
- * @param con         D-Bus connection
- * @param service     D-Bus object path
- * @param ipforward   ipforward object to fill in
+/* ------------------------------------------------------------------------- *
+ * Default modem
+ * ------------------------------------------------------------------------- */
+
+/** Update cached default modem object path
  *
- * @return true on success, false otherwise
+ * @param modem  D-Bus object path, or NULL
  */
-static bool
-connman_service_get_connection_data(DBusConnection *con,
-                                    const char *service,
-                                    ipforward_data_t *ipforward)
+static void
+ofono_modem_changed(const char *modem)
 {
     LOG_REGISTER_CONTEXT;
 
-    bool            ack   = false;
-    DBusMessage    *rsp   = NULL;
-    DBusError       err   = DBUS_ERROR_INIT;
+    if( !g_strcmp0(ofono_modem, modem) )
+        goto EXIT;
 
-    log_debug("Filling in dns data");
+    log_debug("default modem = %s", modem ?: "n/a");
 
-    rsp = umdbus_blocking_call(con,
-                               "net.connman",
-                               service,
-                               "net.connman.Service",
-                               "GetProperties",
-                               &err,
-                               DBUS_TYPE_INVALID);
-    if( !rsp )
-        goto EXIT;
+    NETWORK_STATE_LOCKED_ENTER;
+    g_free(ofono_modem), ofono_modem = g_strdup(modem);
+    NETWORK_STATE_LOCKED_LEAVE;
 
-    const char *dns1 = 0;
-    const char *dns2 = 0;
-    const char *state = 0;
-    const char *interface = 0;
+    /* Forget status of the previous modem */
+    network_ipc_cancel(&ofono_status_pc);
+    ofono_status_changed(0);
 
-    DBusMessageIter body;
-    if( umdbus_parser_init(&body, rsp) ) {
-        // @ body
-        DBusMessageIter array_of_entries;
-        if( umdbus_parser_get_array(&body, &array_of_entries) ) {
-            // @ array of entries
-            DBusMessageIter entry;
-            while( umdbus_parser_get_entry(&array_of_entries, &entry) ) {
-                // @ dict entry
-                const char *key = 0;
-                if( !umdbus_parser_get_string(&entry, &key) )
-                    break;
-                DBusMessageIter var;
-                if( !umdbus_parser_get_variant(&entry, &var) )
-                    break;
+    ofono_status_query();
 
-                if( !strcmp(key, "Nameservers"))
-                {
-                    DBusMessageIter array_of_strings;
-                    if( umdbus_parser_get_array(&var, &array_of_strings) ) {
-                        // expect 0, 1, or 2 entries
-                        if( !umdbus_parser_at_end(&array_of_strings) )
-                            umdbus_parser_get_string(&array_of_strings, &dns1);
-                        if( !umdbus_parser_at_end(&array_of_strings) )
-                            umdbus_parser_get_string(&array_of_strings, &dns2);
-                    }
-                }
-                else if( !strcmp(key, "State"))
-                {
-                    umdbus_parser_get_string(&var, &state);
-                }
-                else if( !strcmp(key, "Ethernet"))
-                {
-                    DBusMessageIter array_of_en_entries;
-                    if( umdbus_parser_get_array(&var, &array_of_en_entries) ) {
-                        DBusMessageIter en_entry;
-                        while( umdbus_parser_get_entry(&array_of_en_entries, &en_entry) ) {
-                            const char *en_key = 0;
-                            if( !umdbus_parser_get_string(&en_entry, &en_key) )
-                                break;
-                            if( strcmp(en_key, "Interface") )
-                                continue;
-                            DBusMessageIter en_var;
-                            if( umdbus_parser_get_variant(&en_entry, &en_var) )
-                                umdbus_parser_get_string(&en_var, &interface);
-                        }
-                    }
-                }
+EXIT:
+    return;
+}
+
+/** Handle reply to Manager.GetModems query
+ *
+ * @param pc    Pending call object
+ * @param aptr  (unused)
+ */
+static void
+ofono_modems_query_cb(DBusPendingCall *pc, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    const char  *modem = 0;
+    DBusMessage *rsp   = network_ipc_get_reply(pc, OFONO_MANAGER_INTERFACE
+                                               ".GetModems");
+
+    // a(oa{sv}) -> get object path in the first struct in the array
+    DBusMessageIter body, iter_array, astruct;
+    if( umdbus_parser_init(&body, rsp) &&
+        umdbus_parser_get_array(&body, &iter_array) &&
+        umdbus_parser_get_struct(&iter_array, &astruct) )
+        umdbus_parser_get_object(&astruct, &modem);
+
+    ofono_modem_changed(modem);
+
+    if( rsp )
+        dbus_message_unref(rsp);
+
+    dbus_pending_call_unref(ofono_modems_pc),
+        ofono_modems_pc = 0;
+}
+
+/** Query modems known to ofono
+ */
+static void
+ofono_modems_query(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    network_ipc_cancel(&ofono_modems_pc);
+
+    network_ipc_call_async(OFONO_SERVICE, "/",
+                           OFONO_MANAGER_INTERFACE, "GetModems",
+                           ofono_modems_query_cb, &ofono_modems_pc);
+}
+
+/** Handle Manager.ModemAdded and Manager.ModemRemoved signals
+ *
+ * @param msg    D-Bus signal message
+ * @param added  true if modem was added, false if removed
+ */
+static void
+ofono_modems_signal(DBusMessage *msg, bool added)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char     *modem = 0;
+    DBusMessageIter body;
+
+    if( !umdbus_parser_init(&body, msg) ||
+        !umdbus_parser_get_object(&body, &modem) )
+        goto EXIT;
+
+    if( added ) {
+        /* The 1st modem becomes the default one */
+        if( !ofono_modem && !ofono_modems_pc )
+            ofono_modem_changed(modem);
+    }
+    else if( !g_strcmp0(ofono_modem, modem) ) {
+        /* Fall back to whatever is still available */
+        ofono_modem_changed(0);
+        ofono_modems_query();
+    }
+
+EXIT:
+    return;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Name owner tracking
+ * ------------------------------------------------------------------------- */
+
+/** Update ofono availability
+ *
+ * @param owner  Current owner of ofono D-Bus name, or NULL/empty
+ */
+static void
+ofono_available_changed(const char *owner)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool is_available = (owner && *owner);
+
+    if( ofono_is_available == is_available )
+        goto EXIT;
+
+    ofono_is_available = is_available;
+    log_debug("ofono is %s", ofono_is_available ? "running" : "stopped");
+
+    /* Forget cached modem state */
+    network_ipc_cancel(&ofono_modems_pc);
+    ofono_modem_changed(0);
+
+    /* Query current state on ofono startup */
+    if( ofono_is_available )
+        ofono_modems_query();
+
+EXIT:
+    return;
+}
+
+/** Handle reply to ofono name owner query
+ *
+ * @param owner  Current owner of ofono D-Bus name
+ */
+static void
+ofono_available_cb(const char *owner)
+{
+    LOG_REGISTER_CONTEXT;
+
+    ofono_available_changed(owner);
+
+    dbus_pending_call_unref(ofono_available_pc),
+        ofono_available_pc = 0;
+}
+
+/** Query ofono availability
+ */
+static void
+ofono_available_query(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    network_ipc_cancel(&ofono_available_pc);
+
+    umdbus_get_name_owner_async(OFONO_SERVICE, ofono_available_cb,
+                                &ofono_available_pc);
+}
+
+/* ------------------------------------------------------------------------- *
+ * USB-MODED interface
+ * ------------------------------------------------------------------------- */
+
+/** Get roaming data from ofono
+ *
+ * Note: This function is safe to call from any thread, the
+ *       cached state is updated by ofono signals.
+ *
+ * @return true if roaming, false when not (or when ofono is unavailable)
+ */
+static bool
+ofono_get_roaming_status(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    NETWORK_STATE_LOCKED_ENTER;
+    bool roaming = ofono_roaming;
+    NETWORK_STATE_LOCKED_LEAVE;
+
+    log_debug("modem roaming = %d", roaming);
+
+    return roaming;
+}
+
+/** Stop tracking ofono state
+ */
+static void
+ofono_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    network_ipc_cancel(&ofono_available_pc);
+    network_ipc_cancel(&ofono_modems_pc);
+    network_ipc_cancel(&ofono_status_pc);
+
+    NETWORK_STATE_LOCKED_ENTER;
+    g_free(ofono_modem), ofono_modem = 0;
+    ofono_roaming = false;
+    NETWORK_STATE_LOCKED_LEAVE;
+
+    ofono_is_available = false;
+}
+#endif /* OFONO */
+
+/* ========================================================================= *
+ * CONNMAN
+ * ========================================================================= */
+
+#ifdef CONNMAN
+# define CONNMAN_SERVICE                "net.connman"
+# define CONNMAN_TECH_INTERFACE         "net.connman.Technology"
+# define CONNMAN_ERROR_ALREADY_ENABLED  "net.connman.Error.AlreadyEnabled"
+# define CONNMAN_ERROR_ALREADY_DISABLED "net.connman.Error.AlreadyDisabled"
+# define CONNMAN_MANAGER_INTERFACE      "net.connman.Manager"
+# define CONNMAN_SERVICE_INTERFACE      "net.connman.Service"
+# define CONNMAN_SERVICES_CHANGED_SIG   "ServicesChanged"
+# define CONNMAN_PROPERTY_CHANGED_SIG   "PropertyChanged"
+
+# define CONNMAN_NAME_OWNER_CHANGED_MATCH\
+     "type='signal'"\
+     ",interface='"DBUS_INTERFACE_DBUS"'"\
+     ",member='"DBUS_NAME_OWNER_CHANGED_SIG"'"\
+     ",arg0='"CONNMAN_SERVICE"'"
+
+# define CONNMAN_MANAGER_MATCH\
+     "type='signal'"\
+     ",sender='"CONNMAN_SERVICE"'"\
+     ",interface='"CONNMAN_MANAGER_INTERFACE"'"\
+     ",member='"CONNMAN_SERVICES_CHANGED_SIG"'"
+
+# define CONNMAN_SERVICE_MATCH\
+     "type='signal'"\
+     ",sender='"CONNMAN_SERVICE"'"\
+     ",interface='"CONNMAN_SERVICE_INTERFACE"'"\
+     ",member='"CONNMAN_PROPERTY_CHANGED_SIG"'"
+
+/* ------------------------------------------------------------------------- *
+ * TECHNOLOGY interface
+ * ------------------------------------------------------------------------- */
+
+/** Configures tethering for the specified connman technology.
+ *
+ * @param con         D-Bus connection
+ * @param technology  D-Bus object path
+ * @param on          true to enable tethering, false to disable
+ * @param err         Where to store D-Bus ipc error
+ *
+ * @return true on success, false otherwise
+ */
+static bool
+connman_technology_set_tethering(DBusConnection *con, const char *technology, bool on,
+                                 DBusError *err)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool         res = FALSE;
+    DBusMessage *rsp = 0;
+    const char  *key = "Tethering";
+    dbus_bool_t  val = on;
+
+    rsp = umdbus_blocking_call(con,
+                               CONNMAN_SERVICE,
+                               technology,
+                               CONNMAN_TECH_INTERFACE,
+                               "SetProperty",
+                               err,
+                               DBUS_TYPE_STRING, &key,
+                               DBUS_TYPE_VARIANT,
+                               DBUS_TYPE_BOOLEAN, &val,
+                               DBUS_TYPE_INVALID);
+
+    if( !rsp ) {
+        if( on ) {
+            if( !g_strcmp0(err->name, CONNMAN_ERROR_ALREADY_ENABLED) )
+                goto SUCCESS;
+        }
+        else {
+            if( !g_strcmp0(err->name, CONNMAN_ERROR_ALREADY_DISABLED) )
+                goto SUCCESS;
+        }
+        log_err("%s.%s method call failed: %s: %s",
+                CONNMAN_TECH_INTERFACE, "SetProperty",
+                err->name, err->message);
+        goto FAILURE;
+    }
+
+SUCCESS:
+    log_debug("%s tethering %s", technology, on ? "on" : "off");
+    dbus_error_free(err);
+    res = TRUE;
+
+FAILURE:
+    if( rsp )
+        dbus_message_unref(rsp);
+
+    return res;
+}
+
+/* ------------------------------------------------------------------------- *
+ * SERVICE object
+ * ------------------------------------------------------------------------- */
+
+/** Create cached connman service object
+ *
+ * @param path  D-Bus object path of the service
+ *
+ * @return service object
+ */
+static connman_service_t *
+connman_service_create(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    connman_service_t *self = g_malloc0(sizeof *self);
+
+    self->cs_path = g_strdup(path);
+
+    return self;
+}
+
+/** Delete cached connman service object
+ *
+ * @param self  service object, or NULL
+ */
+static void
+connman_service_delete(connman_service_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self ) {
+        g_free(self->cs_path);
+        g_free(self->cs_type);
+        g_free(self->cs_state);
+        g_free(self->cs_dns1);
+        g_free(self->cs_dns2);
+        g_free(self->cs_interface);
+        g_free(self);
+    }
+}
+
+/** Predicate for: service has connection data usable for nat
+ *
+ * @param self  service object
+ *
+ * @return true if service is connected, false otherwise
+ */
+static bool
+connman_service_is_connected(const connman_service_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool connected = (!g_strcmp0(self->cs_state, "ready") ||
+                      !g_strcmp0(self->cs_state, "online"));
+
+    return connected && self->cs_dns1 && self->cs_interface;
+}
+
+/** Update cached service property
+ *
+ * @note Assumes that network state data is already locked.
+ *
+ * @param self  service object
+ * @param key   property name
+ * @param var   iterator pointing to property value
+ */
+static void
+connman_service_set_property_locked(connman_service_t *self, const char *key,
+                                    DBusMessageIter *var)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *str = 0;
+
+    if( !strcmp(key, "Type") ) {
+        if( umdbus_parser_get_string(var, &str) )
+            g_free(self->cs_type), self->cs_type = g_strdup(str);
+    }
+    else if( !strcmp(key, "State") ) {
+        if( umdbus_parser_get_string(var, &str) )
+            g_free(self->cs_state), self->cs_state = g_strdup(str);
+    }
+    else if( !strcmp(key, "Nameservers") ) {
+        const char *dns1 = 0;
+        const char *dns2 = 0;
+        DBusMessageIter array_of_strings;
+        if( umdbus_parser_get_array(var, &array_of_strings) ) {
+            // expect 0, 1, or 2 entries
+            if( !umdbus_parser_at_end(&array_of_strings) )
+                umdbus_parser_get_string(&array_of_strings, &dns1);
+            if( !umdbus_parser_at_end(&array_of_strings) )
+                umdbus_parser_get_string(&array_of_strings, &dns2);
+        }
+        g_free(self->cs_dns1), self->cs_dns1 = g_strdup(dns1);
+        g_free(self->cs_dns2), self->cs_dns2 = g_strdup(dns2);
+    }
+    else if( !strcmp(key, "Ethernet") ) {
+        DBusMessageIter array_of_en_entries;
+        if( umdbus_parser_get_array(var, &array_of_en_entries) ) {
+            DBusMessageIter en_entry;
+            while( umdbus_parser_get_entry(&array_of_en_entries, &en_entry) ) {
+                const char *en_key = 0;
+                if( !umdbus_parser_get_string(&en_entry, &en_key) )
+                    break;
+                if( strcmp(en_key, "Interface") )
+                    continue;
+                DBusMessageIter en_var;
+                if( umdbus_parser_get_variant(&en_entry, &en_var) &&
+                    umdbus_parser_get_string(&en_var, &str) )
+                    g_free(self->cs_interface),
+                        self->cs_interface = g_strdup(str);
             }
         }
     }
+}
+
+/** Update cached service properties from a{sv} dictionary
+ *
+ * @note Assumes that network state data is already locked.
+ *
+ * @param self              service object
+ * @param array_of_entries  iterator pointing inside the dictionary
+ */
+static void
+connman_service_update_locked(connman_service_t *self,
+                              DBusMessageIter *array_of_entries)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusMessageIter entry;
+    while( umdbus_parser_get_entry(array_of_entries, &entry) ) {
+        const char *key = 0;
+        if( !umdbus_parser_get_string(&entry, &key) )
+            break;
+        DBusMessageIter var;
+        if( !umdbus_parser_get_variant(&entry, &var) )
+            break;
+        connman_service_set_property_locked(self, key, &var);
+    }
+}
+
+/* ------------------------------------------------------------------------- *
+ * SERVICES list
+ * ------------------------------------------------------------------------- */
+
+/** Remove service from cached services list
+ *
+ * @note Assumes that network state data is already locked.
+ *
+ * @param path  D-Bus object path of the service
+ *
+ * @return service object, or NULL if not found
+ */
+static connman_service_t *
+connman_services_steal_locked(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( guint i = 0; connman_services && i < connman_services->len; ++i ) {
+        connman_service_t *service = g_ptr_array_index(connman_services, i);
+        if( !strcmp(service->cs_path, path) ) {
+            g_ptr_array_remove_index(connman_services, i);
+            return service;
+        }
+    }
+    return 0;
+}
+
+/** Find service from cached services list
+ *
+ * @note Assumes that network state data is already locked.
+ *
+ * @param path  D-Bus object path of the service
+ *
+ * @return service object, or NULL if not found
+ */
+static connman_service_t *
+connman_services_find_locked(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( guint i = 0; connman_services && i < connman_services->len; ++i ) {
+        connman_service_t *service = g_ptr_array_index(connman_services, i);
+        if( !strcmp(service->cs_path, path) )
+            return service;
+    }
+    return 0;
+}
+
+/** Forget all cached services
+ *
+ * @note Assumes that network state data is already locked.
+ */
+static void
+connman_services_clear_locked(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( connman_services ) {
+        for( guint i = 0; i < connman_services->len; ++i )
+            connman_service_delete(g_ptr_array_index(connman_services, i));
+        g_ptr_array_free(connman_services, TRUE), connman_services = 0;
+    }
+}
+
+/** Update cached services list from a(oa{sv}) array
+ *
+ * Services are stored in the order they appear in the array, services
+ * that are not mentioned retain their properties and are moved after
+ * the mentioned ones.
+ *
+ * @note Assumes that network state data is already locked.
+ *
+ * @param array_of_structs  iterator pointing inside the array
+ */
+static void
+connman_services_update_locked(DBusMessageIter *array_of_structs)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GPtrArray *ordered = g_ptr_array_new();
+
+    DBusMessageIter astruct;
+    while( umdbus_parser_get_struct(array_of_structs, &astruct) ) {
+        const char *path = 0;
+        if( !umdbus_parser_get_object(&astruct, &path) )
+            break;
+        DBusMessageIter array_of_entries;
+        if( !umdbus_parser_get_array(&astruct, &array_of_entries) )
+            break;
+
+        connman_service_t *service = connman_services_steal_locked(path);
+        if( !service )
+            service = connman_service_create(path);
+        connman_service_update_locked(service, &array_of_entries);
+        g_ptr_array_add(ordered, service);
+    }
+
+    if( connman_services ) {
+        for( guint i = 0; i < connman_services->len; ++i )
+            g_ptr_array_add(ordered, g_ptr_array_index(connman_services, i));
+        g_ptr_array_free(connman_services, TRUE);
+    }
+    connman_services = ordered;
+}
+
+/** Choose service that provides connection data for nat
+ *
+ * The 1st cellular service is used if it is connected, otherwise
+ * the 1st wifi service is used if it is connected.
+ *
+ * @note Assumes that network state data is already locked.
+ *
+ * @return service object, or NULL
+ */
+static const connman_service_t *
+connman_services_select_locked(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const char * const types[] = { "cellular", "wifi", 0 };
+
+    for( size_t t = 0; types[t]; ++t ) {
+        for( guint i = 0; connman_services && i < connman_services->len; ++i ) {
+            const connman_service_t *service =
+                g_ptr_array_index(connman_services, i);
+            if( g_strcmp0(service->cs_type, types[t]) )
+                continue;
+            if( connman_service_is_connected(service) )
+                return service;
+            log_debug("%s service %s is not connected: state=%s",
+                      types[t], service->cs_path,
+                      service->cs_state ?: "n/a");
+            break;
+        }
+    }
+    return 0;
+}
+
+/** Notify about changes in connection data relevant for nat
+ *
+ * Called after cached services have been updated.
+ */
+static void
+connman_services_changed(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *connection = 0;
+
+    NETWORK_STATE_LOCKED_ENTER;
+    const connman_service_t *service = connman_services_select_locked();
+    if( service )
+        connection = g_strdup_printf("%s %s %s", service->cs_interface,
+                                     service->cs_dns1,
+                                     service->cs_dns2 ?: "-");
+    NETWORK_STATE_LOCKED_LEAVE;
+
+    if( g_strcmp0(connman_connection, connection) ) {
+        log_debug("connection data: %s -> %s",
+                  connman_connection ?: "n/a", connection ?: "n/a");
+        g_free(connman_connection), connman_connection = connection,
+            connection = 0;
+        network_state_changed();
+    }
+
+    g_free(connection);
+}
+
+/* ------------------------------------------------------------------------- *
+ * MANAGER interface
+ * ------------------------------------------------------------------------- */
 
-    bool connected = (!g_strcmp0(state, "ready") ||
-                      !g_strcmp0(state, "online"));
+/** Handle reply to Manager.GetServices query
+ *
+ * @param pc    Pending call object
+ * @param aptr  (unused)
+ */
+static void
+connman_services_query_cb(DBusPendingCall *pc, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
 
-    log_debug("state = %s", state ?: "n/a");
-    log_debug("connected = %s", connected ? "true" : "false");
-    log_debug("interface = %s", interface ?: "n/a");
-    log_debug("dns1 = %s", dns1 ?: "n/a");
-    log_debug("dns2 = %s", dns2 ?: "n/a");
+    (void)aptr;
 
-    if( !dns1 || !interface || !connected )
-        goto EXIT;
+    DBusMessage *rsp = network_ipc_get_reply(pc, CONNMAN_MANAGER_INTERFACE
+                                             ".GetServices");
 
-    ipforward_data_set_dns1(ipforward, dns1);
-    ipforward_data_set_dns2(ipforward, dns2 ?: dns1);
-    ipforward_data_set_nat_interface(ipforward, interface);
+    NETWORK_STATE_LOCKED_ENTER;
+    connman_services_clear_locked();
+    DBusMessageIter body, array_of_structs;
+    if( umdbus_parser_init(&body, rsp) &&
+        umdbus_parser_get_array(&body, &array_of_structs) )
+        connman_services_update_locked(&array_of_structs);
+    NETWORK_STATE_LOCKED_LEAVE;
 
-    ack = true;
+    connman_services_changed();
 
-EXIT:
     if( rsp )
         dbus_message_unref(rsp);
 
-    dbus_error_free(&err);
+    dbus_pending_call_unref(connman_services_pc),
+        connman_services_pc = 0;
+}
 
-    return ack;
+/** Query services known to connman
+ */
+static void
+connman_services_query(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    network_ipc_cancel(&connman_services_pc);
+
+    network_ipc_call_async(CONNMAN_SERVICE, "/",
+                           CONNMAN_MANAGER_INTERFACE, "GetServices",
+                           connman_services_query_cb, &connman_services_pc);
+}
+
+/** Handle Manager.ServicesChanged signal
+ *
+ * @param msg  D-Bus signal message
+ */
+static void
+connman_services_signal(DBusMessage *msg)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* Changes are relative to full services list */
+    if( connman_services_pc )
+        goto EXIT;
+
+    DBusMessageIter body, array_of_structs, array_of_paths;
+    if( !umdbus_parser_init(&body, msg) ||
+        !umdbus_parser_get_array(&body, &array_of_structs) ||
+        !umdbus_parser_get_array(&body, &array_of_paths) )
+        goto EXIT;
+
+    NETWORK_STATE_LOCKED_ENTER;
+    const char *path = 0;
+    while( umdbus_parser_get_object(&array_of_paths, &path) )
+        connman_service_delete(connman_services_steal_locked(path));
+    connman_services_update_locked(&array_of_structs);
+    NETWORK_STATE_LOCKED_LEAVE;
+
+    connman_services_changed();
+
+EXIT:
+    return;
+}
+
+/** Handle Service.PropertyChanged signal
+ *
+ * @param msg  D-Bus signal message
+ */
+static void
+connman_service_signal(DBusMessage *msg)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char     *key = 0;
+    DBusMessageIter var;
+
+    if( !network_ipc_parse_property_changed(msg, &key, &var) )
+        goto EXIT;
+
+    NETWORK_STATE_LOCKED_ENTER;
+    connman_service_t *service =
+        connman_services_find_locked(dbus_message_get_path(msg));
+    if( service )
+        connman_service_set_property_locked(service, key, &var);
+    NETWORK_STATE_LOCKED_LEAVE;
+
+    if( service )
+        connman_services_changed();
+
+EXIT:
+    return;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Name owner tracking
+ * ------------------------------------------------------------------------- */
+
+/** Update connman availability
+ *
+ * @param owner  Current owner of connman D-Bus name, or NULL/empty
+ */
+static void
+connman_available_changed(const char *owner)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool is_available = (owner && *owner);
+
+    if( connman_is_available == is_available )
+        goto EXIT;
+
+    connman_is_available = is_available;
+    log_debug("connman is %s", connman_is_available ? "running" : "stopped");
+
+    /* Forget cached services */
+    network_ipc_cancel(&connman_services_pc);
+    NETWORK_STATE_LOCKED_ENTER;
+    connman_services_clear_locked();
+    NETWORK_STATE_LOCKED_LEAVE;
+    connman_services_changed();
+
+    /* Query current state on connman startup */
+    if( connman_is_available )
+        connman_services_query();
+
+EXIT:
+    return;
+}
+
+/** Handle reply to connman name owner query
+ *
+ * @param owner  Current owner of connman D-Bus name
+ */
+static void
+connman_available_cb(const char *owner)
+{
+    LOG_REGISTER_CONTEXT;
+
+    connman_available_changed(owner);
+
+    dbus_pending_call_unref(connman_available_pc),
+        connman_available_pc = 0;
+}
+
+/** Query connman availability
+ */
+static void
+connman_available_query(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    network_ipc_cancel(&connman_available_pc);
+
+    umdbus_get_name_owner_async(CONNMAN_SERVICE, connman_available_cb,
+                                &connman_available_pc);
 }
 
 /* ------------------------------------------------------------------------- *
  * USB-MODED interface
  * ------------------------------------------------------------------------- */
 
-/** Query ipforwarding parameters from connman
+/** Get ipforwarding parameters from cached connman state
+ *
+ * Note: This function is safe to call from any thread, the
+ *       cached state is updated by connman signals.
  *
  * @param ipforward   ipforward object to fill in
  *
@@ -645,45 +1566,47 @@ connman_get_connection_data(ipforward_data_t *ipforward)
 {
     LOG_REGISTER_CONTEXT;
 
-    bool            ack      = false;
-    DBusConnection *con      = 0;
-    gchar          *cellular = 0;
-    gchar          *wifi     = 0;
-
-    if( !(con = umdbus_get_connection()) )
-        goto FAILURE;
-
-    /* Try to get connection data from cellular service */
-    if( !(cellular = connman_manager_get_service_path(con, "cellular")) )
-        log_warning("no sellular service");
-    else if( connman_service_get_connection_data(con, cellular, ipforward) )
-        goto SUCCESS;
-
-    /* Try to get connection data from wifi service */
-    if( !(wifi = connman_manager_get_service_path(con, "wifi")) )
-        log_warning("no wifi service");
-    else if( connman_service_get_connection_data(con, wifi, ipforward) )
-        goto SUCCESS;
-
-    /* Abandon hope */
-    goto FAILURE;
+    bool ack = false;
 
-SUCCESS:
-    ack = true;
+    NETWORK_STATE_LOCKED_ENTER;
+    const connman_service_t *service = connman_services_select_locked();
+    if( service ) {
+        log_debug("%s service = %s", service->cs_type, service->cs_path);
+        log_debug("interface = %s", service->cs_interface);
+        log_debug("dns1 = %s", service->cs_dns1);
+        log_debug("dns2 = %s", service->cs_dns2 ?: "n/a");
+
+        ipforward_data_set_dns1(ipforward, service->cs_dns1);
+        ipforward_data_set_dns2(ipforward, service->cs_dns2 ?: service->cs_dns1);
+        ipforward_data_set_nat_interface(ipforward, service->cs_interface);
+        ack = true;
+    }
+    NETWORK_STATE_LOCKED_LEAVE;
 
-FAILURE:
     if( !ack )
         log_warning("no connection data");
     else
         log_debug("got connection data");
 
-    g_free(wifi);
-    g_free(cellular);
+    return ack;
+}
 
-    if( con )
-        dbus_connection_unref(con);
+/** Stop tracking connman state
+ */
+static void
+connman_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
 
-    return ack;
+    network_ipc_cancel(&connman_available_pc);
+    network_ipc_cancel(&connman_services_pc);
+
+    NETWORK_STATE_LOCKED_ENTER;
+    connman_services_clear_locked();
+    NETWORK_STATE_LOCKED_LEAVE;
+
+    g_free(connman_connection), connman_connection = 0;
+    connman_is_available = false;
 }
 
 /** Configures tethering for the specified connman technology.
@@ -794,6 +1717,69 @@ EXIT:
  * NETWORK
  * ========================================================================= */
 
+/** Release dynamic data held by network settings object
+ *
+ * @param self  network settings object
+ */
+static void
+network_settings_clear(network_settings_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_free(self->ns_interface), self->ns_interface = 0;
+    g_free(self->ns_address),   self->ns_address   = 0;
+    g_free(self->ns_netmask),   self->ns_netmask   = 0;
+    g_free(self->ns_gateway),   self->ns_gateway   = 0;
+}
+
+/** Copy network settings object
+ *
+ * @param self  network settings object to modify
+ * @param that  network settings object to copy from
+ */
+static void
+network_settings_copy(network_settings_t *self, const network_settings_t *that)
+{
+    LOG_REGISTER_CONTEXT;
+
+    network_settings_clear(self);
+    self->ns_interface = g_strdup(that->ns_interface);
+    self->ns_address   = g_strdup(that->ns_address);
+    self->ns_netmask   = g_strdup(that->ns_netmask);
+    self->ns_gateway   = g_strdup(that->ns_gateway);
+}
+
+/** Get copy of settings applied to the gadget interface
+ *
+ * @param settings  network settings object to fill in
+ */
+static void
+network_applied_get(network_settings_t *settings)
+{
+    LOG_REGISTER_CONTEXT;
+
+    NETWORK_APPLIED_LOCKED_ENTER;
+    network_settings_copy(settings, &network_applied);
+    NETWORK_APPLIED_LOCKED_LEAVE;
+}
+
+/** Remember settings applied to the gadget interface
+ *
+ * @param settings  network settings object, or NULL to forget
+ */
+static void
+network_applied_set(const network_settings_t *settings)
+{
+    LOG_REGISTER_CONTEXT;
+
+    NETWORK_APPLIED_LOCKED_ENTER;
+    if( settings )
+        network_settings_copy(&network_applied, settings);
+    else
+        network_settings_clear(&network_applied);
+    NETWORK_APPLIED_LOCKED_LEAVE;
+}
+
 /** This function checks if the configured interface exists
  *
  * @return true on success, false on failure
@@ -803,16 +1789,7 @@ network_interface_exists(char *interface)
 {
     LOG_REGISTER_CONTEXT;
 
-    bool ack = false;
-
-    if(interface)
-    {
-        char path[PATH_MAX];
-        snprintf(path, sizeof path, "/sys/class/net/%s", interface);
-        ack = (access(path, F_OK) == 0);
-    }
-
-    return ack;
+    return rtnl_link_exists(interface);
 }
 
 /** Get network interface to use
@@ -855,7 +1832,121 @@ network_get_interface(const modedata_t *data)
     return interface;
 }
 
+/** Wait for gadget network interface to appear
+ *
+ * Network interface of usb gadget function gets created some time
+ * after the gadget has been enabled. Rather than retrying interface
+ * configuration at fixed intervals, wait for rtnetlink to report
+ * that either configured or fallback interface is there.
+ *
+ * Only existence of the interface is waited for, it is brought up
+ * by #network_up().
+ *
+ * @param tot_ms  maximum time to wait [ms]
+ *
+ * @return true if interface exists, false otherwise
+ */
+bool
+network_wait_interface(unsigned tot_ms)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar      *setting   = config_get_network_setting(NETWORK_INTERFACE_KEY);
+    const char *ifnames[] = { default_interface, setting, 0 };
+    gint64      started   = g_get_monotonic_time();
+
+    bool ready = rtnl_wait_link(ifnames, tot_ms);
+
+    log_debug("wait for interface %s: %s in %d ms",
+              setting ?: default_interface,
+              ready ? "ready" : "not ready",
+              (int)((g_get_monotonic_time() - started) / 1000));
+
+    g_free(setting);
+
+    return ready;
+}
+
+/** Apply iptables rules as one batch
+ *
+ * Existing rules are left in place, except that user defined chains
+ * declared in the batch get flushed.
+ *
+ * @param rules  rules in iptables-save format
+ *
+ * @return true on success, false on failure
+ */
+static bool
+network_iptables_restore(const char *rules)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool    ack = false;
+    GError *err = 0;
+
+    /* /tmp and /run is often tmpfs, so we avoid writing to flash */
+    if( mkdir(UDHCP_CONFIG_DIR, 0775) == -1 && errno != EEXIST ) {
+        log_warning("%s: can't create directory: %m", UDHCP_CONFIG_DIR);
+    }
+
+    if( !g_file_set_contents(NAT_RULES_PATH, rules, -1, &err) ) {
+        log_err("%s: can't write: %s", NAT_RULES_PATH, err->message);
+        goto EXIT;
+    }
+
+    const char *argv[] = { "/sbin/iptables-restore", "--noflush", NAT_RULES_PATH, 0 };
+    ack = (exec_run(argv, EXEC_DEFAULT_TIMEOUT, 0) == 0);
+
+EXIT:
+    g_clear_error(&err);
+    return ack;
+}
+
+/** Check if built-in chain jumps to usb-moded NAT chain
+ *
+ * Probing is done only until the jump is known to exist. After
+ * that the cached state is used until #network_nat_forget_hooks().
+ *
+ * @param table   iptables table, e.g. "nat"
+ * @param chain   built-in chain, e.g. "POSTROUTING"
+ * @param target  usb-moded owned chain
+ * @param cached  where the outcome is cached
+ *
+ * @return true if jump exists, false otherwise
+ */
+static bool
+network_nat_chain_hooked(const char *table, const char *chain,
+                         const char *target, bool *cached)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !*cached ) {
+        const char *argv[] = {
+            "/sbin/iptables", "-t", table, "-C", chain, "-j", target, 0
+        };
+        *cached = (exec_run(argv, EXEC_DEFAULT_TIMEOUT, 0) == 0);
+    }
+
+    return *cached;
+}
+
+/** Forget cached state of jumps to usb-moded NAT chains
+ *
+ * Should be called when firewall rules are in unknown state, so
+ * that the jumps are probed again on the next setup.
+ */
+static void
+network_nat_forget_hooks(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    network_nat_postrouting_hooked = false;
+    network_nat_forward_hooked     = false;
+}
+
 /** Turn on ip forwarding on the usb interface
+ *
+ * NAT rules are installed as one batch into usb-moded owned chains.
  *
  * To cleanup: #network_cleanup_ip_forwarding()
  *
@@ -868,11 +1959,10 @@ network_setup_ip_forwarding(const modedata_t *data, ipforward_data_t *ipforward)
 {
     LOG_REGISTER_CONTEXT;
 
-    int   failed        = 1;
-    char *interface     = 0;
-    char *nat_interface = 0;
-
-    char command[256];
+    int      failed        = 1;
+    char    *interface     = 0;
+    char    *nat_interface = 0;
+    GString *rules         = 0;
 
     if( !(interface = network_get_interface(data)) )
         goto EXIT;
@@ -886,21 +1976,55 @@ network_setup_ip_forwarding(const modedata_t *data, ipforward_data_t *ipforward)
         nat_interface = strdup(ipforward->nat_interface);
     }
 
-    write_to_file("/proc/sys/net/ipv4/ip_forward", "1");
-
-    snprintf(command, sizeof command, "/sbin/iptables -t nat -A POSTROUTING -o %s -j MASQUERADE", nat_interface);
-    common_system(command);
+    /* Hooking up chains is done only when needed, so that repeated
+     * setup does not create duplicate jumps */
+    bool postrouting_hooked =
+        network_nat_chain_hooked("nat", "POSTROUTING", NAT_POSTROUTING_CHAIN,
+                                 &network_nat_postrouting_hooked);
+    bool forward_hooked =
+        network_nat_chain_hooked("filter", "FORWARD", NAT_FORWARD_CHAIN,
+                                 &network_nat_forward_hooked);
+
+    rules = g_string_new(0);
+
+    g_string_append(rules, "*nat\n");
+    g_string_append(rules, ":" NAT_POSTROUTING_CHAIN " - [0:0]\n");
+    g_string_append_printf(rules, "-A " NAT_POSTROUTING_CHAIN
+                           " -o %s -j MASQUERADE\n", nat_interface);
+    if( !postrouting_hooked )
+        g_string_append(rules, "-A POSTROUTING -j " NAT_POSTROUTING_CHAIN "\n");
+    g_string_append(rules, "COMMIT\n");
+
+    g_string_append(rules, "*filter\n");
+    g_string_append(rules, ":" NAT_FORWARD_CHAIN " - [0:0]\n");
+    g_string_append_printf(rules, "-A " NAT_FORWARD_CHAIN
+                           " -i %s -o %s -m state --state RELATED,ESTABLISHED -j ACCEPT\n",
+                           nat_interface, interface);
+    g_string_append_printf(rules, "-A " NAT_FORWARD_CHAIN
+                           " -i %s -o %s -j ACCEPT\n",
+                           interface, nat_interface);
+    if( !forward_hooked )
+        g_string_append(rules, "-I FORWARD -j " NAT_FORWARD_CHAIN "\n");
+    g_string_append(rules, "COMMIT\n");
+
+    if( !network_iptables_restore(rules->str) ) {
+        /* Do not leave partially applied rules behind */
+        network_nat_forget_hooks();
+        network_cleanup_ip_forwarding();
+        goto EXIT;
+    }
 
-    snprintf(command, sizeof command, "/sbin/iptables -A FORWARD -i %s -o %s  -m state  --state RELATED,ESTABLISHED -j ACCEPT", nat_interface, interface);
-    common_system(command);
+    network_nat_postrouting_hooked = true;
+    network_nat_forward_hooked     = true;
 
-    snprintf(command, sizeof command, "/sbin/iptables -A FORWARD -i %s -o %s -j ACCEPT", interface, nat_interface);
-    common_system(command);
+    write_to_file("/proc/sys/net/ipv4/ip_forward", "1");
 
     log_debug("ipforwarding success!");
     failed = 0;
 
 EXIT:
+    if( rules )
+        g_string_free(rules, TRUE);
     free(interface);
     free(nat_interface);
 
@@ -908,6 +2032,8 @@ EXIT:
 }
 
 /** Turn off ip forwarding on the usb interface
+ *
+ * Only rules in usb-moded owned chains are removed.
  */
 static void
 network_cleanup_ip_forwarding(void)
@@ -916,7 +2042,14 @@ network_cleanup_ip_forwarding(void)
 
     write_to_file("/proc/sys/net/ipv4/ip_forward", "0");
 
-    common_system("/sbin/iptables -F FORWARD");
+    /* Declaring user defined chains in a noflush batch flushes them */
+    if( !network_iptables_restore("*nat\n"
+                                  ":" NAT_POSTROUTING_CHAIN " - [0:0]\n"
+                                  "COMMIT\n"
+                                  "*filter\n"
+                                  ":" NAT_FORWARD_CHAIN " - [0:0]\n"
+                                  "COMMIT\n") )
+        network_nat_forget_hooks();
 }
 
 /** Validate udhcpd.conf symlink
@@ -999,12 +2132,21 @@ network_write_udhcpd_config(const modedata_t *data, ipforward_data_t *ipforward)
         goto EXIT;
     }
 
-    fprintf(conffile, "start\t%.*s.1\n", len, ip);
-    fprintf(conffile, "end\t%.*s.15\n", len, ip);
+    unsigned start = config_get_dhcp_setting(DHCP_RANGE_START_KEY,
+                                             DHCP_DEFAULT_RANGE_START);
+    unsigned end   = config_get_dhcp_setting(DHCP_RANGE_END_KEY,
+                                             DHCP_DEFAULT_RANGE_END);
+    unsigned lease = config_get_dhcp_setting(DHCP_LEASE_TIME_KEY,
+                                             DHCP_DEFAULT_LEASE_TIME);
+    if( end < start )
+        end = start;
+
+    fprintf(conffile, "start\t%.*s.%u\n", len, ip, start);
+    fprintf(conffile, "end\t%.*s.%u\n", len, ip, end);
     fprintf(conffile, "interface\t%s\n", interface);
     fprintf(conffile, "option\tsubnet\t%s\n", netmask);
-    fprintf(conffile, "option\tlease\t3600\n");
-    fprintf(conffile, "max_leases\t15\n");
+    fprintf(conffile, "option\tlease\t%u\n", lease);
+    fprintf(conffile, "max_leases\t%u\n", end - start + 1);
 
     if(ipforward != NULL)
     {
@@ -1015,48 +2157,121 @@ network_write_udhcpd_config(const modedata_t *data, ipforward_data_t *ipforward)
         fprintf(conffile, "opt\trouter\t%s\n", ip);
     }
 
-    fclose(conffile), conffile = 0;
+    fclose(conffile), conffile = 0;
+
+    /* check that we have a valid symlink */
+    if( network_check_udhcpd_symlink() != 0 ) {
+        if( unlink(UDHCP_CONFIG_LINK) == -1 && errno != ENOENT )
+            log_warning("%s: can't remove invalid config: %m", UDHCP_CONFIG_LINK);
+
+        if( symlink(UDHCP_CONFIG_PATH, UDHCP_CONFIG_LINK) == -1 ) {
+            log_err("%s: can't create symlink to %s: %m",
+                    UDHCP_CONFIG_LINK, UDHCP_CONFIG_PATH);
+            goto EXIT;
+        }
+        log_debug("%s: symlink to %s created",
+                  UDHCP_CONFIG_LINK, UDHCP_CONFIG_PATH);
+    }
+
+    // success
+    err = 0;
+
+EXIT:
+    free(netmask);
+    free(ip);
+    free(interface);
+    if( conffile )
+        fclose(conffile);
+
+    return err;
+}
+
+/** Start built-in DHCP server
+ *
+ * @param ipforward  NULL if we want a simple config, otherwise include dns info etc...
+ * @param data       Dynamic mode data
+ *
+ * @return zero on success, non-zero otherwise
+ */
+static int
+network_start_dhcpd(const modedata_t *data, ipforward_data_t *ipforward)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int    err       = -1;
+    gchar *interface = 0;
+    gchar *address   = 0;
+    gchar *netmask   = 0;
+
+    if( !(interface = network_get_interface(data)) ) {
+        log_err("no network interface");
+        goto EXIT;
+    }
 
-    /* check that we have a valid symlink */
-    if( network_check_udhcpd_symlink() != 0 ) {
-        if( unlink(UDHCP_CONFIG_LINK) == -1 && errno != ENOENT )
-            log_warning("%s: can't remove invalid config: %m", UDHCP_CONFIG_LINK);
+    if( !(address = config_get_network_setting(NETWORK_IP_KEY)) ) {
+        log_err("no network address");
+        goto EXIT;
+    }
 
-        if( symlink(UDHCP_CONFIG_PATH, UDHCP_CONFIG_LINK) == -1 ) {
-            log_err("%s: can't create symlink to %s: %m",
-                    UDHCP_CONFIG_LINK, UDHCP_CONFIG_PATH);
-            goto EXIT;
-        }
-        log_debug("%s: symlink to %s created",
-                  UDHCP_CONFIG_LINK, UDHCP_CONFIG_PATH);
+    if( !(netmask = config_get_network_setting(NETWORK_NETMASK_KEY)) ) {
+        log_err("no network address mask");
+        goto EXIT;
     }
 
-    // success
-    err = 0;
+    dhcpd_settings_t settings = {
+        .ds_interface   = interface,
+        .ds_address     = address,
+        .ds_netmask     = netmask,
+        .ds_dns1        = ipforward ? ipforward->dns1 : 0,
+        .ds_dns2        = ipforward ? ipforward->dns2 : 0,
+        .ds_router      = ipforward != 0,
+        .ds_range_start = config_get_dhcp_setting(DHCP_RANGE_START_KEY,
+                                                  DHCP_DEFAULT_RANGE_START),
+        .ds_range_end   = config_get_dhcp_setting(DHCP_RANGE_END_KEY,
+                                                  DHCP_DEFAULT_RANGE_END),
+        .ds_lease_time  = config_get_dhcp_setting(DHCP_LEASE_TIME_KEY,
+                                                  DHCP_DEFAULT_LEASE_TIME),
+    };
+
+    if( dhcpd_start(&settings) )
+        err = 0;
 
 EXIT:
-    free(netmask);
-    free(ip);
-    free(interface);
-    if( conffile )
-        fclose(conffile);
+    g_free(netmask);
+    g_free(address);
+    g_free(interface);
 
     return err;
 }
 
-/** Update udhcpd.conf
+/** Restart external udhcpd so that it picks up rewritten configuration
  *
- * Must be succesfully called before starting udhcpd to ensure
- * /etc/udhcpd.conf points to valid data.
+ * Running udhcpd does not reload its configuration file. The
+ * service is restarted only if it is already running.
+ */
+static void
+network_restart_udhcpd(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char * const units[] = { DHCPD_EXTERNAL_SERVICE, 0 };
+
+    if( !systemd_control_units(SYSTEMD_TRY_RESTART, units,
+                               SYSTEMD_JOB_TIMEOUT) )
+        log_warning("%s: could not apply new configuration",
+                    DHCPD_EXTERNAL_SERVICE);
+}
+
+/** Update dhcp server and nat configuration
  *
- * No cleanup required (the config file can be left behind).
+ * @note Assumes that #network_sharing_mutex is already locked.
  *
  * @param data  Dynamic mode data
  *
  * @return zero on success, non-zero on failure
  */
-int
-network_update_udhcpd_config(const modedata_t *data)
+static int
+network_update_sharing_locked(const modedata_t *data)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -1070,8 +2285,10 @@ network_update_udhcpd_config(const modedata_t *data)
         /* check if we are roaming or not */
         if( ofono_get_roaming_status() ) {
             /* get permission to use roaming */
-            if(config_is_roaming_not_allowed())
+            if(config_is_roaming_not_allowed()) {
+                log_warning("roaming; connection sharing not allowed");
                 goto EXIT;
+            }
         }
 #endif
 
@@ -1092,8 +2309,11 @@ network_update_udhcpd_config(const modedata_t *data)
 #endif
     }
 
-    /* ipforward can be NULL here, which is expected and handled in this function */
-    ret = network_write_udhcpd_config(data, ipforward);
+    /* ipforward can be NULL here, which is expected and handled in these functions */
+    if( config_get_dhcp_setting(DHCP_BUILTIN_KEY, 0) )
+        ret = network_start_dhcpd(data, ipforward);
+    else
+        ret = network_write_udhcpd_config(data, ipforward);
 
     if( ret == 0 && data->nat )
         ret = network_setup_ip_forwarding(data, ipforward);
@@ -1104,6 +2324,40 @@ EXIT:
     return ret;
 }
 
+/** Update udhcpd.conf
+ *
+ * When the built-in DHCP server is enabled, it is started
+ * instead of writing configuration for udhcpd.
+ *
+ * Must be succesfully called before starting udhcpd to ensure
+ * /etc/udhcpd.conf points to valid data.
+ *
+ * No cleanup required (the config file can be left behind).
+ *
+ * When nat is used, the configuration is updated also when
+ * cached ofono / connman state changes, until #network_down().
+ *
+ * @param data  Dynamic mode data
+ *
+ * @return zero on success, non-zero on failure
+ */
+int
+network_update_udhcpd_config(const modedata_t *data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    NETWORK_SHARING_LOCKED_ENTER;
+
+    int ret = network_update_sharing_locked(data);
+
+    if( data->nat )
+        network_sharing_active = true;
+
+    NETWORK_SHARING_LOCKED_LEAVE;
+
+    return ret;
+}
+
 /** Activate the network interface
  *
  * @param data  Dynamic mode data (not used)
@@ -1123,8 +2377,6 @@ network_up(const modedata_t *data)
     gchar *netmask   = 0;
     gchar *gateway   = 0;
 
-    char command[256];
-
     if( !(interface = network_get_interface(data)) ) {
         log_err("no network interface");
         goto EXIT;
@@ -1147,28 +2399,38 @@ network_up(const modedata_t *data)
 
     if( !strcmp(address, "dhcp") )
     {
-        snprintf(command, sizeof command,"dhclient -d %s", interface);
-        if( common_system(command) != 0 ) {
-            snprintf(command, sizeof command,"udhcpc -i %s", interface);
-            if( common_system(command) != 0 )
-                goto EXIT;
-        }
+        const char *dhclient[] = { "dhclient", "-d", interface, 0 };
+        const char *udhcpc[]   = { "udhcpc", "-i", interface, 0 };
+        if( exec_run(dhclient, EXEC_DEFAULT_TIMEOUT, 0) != 0 &&
+            exec_run(udhcpc, EXEC_DEFAULT_TIMEOUT, 0) != 0 )
+            goto EXIT;
     }
     else
     {
-        snprintf(command, sizeof command,"ifconfig %s %s netmask %s", interface, address, netmask);
-        if( common_system(command) != 0 )
+        if( !rtnl_addr_replace(interface, address, netmask) )
+            goto EXIT;
+        if( !rtnl_link_set_up(interface, true) )
             goto EXIT;
     }
 
-    /* TODO: Check first if there is a gateway set */
+    /* Default route is added only when a gateway is configured */
     if( gateway )
     {
-        snprintf(command, sizeof command,"route add default gw %s", gateway);
-        if( common_system(command) != 0 )
+        if( !rtnl_route_add(0, 0, 0, gateway) )
             goto EXIT;
     }
 
+    /* Addresses obtained via dhcp can't be updated in place */
+    if( strcmp(address, "dhcp") ) {
+        network_settings_t applied = {
+            .ns_interface = interface,
+            .ns_address   = address,
+            .ns_netmask   = netmask,
+            .ns_gateway   = gateway,
+        };
+        network_applied_set(&applied);
+    }
+
     ret = 0;
 
 EXIT:
@@ -1197,25 +2459,115 @@ network_down(const modedata_t *data)
 
     gchar *interface = network_get_interface(data);
 
-    char command[256];
-
     log_debug("iface=%s nat=%d", interface ?: "n/a", data->nat);
 
-    if( interface ) {
-        snprintf(command, sizeof command,"ifconfig %s down", interface);
-        common_system(command);
-    }
+    network_applied_set(0);
+
+    dhcpd_stop();
+
+    if( interface )
+        rtnl_link_set_up(interface, false);
 
     /* dhcp client shutdown happens on disconnect automatically */
-    if(data->nat)
+    if(data->nat) {
+        NETWORK_SHARING_LOCKED_ENTER;
+        network_sharing_active = false;
         network_cleanup_ip_forwarding();
+        NETWORK_SHARING_LOCKED_LEAVE;
+    }
 
     g_free(interface);
 }
 
+/** Apply changed network settings without taking the interface down
+ *
+ * Only the address and default route are touched, and only if
+ * they have changed since #network_up().
+ *
+ * @param data  Dynamic mode data
+ *
+ * @return true if settings were applied, false if the interface
+ *         needs to be brought down and up again
+ */
+static bool
+network_reconfigure(const modedata_t *data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool               ack  = false;
+    network_settings_t prev = { 0 };
+    network_settings_t curr = { 0 };
+
+    network_applied_get(&prev);
+
+    if( !prev.ns_address ) {
+        log_debug("no statically configured network; restart needed");
+        goto EXIT;
+    }
+
+    curr.ns_interface = network_get_interface(data);
+    curr.ns_address   = config_get_network_setting(NETWORK_IP_KEY);
+    curr.ns_netmask   = config_get_network_setting(NETWORK_NETMASK_KEY);
+    curr.ns_gateway   = config_get_network_setting(NETWORK_GATEWAY_KEY);
+
+    if( !curr.ns_interface || !curr.ns_address || !curr.ns_netmask ||
+        !strcmp(curr.ns_address, "dhcp") ||
+        strcmp(curr.ns_interface, prev.ns_interface) ) {
+        log_debug("network setup changed; restart needed");
+        goto EXIT;
+    }
+
+    bool address_changed = (strcmp(curr.ns_address, prev.ns_address) ||
+                            g_strcmp0(curr.ns_netmask, prev.ns_netmask));
+
+    /* Changing the address can drop routes via the gateway */
+    bool gateway_changed = (address_changed ||
+                            g_strcmp0(curr.ns_gateway, prev.ns_gateway));
+
+    if( address_changed &&
+        !rtnl_addr_replace(curr.ns_interface, curr.ns_address,
+                           curr.ns_netmask) )
+        goto EXIT;
+
+    /* Replacing the default route could override cellular
+     * connectivity, so only the route via the previously used
+     * gateway is removed */
+    if( gateway_changed ) {
+        if( prev.ns_gateway )
+            rtnl_route_delete(0, 0, 0, prev.ns_gateway);
+        if( curr.ns_gateway && !rtnl_route_add(0, 0, 0, curr.ns_gateway) )
+            goto EXIT;
+    }
+
+    network_applied_set(&curr);
+
+    /* Dhcp server needs to know the new address */
+    if( address_changed && (data->nat || data->dhcp_server) ) {
+        if( network_update_udhcpd_config(data) == 0 &&
+            !config_get_dhcp_setting(DHCP_BUILTIN_KEY, 0) )
+            network_restart_udhcpd();
+    }
+
+    log_debug("iface=%s addr=%s mask=%s gw=%s -> %s",
+              curr.ns_interface, curr.ns_address, curr.ns_netmask,
+              curr.ns_gateway ?: "n/a",
+              (address_changed || gateway_changed) ? "updated" : "unchanged");
+
+    ack = true;
+
+EXIT:
+    network_settings_clear(&curr);
+    network_settings_clear(&prev);
+
+    return ack;
+}
+
 /** Update the network interface with the new setting if connected.
  *
  * Should be called when relevant settings have changed.
+ *
+ * Changes are applied in place when possible, so that sessions
+ * over the usb network are not disconnected.
  */
 void
 network_update(void)
@@ -1223,11 +2575,334 @@ network_update(void)
     LOG_REGISTER_CONTEXT;
 
     if( control_get_cable_state() == CABLE_STATE_PC_CONNECTED ) {
-        modedata_t *data = worker_dup_usb_mode_data();
-        if( data && data->network ) {
+        modedata_t *data = worker_ref_usb_mode_data();
+        if( data && data->network && !network_reconfigure(data) ) {
             network_down(data);
             network_up(data);
+            /* Restore connection sharing torn down above */
+            if( data->nat || data->dhcp_server )
+                network_update_udhcpd_config(data);
+        }
+        modedata_unref(data);
+    }
+}
+
+#if defined OFONO || defined CONNMAN
+/** Apply connection state changes to active connection sharing
+ *
+ * Runs in a separate thread, so that the main loop is not blocked
+ * while iptables / udhcpd are reconfigured. Keeps going until no
+ * more refresh requests are pending.
+ *
+ * @param aptr  (unused)
+ *
+ * @return NULL
+ */
+static void *
+network_refresh_thread_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    /* Leave INT/TERM signal processing up to the main thread */
+    sigset_t ss;
+    sigemptyset(&ss);
+    sigaddset(&ss, SIGINT);
+    sigaddset(&ss, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &ss, 0);
+
+    for( ;; ) {
+        NETWORK_STATE_LOCKED_ENTER;
+        bool pending = network_refresh_pending;
+        network_refresh_pending = false;
+        if( !pending )
+            network_refresh_running = false;
+        NETWORK_STATE_LOCKED_LEAVE;
+
+        if( !pending )
+            break;
+
+        bool restart_udhcpd = false;
+
+        /* Blocks while mode switch is setting up sharing */
+        NETWORK_SHARING_LOCKED_ENTER;
+
+        if( network_sharing_active ) {
+            modedata_t *data = worker_ref_usb_mode_data();
+            if( data && data->nat ) {
+                log_debug("connection state changed; updating connection sharing");
+                /* Firewall rules can get reloaded along with connection
+                 * changes, do not trust cached state of the jumps */
+                network_nat_forget_hooks();
+                if( network_update_sharing_locked(data) != 0 ) {
+                    log_warning("connection sharing not possible; nat disabled");
+                    network_cleanup_ip_forwarding();
+                }
+                else if( !config_get_dhcp_setting(DHCP_BUILTIN_KEY, 0) ) {
+                    restart_udhcpd = true;
+                }
+            }
+            modedata_unref(data);
+        }
+
+        NETWORK_SHARING_LOCKED_LEAVE;
+
+        if( restart_udhcpd )
+            network_restart_udhcpd();
+    }
+
+    return 0;
+}
+
+/** Wait for refresh thread to exit
+ */
+static void
+network_refresh_join(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( network_refresh_thread_id ) {
+        pthread_join(network_refresh_thread_id, 0);
+        network_refresh_thread_id = 0;
+    }
+}
+
+/** Start applying connection state changes to active connection sharing
+ *
+ * @param aptr  (unused)
+ *
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean
+network_refresh_cb(gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    network_refresh_id = 0;
+
+    NETWORK_STATE_LOCKED_ENTER;
+    network_refresh_pending = true;
+    bool start = !network_refresh_running;
+    network_refresh_running = true;
+    NETWORK_STATE_LOCKED_LEAVE;
+
+    if( !start )
+        goto EXIT;
+
+    /* Previous thread has already finished, join does not block */
+    network_refresh_join();
+
+    int err = pthread_create(&network_refresh_thread_id, 0,
+                             network_refresh_thread_cb, 0);
+    if( err ) {
+        log_err("failed to start network refresh thread");
+        network_refresh_thread_id = 0;
+
+        NETWORK_STATE_LOCKED_ENTER;
+        network_refresh_pending = false;
+        network_refresh_running = false;
+        NETWORK_STATE_LOCKED_LEAVE;
+    }
+
+EXIT:
+    return G_SOURCE_REMOVE;
+}
+
+/** Schedule update of connection sharing
+ *
+ * Called when cached ofono / connman state changes. Bursts of
+ * changes are coalesced into one update.
+ */
+static void
+network_state_changed(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !network_refresh_id )
+        network_refresh_id = g_timeout_add(NETWORK_REFRESH_DELAY_MS,
+                                           network_refresh_cb, 0);
+}
+
+/** Handle ofono / connman signals
+ *
+ * @param con   D-Bus connection (unused)
+ * @param msg   D-Bus message
+ * @param aptr  (unused)
+ *
+ * @return DBUS_HANDLER_RESULT_NOT_YET_HANDLED
+ */
+static DBusHandlerResult
+network_dbus_filter_cb(DBusConnection *con, DBusMessage *msg, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)con;
+    (void)aptr;
+
+    const char *owner = 0;
+
+    if( dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL )
+        goto EXIT;
+
+#ifdef OFONO
+    if( dbus_message_is_signal(msg, OFONO_NETREG_INTERFACE,
+                               OFONO_PROPERTY_CHANGED_SIG) )
+        ofono_status_signal(msg);
+    else if( dbus_message_is_signal(msg, OFONO_MANAGER_INTERFACE,
+                                    OFONO_MODEM_ADDED_SIG) )
+        ofono_modems_signal(msg, true);
+    else if( dbus_message_is_signal(msg, OFONO_MANAGER_INTERFACE,
+                                    OFONO_MODEM_REMOVED_SIG) )
+        ofono_modems_signal(msg, false);
+#endif
+
+#ifdef CONNMAN
+    if( dbus_message_is_signal(msg, CONNMAN_SERVICE_INTERFACE,
+                               CONNMAN_PROPERTY_CHANGED_SIG) )
+        connman_service_signal(msg);
+    else if( dbus_message_is_signal(msg, CONNMAN_MANAGER_INTERFACE,
+                                    CONNMAN_SERVICES_CHANGED_SIG) )
+        connman_services_signal(msg);
+#endif
+
+    if( dbus_message_is_signal(msg, DBUS_INTERFACE_DBUS,
+                               DBUS_NAME_OWNER_CHANGED_SIG) ) {
+#ifdef OFONO
+        if( network_ipc_parse_owner_changed(msg, OFONO_SERVICE, &owner) )
+            ofono_available_changed(owner);
+#endif
+#ifdef CONNMAN
+        if( network_ipc_parse_owner_changed(msg, CONNMAN_SERVICE, &owner) )
+            connman_available_changed(owner);
+#endif
+    }
+
+EXIT:
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+#endif /* OFONO || CONNMAN */
+
+/** Schedule update of connection sharing after roaming policy change
+ *
+ * Should be called when NO_ROAMING_KEY setting has changed.
+ */
+void
+network_roaming_policy_changed(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+#ifdef OFONO
+    if( network_con ) {
+        log_debug("roaming policy changed");
+        network_state_changed();
+    }
+#endif
+}
+
+/** Start tracking ofono / connman state
+ *
+ * Roaming status and connection data used for connection sharing
+ * are cached, so that setting up sharing does not need to make
+ * blocking D-Bus calls.
+ *
+ * @return true on success, false on failure
+ */
+bool
+network_start_listener(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+#if defined OFONO || defined CONNMAN
+    DBusConnection *con = 0;
+
+    log_debug("starting network state listener");
+
+    if( !(con = umdbus_get_connection()) ) {
+        log_err("Could not connect to dbus for network state");
+        goto EXIT;
+    }
+
+    if( !dbus_connection_add_filter(con, network_dbus_filter_cb, 0, 0) ) {
+        log_err("adding system dbus filter for network state failed");
+        goto EXIT;
+    }
+
+    network_con = con, con = 0;
+
+    /* Add matches without blocking / error checking */
+# ifdef OFONO
+    dbus_bus_add_match(network_con, OFONO_NAME_OWNER_CHANGED_MATCH, 0);
+    dbus_bus_add_match(network_con, OFONO_MANAGER_MATCH, 0);
+    dbus_bus_add_match(network_con, OFONO_NETREG_MATCH, 0);
+    ofono_available_query();
+# endif
+# ifdef CONNMAN
+    dbus_bus_add_match(network_con, CONNMAN_NAME_OWNER_CHANGED_MATCH, 0);
+    dbus_bus_add_match(network_con, CONNMAN_MANAGER_MATCH, 0);
+    dbus_bus_add_match(network_con, CONNMAN_SERVICE_MATCH, 0);
+    connman_available_query();
+# endif
+#endif
+
+    ack = true;
+
+#if defined OFONO || defined CONNMAN
+EXIT:
+    if( con )
+        dbus_connection_unref(con);
+#endif
+
+    return ack;
+}
+
+/** Stop tracking ofono / connman state
+ */
+void
+network_stop_listener(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+#if defined OFONO || defined CONNMAN
+    log_debug("stopping network state listener");
+
+    if( network_refresh_id )
+        g_source_remove(network_refresh_id), network_refresh_id = 0;
+
+    /* Refresh thread uses cached state, let it finish first */
+    NETWORK_STATE_LOCKED_ENTER;
+    network_refresh_pending = false;
+    NETWORK_STATE_LOCKED_LEAVE;
+    network_refresh_join();
+
+# ifdef OFONO
+    ofono_quit();
+# endif
+# ifdef CONNMAN
+    connman_quit();
+# endif
+
+    if( network_con ) {
+        dbus_connection_remove_filter(network_con, network_dbus_filter_cb, 0);
+
+        if( dbus_connection_get_is_connected(network_con) ) {
+# ifdef OFONO
+            dbus_bus_remove_match(network_con, OFONO_NAME_OWNER_CHANGED_MATCH, 0);
+            dbus_bus_remove_match(network_con, OFONO_MANAGER_MATCH, 0);
+            dbus_bus_remove_match(network_con, OFONO_NETREG_MATCH, 0);
+# endif
+# ifdef CONNMAN
+            dbus_bus_remove_match(network_con, CONNMAN_NAME_OWNER_CHANGED_MATCH, 0);
+            dbus_bus_remove_match(network_con, CONNMAN_MANAGER_MATCH, 0);
+            dbus_bus_remove_match(network_con, CONNMAN_SERVICE_MATCH, 0);
+# endif
         }
-        modedata_free(data);
+
+        dbus_connection_unref(network_con), network_con = 0;
     }
+#endif
 }
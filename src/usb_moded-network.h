@@ -46,9 +46,13 @@ bool connman_set_tethering(const char *technology, bool on);
  * NETWORK
  * ------------------------------------------------------------------------- */
 
-int  network_update_udhcpd_config(const modedata_t *data);
-int  network_up                  (const modedata_t *data);
-void network_down                (const modedata_t *data);
-void network_update              (void);
+int  network_update_udhcpd_config   (const modedata_t *data);
+bool network_wait_interface         (unsigned tot_ms);
+int  network_up                     (const modedata_t *data);
+void network_down                   (const modedata_t *data);
+void network_update                 (void);
+void network_roaming_policy_changed (void);
+bool network_start_listener         (void);
+void network_stop_listener          (void);
 
 #endif /* USB_MODED_NETWORK_H_ */
@@ -0,0 +1,857 @@
+/**
+ * @file usb_moded-rtnl.c
+ *
+ * Network interface configuration via rtnetlink
+ *
+ * Allows bringing links up/down and managing IPv4 addresses and
+ * routes without executing net-tools binaries.
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-rtnl.h"
+
+#include "usb_moded.h"
+#include "usb_moded-common.h"
+#include "usb_moded-log.h"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Maximum time to wait for kernel to reply to a request [ms] */
+#define RTNL_REPLY_TIMEOUT  1000
+
+/** Size of buffer used for receiving replies */
+#define RTNL_RECV_SIZE      8192
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Buffer for constructing rtnetlink requests
+ */
+typedef struct rtnl_request_t
+{
+    /** Netlink message header */
+    struct nlmsghdr nh;
+
+    /** Request specific fixed size payload */
+    union {
+        struct ifinfomsg ifi;
+        struct ifaddrmsg ifa;
+        struct rtmsg     rtm;
+    };
+
+    /** Space for attributes */
+    char attrs[128];
+} rtnl_request_t;
+
+/** IPv4 address and prefix length
+ */
+typedef struct rtnl_inet_t
+{
+    struct in_addr ri_addr;
+    int            ri_prefix;
+} rtnl_inet_t;
+
+/** Context for collecting interface addresses from dump replies
+ */
+typedef struct rtnl_addr_dump_t
+{
+    int          ad_index;
+    rtnl_inet_t  ad_addr[16];
+    size_t       ad_count;
+} rtnl_addr_dump_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * RTNL
+ * ------------------------------------------------------------------------- */
+
+static int  rtnl_link_index        (const char *ifname);
+static bool rtnl_parse_inet        (rtnl_inet_t *inet, const char *address, const char *netmask);
+static void rtnl_request_init      (rtnl_request_t *req, int type, int flags, size_t size);
+static bool rtnl_request_add_attr  (rtnl_request_t *req, int type, const void *data, size_t size);
+static int  rtnl_open_socket       (int groups);
+static int  rtnl_execute           (rtnl_request_t *req, bool (*cb)(const struct nlmsghdr *nh, void *aptr), void *aptr);
+bool        rtnl_link_exists       (const char *ifname);
+static bool rtnl_link_appeared_p   (void *aptr);
+bool        rtnl_wait_link         (const char * const *ifnames, unsigned tot_ms);
+bool        rtnl_link_set_up       (const char *ifname, bool up);
+static bool rtnl_addr_modify       (const char *ifname, int type, int flags, const char *address, const char *netmask);
+static bool rtnl_addr_dump_cb      (const struct nlmsghdr *nh, void *aptr);
+static bool rtnl_addr_remove_others(const char *ifname, const rtnl_inet_t *keep);
+bool        rtnl_addr_add          (const char *ifname, const char *address, const char *netmask);
+bool        rtnl_addr_replace      (const char *ifname, const char *address, const char *netmask);
+bool        rtnl_addr_delete       (const char *ifname, const char *address, const char *netmask);
+bool        rtnl_addr_flush        (const char *ifname);
+static bool rtnl_route_modify      (const char *ifname, int type, int flags, const char *destination, const char *netmask, const char *gateway);
+bool        rtnl_route_add         (const char *ifname, const char *destination, const char *netmask, const char *gateway);
+bool        rtnl_route_replace     (const char *ifname, const char *destination, const char *netmask, const char *gateway);
+bool        rtnl_route_delete      (const char *ifname, const char *destination, const char *netmask, const char *gateway);
+
+/* ========================================================================= *
+ * RTNL
+ * ========================================================================= */
+
+/** Get interface index
+ *
+ * @param ifname  interface name
+ *
+ * @return interface index, or zero if interface does not exist
+ */
+static int
+rtnl_link_index(const char *ifname)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return ifname ? (int)if_nametoindex(ifname) : 0;
+}
+
+/** Parse IPv4 address and netmask
+ *
+ * The netmask can be given either in dotted quad form or as
+ * prefix length.
+ *
+ * @param inet     where to store parsed data
+ * @param address  address string, e.g. "192.168.2.15"
+ * @param netmask  netmask string e.g. "255.255.255.0" or "24",
+ *                 or NULL for host address
+ *
+ * @return true on success, false on failure
+ */
+static bool
+rtnl_parse_inet(rtnl_inet_t *inet, const char *address, const char *netmask)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    if( !address || inet_pton(AF_INET, address, &inet->ri_addr) != 1 ) {
+        log_err("invalid address: %s", address ?: "NULL");
+        goto EXIT;
+    }
+
+    inet->ri_prefix = 32;
+
+    if( !netmask ) {
+        /* Host address */
+    }
+    else if( !strchr(netmask, '.') ) {
+        char *end = 0;
+        long  val = strtol(netmask, &end, 10);
+        if( end == netmask || *end || val < 0 || val > 32 ) {
+            log_err("invalid prefix length: %s", netmask);
+            goto EXIT;
+        }
+        inet->ri_prefix = (int)val;
+    }
+    else {
+        struct in_addr mask;
+        if( inet_pton(AF_INET, netmask, &mask) != 1 ) {
+            log_err("invalid netmask: %s", netmask);
+            goto EXIT;
+        }
+
+        /* Only contiguous netmasks can be expressed as prefix */
+        uint32_t inv = ~ntohl(mask.s_addr);
+        if( inv & (inv + 1) ) {
+            log_err("non-contiguous netmask: %s", netmask);
+            goto EXIT;
+        }
+        inet->ri_prefix = 32 - __builtin_popcount(inv);
+    }
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Initialize rtnetlink request
+ *
+ * @param req    request buffer
+ * @param type   message type, e.g. RTM_NEWADDR
+ * @param flags  additional message flags, e.g. NLM_F_CREATE
+ * @param size   size of fixed payload, e.g. sizeof (struct ifaddrmsg)
+ */
+static void
+rtnl_request_init(rtnl_request_t *req, int type, int flags, size_t size)
+{
+    LOG_REGISTER_CONTEXT;
+
+    memset(req, 0, sizeof *req);
+    req->nh.nlmsg_len   = NLMSG_LENGTH(size);
+    req->nh.nlmsg_type  = type;
+    req->nh.nlmsg_flags = NLM_F_REQUEST | flags;
+    req->nh.nlmsg_seq   = 1;
+}
+
+/** Append attribute to rtnetlink request
+ *
+ * @param req   request buffer
+ * @param type  attribute type, e.g. IFA_LOCAL
+ * @param data  attribute data
+ * @param size  size of attribute data
+ *
+ * @return true on success, false if request buffer is full
+ */
+static bool
+rtnl_request_add_attr(rtnl_request_t *req, int type, const void *data,
+                      size_t size)
+{
+    LOG_REGISTER_CONTEXT;
+
+    size_t offs = NLMSG_ALIGN(req->nh.nlmsg_len);
+    size_t len  = RTA_LENGTH(size);
+
+    if( offs + RTA_ALIGN(len) > sizeof *req ) {
+        log_err("rtnetlink request too large");
+        return false;
+    }
+
+    struct rtattr *rta = (struct rtattr *)((char *)req + offs);
+    rta->rta_type = type;
+    rta->rta_len  = len;
+    memcpy(RTA_DATA(rta), data, size);
+    req->nh.nlmsg_len = offs + RTA_ALIGN(len);
+
+    return true;
+}
+
+/** Open rtnetlink socket
+ *
+ * @param groups  multicast groups to join, or 0 for request/reply use
+ *
+ * @return socket file descriptor, or -1 on failure
+ */
+static int
+rtnl_open_socket(int groups)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC |
+                    (groups ? SOCK_NONBLOCK : 0), NETLINK_ROUTE);
+    if( fd == -1 ) {
+        log_warning("rtnetlink socket: %m");
+        goto EXIT;
+    }
+
+    struct sockaddr_nl sa = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = groups,
+    };
+
+    if( bind(fd, (struct sockaddr *)&sa, sizeof sa) == -1 ) {
+        log_warning("rtnetlink bind: %m");
+        close(fd), fd = -1;
+        goto EXIT;
+    }
+
+    if( !groups ) {
+        /* Kernel replies immediately, the timeout is just a safeguard
+         * against blocking the worker thread indefinitely */
+        struct timeval tv = {
+            .tv_sec  = RTNL_REPLY_TIMEOUT / 1000,
+            .tv_usec = RTNL_REPLY_TIMEOUT % 1000 * 1000,
+        };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    }
+
+EXIT:
+    return fd;
+}
+
+/** Send rtnetlink request and process replies
+ *
+ * Requests with NLM_F_ACK flag finish when kernel acknowledges the
+ * request. Requests with NLM_F_DUMP flag finish after the last reply
+ * message has been passed to the callback function.
+ *
+ * @param req   request to send
+ * @param cb    callback for handling reply messages, or NULL
+ * @param aptr  argument for the callback
+ *
+ * @return 0 on success, or errno value on failure
+ */
+static int
+rtnl_execute(rtnl_request_t *req,
+             bool (*cb)(const struct nlmsghdr *nh, void *aptr), void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int   err  = EIO;
+    int   fd   = -1;
+    char *buf  = 0;
+    bool  done = false;
+
+    struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+
+    if( (fd = rtnl_open_socket(0)) == -1 ) {
+        err = errno;
+        goto EXIT;
+    }
+
+    if( sendto(fd, req, req->nh.nlmsg_len, 0,
+               (struct sockaddr *)&kernel, sizeof kernel) == -1 ) {
+        err = errno;
+        goto EXIT;
+    }
+
+    buf = g_malloc(RTNL_RECV_SIZE);
+
+    while( !done ) {
+        ssize_t rc = recv(fd, buf, RTNL_RECV_SIZE, 0);
+
+        if( rc == -1 ) {
+            if( errno == EINTR )
+                continue;
+            err = (errno == EAGAIN) ? ETIMEDOUT : errno;
+            goto EXIT;
+        }
+
+        size_t len = (size_t)rc;
+        for( struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+             !done && NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len) ) {
+            if( nh->nlmsg_seq != req->nh.nlmsg_seq )
+                continue;
+
+            switch( nh->nlmsg_type ) {
+            case NLMSG_ERROR:
+                {
+                    const struct nlmsgerr *msg = NLMSG_DATA(nh);
+                    err  = -msg->error;
+                    done = true;
+                }
+                break;
+
+            case NLMSG_DONE:
+                err  = 0;
+                done = true;
+                break;
+
+            default:
+                if( cb && !cb(nh, aptr) ) {
+                    err  = ENOBUFS;
+                    done = true;
+                }
+                break;
+            }
+        }
+    }
+
+EXIT:
+    g_free(buf);
+
+    if( fd != -1 )
+        close(fd);
+
+    return err;
+}
+
+/** Check if network interface exists
+ *
+ * @param ifname  interface name, or NULL
+ *
+ * @return true if interface exists, false otherwise
+ */
+bool
+rtnl_link_exists(const char *ifname)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return rtnl_link_index(ifname) > 0;
+}
+
+/** Predicate for: any of the listed network interfaces exists
+ *
+ * @param aptr  NULL terminated array of interface names
+ *
+ * @return true if interface exists, false otherwise
+ */
+static bool
+rtnl_link_appeared_p(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char * const *ifnames = aptr;
+
+    for( size_t i = 0; ifnames[i]; ++i ) {
+        if( rtnl_link_exists(ifnames[i]) )
+            return true;
+    }
+    return false;
+}
+
+/** Wait for any of the listed network interfaces to appear
+ *
+ * Rather than probing at fixed intervals, rtnetlink link change
+ * notifications are used for waking up.
+ *
+ * Note: If called from the worker thread, waiting is canceled if
+ * the mode switch gets superseded.
+ *
+ * @param ifnames  NULL terminated array of interface names
+ * @param tot_ms   maximum time to wait [ms]
+ *
+ * @return true if interface exists, false otherwise
+ */
+bool
+rtnl_wait_link(const char * const *ifnames, unsigned tot_ms)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int       fd  = rtnl_open_socket(RTMGRP_LINK);
+    waitres_t res = common_wait_fd(tot_ms, fd, rtnl_link_appeared_p,
+                                   (void *)ifnames);
+
+    if( fd != -1 )
+        close(fd);
+
+    return res == WAIT_READY;
+}
+
+/** Bring network interface up or down
+ *
+ * @param ifname  interface name
+ * @param up      true to bring interface up, false to bring it down
+ *
+ * @return true on success, false on failure
+ */
+bool
+rtnl_link_set_up(const char *ifname, bool up)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int            err   = ENODEV;
+    int            index = rtnl_link_index(ifname);
+    rtnl_request_t req;
+
+    if( index <= 0 )
+        goto EXIT;
+
+    rtnl_request_init(&req, RTM_NEWLINK, NLM_F_ACK, sizeof req.ifi);
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index  = index;
+    req.ifi.ifi_change = IFF_UP;
+    req.ifi.ifi_flags  = up ? IFF_UP : 0;
+
+    err = rtnl_execute(&req, 0, 0);
+
+EXIT:
+    if( err )
+        log_err("set link %s %s: %s", ifname ?: "NULL",
+                up ? "up" : "down", strerror(err));
+    else
+        log_debug("set link %s %s", ifname, up ? "up" : "down");
+
+    return err == 0;
+}
+
+/** Add or delete IPv4 address of a network interface
+ *
+ * @param ifname   interface name
+ * @param type     RTM_NEWADDR or RTM_DELADDR
+ * @param flags    additional message flags
+ * @param address  address in dotted quad form
+ * @param netmask  netmask in dotted quad form or prefix length
+ *
+ * @return true on success, false on failure
+ */
+static bool
+rtnl_addr_modify(const char *ifname, int type, int flags,
+                 const char *address, const char *netmask)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int            err   = ENODEV;
+    int            index = rtnl_link_index(ifname);
+    const char    *what  = (type == RTM_NEWADDR) ? "add" : "delete";
+    rtnl_request_t req;
+    rtnl_inet_t    inet;
+
+    if( index <= 0 )
+        goto EXIT;
+
+    err = EINVAL;
+    if( !rtnl_parse_inet(&inet, address, netmask) )
+        goto EXIT;
+
+    rtnl_request_init(&req, type, NLM_F_ACK | flags, sizeof req.ifa);
+    req.ifa.ifa_family    = AF_INET;
+    req.ifa.ifa_prefixlen = inet.ri_prefix;
+    req.ifa.ifa_scope     = RT_SCOPE_UNIVERSE;
+    req.ifa.ifa_index     = index;
+
+    err = ENOBUFS;
+    if( !rtnl_request_add_attr(&req, IFA_LOCAL, &inet.ri_addr,
+                               sizeof inet.ri_addr) ||
+        !rtnl_request_add_attr(&req, IFA_ADDRESS, &inet.ri_addr,
+                               sizeof inet.ri_addr) )
+        goto EXIT;
+
+    /* Like ifconfig, set up broadcast address for the subnet */
+    if( type == RTM_NEWADDR && inet.ri_prefix < 31 ) {
+        struct in_addr brd = {
+            .s_addr = inet.ri_addr.s_addr | htonl(~0u >> inet.ri_prefix),
+        };
+        if( !rtnl_request_add_attr(&req, IFA_BROADCAST, &brd, sizeof brd) )
+            goto EXIT;
+    }
+
+    err = rtnl_execute(&req, 0, 0);
+
+EXIT:
+    if( err )
+        log_err("%s address %s/%s on %s: %s", what,
+                address ?: "NULL", netmask ?: "32", ifname ?: "NULL",
+                strerror(err));
+    else
+        log_debug("%s address %s/%d on %s", what,
+                  address, inet.ri_prefix, ifname);
+
+    return err == 0;
+}
+
+/** Collect IPv4 addresses of an interface from RTM_GETADDR dump
+ *
+ * @param nh    reply message
+ * @param aptr  rtnl_addr_dump_t pointer
+ *
+ * @return true to continue, false if there is no room for more addresses
+ */
+static bool
+rtnl_addr_dump_cb(const struct nlmsghdr *nh, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    rtnl_addr_dump_t       *dump = aptr;
+    const struct ifaddrmsg *ifa  = NLMSG_DATA(nh);
+
+    if( nh->nlmsg_type != RTM_NEWADDR )
+        goto EXIT;
+
+    if( ifa->ifa_family != AF_INET || (int)ifa->ifa_index != dump->ad_index )
+        goto EXIT;
+
+    int len = IFA_PAYLOAD(nh);
+    for( const struct rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, len);
+         rta = RTA_NEXT(rta, len) ) {
+        if( rta->rta_type != IFA_LOCAL )
+            continue;
+
+        if( dump->ad_count >= G_N_ELEMENTS(dump->ad_addr) )
+            return false;
+
+        rtnl_inet_t *inet = &dump->ad_addr[dump->ad_count++];
+        memcpy(&inet->ri_addr, RTA_DATA(rta), sizeof inet->ri_addr);
+        inet->ri_prefix = ifa->ifa_prefixlen;
+    }
+
+EXIT:
+    return true;
+}
+
+/** Remove IPv4 addresses from a network interface
+ *
+ * @param ifname  interface name
+ * @param keep    address to leave in place, or NULL to remove all
+ *
+ * @return true on success, false on failure
+ */
+static bool
+rtnl_addr_remove_others(const char *ifname, const rtnl_inet_t *keep)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool             ack  = false;
+    int              err  = ENODEV;
+    rtnl_addr_dump_t dump = { .ad_index = rtnl_link_index(ifname) };
+    rtnl_request_t   req;
+
+    if( dump.ad_index <= 0 )
+        goto EXIT;
+
+    rtnl_request_init(&req, RTM_GETADDR, NLM_F_DUMP, sizeof req.ifa);
+    req.ifa.ifa_family = AF_INET;
+    req.ifa.ifa_index  = dump.ad_index;
+
+    if( (err = rtnl_execute(&req, rtnl_addr_dump_cb, &dump)) )
+        goto EXIT;
+
+    ack = true;
+
+    for( size_t i = 0; i < dump.ad_count; ++i ) {
+        const rtnl_inet_t *inet = &dump.ad_addr[i];
+        char address[INET_ADDRSTRLEN];
+        char prefix[8];
+
+        if( keep && keep->ri_addr.s_addr == inet->ri_addr.s_addr &&
+            keep->ri_prefix == inet->ri_prefix )
+            continue;
+
+        inet_ntop(AF_INET, &inet->ri_addr, address, sizeof address);
+        snprintf(prefix, sizeof prefix, "%d", inet->ri_prefix);
+
+        /* Removing primary address can take secondaries with it */
+        if( !rtnl_addr_modify(ifname, RTM_DELADDR, 0, address, prefix) &&
+            rtnl_link_exists(ifname) )
+            ack = false;
+    }
+
+EXIT:
+    if( err )
+        log_err("list addresses of %s: %s", ifname ?: "NULL", strerror(err));
+
+    return ack;
+}
+
+/** Add IPv4 address to a network interface
+ *
+ * Existing addresses are left in place.
+ *
+ * @param ifname   interface name
+ * @param address  address in dotted quad form
+ * @param netmask  netmask in dotted quad form or prefix length
+ *
+ * @return true on success, false on failure
+ */
+bool
+rtnl_addr_add(const char *ifname, const char *address, const char *netmask)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return rtnl_addr_modify(ifname, RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL,
+                            address, netmask);
+}
+
+/** Set IPv4 address of a network interface
+ *
+ * Like ifconfig, any other IPv4 addresses are removed from the
+ * interface.
+ *
+ * @param ifname   interface name
+ * @param address  address in dotted quad form
+ * @param netmask  netmask in dotted quad form or prefix length
+ *
+ * @return true on success, false on failure
+ */
+bool
+rtnl_addr_replace(const char *ifname, const char *address, const char *netmask)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool        ack = false;
+    rtnl_inet_t inet;
+
+    if( !rtnl_parse_inet(&inet, address, netmask) )
+        goto EXIT;
+
+    /* Failing to remove stale addresses is not fatal as such */
+    rtnl_addr_remove_others(ifname, &inet);
+
+    ack = rtnl_addr_modify(ifname, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE,
+                           address, netmask);
+
+EXIT:
+    return ack;
+}
+
+/** Remove IPv4 address from a network interface
+ *
+ * @param ifname   interface name
+ * @param address  address in dotted quad form
+ * @param netmask  netmask in dotted quad form or prefix length
+ *
+ * @return true on success, false on failure
+ */
+bool
+rtnl_addr_delete(const char *ifname, const char *address, const char *netmask)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return rtnl_addr_modify(ifname, RTM_DELADDR, 0, address, netmask);
+}
+
+/** Remove all IPv4 addresses from a network interface
+ *
+ * @param ifname  interface name
+ *
+ * @return true on success, false on failure
+ */
+bool
+rtnl_addr_flush(const char *ifname)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return rtnl_addr_remove_others(ifname, 0);
+}
+
+/** Add, replace or delete IPv4 route
+ *
+ * @param ifname       output interface name, or NULL
+ * @param type         RTM_NEWROUTE or RTM_DELROUTE
+ * @param flags        additional message flags
+ * @param destination  destination network, or NULL for default route
+ * @param netmask      netmask of destination network, or NULL for host
+ * @param gateway      gateway address, or NULL for link scope route
+ *
+ * @return true on success, false on failure
+ */
+static bool
+rtnl_route_modify(const char *ifname, int type, int flags,
+                  const char *destination, const char *netmask,
+                  const char *gateway)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int            err   = ENODEV;
+    int            index = 0;
+    bool           add   = (type == RTM_NEWROUTE);
+    rtnl_inet_t    dst   = { .ri_prefix = 0 };
+    rtnl_inet_t    gw;
+    rtnl_request_t req;
+
+    if( ifname && (index = rtnl_link_index(ifname)) <= 0 )
+        goto EXIT;
+
+    err = EINVAL;
+    if( destination && !rtnl_parse_inet(&dst, destination, netmask) )
+        goto EXIT;
+    if( gateway && !rtnl_parse_inet(&gw, gateway, 0) )
+        goto EXIT;
+
+    rtnl_request_init(&req, type, NLM_F_ACK | flags, sizeof req.rtm);
+    req.rtm.rtm_family   = AF_INET;
+    req.rtm.rtm_dst_len  = dst.ri_prefix;
+    req.rtm.rtm_table    = RT_TABLE_MAIN;
+    req.rtm.rtm_protocol = add ? RTPROT_BOOT : RTPROT_UNSPEC;
+    req.rtm.rtm_type     = add ? RTN_UNICAST : RTN_UNSPEC;
+    req.rtm.rtm_scope    = (!add    ? RT_SCOPE_NOWHERE :
+                            gateway ? RT_SCOPE_UNIVERSE :
+                            RT_SCOPE_LINK);
+
+    err = ENOBUFS;
+    if( destination &&
+        !rtnl_request_add_attr(&req, RTA_DST, &dst.ri_addr,
+                               sizeof dst.ri_addr) )
+        goto EXIT;
+    if( gateway &&
+        !rtnl_request_add_attr(&req, RTA_GATEWAY, &gw.ri_addr,
+                               sizeof gw.ri_addr) )
+        goto EXIT;
+    if( index > 0 &&
+        !rtnl_request_add_attr(&req, RTA_OIF, &index, sizeof index) )
+        goto EXIT;
+
+    err = rtnl_execute(&req, 0, 0);
+
+EXIT:
+    if( err )
+        log_err("%s route %s/%d via %s dev %s: %s",
+                !add ? "delete" : (flags & NLM_F_REPLACE) ? "replace" : "add",
+                destination ?: "default", dst.ri_prefix, gateway ?: "-",
+                ifname ?: "-", strerror(err));
+    else
+        log_debug("%s route %s/%d via %s dev %s",
+                  !add ? "delete" : (flags & NLM_F_REPLACE) ? "replace" : "add",
+                  destination ?: "default", dst.ri_prefix, gateway ?: "-",
+                  ifname ?: "-");
+
+    return err == 0;
+}
+
+/** Add IPv4 route
+ *
+ * Like "route add", the route is added also if there already are
+ * other routes to the same destination.
+ *
+ * @param ifname       output interface name, or NULL
+ * @param destination  destination network, or NULL for default route
+ * @param netmask      netmask of destination network, or NULL for host
+ * @param gateway      gateway address, or NULL for link scope route
+ *
+ * @return true on success, false on failure
+ */
+bool
+rtnl_route_add(const char *ifname, const char *destination,
+               const char *netmask, const char *gateway)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return rtnl_route_modify(ifname, RTM_NEWROUTE, NLM_F_CREATE,
+                             destination, netmask, gateway);
+}
+
+/** Add IPv4 route, replacing existing route to the same destination
+ *
+ * @param ifname       output interface name, or NULL
+ * @param destination  destination network, or NULL for default route
+ * @param netmask      netmask of destination network, or NULL for host
+ * @param gateway      gateway address, or NULL for link scope route
+ *
+ * @return true on success, false on failure
+ */
+bool
+rtnl_route_replace(const char *ifname, const char *destination,
+                   const char *netmask, const char *gateway)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return rtnl_route_modify(ifname, RTM_NEWROUTE,
+                             NLM_F_CREATE | NLM_F_REPLACE,
+                             destination, netmask, gateway);
+}
+
+/** Delete IPv4 route
+ *
+ * @param ifname       output interface name, or NULL for any
+ * @param destination  destination network, or NULL for default route
+ * @param netmask      netmask of destination network, or NULL for host
+ * @param gateway      gateway address, or NULL for any
+ *
+ * @return true on success, false on failure
+ */
+bool
+rtnl_route_delete(const char *ifname, const char *destination,
+                  const char *netmask, const char *gateway)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return rtnl_route_modify(ifname, RTM_DELROUTE, 0,
+                             destination, netmask, gateway);
+}
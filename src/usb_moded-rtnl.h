@@ -0,0 +1,47 @@
+/**
+ * @file usb_moded-rtnl.h
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_RTNL_H_
+# define USB_MODED_RTNL_H_
+
+# include <stdbool.h>
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * RTNL
+ * ------------------------------------------------------------------------- */
+
+bool rtnl_link_exists   (const char *ifname);
+bool rtnl_wait_link     (const char * const *ifnames, unsigned tot_ms);
+bool rtnl_link_set_up   (const char *ifname, bool up);
+bool rtnl_addr_add      (const char *ifname, const char *address, const char *netmask);
+bool rtnl_addr_replace  (const char *ifname, const char *address, const char *netmask);
+bool rtnl_addr_delete   (const char *ifname, const char *address, const char *netmask);
+bool rtnl_addr_flush    (const char *ifname);
+bool rtnl_route_add     (const char *ifname, const char *destination, const char *netmask, const char *gateway);
+bool rtnl_route_replace (const char *ifname, const char *destination, const char *netmask, const char *gateway);
+bool rtnl_route_delete  (const char *ifname, const char *destination, const char *netmask, const char *gateway);
+
+#endif /* USB_MODED_RTNL_H_ */
@@ -0,0 +1,916 @@
+/**
+ * @file usb_moded-snapshot.c
+ *
+ * Precompiled snapshot of static configuration and mode data
+ *
+ * Parsing all the ini-files under /etc/usb-moded on every startup
+ * is relatively slow on devices with slow storage. To avoid that,
+ * the merged static configuration and the dynamic mode definitions
+ * can be stored in a binary file that is mapped to memory and used
+ * as is - provided that the ini-files it was generated from are
+ * still present with unchanged size and modification time.
+ *
+ * Stale or missing snapshot is not an error, the ini-files are
+ * then parsed just like before.
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-snapshot.h"
+
+#include "usb_moded-config-private.h"
+#include "usb_moded-dyn-config.h"
+#include "usb_moded-keyfile.h"
+#include "usb_moded-log.h"
+#include "usb_moded-modes.h"
+
+#include <sys/stat.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <glob.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** File identification, exactly sizeof snapshot_header_t::sh_magic bytes */
+#define SNAPSHOT_MAGIC   "USBMSNAP"
+
+/** Bump whenever the binary layout changes */
+#define SNAPSHOT_VERSION 1
+
+/** Alignment used for sections within snapshot file */
+#define SNAPSHOT_ALIGN   8
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Groups of ini-files covered by snapshot
+ */
+typedef enum snapshot_set_t
+{
+    SNAPSHOT_SET_STATIC,  /**< Static config files */
+    SNAPSHOT_SET_MODES,   /**< Normal dynamic mode files */
+    SNAPSHOT_SET_DIAG,    /**< Diagnostic dynamic mode files */
+    SNAPSHOT_SET_COUNT
+} snapshot_set_t;
+
+/** Snapshot file header
+ *
+ * All offsets are relative to start of file, and all string
+ * references are offsets to string pool. String offset zero
+ * is used for representing NULL strings.
+ */
+typedef struct snapshot_header_t
+{
+    char     sh_magic[8];
+    uint32_t sh_version;
+    uint32_t sh_size;
+    uint32_t sh_field_count;
+    uint32_t sh_stamp_count;
+    uint32_t sh_stamp_offset;
+    uint32_t sh_setting_count;
+    uint32_t sh_setting_offset;
+    uint32_t sh_mode_count;
+    uint32_t sh_mode_offset;
+    uint32_t sh_string_offset;
+    uint32_t sh_string_size;
+    uint32_t sh_reserved;
+} snapshot_header_t;
+
+/** Identification of one ini-file the snapshot was generated from
+ */
+typedef struct snapshot_stamp_t
+{
+    uint32_t ss_set;
+    uint32_t ss_path;
+    int64_t  ss_size;
+    int64_t  ss_mtime_sec;
+    int64_t  ss_mtime_nsec;
+} snapshot_stamp_t;
+
+/** One value from merged static configuration
+ */
+typedef struct snapshot_setting_t
+{
+    uint32_t se_group;
+    uint32_t se_key;
+    uint32_t se_value;
+} snapshot_setting_t;
+
+/** Mapping between modedata_t member and mode record slot
+ */
+typedef struct snapshot_field_t
+{
+    size_t sf_offset;
+    bool   sf_string;
+} snapshot_field_t;
+
+/** Memory mapped snapshot file
+ */
+typedef struct snapshot_t
+{
+    GMappedFile             *sn_file;
+    const char              *sn_data;
+    size_t                   sn_size;
+    const snapshot_header_t *sn_header;
+} snapshot_t;
+
+/** State data for generating snapshot file content
+ */
+typedef struct snapshot_builder_t
+{
+    GString    *sb_stamps;
+    GString    *sb_settings;
+    GString    *sb_modes;
+    GString    *sb_strings;
+    GHashTable *sb_lookup;
+    uint32_t    sb_stamp_count;
+    uint32_t    sb_setting_count;
+    uint32_t    sb_mode_count;
+} snapshot_builder_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * SNAPSHOT_SET
+ * ------------------------------------------------------------------------- */
+
+static gchar     **snapshot_set_scan        (snapshot_set_t set);
+static bool        snapshot_set_stat        (const char *path, snapshot_stamp_t *stamp);
+
+/* ------------------------------------------------------------------------- *
+ * SNAPSHOT
+ * ------------------------------------------------------------------------- */
+
+static bool        snapshot_check_range     (const snapshot_t *self, uint32_t offset, uint64_t count, size_t size);
+static bool        snapshot_check_layout    (const snapshot_t *self);
+static bool        snapshot_open            (snapshot_t *self);
+static void        snapshot_close           (snapshot_t *self);
+static const char *snapshot_string          (const snapshot_t *self, uint32_t offset);
+static bool        snapshot_validate_set    (const snapshot_t *self, snapshot_set_t set);
+static modedata_t *snapshot_make_modedata   (const snapshot_t *self, const uint32_t *record);
+static void        snapshot_parse_static_config(GKeyFile *ini);
+void               snapshot_load_static_config(GKeyFile *ini);
+GList             *snapshot_load_modelist   (bool diag);
+
+/* ------------------------------------------------------------------------- *
+ * SNAPSHOT_BUILDER
+ * ------------------------------------------------------------------------- */
+
+static void        snapshot_builder_init    (snapshot_builder_t *self);
+static void        snapshot_builder_quit    (snapshot_builder_t *self);
+static uint32_t    snapshot_builder_string  (snapshot_builder_t *self, const char *str);
+static bool        snapshot_builder_stamps  (snapshot_builder_t *self, snapshot_set_t set);
+static void        snapshot_builder_settings(snapshot_builder_t *self, GKeyFile *ini);
+static void        snapshot_builder_modes   (snapshot_builder_t *self, snapshot_set_t set);
+static uint32_t    snapshot_builder_section (GString *data, const GString *section);
+static GString    *snapshot_builder_finish  (snapshot_builder_t *self);
+bool               snapshot_write           (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+#define SNAPSHOT_STRING_FIELD(name) { offsetof(modedata_t, name), true  }
+#define SNAPSHOT_INT_FIELD(name)    { offsetof(modedata_t, name), false }
+
+/** Layout of mode records
+ *
+ * Changes in modedata_t layout must be reflected here. Field count
+ * is stored in snapshot header, and snapshots with mismatching count
+ * are ignored.
+ */
+static const snapshot_field_t snapshot_modedata_fields[] =
+{
+    SNAPSHOT_STRING_FIELD(mode_name),
+    SNAPSHOT_STRING_FIELD(mode_module),
+    SNAPSHOT_INT_FIELD(appsync),
+    SNAPSHOT_INT_FIELD(network),
+    SNAPSHOT_INT_FIELD(mass_storage),
+    SNAPSHOT_STRING_FIELD(network_interface),
+    SNAPSHOT_STRING_FIELD(sysfs_path),
+    SNAPSHOT_STRING_FIELD(sysfs_value),
+    SNAPSHOT_STRING_FIELD(sysfs_reset_value),
+    SNAPSHOT_STRING_FIELD(android_extra_sysfs_path),
+    SNAPSHOT_STRING_FIELD(android_extra_sysfs_value),
+    SNAPSHOT_STRING_FIELD(android_extra_sysfs_path2),
+    SNAPSHOT_STRING_FIELD(android_extra_sysfs_value2),
+    SNAPSHOT_STRING_FIELD(android_extra_sysfs_path3),
+    SNAPSHOT_STRING_FIELD(android_extra_sysfs_value3),
+    SNAPSHOT_STRING_FIELD(android_extra_sysfs_path4),
+    SNAPSHOT_STRING_FIELD(android_extra_sysfs_value4),
+    SNAPSHOT_STRING_FIELD(idProduct),
+    SNAPSHOT_STRING_FIELD(idVendorOverride),
+    SNAPSHOT_INT_FIELD(nat),
+    SNAPSHOT_INT_FIELD(dhcp_server),
+#ifdef CONNMAN
+    SNAPSHOT_STRING_FIELD(connman_tethering),
+#endif
+};
+
+#define SNAPSHOT_FIELD_COUNT G_N_ELEMENTS(snapshot_modedata_fields)
+
+/** Size of mode record: set id + one slot per modedata_t field */
+#define SNAPSHOT_MODE_SIZE   (sizeof(uint32_t) * (1 + SNAPSHOT_FIELD_COUNT))
+
+/* ========================================================================= *
+ * SNAPSHOT_SET
+ * ========================================================================= */
+
+/** Get sorted list of ini-files belonging to a file set
+ *
+ * @param set  file set
+ *
+ * @return NULL terminated array of paths, release with g_strfreev()
+ */
+static gchar **
+snapshot_set_scan(snapshot_set_t set)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const char * const pattern[SNAPSHOT_SET_COUNT] = {
+        [SNAPSHOT_SET_STATIC] = USB_MODED_STATIC_CONFIG_DIR"/*.ini",
+        [SNAPSHOT_SET_MODES]  = MODE_DIR_PATH"/*.ini",
+        [SNAPSHOT_SET_DIAG]   = DIAG_DIR_PATH"/*.ini",
+    };
+
+    GPtrArray *array = g_ptr_array_new();
+    glob_t     gb    = {};
+
+    /* Note: glob() returns sorted results */
+    if( glob(pattern[set], 0, 0, &gb) == 0 ) {
+        for( size_t i = 0; i < gb.gl_pathc; ++i ) {
+            const char *path = gb.gl_pathv[i];
+            /* Legacy config file is not part of static config */
+            if( set == SNAPSHOT_SET_STATIC &&
+                !strcmp(path, USB_MODED_STATIC_CONFIG_FILE) )
+                continue;
+            g_ptr_array_add(array, g_strdup(path));
+        }
+    }
+    globfree(&gb);
+
+    g_ptr_array_add(array, 0);
+    return (gchar **)g_ptr_array_free(array, FALSE);
+}
+
+/** Get size and modification time of a file
+ *
+ * @param path   file path
+ * @param stamp  where to store file details
+ *
+ * @return true on success, false otherwise
+ */
+static bool
+snapshot_set_stat(const char *path, snapshot_stamp_t *stamp)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct stat st = {};
+
+    if( stat(path, &st) == -1 ) {
+        log_debug("%s: stat: %m", path);
+        return false;
+    }
+
+    stamp->ss_size       = st.st_size;
+    stamp->ss_mtime_sec  = st.st_mtim.tv_sec;
+    stamp->ss_mtime_nsec = st.st_mtim.tv_nsec;
+    return true;
+}
+
+/* ========================================================================= *
+ * SNAPSHOT
+ * ========================================================================= */
+
+/** Check that an array of items fits within snapshot file
+ *
+ * @param self    snapshot object
+ * @param offset  array offset
+ * @param count   number of items in array
+ * @param size    size of one array item
+ *
+ * @return true if array is properly aligned and within file, false otherwise
+ */
+static bool
+snapshot_check_range(const snapshot_t *self, uint32_t offset,
+                     uint64_t count, size_t size)
+{
+    if( offset % SNAPSHOT_ALIGN )
+        return false;
+    return offset + count * size <= self->sn_size;
+}
+
+/** Check that snapshot file content is usable
+ *
+ * @param self  snapshot object
+ *
+ * @return true if snapshot file is valid, false otherwise
+ */
+static bool
+snapshot_check_layout(const snapshot_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const snapshot_header_t *hdr = (const snapshot_header_t *)self->sn_data;
+
+    if( self->sn_size < sizeof *hdr )
+        return false;
+
+    if( memcmp(hdr->sh_magic, SNAPSHOT_MAGIC, sizeof hdr->sh_magic) )
+        return false;
+
+    if( hdr->sh_version != SNAPSHOT_VERSION ||
+        hdr->sh_size != self->sn_size ||
+        hdr->sh_field_count != SNAPSHOT_FIELD_COUNT )
+        return false;
+
+    if( !snapshot_check_range(self, hdr->sh_stamp_offset,
+                              hdr->sh_stamp_count,
+                              sizeof(snapshot_stamp_t)) ||
+        !snapshot_check_range(self, hdr->sh_setting_offset,
+                              hdr->sh_setting_count,
+                              sizeof(snapshot_setting_t)) ||
+        !snapshot_check_range(self, hdr->sh_mode_offset,
+                              hdr->sh_mode_count,
+                              SNAPSHOT_MODE_SIZE) ||
+        !snapshot_check_range(self, hdr->sh_string_offset,
+                              hdr->sh_string_size, 1) )
+        return false;
+
+    /* String pool must be non-empty and end with a terminator */
+    if( hdr->sh_string_size < 1 ||
+        self->sn_data[hdr->sh_string_offset + hdr->sh_string_size - 1] )
+        return false;
+
+    return true;
+}
+
+/** Map snapshot file to memory
+ *
+ * @param self  snapshot object
+ *
+ * @return true if valid snapshot file was mapped, false otherwise
+ */
+static bool
+snapshot_open(snapshot_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool    ack = false;
+    GError *err = 0;
+
+    self->sn_file = g_mapped_file_new(USB_MODED_SNAPSHOT_FILE, FALSE, &err);
+    if( !self->sn_file ) {
+        log_debug("%s: can't map: %s", USB_MODED_SNAPSHOT_FILE,
+                  err->message);
+        goto EXIT;
+    }
+
+    self->sn_data = g_mapped_file_get_contents(self->sn_file);
+    self->sn_size = g_mapped_file_get_length(self->sn_file);
+
+    if( !snapshot_check_layout(self) ) {
+        log_warning("%s: invalid snapshot file; ignored",
+                    USB_MODED_SNAPSHOT_FILE);
+        goto EXIT;
+    }
+
+    self->sn_header = (const snapshot_header_t *)self->sn_data;
+    ack = true;
+
+EXIT:
+    g_clear_error(&err);
+
+    if( !ack )
+        snapshot_close(self);
+
+    return ack;
+}
+
+/** Unmap snapshot file
+ *
+ * @param self  snapshot object
+ */
+static void
+snapshot_close(snapshot_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self->sn_file )
+        g_mapped_file_unref(self->sn_file);
+
+    self->sn_file   = 0;
+    self->sn_data   = 0;
+    self->sn_size   = 0;
+    self->sn_header = 0;
+}
+
+/** Lookup string from snapshot string pool
+ *
+ * @param self    snapshot object
+ * @param offset  offset within string pool
+ *
+ * @return string pointer, or NULL
+ */
+static const char *
+snapshot_string(const snapshot_t *self, uint32_t offset)
+{
+    const snapshot_header_t *hdr = self->sn_header;
+
+    if( offset == 0 || offset >= hdr->sh_string_size )
+        return 0;
+
+    return self->sn_data + hdr->sh_string_offset + offset;
+}
+
+/** Check that files in a set have not changed since snapshot was made
+ *
+ * @param self  snapshot object
+ * @param set   file set
+ *
+ * @return true if snapshot content is up to date, false otherwise
+ */
+static bool
+snapshot_validate_set(const snapshot_t *self, snapshot_set_t set)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const snapshot_header_t *hdr    = self->sn_header;
+    const snapshot_stamp_t  *stamps =
+        (const snapshot_stamp_t *)(self->sn_data + hdr->sh_stamp_offset);
+
+    bool    valid = false;
+    gchar **paths = snapshot_set_scan(set);
+    size_t  count = 0;
+
+    for( uint32_t i = 0; i < hdr->sh_stamp_count; ++i ) {
+        const snapshot_stamp_t *stamp = stamps + i;
+
+        if( stamp->ss_set != set )
+            continue;
+
+        const char      *path = paths[count];
+        snapshot_stamp_t curr = {};
+
+        if( !path || g_strcmp0(path, snapshot_string(self, stamp->ss_path)) ) {
+            log_debug("snapshot: set of config files has changed");
+            goto EXIT;
+        }
+
+        if( !snapshot_set_stat(path, &curr) ||
+            curr.ss_size       != stamp->ss_size ||
+            curr.ss_mtime_sec  != stamp->ss_mtime_sec ||
+            curr.ss_mtime_nsec != stamp->ss_mtime_nsec ) {
+            log_debug("snapshot: %s has changed", path);
+            goto EXIT;
+        }
+        ++count;
+    }
+
+    if( paths[count] ) {
+        log_debug("snapshot: %s has been added", paths[count]);
+        goto EXIT;
+    }
+
+    valid = true;
+
+EXIT:
+    g_strfreev(paths);
+    return valid;
+}
+
+/** Construct modedata_t object from snapshot mode record
+ *
+ * @param self    snapshot object
+ * @param record  array of SNAPSHOT_FIELD_COUNT values
+ *
+ * @return modedata_t object, or NULL
+ */
+static modedata_t *
+snapshot_make_modedata(const snapshot_t *self, const uint32_t *record)
+{
+    LOG_REGISTER_CONTEXT;
+
+    modedata_t *data = modedata_create();
+
+    if( !data )
+        goto EXIT;
+
+    for( size_t i = 0; i < SNAPSHOT_FIELD_COUNT; ++i ) {
+        const snapshot_field_t *field = snapshot_modedata_fields + i;
+        char *member = (char *)data + field->sf_offset;
+        if( field->sf_string )
+            *(gchar **)member = g_strdup(snapshot_string(self, record[i]));
+        else
+            *(int *)member = (int)record[i];
+    }
+
+    /* Snapshot generation skips invalid mode files, so this
+     * should not happen unless the file has been tampered with */
+    if( !data->mode_name || !data->mode_module )
+        modedata_unref(data), data = 0;
+
+EXIT:
+    return data;
+}
+
+/** Parse static configuration ini-files
+ *
+ * Files are processed in alphabetical order, and values from
+ * later files override values from earlier ones.
+ *
+ * @param ini  keyfile to fill in
+ */
+static void
+snapshot_parse_static_config(GKeyFile *ini)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar **paths = snapshot_set_scan(SNAPSHOT_SET_STATIC);
+
+    if( !*paths )
+        log_debug("no configuration ini-files found");
+
+    /* Seed with default values */
+    g_key_file_set_string(ini, MODE_SETTING_ENTRY, MODE_SETTING_KEY, MODE_ASK);
+
+    /* Override with content from config files */
+    for( size_t i = 0; paths[i]; ++i )
+        keyfile_merge_from_file(ini, paths[i]);
+
+    g_strfreev(paths);
+}
+
+/** Load merged static configuration
+ *
+ * Uses snapshot if it is up to date, parses ini-files otherwise.
+ *
+ * @param ini  keyfile to fill in
+ */
+void
+snapshot_load_static_config(GKeyFile *ini)
+{
+    LOG_REGISTER_CONTEXT;
+
+    snapshot_t snap = {};
+
+    if( snapshot_open(&snap) &&
+        snapshot_validate_set(&snap, SNAPSHOT_SET_STATIC) ) {
+        const snapshot_header_t  *hdr = snap.sn_header;
+        const snapshot_setting_t *settings =
+            (const snapshot_setting_t *)(snap.sn_data + hdr->sh_setting_offset);
+
+        for( uint32_t i = 0; i < hdr->sh_setting_count; ++i ) {
+            const char *grp = snapshot_string(&snap, settings[i].se_group);
+            const char *key = snapshot_string(&snap, settings[i].se_key);
+            const char *val = snapshot_string(&snap, settings[i].se_value);
+            if( grp && key && val )
+                g_key_file_set_value(ini, grp, key, val);
+        }
+        log_debug("static config loaded from snapshot");
+    }
+    else {
+        snapshot_parse_static_config(ini);
+    }
+
+    snapshot_close(&snap);
+}
+
+/** Load dynamic mode data items
+ *
+ * Uses snapshot if it is up to date, parses ini-files otherwise.
+ *
+ * @param diag  true to load diagnostic modes, or
+ *              false for normal modes
+ *
+ * @return List of mode data objects, or NULL
+ */
+GList *
+snapshot_load_modelist(bool diag)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GList          *modelist = 0;
+    snapshot_t      snap     = {};
+    snapshot_set_t  set      = diag ? SNAPSHOT_SET_DIAG : SNAPSHOT_SET_MODES;
+
+    if( snapshot_open(&snap) && snapshot_validate_set(&snap, set) ) {
+        const snapshot_header_t *hdr = snap.sn_header;
+        const char *records = snap.sn_data + hdr->sh_mode_offset;
+
+        /* Records are stored in modelist_load() order */
+        for( uint32_t i = 0; i < hdr->sh_mode_count; ++i ) {
+            const uint32_t *record =
+                (const uint32_t *)(records + i * SNAPSHOT_MODE_SIZE);
+            modedata_t *data;
+            if( record[0] != set )
+                continue;
+            if( (data = snapshot_make_modedata(&snap, record + 1)) )
+                modelist = g_list_append(modelist, data);
+        }
+        log_debug("modelist loaded from snapshot");
+    }
+    else {
+        modelist = modelist_load(diag);
+    }
+
+    snapshot_close(&snap);
+
+    return modelist;
+}
+
+/* ========================================================================= *
+ * SNAPSHOT_BUILDER
+ * ========================================================================= */
+
+static void
+snapshot_builder_init(snapshot_builder_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    self->sb_stamps   = g_string_new(0);
+    self->sb_settings = g_string_new(0);
+    self->sb_modes    = g_string_new(0);
+    self->sb_strings  = g_string_new(0);
+    self->sb_lookup   = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free, 0);
+
+    self->sb_stamp_count   = 0;
+    self->sb_setting_count = 0;
+    self->sb_mode_count    = 0;
+
+    /* Offset zero is reserved for NULL strings */
+    g_string_append_c(self->sb_strings, 0);
+}
+
+static void
+snapshot_builder_quit(snapshot_builder_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_string_free(self->sb_stamps, TRUE);
+    g_string_free(self->sb_settings, TRUE);
+    g_string_free(self->sb_modes, TRUE);
+    g_string_free(self->sb_strings, TRUE);
+    g_hash_table_unref(self->sb_lookup);
+}
+
+/** Add string to string pool
+ *
+ * @param self  builder object
+ * @param str   string to add, or NULL
+ *
+ * @return string pool offset
+ */
+static uint32_t
+snapshot_builder_string(snapshot_builder_t *self, const char *str)
+{
+    gpointer offset;
+
+    if( !str )
+        return 0;
+
+    if( !g_hash_table_lookup_extended(self->sb_lookup, str, 0, &offset) ) {
+        offset = GUINT_TO_POINTER(self->sb_strings->len);
+        g_string_append_len(self->sb_strings, str, strlen(str) + 1);
+        g_hash_table_insert(self->sb_lookup, g_strdup(str), offset);
+    }
+
+    return GPOINTER_TO_UINT(offset);
+}
+
+/** Add stamps for all files in a file set
+ *
+ * @param self  builder object
+ * @param set   file set
+ *
+ * @return true on success, false otherwise
+ */
+static bool
+snapshot_builder_stamps(snapshot_builder_t *self, snapshot_set_t set)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool    ack   = true;
+    gchar **paths = snapshot_set_scan(set);
+
+    for( size_t i = 0; paths[i]; ++i ) {
+        snapshot_stamp_t stamp = {
+            .ss_set  = set,
+            .ss_path = snapshot_builder_string(self, paths[i]),
+        };
+        if( !snapshot_set_stat(paths[i], &stamp) ) {
+            log_err("%s: can't stat", paths[i]);
+            ack = false;
+            break;
+        }
+        g_string_append_len(self->sb_stamps, (const char *)&stamp,
+                            sizeof stamp);
+        self->sb_stamp_count += 1;
+    }
+
+    g_strfreev(paths);
+    return ack;
+}
+
+/** Add all values from a keyfile
+ *
+ * @param self  builder object
+ * @param ini   merged static configuration
+ */
+static void
+snapshot_builder_settings(snapshot_builder_t *self, GKeyFile *ini)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar **grp = g_key_file_get_groups(ini, 0);
+
+    for( size_t g = 0; grp && grp[g]; ++g ) {
+        gchar **key = g_key_file_get_keys(ini, grp[g], 0, 0);
+        for( size_t k = 0; key && key[k]; ++k ) {
+            gchar *val = g_key_file_get_value(ini, grp[g], key[k], 0);
+            if( val ) {
+                snapshot_setting_t setting = {
+                    .se_group = snapshot_builder_string(self, grp[g]),
+                    .se_key   = snapshot_builder_string(self, key[k]),
+                    .se_value = snapshot_builder_string(self, val),
+                };
+                g_string_append_len(self->sb_settings,
+                                    (const char *)&setting, sizeof setting);
+                self->sb_setting_count += 1;
+            }
+            g_free(val);
+        }
+        g_strfreev(key);
+    }
+    g_strfreev(grp);
+}
+
+/** Add mode records for all valid mode files in a file set
+ *
+ * @param self  builder object
+ * @param set   SNAPSHOT_SET_MODES or SNAPSHOT_SET_DIAG
+ */
+static void
+snapshot_builder_modes(snapshot_builder_t *self, snapshot_set_t set)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GList *modelist = modelist_load(set == SNAPSHOT_SET_DIAG);
+
+    for( GList *iter = modelist; iter; iter = g_list_next(iter) ) {
+        const modedata_t *data = iter->data;
+        uint32_t record[1 + SNAPSHOT_FIELD_COUNT];
+
+        record[0] = set;
+        for( size_t i = 0; i < SNAPSHOT_FIELD_COUNT; ++i ) {
+            const snapshot_field_t *field = snapshot_modedata_fields + i;
+            const char *member = (const char *)data + field->sf_offset;
+            if( field->sf_string )
+                record[1 + i] = snapshot_builder_string(self, *(gchar * const *)member);
+            else
+                record[1 + i] = (uint32_t)*(const int *)member;
+        }
+        g_string_append_len(self->sb_modes, (const char *)record,
+                            sizeof record);
+        self->sb_mode_count += 1;
+    }
+
+    modelist_free(modelist);
+}
+
+/** Append aligned section to snapshot data
+ *
+ * @param data     snapshot data
+ * @param section  section data
+ *
+ * @return offset of section within snapshot data
+ */
+static uint32_t
+snapshot_builder_section(GString *data, const GString *section)
+{
+    while( data->len % SNAPSHOT_ALIGN )
+        g_string_append_c(data, 0);
+
+    uint32_t offset = data->len;
+    g_string_append_len(data, section->str, section->len);
+    return offset;
+}
+
+/** Combine collected data into snapshot file content
+ *
+ * @param self  builder object
+ *
+ * @return snapshot file content, release with g_string_free()
+ */
+static GString *
+snapshot_builder_finish(snapshot_builder_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GString          *data   = g_string_new(0);
+    snapshot_header_t header = {};
+
+    /* Reserve space for header */
+    g_string_append_len(data, (const char *)&header, sizeof header);
+
+    memcpy(header.sh_magic, SNAPSHOT_MAGIC, sizeof header.sh_magic);
+    header.sh_version        = SNAPSHOT_VERSION;
+    header.sh_field_count    = SNAPSHOT_FIELD_COUNT;
+    header.sh_stamp_count    = self->sb_stamp_count;
+    header.sh_stamp_offset   = snapshot_builder_section(data, self->sb_stamps);
+    header.sh_setting_count  = self->sb_setting_count;
+    header.sh_setting_offset = snapshot_builder_section(data, self->sb_settings);
+    header.sh_mode_count     = self->sb_mode_count;
+    header.sh_mode_offset    = snapshot_builder_section(data, self->sb_modes);
+    header.sh_string_size    = self->sb_strings->len;
+    header.sh_string_offset  = snapshot_builder_section(data, self->sb_strings);
+    header.sh_size           = data->len;
+
+    memcpy(data->str, &header, sizeof header);
+    return data;
+}
+
+/** Generate snapshot from current ini-files
+ *
+ * @return true on success, false otherwise
+ */
+bool
+snapshot_write(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool                ack     = false;
+    GError             *err     = 0;
+    GKeyFile           *ini     = g_key_file_new();
+    GString            *data    = 0;
+    snapshot_builder_t  builder = {};
+
+    snapshot_builder_init(&builder);
+
+    /* Stamp files before parsing them: if something gets modified
+     * while the snapshot is being generated, the result looks stale
+     * instead of outdated content passing validation. */
+    for( int set = 0; set < SNAPSHOT_SET_COUNT; ++set ) {
+        if( !snapshot_builder_stamps(&builder, set) )
+            goto EXIT;
+    }
+
+    snapshot_parse_static_config(ini);
+    snapshot_builder_settings(&builder, ini);
+
+    snapshot_builder_modes(&builder, SNAPSHOT_SET_MODES);
+    snapshot_builder_modes(&builder, SNAPSHOT_SET_DIAG);
+
+    data = snapshot_builder_finish(&builder);
+
+    if( g_mkdir_with_parents(USB_MODED_SNAPSHOT_DIR, 0755) == -1 ) {
+        log_err("%s: can't create directory: %m", USB_MODED_SNAPSHOT_DIR);
+        goto EXIT;
+    }
+
+    /* Note: g_file_set_contents() replaces the file atomically, so
+     *       concurrent readers see either the old or the new data */
+    if( !g_file_set_contents(USB_MODED_SNAPSHOT_FILE, data->str,
+                             data->len, &err) ) {
+        log_err("%s: can't save: %s", USB_MODED_SNAPSHOT_FILE, err->message);
+        goto EXIT;
+    }
+
+    log_notice("%s: %u files, %u settings, %u modes",
+               USB_MODED_SNAPSHOT_FILE, builder.sb_stamp_count,
+               builder.sb_setting_count, builder.sb_mode_count);
+    ack = true;
+
+EXIT:
+    if( data )
+        g_string_free(data, TRUE);
+    g_clear_error(&err);
+    g_key_file_free(ini);
+    snapshot_builder_quit(&builder);
+
+    return ack;
+}
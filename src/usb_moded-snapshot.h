@@ -0,0 +1,50 @@
+/**
+ * @file usb_moded-snapshot.h
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_SNAPSHOT_H_
+# define USB_MODED_SNAPSHOT_H_
+
+# include <stdbool.h>
+# include <glib.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+# ifndef USB_MODED_SNAPSHOT_DIR
+#  define USB_MODED_SNAPSHOT_DIR   "/var/cache/usb-moded"
+# endif
+# define USB_MODED_SNAPSHOT_FILE  USB_MODED_SNAPSHOT_DIR"/config.snapshot"
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * SNAPSHOT
+ * ------------------------------------------------------------------------- */
+
+void   snapshot_load_static_config(GKeyFile *ini);
+GList *snapshot_load_modelist     (bool diag);
+bool   snapshot_write             (void);
+
+#endif /* USB_MODED_SNAPSHOT_H_ */
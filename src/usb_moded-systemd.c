@@ -25,8 +25,19 @@
 
 #include "usb_moded-systemd.h"
 
+#include "usb_moded.h"
+#include "usb_moded-common.h"
 #include "usb_moded-dbus-private.h"
+#include "usb_moded-exec.h"
 #include "usb_moded-log.h"
+#include "usb_moded-worker.h"
+
+#include <sys/eventfd.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../dbus-gmain/dbus-gmain.h"
 
 /* ========================================================================= *
  * Constants
@@ -36,17 +47,124 @@
 #define SYSTEMD_DBUS_PATH      "/org/freedesktop/systemd1"
 #define SYSTEMD_DBUS_INTERFACE "org.freedesktop.systemd1.Manager"
 
+#define SYSTEMD_SUBSCRIBE_REQ  "Subscribe"
+#define SYSTEMD_UNSUBSCRIBE_REQ "Unsubscribe"
+#define SYSTEMD_JOB_REMOVED_SIG "JobRemoved"
+
+#define SYSTEMD_JOB_REMOVED_MATCH\
+     "type='signal'"\
+     ",sender='"SYSTEMD_DBUS_SERVICE"'"\
+     ",path='"SYSTEMD_DBUS_PATH"'"\
+     ",interface='"SYSTEMD_DBUS_INTERFACE"'"\
+     ",member='"SYSTEMD_JOB_REMOVED_SIG"'"
+
+/** Session bus socket paths to try, with user id as parameter */
+#define SYSTEMD_USER_BUS_SAILFISH "/run/user/%u/dbus/user_bus_socket"
+#define SYSTEMD_USER_BUS_DEFAULT  "/run/user/%u/bus"
+
+/** Timeout for systemd method calls [ms] */
+#define SYSTEMD_DBUS_TIMEOUT   25000
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Unit job life cycle states
+ */
+typedef enum systemd_job_state_t
+{
+    /** StartUnit / StopUnit call has been sent */
+    SYSTEMD_JOB_CALLING,
+
+    /** Job has been queued, waiting for JobRemoved signal */
+    SYSTEMD_JOB_QUEUED,
+
+    /** Job has finished, or the method call failed */
+    SYSTEMD_JOB_FINISHED,
+} systemd_job_state_t;
+
+/** Tracking data for one unit job
+ */
+struct systemd_job_t
+{
+    /** Unit name */
+    gchar               *sj_unit;
+
+    /** Method used for creating the job, e.g. SYSTEMD_START */
+    gchar               *sj_method;
+
+    /** Connection to the systemd instance running the job */
+    DBusConnection      *sj_con;
+
+    /** Pending StartUnit / StopUnit call */
+    DBusPendingCall     *sj_pc;
+
+    /** Job object path, once known */
+    gchar               *sj_path;
+
+    /** Job result from JobRemoved signal, or "failed" */
+    gchar               *sj_result;
+
+    /** Life cycle state */
+    systemd_job_state_t  sj_state;
+};
+
+/** Array of jobs to wait for
+ */
+typedef struct systemd_job_set_t
+{
+    /** Job objects */
+    systemd_job_t **js_jobs;
+
+    /** Number of jobs */
+    size_t          js_count;
+} systemd_job_set_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
 
+/* ------------------------------------------------------------------------- *
+ * SYSTEMD_JOB
+ * ------------------------------------------------------------------------- */
+
+static void               systemd_job_finish_locked      (systemd_job_t *self, const char *result);
+static void               systemd_job_handle_reply_locked(systemd_job_t *self);
+static bool               systemd_job_tracked_locked     (const systemd_job_t *self);
+static void               systemd_job_reply_cb           (DBusPendingCall *pc, void *aptr);
+static systemd_job_t     *systemd_job_start_on           (DBusConnection *con, const char *unit, const char *method);
+systemd_job_t            *systemd_job_start              (const char *unit, const char *method);
+static bool               systemd_job_succeeded_locked   (const systemd_job_t *self, bool queued_ok);
+static bool               systemd_job_all_finished_p     (void *aptr);
+bool                      systemd_job_wait               (systemd_job_t **jobs, size_t count, unsigned tot_ms);
+bool                      systemd_job_succeeded          (const systemd_job_t *self);
+const char               *systemd_job_result             (const systemd_job_t *self);
+void                      systemd_job_free               (systemd_job_t *self);
+
 /* ------------------------------------------------------------------------- *
  * SYSTEMD
  * ------------------------------------------------------------------------- */
 
-gboolean systemd_control_service(const char *name, const char *method);
-gboolean systemd_control_start  (void);
-void     systemd_control_stop   (void);
+static void               systemd_job_removed_signal     (DBusConnection *con, DBusMessage *msg);
+static void               systemd_connection_lost        (DBusConnection *con);
+static DBusHandlerResult  systemd_dbus_filter_cb         (DBusConnection *con, DBusMessage *msg, void *aptr);
+static void               systemd_send_manager_request   (DBusConnection *con, const char *method);
+gboolean                  systemd_control_units          (const char *method, const char * const *units, unsigned tot_ms);
+gboolean                  systemd_control_service        (const char *name, const char *method);
+gboolean                  systemd_control_start          (void);
+void                      systemd_control_stop           (void);
+
+/* ------------------------------------------------------------------------- *
+ * SYSTEMD_USER
+ * ------------------------------------------------------------------------- */
+
+static gchar             *systemd_user_bus_address       (uid_t uid);
+static DBusConnection    *systemd_user_connect           (uid_t uid);
+static void               systemd_user_disconnect        (DBusConnection *con);
+static DBusConnection    *systemd_user_get_connection    (void);
+void                      systemd_user_changed           (void);
+systemd_job_t            *systemd_user_job_start         (const char *unit, const char *method);
+gboolean                  systemd_user_control_service   (const char *name, const char *method, unsigned tot_ms);
 
 /* ========================================================================= *
  * Data
@@ -55,29 +173,191 @@ void     systemd_control_stop   (void);
 /* SystemBus connection ref used for systemd control ipc */
 static DBusConnection *systemd_con = NULL;
 
+/** Private connection to user session bus, for user systemd control */
+static DBusConnection *systemd_user_con = NULL;
+
+/** User that systemd_user_con belongs to */
+static uid_t systemd_user_uid = UID_UNKNOWN;
+
+/** Unit jobs that have not been released yet */
+static GSList *systemd_jobs = NULL;
+
+/** eventfd descriptor for waking up threads waiting for jobs to finish */
+static int systemd_job_evfd = -1;
+
+/** Mutex for accessing systemd_jobs, job contents and user connection */
+static pthread_mutex_t systemd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define SYSTEMD_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&systemd_mutex) != 0 ) { \
+        log_crit("SYSTEMD LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define SYSTEMD_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&systemd_mutex) != 0 ) { \
+        log_crit("SYSTEMD UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
 /* ========================================================================= *
- * Functions
+ * SYSTEMD_JOB
  * ========================================================================= */
 
-// QDBusObjectPath org.freedesktop.systemd1.Manager.StartUnit(QString name, QString mode)
-// QDBusObjectPath org.freedesktop.systemd1.Manager.StopUnit(QString name, QString mode)
+/** Mark job finished and wake up waiting threads
+ *
+ * @param self    job object
+ * @param result  job result, e.g. "done"
+ */
+static void
+systemd_job_finish_locked(systemd_job_t *self, const char *result)
+{
+    LOG_REGISTER_CONTEXT;
 
-//  mode = replace
-//  method = StartUnit or StopUnit
-gboolean systemd_control_service(const char *name, const char *method)
+    if( self->sj_state == SYSTEMD_JOB_FINISHED )
+        goto EXIT;
+
+    self->sj_state  = SYSTEMD_JOB_FINISHED;
+    self->sj_result = g_strdup(result);
+
+    log_debug("%s(%s) -> %s", self->sj_method, self->sj_unit, result);
+
+    if( systemd_job_evfd != -1 ) {
+        uint64_t cnt = 1;
+        if( write(systemd_job_evfd, &cnt, sizeof cnt) == -1 )
+            log_warning("systemd job wakeup: %m");
+    }
+
+EXIT:
+    return;
+}
+
+/** Process StartUnit / StopUnit reply
+ *
+ * Can be called several times, only the first call after the reply
+ * has arrived has an effect.
+ *
+ * @param self  job object
+ */
+static void
+systemd_job_handle_reply_locked(systemd_job_t *self)
 {
     LOG_REGISTER_CONTEXT;
 
-    DBusMessage    *req = NULL;
-    DBusMessage    *rsp = NULL;
-    DBusError       err = DBUS_ERROR_INIT;
-    const char     *arg = "replace";
-    const char     *res = 0;
+    DBusMessage *rsp = NULL;
+    DBusError    err = DBUS_ERROR_INIT;
+    const char  *res = 0;
 
-    log_debug("%s(%s) ...", method, name);
+    if( !self->sj_pc || !dbus_pending_call_get_completed(self->sj_pc) )
+        goto EXIT;
 
-    if( !systemd_con ) {
-        log_err("not connected to system bus; skip systemd unit control");
+    rsp = dbus_pending_call_steal_reply(self->sj_pc);
+    dbus_pending_call_unref(self->sj_pc), self->sj_pc = 0;
+
+    if( !rsp ) {
+        log_err("no reply to %s.%s request",
+                SYSTEMD_DBUS_INTERFACE,
+                self->sj_method);
+        systemd_job_finish_locked(self, "failed");
+        goto EXIT;
+    }
+
+    if( dbus_set_error_from_message(&err, rsp) ) {
+        log_err("got error reply to %s.%s request: %s: %s",
+                SYSTEMD_DBUS_INTERFACE,
+                self->sj_method,
+                err.name, err.message);
+        systemd_job_finish_locked(self, "failed");
+        goto EXIT;
+    }
+
+    if( !dbus_message_get_args(rsp, &err,
+                               DBUS_TYPE_OBJECT_PATH, &res,
+                               DBUS_TYPE_INVALID) ) {
+        log_err("failed to parse reply to %s.%s request: %s: %s",
+                SYSTEMD_DBUS_INTERFACE,
+                self->sj_method,
+                err.name, err.message);
+        systemd_job_finish_locked(self, "failed");
+        goto EXIT;
+    }
+
+    log_debug("%s(%s) -> queued as %s", self->sj_method, self->sj_unit, res);
+    self->sj_path  = g_strdup(res);
+    self->sj_state = SYSTEMD_JOB_QUEUED;
+
+EXIT:
+    dbus_error_free(&err);
+
+    if( rsp )
+        dbus_message_unref(rsp);
+}
+
+/** Check that job has not been released
+ *
+ * @param self  job object
+ *
+ * @return true if job is still tracked, false otherwise
+ */
+static bool
+systemd_job_tracked_locked(const systemd_job_t *self)
+{
+    return g_slist_find(systemd_jobs, self) != 0;
+}
+
+/** Pending call notification callback
+ *
+ * Note: This function is called from the main thread.
+ *
+ * @param pc    pending call
+ * @param aptr  job object, possibly already released
+ */
+static void
+systemd_job_reply_cb(DBusPendingCall *pc, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    systemd_job_t *self = aptr;
+
+    SYSTEMD_LOCKED_ENTER;
+    if( systemd_job_tracked_locked(self) && self->sj_pc == pc )
+        systemd_job_handle_reply_locked(self);
+    SYSTEMD_LOCKED_LEAVE;
+}
+
+/** Start a unit job without waiting for it to finish
+ *
+ * @param con     connection to systemd instance, or NULL
+ * @param unit    unit name
+ * @param method  SYSTEMD_START or SYSTEMD_STOP
+ *
+ * @return job object
+ */
+static systemd_job_t *
+systemd_job_start_on(DBusConnection *con, const char *unit, const char *method)
+{
+    LOG_REGISTER_CONTEXT;
+
+    systemd_job_t   *self = g_malloc0(sizeof *self);
+    DBusMessage     *req  = NULL;
+    DBusPendingCall *pc   = NULL;
+    const char      *arg  = "replace";
+
+    self->sj_unit   = g_strdup(unit);
+    self->sj_method = g_strdup(method);
+    self->sj_con    = con ? dbus_connection_ref(con) : 0;
+    self->sj_state  = SYSTEMD_JOB_CALLING;
+
+    SYSTEMD_LOCKED_ENTER;
+    systemd_jobs = g_slist_prepend(systemd_jobs, self);
+    SYSTEMD_LOCKED_LEAVE;
+
+    log_debug("%s(%s) ...", method, unit);
+
+    if( !con ) {
+        log_err("not connected to systemd; skip systemd unit control");
         goto EXIT;
     }
 
@@ -93,7 +373,7 @@ gboolean systemd_control_service(const char *name, const char *method)
     }
 
     if( !dbus_message_append_args(req,
-                                  DBUS_TYPE_STRING, &name,
+                                  DBUS_TYPE_STRING, &unit,
                                   DBUS_TYPE_STRING, &arg,
                                   DBUS_TYPE_INVALID))
     {
@@ -101,43 +381,429 @@ gboolean systemd_control_service(const char *name, const char *method)
         goto EXIT;
     }
 
-    rsp = dbus_connection_send_with_reply_and_block(systemd_con, req, -1, &err);
-    if( !rsp ) {
-        log_err("no reply to %s.%s request: %s: %s",
+    /* The pending call must be attached to the job before the
+     * main thread gets a chance to dispatch the reply or the
+     * JobRemoved signal that follows it */
+    SYSTEMD_LOCKED_ENTER;
+    if( dbus_connection_send_with_reply(con, req, &pc,
+                                        SYSTEMD_DBUS_TIMEOUT) && pc )
+        self->sj_pc = dbus_pending_call_ref(pc);
+    SYSTEMD_LOCKED_LEAVE;
+
+    if( !pc ) {
+        log_err("failed to send %s.%s request",
                 SYSTEMD_DBUS_INTERFACE,
-                method,
-                err.name, err.message);
+                method);
         goto EXIT;
     }
 
-    if( dbus_set_error_from_message(&err, rsp) ) {
-        log_err("got error reply to %s.%s request: %s: %s",
-                SYSTEMD_DBUS_INTERFACE,
-                method,
-                err.name, err.message);
+    if( !dbus_pending_call_set_notify(pc, systemd_job_reply_cb, self, 0) )
+        log_warning("failed to set up %s.%s reply notification",
+                    SYSTEMD_DBUS_INTERFACE, method);
+
+    /* Reply might have arrived already, in which case the
+     * notification is either not made or ignored */
+    SYSTEMD_LOCKED_ENTER;
+    systemd_job_handle_reply_locked(self);
+    SYSTEMD_LOCKED_LEAVE;
+
+EXIT:
+    if( pc )
+        dbus_pending_call_unref(pc);
+
+    if( req )
+        dbus_message_unref(req);
+
+    SYSTEMD_LOCKED_ENTER;
+    if( self->sj_state == SYSTEMD_JOB_CALLING && !self->sj_pc )
+        systemd_job_finish_locked(self, "failed");
+    SYSTEMD_LOCKED_LEAVE;
+
+    return self;
+}
+
+/** Start a system unit job without waiting for it to finish
+ *
+ * The returned object must be released with #systemd_job_free().
+ *
+ * Note: This function is safe to call from any thread.
+ *
+ * @param unit    unit name
+ * @param method  SYSTEMD_START or SYSTEMD_STOP
+ *
+ * @return job object
+ */
+systemd_job_t *
+systemd_job_start(const char *unit, const char *method)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return systemd_job_start_on(systemd_con, unit, method);
+}
+
+/** Check if job finished successfully
+ *
+ * @param self       job object
+ * @param queued_ok  true if getting the job queued is enough
+ *
+ * @return true if job succeeded, false otherwise
+ */
+static bool
+systemd_job_succeeded_locked(const systemd_job_t *self, bool queued_ok)
+{
+    if( self->sj_state == SYSTEMD_JOB_QUEUED )
+        return queued_ok;
+
+    if( self->sj_state != SYSTEMD_JOB_FINISHED )
+        return false;
+
+    return (!g_strcmp0(self->sj_result, "done") ||
+            !g_strcmp0(self->sj_result, "skipped"));
+}
+
+/** Predicate for: all jobs in a set have finished
+ *
+ * @param aptr  job set
+ *
+ * @return true if all jobs are finished, false otherwise
+ */
+static bool
+systemd_job_all_finished_p(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const systemd_job_set_t *set = aptr;
+    bool finished = true;
+
+    SYSTEMD_LOCKED_ENTER;
+    for( size_t i = 0; finished && i < set->js_count; ++i )
+        finished = (set->js_jobs[i]->sj_state == SYSTEMD_JOB_FINISHED);
+    SYSTEMD_LOCKED_LEAVE;
+
+    return finished;
+}
+
+/** Wait for unit jobs to finish
+ *
+ * When called from the worker thread, waits until systemd reports
+ * all jobs as removed, the time limit is reached, or the mode switch
+ * gets superseded.
+ *
+ * D-Bus signals are dispatched by the main thread, so other threads
+ * can only wait for the jobs to get queued.
+ *
+ * @param jobs    array of job objects
+ * @param count   number of jobs in the array
+ * @param tot_ms  maximum time to wait [ms]
+ *
+ * @return true if all jobs succeeded, false otherwise
+ */
+bool
+systemd_job_wait(systemd_job_t **jobs, size_t count, unsigned tot_ms)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack       = false;
+    bool queued_ok = !worker_thread_p();
+
+    if( queued_ok ) {
+        for( size_t i = 0; i < count; ++i ) {
+            DBusPendingCall *pc = 0;
+
+            SYSTEMD_LOCKED_ENTER;
+            if( jobs[i]->sj_pc )
+                pc = dbus_pending_call_ref(jobs[i]->sj_pc);
+            SYSTEMD_LOCKED_LEAVE;
+
+            if( pc ) {
+                dbus_pending_call_block(pc);
+                dbus_pending_call_unref(pc);
+            }
+
+            SYSTEMD_LOCKED_ENTER;
+            systemd_job_handle_reply_locked(jobs[i]);
+            SYSTEMD_LOCKED_LEAVE;
+        }
+    }
+    else {
+        systemd_job_set_t set = {
+            .js_jobs  = jobs,
+            .js_count = count,
+        };
+        if( common_wait_fd(tot_ms, systemd_job_evfd,
+                           systemd_job_all_finished_p, &set) != WAIT_READY )
+            log_warning("waiting for systemd jobs canceled");
+    }
+
+    SYSTEMD_LOCKED_ENTER;
+    ack = true;
+    for( size_t i = 0; i < count; ++i ) {
+        if( !systemd_job_succeeded_locked(jobs[i], queued_ok) ) {
+            log_warning("%s(%s) did not succeed: %s",
+                        jobs[i]->sj_method, jobs[i]->sj_unit,
+                        jobs[i]->sj_result ?: "unfinished");
+            ack = false;
+        }
+    }
+    SYSTEMD_LOCKED_LEAVE;
+
+    return ack;
+}
+
+/** Check if job finished successfully
+ *
+ * Meant to be used after #systemd_job_wait() for finding out which
+ * jobs failed. Like there, getting the job queued is enough when not
+ * called from the worker thread.
+ *
+ * @param self  job object
+ *
+ * @return true if job succeeded, false otherwise
+ */
+bool
+systemd_job_succeeded(const systemd_job_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack;
+
+    SYSTEMD_LOCKED_ENTER;
+    ack = systemd_job_succeeded_locked(self, !worker_thread_p());
+    SYSTEMD_LOCKED_LEAVE;
+
+    return ack;
+}
+
+/** Get job result
+ *
+ * @param self  job object
+ *
+ * @return result reported by systemd, "failed", or NULL if not finished
+ */
+const char *
+systemd_job_result(const systemd_job_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *res = 0;
+
+    SYSTEMD_LOCKED_ENTER;
+    if( self->sj_state == SYSTEMD_JOB_FINISHED )
+        res = self->sj_result;
+    SYSTEMD_LOCKED_LEAVE;
+
+    return res;
+}
+
+/** Stop tracking a unit job and release it
+ *
+ * Unfinished jobs are left running in systemd.
+ *
+ * @param self  job object, or NULL
+ */
+void
+systemd_job_free(systemd_job_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !self )
         goto EXIT;
+
+    SYSTEMD_LOCKED_ENTER;
+    systemd_jobs = g_slist_remove(systemd_jobs, self);
+    SYSTEMD_LOCKED_LEAVE;
+
+    if( self->sj_pc ) {
+        dbus_pending_call_cancel(self->sj_pc);
+        dbus_pending_call_unref(self->sj_pc);
     }
 
-    if( !dbus_message_get_args(rsp, &err,
-                               DBUS_TYPE_OBJECT_PATH, &res,
+    if( self->sj_con )
+        dbus_connection_unref(self->sj_con);
+
+    g_free(self->sj_unit);
+    g_free(self->sj_method);
+    g_free(self->sj_path);
+    g_free(self->sj_result);
+    g_free(self);
+
+EXIT:
+    return;
+}
+
+/* ========================================================================= *
+ * SYSTEMD
+ * ========================================================================= */
+
+/** Handle JobRemoved signal from systemd
+ *
+ * Note: This function is called from the main thread.
+ *
+ * @param con  connection the signal was received from
+ * @param msg  signal message
+ */
+static void
+systemd_job_removed_signal(DBusConnection *con, DBusMessage *msg)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusError      err  = DBUS_ERROR_INIT;
+    dbus_uint32_t  id   = 0;
+    const char    *path = 0;
+    const char    *unit = 0;
+    const char    *res  = 0;
+
+    if( !dbus_message_get_args(msg, &err,
+                               DBUS_TYPE_UINT32, &id,
+                               DBUS_TYPE_OBJECT_PATH, &path,
+                               DBUS_TYPE_STRING, &unit,
+                               DBUS_TYPE_STRING, &res,
                                DBUS_TYPE_INVALID) ) {
-        log_err("failed to parse reply to %s.%s request: %s: %s",
-                SYSTEMD_DBUS_INTERFACE,
-                method,
-                err.name, err.message);
+        log_err("failed to parse %s signal: %s: %s",
+                SYSTEMD_JOB_REMOVED_SIG, err.name, err.message);
         goto EXIT;
     }
 
-EXIT:
+    SYSTEMD_LOCKED_ENTER;
+    for( GSList *iter = systemd_jobs; iter; iter = iter->next ) {
+        systemd_job_t *job = iter->data;
+
+        /* Replies are dispatched before signals sent after them,
+         * but the notification might not have been handled yet */
+        systemd_job_handle_reply_locked(job);
 
+        if( job->sj_state == SYSTEMD_JOB_QUEUED &&
+            job->sj_con == con &&
+            !g_strcmp0(job->sj_path, path) )
+            systemd_job_finish_locked(job, res);
+    }
+    SYSTEMD_LOCKED_LEAVE;
+
+EXIT:
     dbus_error_free(&err);
+}
+
+/** Handle loss of connection to systemd instance
+ *
+ * Jobs that were made via the connection can't be tracked anymore,
+ * so they are marked as failed.
+ *
+ * Note: This function is called from the main thread.
+ *
+ * @param con  connection that got disconnected
+ */
+static void
+systemd_connection_lost(DBusConnection *con)
+{
+    LOG_REGISTER_CONTEXT;
+
+    SYSTEMD_LOCKED_ENTER;
+    for( GSList *iter = systemd_jobs; iter; iter = iter->next ) {
+        systemd_job_t *job = iter->data;
+        if( job->sj_con == con )
+            systemd_job_finish_locked(job, "failed");
+    }
+    SYSTEMD_LOCKED_LEAVE;
+}
 
-    if( rsp ) dbus_message_unref(rsp);
-    if( req ) dbus_message_unref(req);
+static DBusHandlerResult
+systemd_dbus_filter_cb(DBusConnection *con, DBusMessage *msg, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
 
-    log_debug("%s(%s) -> %s", method, name, res ?: "N/A");
+    (void)aptr;
 
-    return res != 0;
+    if( dbus_message_is_signal(msg,
+                               SYSTEMD_DBUS_INTERFACE,
+                               SYSTEMD_JOB_REMOVED_SIG) )
+    {
+        systemd_job_removed_signal(con, msg);
+    }
+    else if( dbus_message_is_signal(msg,
+                                    DBUS_INTERFACE_LOCAL,
+                                    "Disconnected") )
+    {
+        systemd_connection_lost(con);
+    }
+
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/** Send argumentless request to systemd manager without waiting for reply
+ *
+ * @param con     connection to systemd instance
+ * @param method  method name, e.g. SYSTEMD_SUBSCRIBE_REQ
+ */
+static void
+systemd_send_manager_request(DBusConnection *con, const char *method)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusMessage *req = dbus_message_new_method_call(SYSTEMD_DBUS_SERVICE,
+                                                    SYSTEMD_DBUS_PATH,
+                                                    SYSTEMD_DBUS_INTERFACE,
+                                                    method);
+    if( !req ) {
+        log_err("failed to construct %s.%s request",
+                SYSTEMD_DBUS_INTERFACE, method);
+        goto EXIT;
+    }
+
+    dbus_message_set_no_reply(req, true);
+
+    if( !dbus_connection_send(con, req, 0) )
+        log_err("failed to send %s.%s request",
+                SYSTEMD_DBUS_INTERFACE, method);
+
+EXIT:
+    if( req )
+        dbus_message_unref(req);
+}
+
+/** Start or stop several units and wait for all jobs to finish
+ *
+ * All jobs are started before waiting for any of them, so that
+ * systemd can execute them concurrently.
+ *
+ * @param method  SYSTEMD_START or SYSTEMD_STOP
+ * @param units   NULL terminated array of unit names
+ * @param tot_ms  maximum time to wait [ms]
+ *
+ * @return TRUE if all jobs succeeded, FALSE otherwise
+ */
+gboolean
+systemd_control_units(const char *method, const char * const *units,
+                      unsigned tot_ms)
+{
+    LOG_REGISTER_CONTEXT;
+
+    size_t          count = units ? g_strv_length((gchar **)units) : 0;
+    systemd_job_t **jobs  = g_malloc0_n(count + 1, sizeof *jobs);
+
+    for( size_t i = 0; i < count; ++i )
+        jobs[i] = systemd_job_start(units[i], method);
+
+    gboolean ack = systemd_job_wait(jobs, count, tot_ms);
+
+    for( size_t i = 0; i < count; ++i )
+        systemd_job_free(jobs[i]);
+    g_free(jobs);
+
+    return ack;
+}
+
+// QDBusObjectPath org.freedesktop.systemd1.Manager.StartUnit(QString name, QString mode)
+// QDBusObjectPath org.freedesktop.systemd1.Manager.StopUnit(QString name, QString mode)
+
+//  mode = replace
+//  method = StartUnit or StopUnit
+gboolean systemd_control_service(const char *name, const char *method)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char * const units[] = { name, 0 };
+
+    return systemd_control_units(method, units, SYSTEMD_JOB_TIMEOUT);
 }
 
 /* ========================================================================= *
@@ -159,6 +825,24 @@ systemd_control_start(void)
         log_err("Could not connect to dbus for systemd control\n");
         goto cleanup;
     }
+
+    if( (systemd_job_evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1 )
+        log_warning("systemd job eventfd: %m");
+
+    /* Add filter callback */
+    if( !dbus_connection_add_filter(systemd_con,
+                                    systemd_dbus_filter_cb, 0, 0) )
+    {
+        log_err("adding system dbus filter for systemd failed");
+        goto cleanup;
+    }
+
+    /* Add match without blocking / error checking */
+    dbus_bus_add_match(systemd_con, SYSTEMD_JOB_REMOVED_MATCH, 0);
+
+    /* Make sure systemd emits job signals */
+    systemd_send_manager_request(systemd_con, SYSTEMD_SUBSCRIBE_REQ);
+
     ack = TRUE;
 
 cleanup:
@@ -173,10 +857,280 @@ systemd_control_stop(void)
 
     log_debug("stopping systemd control");
 
+    /* Drop user session bus connection */
+    systemd_user_changed();
+
     if(systemd_con)
     {
+        /* Remove filter callback */
+        dbus_connection_remove_filter(systemd_con,
+                                      systemd_dbus_filter_cb, 0);
+
+        if( dbus_connection_get_is_connected(systemd_con) ) {
+            systemd_send_manager_request(systemd_con, SYSTEMD_UNSUBSCRIBE_REQ);
+
+            /* Remove match without blocking / error checking */
+            dbus_bus_remove_match(systemd_con,
+                                  SYSTEMD_JOB_REMOVED_MATCH, 0);
+        }
+
         /* Let go of connection ref */
         dbus_connection_unref(systemd_con),
             systemd_con = 0;
     }
+
+    if( systemd_job_evfd != -1 )
+        close(systemd_job_evfd), systemd_job_evfd = -1;
+}
+
+/* ========================================================================= *
+ * SYSTEMD_USER
+ * ========================================================================= */
+
+/** Get address of user session bus
+ *
+ * @param uid  user id
+ *
+ * @return bus address, or NULL if session bus socket does not exist
+ */
+static gchar *
+systemd_user_bus_address(uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const char * const lut[] = {
+        SYSTEMD_USER_BUS_SAILFISH,
+        SYSTEMD_USER_BUS_DEFAULT,
+    };
+
+    gchar *address = 0;
+
+    for( size_t i = 0; !address && i < G_N_ELEMENTS(lut); ++i ) {
+        gchar *path = g_strdup_printf(lut[i], (unsigned)uid);
+        if( access(path, F_OK) == 0 )
+            address = g_strdup_printf("unix:path=%s", path);
+        g_free(path);
+    }
+
+    return address;
+}
+
+/** Connect to systemd instance of given user
+ *
+ * @param uid  user id
+ *
+ * @return private connection to user session bus, or NULL on failure
+ */
+static DBusConnection *
+systemd_user_connect(uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusConnection *con     = 0;
+    DBusError       err     = DBUS_ERROR_INIT;
+    gchar          *address = systemd_user_bus_address(uid);
+
+    if( !address ) {
+        log_warning("session bus of user %d not found", (int)uid);
+        goto EXIT;
+    }
+
+    if( !(con = dbus_connection_open_private(address, &err)) ) {
+        log_warning("%s: failed to connect: %s: %s", address,
+                    err.name, err.message);
+        goto EXIT;
+    }
+
+    dbus_connection_set_exit_on_disconnect(con, FALSE);
+
+    if( !dbus_bus_register(con, &err) ) {
+        log_warning("%s: failed to register: %s: %s", address,
+                    err.name, err.message);
+        systemd_user_disconnect(con), con = 0;
+        goto EXIT;
+    }
+
+    if( !dbus_connection_add_filter(con, systemd_dbus_filter_cb, 0, 0) ) {
+        log_err("adding session dbus filter for systemd failed");
+        systemd_user_disconnect(con), con = 0;
+        goto EXIT;
+    }
+
+    /* Add match without blocking / error checking */
+    dbus_bus_add_match(con, SYSTEMD_JOB_REMOVED_MATCH, 0);
+
+    /* Signals are handled in the main thread */
+    dbus_gmain_set_up_connection(con, NULL);
+
+    systemd_send_manager_request(con, SYSTEMD_SUBSCRIBE_REQ);
+
+    log_debug("connected to systemd of user %d", (int)uid);
+
+EXIT:
+    dbus_error_free(&err);
+    g_free(address);
+
+    return con;
+}
+
+/** Close connection to systemd instance of a user
+ *
+ * @param con  private connection to user session bus, or NULL
+ */
+static void
+systemd_user_disconnect(DBusConnection *con)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( con ) {
+        dbus_connection_remove_filter(con, systemd_dbus_filter_cb, 0);
+        dbus_connection_close(con);
+        dbus_connection_unref(con);
+    }
+}
+
+/** Get connection to systemd instance of the current user
+ *
+ * Connection is made on demand and reused until the current
+ * user changes.
+ *
+ * Note: This function should be called only from the worker thread.
+ *
+ * @return connection reference to release with dbus_connection_unref(),
+ *         or NULL if not available
+ */
+static DBusConnection *
+systemd_user_get_connection(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusConnection *con = 0;
+    DBusConnection *old = 0;
+    uid_t           uid = usbmoded_get_current_user();
+
+    /* Without knowing the user, only systemctl-user can do */
+    if( uid == UID_UNKNOWN || uid == 0 )
+        goto EXIT;
+
+    SYSTEMD_LOCKED_ENTER;
+    if( systemd_user_con && systemd_user_uid == uid &&
+        dbus_connection_get_is_connected(systemd_user_con) ) {
+        con = dbus_connection_ref(systemd_user_con);
+    }
+    else {
+        old = systemd_user_con, systemd_user_con = 0;
+        systemd_user_uid = UID_UNKNOWN;
+    }
+    SYSTEMD_LOCKED_LEAVE;
+
+    if( con )
+        goto EXIT;
+
+    systemd_user_disconnect(old);
+
+    if( !(con = systemd_user_connect(uid)) )
+        goto EXIT;
+
+    SYSTEMD_LOCKED_ENTER;
+    if( !systemd_user_con ) {
+        systemd_user_con = dbus_connection_ref(con);
+        systemd_user_uid = uid;
+    }
+    SYSTEMD_LOCKED_LEAVE;
+
+EXIT:
+    return con;
+}
+
+/** Drop connection to systemd instance of the previous user
+ *
+ * Next user unit control makes a connection to systemd of the
+ * current user.
+ *
+ * Note: This function should be called only from the main thread.
+ */
+void
+systemd_user_changed(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusConnection *con = 0;
+
+    SYSTEMD_LOCKED_ENTER;
+    con = systemd_user_con, systemd_user_con = 0;
+    systemd_user_uid = UID_UNKNOWN;
+    SYSTEMD_LOCKED_LEAVE;
+
+    if( con ) {
+        log_debug("disconnecting from systemd of previous user");
+        systemd_connection_lost(con);
+        systemd_user_disconnect(con);
+    }
+}
+
+/** Start a user unit job without waiting for it to finish
+ *
+ * The returned object must be released with #systemd_job_free().
+ *
+ * Note: This function should be called only from the worker thread.
+ *
+ * @param unit    unit name
+ * @param method  SYSTEMD_START or SYSTEMD_STOP
+ *
+ * @return job object, or NULL if user systemd is not available
+ */
+systemd_job_t *
+systemd_user_job_start(const char *unit, const char *method)
+{
+    LOG_REGISTER_CONTEXT;
+
+    systemd_job_t  *job = 0;
+    DBusConnection *con = systemd_user_get_connection();
+
+    if( con ) {
+        job = systemd_job_start_on(con, unit, method);
+        dbus_connection_unref(con);
+    }
+
+    return job;
+}
+
+/** Start or stop a user unit and wait for the job to finish
+ *
+ * If systemd of the current user can't be reached, falls back
+ * to using systemctl-user.
+ *
+ * Note: This function should be called only from the worker thread.
+ *
+ * @param name    unit name
+ * @param method  SYSTEMD_START or SYSTEMD_STOP
+ * @param tot_ms  maximum time to wait for the job to finish [ms]
+ *
+ * @return TRUE if job succeeded, FALSE otherwise
+ */
+gboolean
+systemd_user_control_service(const char *name, const char *method,
+                             unsigned tot_ms)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gboolean       ack = FALSE;
+    systemd_job_t *job = systemd_user_job_start(name, method);
+
+    if( job ) {
+        ack = systemd_job_wait(&job, 1, tot_ms);
+        systemd_job_free(job);
+    }
+    else {
+        const char *verb   = g_strcmp0(method, SYSTEMD_STOP) ? "start" : "stop";
+        const char *argv[] = { "systemctl-user", verb, name, 0 };
+        int         rc     = exec_run(argv, tot_ms, 0);
+
+        if( rc != 0 )
+            log_warning("systemctl-user %s %s: exit code = %d", verb, name, rc);
+        else
+            ack = TRUE;
+    }
+
+    return ack;
 }
@@ -25,6 +25,8 @@
 #ifndef  USB_MODED_SYSTEMD_H_
 # define USB_MODED_SYSTEMD_H_
 
+# include <stdbool.h>
+
 # include <glib.h>
 
 /* ========================================================================= *
@@ -33,6 +35,17 @@
 
 # define SYSTEMD_STOP   "StopUnit"
 # define SYSTEMD_START   "StartUnit"
+# define SYSTEMD_TRY_RESTART "TryRestartUnit"
+
+/** Timeout for waiting unit jobs to finish [ms] */
+# define SYSTEMD_JOB_TIMEOUT 30000
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Opaque tracking object for a systemd unit job */
+typedef struct systemd_job_t systemd_job_t;
 
 /* ========================================================================= *
  * Prototypes
@@ -42,8 +55,22 @@
  * SYSTEMD
  * ------------------------------------------------------------------------- */
 
-gboolean systemd_control_service(const char *name, const char *method);
-gboolean systemd_control_start  (void);
-void     systemd_control_stop   (void);
+systemd_job_t *systemd_job_start      (const char *unit, const char *method);
+bool           systemd_job_wait       (systemd_job_t **jobs, size_t count, unsigned tot_ms);
+bool           systemd_job_succeeded  (const systemd_job_t *self);
+const char    *systemd_job_result     (const systemd_job_t *self);
+void           systemd_job_free       (systemd_job_t *self);
+gboolean       systemd_control_units  (const char *method, const char * const *units, unsigned tot_ms);
+gboolean       systemd_control_service(const char *name, const char *method);
+gboolean       systemd_control_start  (void);
+void           systemd_control_stop   (void);
+
+/* ------------------------------------------------------------------------- *
+ * SYSTEMD_USER
+ * ------------------------------------------------------------------------- */
+
+void           systemd_user_changed        (void);
+systemd_job_t *systemd_user_job_start      (const char *unit, const char *method);
+gboolean       systemd_user_control_service(const char *name, const char *method, unsigned tot_ms);
 
 #endif /* USB_MODED_SYSTEMD_H_ */
@@ -0,0 +1,270 @@
+/**
+ * @file usb_moded-trace.c
+ *
+ * Timing of mode transition phases
+ *
+ * Worker thread records monotonic timestamps for each phase of a mode
+ * transition. Results for the most recent transitions are kept in a
+ * fixed size ring buffer that can be queried over D-Bus.
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-trace.h"
+
+#include "usb_moded-log.h"
+
+#include <unistd.h>
+#include <pthread.h>
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * TRACE
+ * ------------------------------------------------------------------------- */
+
+static gint64 trace_now_ms          (void);
+const char   *trace_phase_name      (trace_phase_t phase);
+const char   *trace_outcome_name    (trace_outcome_t outcome);
+void          trace_begin_transition(const char *from, const char *to);
+void          trace_enter_phase     (trace_phase_t phase);
+void          trace_leave_phase     (trace_phase_t phase);
+void          trace_end_transition  (const char *result, trace_outcome_t outcome);
+guint         trace_get_history     (trace_record_t *records, guint count);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+static const char * const trace_phase_lut[TRACE_PHASE_COUNT] = {
+    [TRACE_PHASE_STOP_MTPD]      = "stop_mtpd",
+    [TRACE_PHASE_UNMOUNT_MTP]    = "unmount_mtp",
+    [TRACE_PHASE_LEAVE_MODE]     = "leave_mode",
+    [TRACE_PHASE_APPSYNC_SWITCH] = "appsync_switch",
+    [TRACE_PHASE_START_MTPD]     = "start_mtpd",
+    [TRACE_PHASE_LOAD_MODULE]    = "load_module",
+    [TRACE_PHASE_ENTER_MODE]     = "enter_mode",
+    [TRACE_PHASE_APPSYNC_PRE]    = "appsync_pre",
+    [TRACE_PHASE_GADGET]         = "gadget",
+    [TRACE_PHASE_NETWORK]        = "network",
+    [TRACE_PHASE_DHCP]           = "dhcp",
+    [TRACE_PHASE_APPSYNC_POST]   = "appsync_post",
+    [TRACE_PHASE_TETHERING]      = "tethering",
+    [TRACE_PHASE_CHARGING]       = "charging",
+    [TRACE_PHASE_WAIT_INTERFACE] = "wait_interface",
+    [TRACE_PHASE_WAIT_UDC]       = "wait_udc",
+    [TRACE_PHASE_WAIT_UMOUNT]    = "wait_umount",
+};
+
+static const char * const trace_outcome_lut[TRACE_OUTCOME_COUNT] = {
+    [TRACE_OUTCOME_SUCCESS]    = "success",
+    [TRACE_OUTCOME_FALLBACK]   = "fallback",
+    [TRACE_OUTCOME_ABORTED]    = "aborted",
+    [TRACE_OUTCOME_FAILED]     = "failed",
+    [TRACE_OUTCOME_SUPERSEDED] = "superseded",
+};
+
+/** Transition in progress, accessed only from worker thread */
+static trace_record_t trace_current;
+
+/** Phase start times for transition in progress [ms] */
+static gint64         trace_phase_started[TRACE_PHASE_COUNT];
+
+/** Flag for: transition in progress */
+static bool           trace_active = false;
+
+/** Ring buffer of finished transitions */
+static trace_record_t trace_history[TRACE_HISTORY_SIZE];
+
+/** Number of finished transitions */
+static guint          trace_finished = 0;
+
+/** Mutex for accessing trace_history and trace_finished */
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define TRACE_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&trace_mutex) != 0 ) { \
+        log_crit("TRACE LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define TRACE_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&trace_mutex) != 0 ) { \
+        log_crit("TRACE UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+/* ========================================================================= *
+ * TRACE
+ * ========================================================================= */
+
+static gint64
+trace_now_ms(void)
+{
+    return g_get_monotonic_time() / 1000;
+}
+
+const char *
+trace_phase_name(trace_phase_t phase)
+{
+    return (phase < TRACE_PHASE_COUNT) ? trace_phase_lut[phase] : "unknown";
+}
+
+const char *
+trace_outcome_name(trace_outcome_t outcome)
+{
+    return (outcome < TRACE_OUTCOME_COUNT) ? trace_outcome_lut[outcome] : "unknown";
+}
+
+/** Start timing a mode transition
+ *
+ * Note: This function should be called only from the worker thread.
+ *
+ * @param from  currently active mode, or NULL
+ * @param to    mode to activate
+ */
+void
+trace_begin_transition(const char *from, const char *to)
+{
+    LOG_REGISTER_CONTEXT;
+
+    trace_current = (trace_record_t){ 0 };
+
+    g_strlcpy(trace_current.tr_from, from ?: "", sizeof trace_current.tr_from);
+    g_strlcpy(trace_current.tr_to, to ?: "", sizeof trace_current.tr_to);
+    trace_current.tr_started_ms = trace_now_ms();
+
+    for( int i = 0; i < TRACE_PHASE_COUNT; ++i ) {
+        trace_current.tr_phase_ms[i] = -1;
+        trace_phase_started[i] = 0;
+    }
+
+    trace_active = true;
+}
+
+/** Mark start of a mode transition phase
+ *
+ * Note: This function should be called only from the worker thread.
+ *
+ * @param phase  phase that is about to start
+ */
+void
+trace_enter_phase(trace_phase_t phase)
+{
+    if( trace_active && phase < TRACE_PHASE_COUNT )
+        trace_phase_started[phase] = trace_now_ms();
+}
+
+/** Mark end of a mode transition phase
+ *
+ * If the same phase is executed several times within one transition,
+ * the time spent is accumulated.
+ *
+ * Note: This function should be called only from the worker thread.
+ *
+ * @param phase  phase that just finished
+ */
+void
+trace_leave_phase(trace_phase_t phase)
+{
+    if( !trace_active || phase >= TRACE_PHASE_COUNT )
+        goto EXIT;
+
+    if( !trace_phase_started[phase] )
+        goto EXIT;
+
+    gint elapsed = (gint)(trace_now_ms() - trace_phase_started[phase]);
+    if( trace_current.tr_phase_ms[phase] < 0 )
+        trace_current.tr_phase_ms[phase] = elapsed;
+    else
+        trace_current.tr_phase_ms[phase] += elapsed;
+    trace_phase_started[phase] = 0;
+
+EXIT:
+    return;
+}
+
+/** Finish timing a mode transition and store results in history
+ *
+ * Note: This function should be called only from the worker thread.
+ *
+ * @param result   mode that was activated
+ * @param outcome  how the transition ended
+ */
+void
+trace_end_transition(const char *result, trace_outcome_t outcome)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !trace_active )
+        goto EXIT;
+
+    trace_active = false;
+
+    g_strlcpy(trace_current.tr_result, result ?: "",
+              sizeof trace_current.tr_result);
+    trace_current.tr_outcome  = outcome;
+    trace_current.tr_total_ms = (gint)(trace_now_ms() -
+                                       trace_current.tr_started_ms);
+
+    log_debug("mode transition %s -> %s: %s in %d ms",
+              trace_current.tr_from, trace_current.tr_to,
+              trace_outcome_name(outcome), trace_current.tr_total_ms);
+
+    TRACE_LOCKED_ENTER;
+    trace_current.tr_seq = ++trace_finished;
+    trace_history[(trace_current.tr_seq - 1) % TRACE_HISTORY_SIZE] = trace_current;
+    TRACE_LOCKED_LEAVE;
+
+EXIT:
+    return;
+}
+
+/** Get timing details of recent mode transitions
+ *
+ * Note: This function is safe to call from any thread.
+ *
+ * @param records  array for storing the records, oldest first
+ * @param count    number of records that fit in the array
+ *
+ * @return number of records stored
+ */
+guint
+trace_get_history(trace_record_t *records, guint count)
+{
+    LOG_REGISTER_CONTEXT;
+
+    guint used = 0;
+
+    TRACE_LOCKED_ENTER;
+
+    guint avail = MIN(trace_finished, TRACE_HISTORY_SIZE);
+    guint first = trace_finished - MIN(avail, count);
+
+    for( guint seq = first; seq < trace_finished; ++seq )
+        records[used++] = trace_history[seq % TRACE_HISTORY_SIZE];
+
+    TRACE_LOCKED_LEAVE;
+
+    return used;
+}
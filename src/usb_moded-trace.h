@@ -0,0 +1,124 @@
+/**
+ * @file usb_moded-trace.h
+ *
+ * Copyright (c) 2026 agent
+ *
+ * @author agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_TRACE_H_
+# define USB_MODED_TRACE_H_
+
+# include <stdbool.h>
+# include <glib.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Number of mode transitions to keep in history */
+# define TRACE_HISTORY_SIZE   16
+
+/** Maximum length of mode names stored in trace records */
+# define TRACE_MODE_NAME_MAX  64
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Mode transition phases that are timed separately
+ */
+typedef enum trace_phase_t
+{
+    TRACE_PHASE_STOP_MTPD,       /**< Stopping mtp daemon */
+    TRACE_PHASE_UNMOUNT_MTP,     /**< Unmounting mtp device */
+    TRACE_PHASE_LEAVE_MODE,      /**< Cleaning up previous dynamic mode */
+    TRACE_PHASE_APPSYNC_SWITCH,  /**< Taking updated appsync config in use */
+    TRACE_PHASE_START_MTPD,      /**< Mounting mtp device and starting mtpd */
+    TRACE_PHASE_LOAD_MODULE,     /**< Loading kernel module */
+    TRACE_PHASE_ENTER_MODE,      /**< Setting up dynamic mode, total */
+    TRACE_PHASE_APPSYNC_PRE,     /**< Starting pre-enumeration applications */
+    TRACE_PHASE_GADGET,          /**< Configuring usb gadget */
+    TRACE_PHASE_NETWORK,         /**< Bringing up network interface */
+    TRACE_PHASE_DHCP,            /**< Updating dhcp server configuration */
+    TRACE_PHASE_APPSYNC_POST,    /**< Starting post-enumeration applications */
+    TRACE_PHASE_TETHERING,       /**< Enabling connman tethering */
+    TRACE_PHASE_CHARGING,        /**< Switching to charging mode */
+    TRACE_PHASE_WAIT_INTERFACE,  /**< Waiting for network interface to appear */
+    TRACE_PHASE_WAIT_UDC,        /**< Waiting for host to configure gadget */
+    TRACE_PHASE_WAIT_UMOUNT,     /**< Retrying busy unmount */
+    TRACE_PHASE_COUNT
+} trace_phase_t;
+
+/** Mode transition outcomes
+ */
+typedef enum trace_outcome_t
+{
+    TRACE_OUTCOME_SUCCESS,     /**< Requested mode was activated */
+    TRACE_OUTCOME_FALLBACK,    /**< Requested mode failed, charging activated */
+    TRACE_OUTCOME_ABORTED,     /**< Mode switch abandoned due to cable disconnect */
+    TRACE_OUTCOME_FAILED,      /**< Nothing could be activated */
+    TRACE_OUTCOME_SUPERSEDED,  /**< Mode switch abandoned due to newer request */
+    TRACE_OUTCOME_COUNT
+} trace_outcome_t;
+
+/** Timing details for one mode transition
+ */
+typedef struct trace_record_t
+{
+    /** Running transition number */
+    guint            tr_seq;
+
+    /** Mode active before the transition */
+    char             tr_from[TRACE_MODE_NAME_MAX];
+
+    /** Mode that was requested */
+    char             tr_to[TRACE_MODE_NAME_MAX];
+
+    /** Mode that was activated */
+    char             tr_result[TRACE_MODE_NAME_MAX];
+
+    /** How the transition ended */
+    trace_outcome_t  tr_outcome;
+
+    /** Monotonic time when the transition started [ms] */
+    gint64           tr_started_ms;
+
+    /** Duration of the whole transition [ms] */
+    gint             tr_total_ms;
+
+    /** Time spent in each phase [ms], or -1 if phase was not executed */
+    gint             tr_phase_ms[TRACE_PHASE_COUNT];
+} trace_record_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * TRACE
+ * ------------------------------------------------------------------------- */
+
+const char *trace_phase_name      (trace_phase_t phase);
+const char *trace_outcome_name    (trace_outcome_t outcome);
+void        trace_begin_transition(const char *from, const char *to);
+void        trace_enter_phase     (trace_phase_t phase);
+void        trace_leave_phase     (trace_phase_t phase);
+void        trace_end_transition  (const char *result, trace_outcome_t outcome);
+guint       trace_get_history     (trace_record_t *records, guint count);
+
+#endif /* USB_MODED_TRACE_H_ */
@@ -25,6 +25,7 @@
  */
 
 #include "usb_moded-dbus-private.h"
+#include "usb_moded-snapshot.h"
 
 #include <stdio.h>
 #include <getopt.h>
@@ -48,6 +49,9 @@ static int util_set_unhide_mode_config(char *mode);
 static int util_get_hiddenlist        (void);
 static int util_handle_network        (char *network);
 static int util_clear_user_config     (char *uid);
+static int util_set_config_batch      (char *batch);
+static int util_get_dict_list         (const char *method);
+static int util_write_snapshot        (void);
 
 /* ------------------------------------------------------------------------- *
  * MAIN
@@ -395,10 +399,150 @@ static int util_clear_user_config(char *uid)
     return ret;
 }
 
+static int util_set_config_batch(char *batch)
+{
+    DBusMessage     *req = NULL;
+    DBusMessage     *reply = NULL;
+    DBusMessageIter  iter, array, tuple;
+    char            *item, *save = 0;
+    int              ret = 1;
+
+    if (!batch) {
+        fprintf(stderr, "No settings given, try -h for more information\n");
+        return 1;
+    }
+
+    if ((req = dbus_message_new_method_call(USB_MODE_SERVICE, USB_MODE_OBJECT, USB_MODE_INTERFACE, USB_MODE_CONFIG_BATCH_SET)) == NULL)
+        return 1;
+
+    dbus_message_iter_init_append(req, &iter);
+    if (!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(sss)", &array))
+        goto EXIT;
+
+    for (item = strtok_r(batch, ";", &save); item; item = strtok_r(NULL, ";", &save))
+    {
+        /* section:key=value */
+        char *section = item;
+        char *key = strchr(section, ':');
+        char *value = key ? strchr(key, '=') : NULL;
+
+        if (!key || !value)
+        {
+            printf("Argument list is wrong. Please use $section:$key=$value[;...]\n");
+            dbus_message_iter_abandon_container(&iter, &array);
+            goto EXIT;
+        }
+        *key++ = 0;
+        *value++ = 0;
+
+        printf("Setting [%s] %s = %s\n", section, key, value);
+        dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &tuple);
+        dbus_message_iter_append_basic(&tuple, DBUS_TYPE_STRING, &section);
+        dbus_message_iter_append_basic(&tuple, DBUS_TYPE_STRING, &key);
+        dbus_message_iter_append_basic(&tuple, DBUS_TYPE_STRING, &value);
+        dbus_message_iter_close_container(&array, &tuple);
+    }
+
+    if (!dbus_message_iter_close_container(&iter, &array))
+        goto EXIT;
+
+    if ((reply = dbus_connection_send_with_reply_and_block(conn, req, -1, NULL)) != NULL)
+    {
+        if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN)
+        {
+            printf("The settings have been applied\n");
+            ret = 0;
+        }
+        dbus_message_unref(reply);
+    }
+
+EXIT:
+    dbus_message_unref(req);
+    return ret;
+}
+
+/** Print array of dictionaries returned by a method call
+ *
+ * Used for methods like get_mode_transitions and get_exec_stats.
+ * One array entry is printed per line, as key=value pairs.
+ */
+static int util_get_dict_list(const char *method)
+{
+    DBusMessage     *req = NULL;
+    DBusMessage     *reply = NULL;
+    DBusMessageIter  iter, array, dict, entry, variant;
+    int              ret = 1;
+
+    if ((req = dbus_message_new_method_call(USB_MODE_SERVICE, USB_MODE_OBJECT, USB_MODE_INTERFACE, method)) == NULL)
+        return 1;
+
+    if ((reply = dbus_connection_send_with_reply_and_block(conn, req, -1, NULL)) == NULL)
+        goto EXIT;
+
+    if (!dbus_message_iter_init(reply, &iter) ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+        goto EXIT;
+
+    /* One line per entry, key=value pairs separated by spaces */
+    dbus_message_iter_recurse(&iter, &array);
+    while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_ARRAY)
+    {
+        const char *sep = "";
+        dbus_message_iter_recurse(&array, &dict);
+        while (dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY)
+        {
+            const char   *key = 0;
+            const char   *str = 0;
+            dbus_int32_t  num = 0;
+
+            dbus_message_iter_recurse(&dict, &entry);
+            dbus_message_iter_get_basic(&entry, &key);
+            dbus_message_iter_next(&entry);
+            dbus_message_iter_recurse(&entry, &variant);
+
+            switch (dbus_message_iter_get_arg_type(&variant))
+            {
+            case DBUS_TYPE_STRING:
+                dbus_message_iter_get_basic(&variant, &str);
+                printf("%s%s=%s", sep, key, *str ? str : "-");
+                break;
+            case DBUS_TYPE_INT32:
+                dbus_message_iter_get_basic(&variant, &num);
+                printf("%s%s=%d", sep, key, (int)num);
+                break;
+            default:
+                break;
+            }
+            sep = " ";
+            dbus_message_iter_next(&dict);
+        }
+        printf("\n");
+        dbus_message_iter_next(&array);
+    }
+    ret = 0;
+
+EXIT:
+    if (reply)
+        dbus_message_unref(reply);
+    dbus_message_unref(req);
+    return ret;
+}
+
+static int util_write_snapshot(void)
+{
+    /* Works offline, without usb-moded running */
+    if (!snapshot_write())
+        return 1;
+
+    printf("Configuration snapshot written to %s\n", USB_MODED_SNAPSHOT_FILE);
+    return 0;
+}
+
 int main (int argc, char *argv[])
 {
     int query = 0, network = 0, setmode = 0, config = 0;
     int modelist = 0, mode_configured = 0, hide = 0, unhide = 0, hiddenlist = 0, clear = 0;
+    int batch = 0, snapshot = 0, transitions = 0, exec_stats = 0;
     int res = 1, opt, rescue = 0;
     char *option = 0;
 
@@ -408,9 +552,13 @@ int main (int argc, char *argv[])
         exit(1);
     }
 
-    while ((opt = getopt(argc, argv, "c:dhi:mn:qrs:u:vU:")) != -1)
+    while ((opt = getopt(argc, argv, "b:c:dhi:mn:qrSs:tu:vU:x")) != -1)
     {
         switch (opt) {
+        case 'b':
+            batch = 1;
+            option = optarg;
+            break;
         case 'c':
             config = 1;
             option = optarg;
@@ -435,10 +583,16 @@ int main (int argc, char *argv[])
         case 'r':
             rescue = 1;
             break;
+        case 'S':
+            snapshot = 1;
+            break;
         case 's':
             setmode = 1;
             option = optarg;
             break;
+        case 't':
+            transitions = 1;
+            break;
         case 'u':
             unhide = 1;
             option = optarg;
@@ -450,10 +604,14 @@ int main (int argc, char *argv[])
             clear = 1;
             option = optarg;
             break;
+        case 'x':
+            exec_stats = 1;
+            break;
         case 'h':
         default:
                 fprintf(stderr, "\nUsage: %s -<option> <args>\n\n \
                    Options are: \n \
+                   \t-b to set several settings at once. Use ${section}:${key}=${value};...\n \
                    \t-c to set a mode in the config file,\n \
                    \t-d to get the default mode set in the configuration, \n \
                    \t-h to get this help, \n \
@@ -462,15 +620,27 @@ int main (int argc, char *argv[])
                    \t-m to get the list of supported modes, \n \
                    \t-q to query the current mode,\n \
                    \t-r turn rescue mode off,\n \
+                   \t-S to regenerate the configuration snapshot,\n \
                    \t-s to set/activate a mode,\n \
+                   \t-t to show timing of recent mode transitions,\n \
                    \t-u unhide a mode,\n \
                    \t-v to get the list of hidden modes\n \
-                   \t-U <uid> to clear config for a user\n",
+                   \t-U <uid> to clear config for a user\n \
+                   \t-x to show statistics of executed commands\n",
                         argv[0]);
             exit(1);
         }
     }
 
+    /* snapshot generation does not need dbus */
+    if (snapshot)
+    {
+        res = util_write_snapshot();
+        if(res)
+            printf("Sorry an error occured, your request was not processed.\n");
+        return res;
+    }
+
     /* init dbus */
     DBusError error = DBUS_ERROR_INIT;
 
@@ -504,6 +674,12 @@ int main (int argc, char *argv[])
         res = util_get_hiddenlist();
     else if (clear)
         res = util_clear_user_config(option);
+    else if (batch)
+        res = util_set_config_batch(option);
+    else if (transitions)
+        res = util_get_dict_list(USB_MODE_TRANSITIONS_GET);
+    else if (exec_stats)
+        res = util_get_dict_list(USB_MODE_EXEC_STATS_GET);
 
     /* subfunctions will return 1 if an error occured, print message */
     if(res)
@@ -28,13 +28,17 @@
 #include "usb_moded-android.h"
 #include "usb_moded-configfs.h"
 #include "usb_moded-control.h"
+#include "usb_moded-exec.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modes.h"
 #include "usb_moded-modesetting.h"
 #include "usb_moded-modules.h"
 #include "usb_moded-appsync.h"
+#include "usb_moded-systemd.h"
+#include "usb_moded-trace.h"
 
 #include <sys/eventfd.h>
+#include <poll.h>
 
 #include <pthread.h> // NOTRIM
 #include <unistd.h>
@@ -68,8 +72,9 @@ static const char * const devstate_name[] = {
  * WORKER
  * ------------------------------------------------------------------------- */
 
-static bool        worker_thread_p                 (void);
+bool               worker_thread_p                 (void);
 bool               worker_bailing_out              (void);
+int                worker_get_wakeup_fd            (void);
 static devstate_t  worker_get_mtp_device_state     (void);
 static void        worker_unmount_mtp_device       (void);
 static bool        worker_mount_mtp_device         (void);
@@ -84,7 +89,7 @@ const char        *worker_get_kernel_module        (void);
 bool               worker_set_kernel_module        (const char *module);
 void               worker_clear_kernel_module      (void);
 const modedata_t  *worker_get_usb_mode_data        (void);
-modedata_t        *worker_dup_usb_mode_data        (void);
+modedata_t        *worker_ref_usb_mode_data        (void);
 void               worker_set_usb_mode_data        (const modedata_t *data);
 static const char *worker_get_activated_mode_locked(void);
 static bool        worker_set_activated_mode_locked(const char *mode);
@@ -92,6 +97,7 @@ static const char *worker_get_requested_mode_locked(void);
 static bool        worker_set_requested_mode_locked(const char *mode);
 void               worker_request_hardware_mode    (const char *mode);
 void               worker_clear_hardware_mode      (void);
+static void        worker_drain_wakeups_locked     (void);
 static void        worker_execute                  (void);
 static void        worker_switch_to_mode           (const char *mode);
 static guint       worker_add_iowatch              (int fd, bool close_on_unref, GIOCondition cnd, GIOFunc io_cb, gpointer aptr);
@@ -114,12 +120,23 @@ static pthread_t worker_thread_id = 0;
 
 static pthread_mutex_t  worker_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/** Flag for: Main thread has changed target mode worker should apply
+/** Number of mode requests made by the main thread
  *
- * Worker should bailout from synchronous activities related to
- * ongoing activation of a usb mode.
+ * Incremented whenever target mode worker should apply changes.
+ *
+ * Access only via g_atomic_int_xxx() functions.
+ */
+static gint worker_request_seq = 0;
+
+/** Value of worker_request_seq when worker picked up the target mode
+ *
+ * When this differs from worker_request_seq, ongoing activation of
+ * a usb mode has been superseded and worker should bailout from
+ * synchronous activities related to it.
+ *
+ * Access only via g_atomic_int_xxx() functions.
  */
-static volatile bool worker_bailout_requested = false;
+static gint worker_execute_seq = 0;
 
 /** Flag for: Worker thread is cleaning up after abandoning mode switch
  *
@@ -128,6 +145,15 @@ static volatile bool worker_bailout_requested = false;
  */
 static volatile bool worker_bailout_handled = false;
 
+/** eventfd descriptor for waking up worker thread after adding new jobs */
+static int              worker_req_evfd  = -1;
+
+/** eventfd descriptor for waking up main thread after executing jobs */
+static int              worker_rsp_evfd  = -1;
+
+/** I/O watch identifier for worker_rsp_evfd */
+static guint            worker_rsp_wid   = 0;
+
 #define WORKER_LOCKED_ENTER do {\
     if( pthread_mutex_lock(&worker_mutex) != 0 ) { \
         log_crit("WORKER LOCK FAILED");\
@@ -146,7 +172,7 @@ static volatile bool worker_bailout_handled = false;
  * Functions
  * ========================================================================= */
 
-static bool
+bool
 worker_thread_p(void)
 {
     LOG_REGISTER_CONTEXT;
@@ -161,10 +187,30 @@ worker_bailing_out(void)
 
     // ref: see common_msleep_()
     return (worker_thread_p() &&
-            worker_bailout_requested &&
+            g_atomic_int_get(&worker_request_seq) !=
+            g_atomic_int_get(&worker_execute_seq) &&
             !worker_bailout_handled);
 }
 
+/** Get file descriptor that becomes readable when mode switch is superseded
+ *
+ * Blocking operations made by the worker thread can include the
+ * returned descriptor in poll() set to get woken up immediately when
+ * the main thread changes the target mode.
+ *
+ * @return file descriptor, or -1 if caller should not bail out
+ */
+int
+worker_get_wakeup_fd(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !worker_thread_p() || worker_bailout_handled )
+        return -1;
+
+    return worker_req_evfd;
+}
+
 /* ------------------------------------------------------------------------- *
  * MTP_DEVICE
  * ------------------------------------------------------------------------- */
@@ -213,7 +259,8 @@ worker_unmount_mtp_device(void)
 
     if( worker_get_mtp_device_state() != DEVSTATE_UNMOUNTED ) {
         log_debug("unmounting mtp device");
-        common_system("/bin/umount /dev/mtp");
+        const char *argv[] = { "/bin/umount", "/dev/mtp", 0 };
+        exec_run(argv, EXEC_DEFAULT_TIMEOUT, 0);
     }
 }
 
@@ -251,13 +298,15 @@ worker_mount_mtp_device(void)
     /* Attempt to mount mtp device using root uid and primary
      * gid of the current user.
      */
-    char cmd[256];
-    snprintf(cmd, sizeof cmd,
-             "/bin/mount -o mode=0770,uid=0,gid=%u -t functionfs mtp /dev/mtp",
-             (unsigned)gid);
+    char opts[64];
+    snprintf(opts, sizeof opts, "mode=0770,uid=0,gid=%u", (unsigned)gid);
+
+    const char *argv[] = {
+        "/bin/mount", "-o", opts, "-t", "functionfs", "mtp", "/dev/mtp", 0
+    };
 
     log_debug("mounting mtp device");
-    if( common_system(cmd) != 0 )
+    if( exec_run(argv, EXEC_DEFAULT_TIMEOUT, 0) != 0 )
         goto EXIT;
 
     /* Check that control endpoint is present */
@@ -296,6 +345,9 @@ static unsigned worker_mtp_start_delay = 120 * 1000;
  */
 static unsigned worker_mtp_stop_delay  =  15 * 1000;
 
+/** Systemd user unit for mtp daemon */
+static const char worker_mtp_service[] = "buteo-mtp.service";
+
 /** Flag for: We have started mtp daemon
  *
  * If we have issued systemd unit start, we should also
@@ -304,6 +356,16 @@ static unsigned worker_mtp_stop_delay  =  15 * 1000;
  */
 static bool worker_mtp_service_started = false;
 
+/** Directories to watch while waiting for mtpd to start / stop
+ *
+ * Mtp daemon opens and closes endpoint files in the mtp device
+ * directory, which wakes up the wait via inotify.
+ */
+static const char * const worker_mtp_watch_paths[] = {
+    "/dev/mtp",
+    0
+};
+
 static bool worker_mode_is_mtp_mode(const char *mode)
 {
     LOG_REGISTER_CONTEXT;
@@ -319,12 +381,15 @@ static bool worker_is_mtpd_running(void)
      *
      * ep1, ep2, ep3 exist while mtp daemon is running,
      * has ep0 opened and has written config data to it.
+     *
+     * Probe in reverse order, so that the typical "not yet
+     * running" case is resolved with a single access() call.
      */
     static const char * const lut[] = {
-        "/dev/mtp/ep0",
-        "/dev/mtp/ep1",
-        "/dev/mtp/ep2",
         "/dev/mtp/ep3",
+        "/dev/mtp/ep2",
+        "/dev/mtp/ep1",
+        "/dev/mtp/ep0",
         0
     };
 
@@ -370,16 +435,17 @@ worker_stop_mtpd(void)
         goto SUCCESS;
     }
 
-    int rc = common_system("systemctl-user stop buteo-mtp.service");
-    if( rc != 0 ) {
-        log_warning("failed to stop mtp daemon; exit code = %d", rc);
+    if( !systemd_user_control_service(worker_mtp_service, SYSTEMD_STOP,
+                                      worker_mtp_stop_delay) ) {
+        log_warning("failed to stop mtp daemon");
         goto FAILURE;
     }
 
     /* Have succesfully stopped mtp service */
     worker_mtp_service_started = false;
 
-    if( common_wait(worker_mtp_stop_delay, worker_mtpd_stopped_p, 0) != WAIT_READY ) {
+    if( common_wait_paths(worker_mtp_stop_delay, worker_mtp_watch_paths,
+                          worker_mtpd_stopped_p, 0) != WAIT_READY ) {
         log_warning("failed to stop mtp daemon; giving up");
         goto FAILURE;
     }
@@ -408,13 +474,14 @@ worker_start_mtpd(void)
     /* Have attempted to start mtp service */
     worker_mtp_service_started = true;
 
-    int rc = common_system("systemctl-user start buteo-mtp.service");
-    if( rc != 0 ) {
-        log_warning("failed to start mtp daemon; exit code = %d", rc);
+    if( !systemd_user_control_service(worker_mtp_service, SYSTEMD_START,
+                                      worker_mtp_start_delay) ) {
+        log_warning("failed to start mtp daemon");
         goto FAILURE;
     }
 
-    if( common_wait(worker_mtp_start_delay, worker_mtpd_running_p, 0) != WAIT_READY ) {
+    if( common_wait_paths(worker_mtp_start_delay, worker_mtp_watch_paths,
+                          worker_mtpd_running_p, 0) != WAIT_READY ) {
         log_warning("failed to start mtp daemon; giving up");
         goto FAILURE;
     }
@@ -537,19 +604,19 @@ const modedata_t *worker_get_usb_mode_data(void)
     return worker_mode_data;
 }
 
-/** get clone of the usb mode data
+/** get reference to the usb mode data
  *
- * Caller must release the returned object via #modedata_free().
+ * Caller must release the returned object via #modedata_unref().
  *
  * @return a pointer to the usb mode data
  */
-modedata_t *worker_dup_usb_mode_data(void)
+modedata_t *worker_ref_usb_mode_data(void)
 {
     LOG_REGISTER_CONTEXT;
 
     WORKER_LOCKED_ENTER;
 
-    modedata_t *modedata = modedata_copy(worker_mode_data);
+    modedata_t *modedata = modedata_ref(worker_mode_data);
 
     WORKER_LOCKED_LEAVE;
 
@@ -568,8 +635,9 @@ void worker_set_usb_mode_data(const modedata_t *data)
 
     WORKER_LOCKED_ENTER;
 
-    modedata_free(worker_mode_data),
-        worker_mode_data = modedata_copy(data);
+    modedata_t *prev = worker_mode_data;
+    worker_mode_data = modedata_ref(data);
+    modedata_unref(prev);
 
     WORKER_LOCKED_LEAVE;
 }
@@ -669,6 +737,32 @@ void worker_clear_hardware_mode(void)
     WORKER_LOCKED_LEAVE;
 }
 
+/** Consume pending worker wakeups
+ *
+ * All requests made so far are covered by the target mode the worker
+ * is about to pick up, so pending wakeups are no longer relevant and
+ * the eventfd becomes readable again only when the target mode is
+ * changed after this.
+ *
+ * Note: This function should be called only from the worker thread,
+ *       while holding worker_mutex.
+ */
+static void
+worker_drain_wakeups_locked(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    uint64_t cnt = 0;
+    if( read(worker_req_evfd, &cnt, sizeof cnt) == -1 ) {
+        if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+            log_err("failed to consume requests: %m");
+    }
+
+    g_atomic_int_set(&worker_execute_seq,
+                     g_atomic_int_get(&worker_request_seq));
+    worker_bailout_handled = false;
+}
+
 static void
 worker_execute(void)
 {
@@ -676,6 +770,10 @@ worker_execute(void)
 
     WORKER_LOCKED_ENTER;
 
+    /* Only the latest target mode matters, earlier requests that
+     * have not been acted on yet are superseded by it. */
+    worker_drain_wakeups_locked();
+
     const char *activated = worker_get_activated_mode_locked();
     const char *requested = worker_get_requested_mode_locked();
     const char *activate  = common_map_mode_to_hardware(requested);
@@ -708,8 +806,14 @@ worker_switch_to_mode(const char *mode)
 {
     LOG_REGISTER_CONTEXT;
 
-    const char *override = 0;
-    modedata_t *data     = 0;
+    const char      *override   = 0;
+    modedata_t      *data       = 0;
+    trace_outcome_t  outcome    = TRACE_OUTCOME_SUCCESS;
+    bool             superseded = false;
+
+    WORKER_LOCKED_ENTER;
+    trace_begin_transition(worker_get_activated_mode_locked(), mode);
+    WORKER_LOCKED_LEAVE;
 
     /* set return to 1 to be sure to error out if no matching mode is found either */
 
@@ -721,18 +825,35 @@ worker_switch_to_mode(const char *mode)
      * Similarly, unmount mtp device to make sure sure it gets mounted
      * with appropriate uid/gid values when it is actually needed.
      */
+    trace_enter_phase(TRACE_PHASE_STOP_MTPD);
     worker_stop_mtpd();
+    trace_leave_phase(TRACE_PHASE_STOP_MTPD);
+    if( worker_bailing_out() )
+        goto FAILED;
+
+    trace_enter_phase(TRACE_PHASE_UNMOUNT_MTP);
     worker_unmount_mtp_device();
+    trace_leave_phase(TRACE_PHASE_UNMOUNT_MTP);
+    if( worker_bailing_out() )
+        goto FAILED;
 
     if( worker_get_usb_mode_data() ) {
+        trace_enter_phase(TRACE_PHASE_LEAVE_MODE);
         modesetting_leave_dynamic_mode();
         worker_set_usb_mode_data(NULL);
+        trace_leave_phase(TRACE_PHASE_LEAVE_MODE);
+        if( worker_bailing_out() )
+            goto FAILED;
     }
 
     /* Mode specific applications have been stopped and we can
      * take updated appsync configuration in use.
      */
+    trace_enter_phase(TRACE_PHASE_APPSYNC_SWITCH);
     appsync_switch_configuration();
+    trace_leave_phase(TRACE_PHASE_APPSYNC_SWITCH);
+    if( worker_bailing_out() )
+        goto FAILED;
 
     log_debug("Setting %s\n", mode);
 
@@ -752,7 +873,7 @@ worker_switch_to_mode(const char *mode)
         goto FAILED;
     }
 
-    if( (data = usbmoded_dup_modedata(mode)) ) {
+    if( (data = usbmoded_ref_modedata(mode)) ) {
         log_debug("Matching mode %s found.\n", mode);
 
         /* set data before calling any of the dynamic mode functions
@@ -762,25 +883,33 @@ worker_switch_to_mode(const char *mode)
         /* When dealing with configfs, we can't enable UDC without
          * already having mtpd running */
         if( worker_mode_is_mtp_mode(mode) && configfs_in_use() ) {
-            if( !worker_mount_mtp_device() )
-                goto FAILED;
-            if( !worker_start_mtpd() )
+            trace_enter_phase(TRACE_PHASE_START_MTPD);
+            bool ack = worker_mount_mtp_device() && worker_start_mtpd();
+            trace_leave_phase(TRACE_PHASE_START_MTPD);
+            if( !ack || worker_bailing_out() )
                 goto FAILED;
         }
 
-        if( !worker_set_kernel_module(data->mode_module) )
+        trace_enter_phase(TRACE_PHASE_LOAD_MODULE);
+        bool loaded = worker_set_kernel_module(data->mode_module);
+        trace_leave_phase(TRACE_PHASE_LOAD_MODULE);
+        if( !loaded || worker_bailing_out() )
             goto FAILED;
 
-        if( !modesetting_enter_dynamic_mode() )
+        trace_enter_phase(TRACE_PHASE_ENTER_MODE);
+        bool entered = modesetting_enter_dynamic_mode();
+        trace_leave_phase(TRACE_PHASE_ENTER_MODE);
+        if( !entered || worker_bailing_out() )
             goto FAILED;
 
         /* When dealing with android usb, it must be enabled before
          * we can start mtpd. Assumption is that the same applies
          * when using kernel modules. */
         if( worker_mode_is_mtp_mode(mode) && !configfs_in_use() ) {
-            if( !worker_mount_mtp_device() )
-                goto FAILED;
-            if( !worker_start_mtpd() )
+            trace_enter_phase(TRACE_PHASE_START_MTPD);
+            bool ack = worker_mount_mtp_device() && worker_start_mtpd();
+            trace_leave_phase(TRACE_PHASE_START_MTPD);
+            if( !ack || worker_bailing_out() )
                 goto FAILED;
         }
 
@@ -790,6 +919,11 @@ worker_switch_to_mode(const char *mode)
     log_warning("Matching mode %s was not found.", mode);
 
 FAILED:
+    /* Target mode changed while we were busy; bail out without
+     * falling back to charging mode, the new target gets applied
+     * as soon as we return to the worker loop. */
+    superseded = worker_bailing_out();
+
     worker_bailout_handled = true;
 
     /* Undo any changes we might have might have already done */
@@ -800,6 +934,12 @@ FAILED:
         worker_set_usb_mode_data(NULL);
     }
 
+    if( superseded ) {
+        log_debug("mode switch to %s superseded", mode);
+        outcome = TRACE_OUTCOME_SUPERSEDED;
+        goto SUCCESS;
+    }
+
     /* From usb configuration point of view MODE_UNDEFINED and
      * MODE_CHARGING are the same, but for the purposes of exposing
      * a sane state over D-Bus we need to differentiate between
@@ -810,14 +950,17 @@ FAILED:
     WORKER_LOCKED_ENTER;
     const char *requested = worker_get_requested_mode_locked();
     if( !g_strcmp0(requested, MODE_UNDEFINED) )
-        override = MODE_UNDEFINED;
+        override = MODE_UNDEFINED, outcome = TRACE_OUTCOME_ABORTED;
     else
-        override = MODE_CHARGING;
+        override = MODE_CHARGING, outcome = TRACE_OUTCOME_FALLBACK;
     WORKER_LOCKED_LEAVE;
     log_warning("mode setting failed, try %s", override);
 
 CHARGE:
-    if( worker_switch_to_charging() )
+    trace_enter_phase(TRACE_PHASE_CHARGING);
+    bool charging = worker_switch_to_charging();
+    trace_leave_phase(TRACE_PHASE_CHARGING);
+    if( charging )
         goto SUCCESS;
 
     log_crit("failed to activate charging, all bets are off");
@@ -828,14 +971,19 @@ CHARGE:
      * no mode matched, and charging setup failed too.
      */
 
-    override = MODE_UNDEFINED;
+    override = MODE_UNDEFINED, outcome = TRACE_OUTCOME_FAILED;
     log_warning("mode setting failed, fallback to %s", override);
     worker_set_kernel_module(MODULE_NONE);
 
 SUCCESS:
 
     WORKER_LOCKED_ENTER;
-    if( override ) {
+    if( superseded ) {
+        /* Hardware state is not known, make sure that whatever
+         * gets requested next is applied without shortcuts. */
+        worker_set_activated_mode_locked(MODE_UNDEFINED);
+    }
+    else if( override ) {
         worker_set_requested_mode_locked(override);
         override = common_map_mode_to_hardware(override);
         worker_set_activated_mode_locked(override);
@@ -843,11 +991,14 @@ SUCCESS:
     else {
         worker_set_activated_mode_locked(mode);
     }
+    trace_end_transition(worker_get_activated_mode_locked(), outcome);
     WORKER_LOCKED_LEAVE;
 
-    worker_notify();
+    /* Main thread is notified after the final target has been applied */
+    if( !superseded )
+        worker_notify();
 
-    modedata_free(data);
+    modedata_unref(data);
 
     return;
 }
@@ -856,15 +1007,6 @@ SUCCESS:
  * WORKER_THREAD
  * ------------------------------------------------------------------------- */
 
-/** eventfd descriptor for waking up worker thread after adding new jobs */
-static int              worker_req_evfd  = -1;
-
-/** eventfd descriptor for waking up main thread after executing jobs */
-static int              worker_rsp_evfd  = -1;
-
-/** I/O watch identifier for worker_rsp_evfd */
-static guint            worker_rsp_wid   = 0;
-
 static guint
 worker_add_iowatch(int fd, bool close_on_unref,
                GIOCondition cnd, GIOFunc io_cb, gpointer aptr)
@@ -910,28 +1052,31 @@ static void *worker_thread_cb(void *aptr)
 
     /* Loop until explicitly canceled */
     for( ;; ) {
+        struct pollfd pfd = {
+            .fd     = worker_req_evfd,
+            .events = POLLIN,
+        };
+
         /* Async cancellation point at wait() */
         pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, 0);
-        uint64_t cnt = 0;
-        int rc = read(worker_req_evfd, &cnt, sizeof cnt);
+        int rc = poll(&pfd, 1, -1);
         pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
 
         if( rc == -1 ) {
-            if( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK )
+            if( errno == EINTR || errno == EAGAIN )
                 continue;
-            log_err("read: %m");
+            log_err("poll: %m");
             goto EXIT;
         }
 
-        if( rc != sizeof cnt )
-            continue;
-
-        if( cnt > 0 ) {
-            worker_bailout_requested = false;
-            worker_bailout_handled = false;
-            worker_execute();
+        if( pfd.revents & ~POLLIN ) {
+            log_err("unexpected poll events: 0x%x", (unsigned)pfd.revents);
+            goto EXIT;
         }
 
+        /* Pending wakeups are consumed by worker_execute() */
+        if( pfd.revents & POLLIN )
+            worker_execute();
     }
 EXIT:
     return 0;
@@ -1094,7 +1239,7 @@ worker_create_eventfd(void)
 
     /* Setup request pipeline */
 
-    if( (worker_req_evfd = eventfd(0, EFD_CLOEXEC)) == -1 )
+    if( (worker_req_evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1 )
         goto EXIT;
 
     ack = true;
@@ -1143,7 +1288,7 @@ worker_wakeup(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    worker_bailout_requested = true;
+    g_atomic_int_inc(&worker_request_seq);
 
     uint64_t cnt = 1;
     if( write(worker_req_evfd, &cnt, sizeof cnt) == -1 ) {
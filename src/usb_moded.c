@@ -44,11 +44,16 @@
 #include "usb_moded-control.h"
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-devicelock.h"
+#include "usb_moded-dhcpd.h"
+#include "usb_moded-exec.h"
+#include "usb_moded-identity.h"
 #include "usb_moded-log.h"
 #include "usb_moded-mac.h"
 #include "usb_moded-modesetting.h"
 #include "usb_moded-modules.h"
+#include "usb_moded-network.h"
 #include "usb_moded-sigpipe.h"
+#include "usb_moded-snapshot.h"
 #include "usb_moded-systemd.h"
 #include "usb_moded-trigger.h"
 #include "usb_moded-udev.h"
@@ -101,6 +106,14 @@
 
 #define CABLE_CONNECTION_DELAY_MAXIMUM 4000
 
+/** Delay before releasing replaced mode data lookup tables [ms]
+ *
+ * Lookups made from other threads take only a hash table search
+ * and a reference count increment - this just needs to be long
+ * enough for them to finish without main thread busy waiting.
+ */
+#define USBMODED_MODETABLE_GRACE_MS 1000
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -109,15 +122,24 @@
  * USBMODED
  * ------------------------------------------------------------------------- */
 
+static gboolean   usbmoded_retire_modetables_cb      (gpointer aptr);
+static void       usbmoded_release_modetables        (void);
+static void       usbmoded_publish_modetable         (modetable_t *modetable);
 GList            *usbmoded_get_modelist              (void);
 void              usbmoded_load_modelist             (void);
+gchar           **usbmoded_reload_modelist           (void);
 void              usbmoded_free_modelist             (void);
 const modedata_t *usbmoded_get_modedata              (const char *modename);
-modedata_t       *usbmoded_dup_modedata              (const char *modename);
+modedata_t       *usbmoded_ref_modedata              (const char *modename);
 bool              usbmoded_get_rescue_mode           (void);
 void              usbmoded_set_rescue_mode           (bool rescue_mode);
 bool              usbmoded_get_diag_mode             (void);
 void              usbmoded_set_diag_mode             (bool diag_mode);
+#ifdef SAILFISH_ACCESS_CONTROL
+static guint8    *usbmoded_build_permits             (uid_t uid);
+#endif
+void              usbmoded_invalidate_permissions    (void);
+guint             usbmoded_get_modes_generation      (void);
 bool              usbmoded_is_mode_permitted         (const char *modename, uid_t uid);
 void              usbmoded_set_cable_connection_delay(int delay_ms);
 int               usbmoded_get_cable_connection_delay(void);
@@ -157,22 +179,6 @@ static bool       usbmoded_systemd_notify = false;
 #endif
 static bool       usbmoded_auto_exit      = false;
 
-static pthread_mutex_t  usbmoded_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-#define USBMODED_LOCKED_ENTER do {\
-    if( pthread_mutex_lock(&usbmoded_mutex) != 0 ) { \
-        log_crit("USBMODED LOCK FAILED");\
-        _exit(EXIT_FAILURE);\
-    }\
-}while(0)
-
-#define USBMODED_LOCKED_LEAVE do {\
-    if( pthread_mutex_unlock(&usbmoded_mutex) != 0 ) { \
-        log_crit("USBMODED UNLOCK FAILED");\
-        _exit(EXIT_FAILURE);\
-    }\
-}while(0)
-
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
@@ -181,11 +187,127 @@ static pthread_mutex_t  usbmoded_mutex = PTHREAD_MUTEX_INITIALIZER;
  * MODELIST
  * ------------------------------------------------------------------------- */
 
-/** List of mode data items read from configuration files
+/** Lookup table for mode data items read from configuration files
+ *
+ * The table is replaced as a whole when mode configuration is reloaded.
+ * Only main thread modifies the pointer, other threads access mode data
+ * only via #usbmoded_ref_modedata().
+ */
+static modetable_t *usbmoded_modetable = 0;
+
+/** Number of #usbmoded_ref_modedata() calls in progress
+ *
+ * Used for determining when a replaced lookup table can be released.
+ */
+static gint usbmoded_modetable_readers = 0;
+
+/** Replaced lookup tables waiting to be released
+ *
+ * Only main thread accesses this.
+ */
+static GSList *usbmoded_retired_modetables = 0;
+
+/** Timer id for releasing #usbmoded_retired_modetables */
+static guint usbmoded_retire_modetables_id = 0;
+
+/** Tracking data for mode configuration files
+ *
+ * Created on the first reload, so that unchanged files do not need
+ * to be parsed again on subsequent reloads.
+ */
+static filecache_t *usbmoded_modefiles = 0;
+
+/** Timer callback for releasing replaced lookup tables
+ *
+ * Lookups that started after the tables were replaced can not see
+ * them, so the tables can be released as soon as there are no lookups
+ * in progress. Otherwise try again after another grace period.
+ *
+ * @param aptr  (unused)
+ *
+ * @return G_SOURCE_CONTINUE while lookups are in progress,
+ *         G_SOURCE_REMOVE otherwise
+ */
+static gboolean
+usbmoded_retire_modetables_cb(gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    if( g_atomic_int_get(&usbmoded_modetable_readers) > 0 ) {
+        log_debug("mode lookups in progress; postponing table release");
+        return G_SOURCE_CONTINUE;
+    }
+
+    usbmoded_retire_modetables_id = 0;
+    usbmoded_release_modetables();
+
+    return G_SOURCE_REMOVE;
+}
+
+/** Release replaced lookup tables immediately
+ *
+ * Note: This function should be called only from the main thread,
+ *       either from #usbmoded_retire_modetables_cb() or when no other
+ *       thread can be making lookups.
+ */
+static void
+usbmoded_release_modetables(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( usbmoded_retire_modetables_id ) {
+        g_source_remove(usbmoded_retire_modetables_id),
+            usbmoded_retire_modetables_id = 0;
+    }
+
+    g_slist_free_full(usbmoded_retired_modetables,
+                      (GDestroyNotify)modetable_free),
+        usbmoded_retired_modetables = 0;
+}
+
+/** Replace mode data lookup table
+ *
+ * Lookups done from other threads are not blocked. The previous table
+ * is released after a grace period, once all lookups that might have
+ * seen it are finished. Mode data objects referenced before that remain
+ * valid until released via #modedata_unref().
+ *
+ * Note: This function should be called only from the main thread.
  *
- * Note: Worker thread should access this only via #usbmoded_dup_modedata().
+ * @param modetable  Lookup table to publish, or NULL
  */
-static GList *usbmoded_modelist = 0;
+static void
+usbmoded_publish_modetable(modetable_t *modetable)
+{
+    LOG_REGISTER_CONTEXT;
+
+    modetable_t *previous = g_atomic_pointer_get(&usbmoded_modetable);
+
+    if( previous == modetable )
+        goto EXIT;
+
+    g_atomic_pointer_set(&usbmoded_modetable, modetable);
+
+    /* Cached permissions are indexed by modetable position */
+    usbmoded_invalidate_permissions();
+
+    if( !previous )
+        goto EXIT;
+
+    usbmoded_retired_modetables =
+        g_slist_prepend(usbmoded_retired_modetables, previous);
+
+    if( !usbmoded_retire_modetables_id ) {
+        usbmoded_retire_modetables_id =
+            g_timeout_add(USBMODED_MODETABLE_GRACE_MS,
+                          usbmoded_retire_modetables_cb, 0);
+    }
+
+EXIT:
+    return;
+}
 
 /** Get list of dynamic mode data items
  *
@@ -198,7 +320,7 @@ usbmoded_get_modelist(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    return usbmoded_modelist;
+    return modetable_get_list(usbmoded_modetable);
 }
 
 /** Load dynamic mode data items
@@ -210,34 +332,96 @@ usbmoded_load_modelist(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    USBMODED_LOCKED_ENTER;
-
-    if( !usbmoded_modelist ) {
+    if( !usbmoded_modetable ) {
         log_notice("load modelist");
-        usbmoded_modelist = modelist_load(usbmoded_get_diag_mode());
+        GList *modelist = snapshot_load_modelist(usbmoded_get_diag_mode());
+        usbmoded_publish_modetable(modetable_create(modelist));
+    }
+}
+
+/** Reload dynamic mode data items
+ *
+ * Only mode configuration files that have been added or changed since
+ * the previous reload are parsed. The lookup table is replaced only if
+ * some mode was added, removed or modified, and unlike unload + load,
+ * this never leaves other threads looking at an empty mode list.
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @return NULL terminated array of changed mode names, release with
+ *         g_strfreev()
+ */
+gchar **
+usbmoded_reload_modelist(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GPtrArray   *changed   = g_ptr_array_new();
+    modetable_t *modetable = 0;
+    bool         initial   = !usbmoded_modefiles;
+
+    log_notice("reload modelist");
+
+    if( initial )
+        usbmoded_modefiles = modelist_cache_create(usbmoded_get_diag_mode());
+
+    /* Initial scan needs to be compared against snapshot data */
+    if( !filecache_scan(usbmoded_modefiles) && !initial )
+        goto EXIT;
+
+    modetable = modetable_create(modelist_cache_load(usbmoded_modefiles));
+
+    for( GList *iter = usbmoded_get_modelist(); iter; iter = g_list_next(iter) ) {
+        const modedata_t *prev = iter->data;
+        const modedata_t *curr = modetable_lookup(modetable, prev->mode_name);
+        if( !curr )
+            log_debug("mode '%s' removed", prev->mode_name);
+        else if( !modedata_equal(prev, curr) )
+            log_debug("mode '%s' modified", prev->mode_name);
+        else
+            continue;
+        g_ptr_array_add(changed, g_strdup(prev->mode_name));
+    }
+
+    for( GList *iter = modetable_get_list(modetable); iter; iter = g_list_next(iter) ) {
+        const modedata_t *curr = iter->data;
+        if( usbmoded_get_modedata(curr->mode_name) )
+            continue;
+        log_debug("mode '%s' added", curr->mode_name);
+        g_ptr_array_add(changed, g_strdup(curr->mode_name));
     }
 
-    USBMODED_LOCKED_LEAVE;
+    if( changed->len > 0 )
+        usbmoded_publish_modetable(modetable), modetable = 0;
+
+EXIT:
+    modetable_free(modetable);
+
+    log_notice("modelist changes: %u", changed->len);
+    g_ptr_array_add(changed, 0);
+    return (gchar **)g_ptr_array_free(changed, FALSE);
 }
 
 /** Free dynamic mode data items
  *
- * Note: This function should be called only from the main thread.
+ * Note: This function should be called only from the main thread,
+ *       after the worker thread has been stopped.
  */
 void
 usbmoded_free_modelist(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    USBMODED_LOCKED_ENTER;
-
-    if( usbmoded_modelist ) {
+    if( usbmoded_modetable ) {
         log_notice("free modelist");
-        modelist_free(usbmoded_modelist),
-            usbmoded_modelist = 0;
+        usbmoded_publish_modetable(0);
     }
 
-    USBMODED_LOCKED_LEAVE;
+    /* No lookups are possible, skip the grace period */
+    usbmoded_release_modetables();
+
+    filecache_delete(usbmoded_modefiles),
+        usbmoded_modefiles = 0;
 }
 
 /** Lookup dynamic mode data by name
@@ -253,38 +437,30 @@ usbmoded_get_modedata(const char *modename)
 {
     LOG_REGISTER_CONTEXT;
 
-    modedata_t *modedata = 0;
-
-    for( GList *iter = usbmoded_get_modelist(); iter; iter = g_list_next(iter) ) {
-        modedata_t *data = iter->data;
-        if( !g_strcmp0(data->mode_name, modename) ) {
-            modedata = data;
-            break;
-        }
-    }
-    return modedata;
+    return modetable_lookup(usbmoded_modetable, modename);
 }
 
-/** Lookup and clone dynamic mode data by name
+/** Lookup and reference dynamic mode data by name
  *
  * Note: This function is safe to call from worker thread too.
  *
- * Caller must release the returned object via #modedata_free().
+ * Caller must release the returned object via #modedata_unref().
  *
  * @param modename  Name of mode to lookup
  *
  * @return Mode data object, or NULL
  */
 modedata_t *
-usbmoded_dup_modedata(const char *modename)
+usbmoded_ref_modedata(const char *modename)
 {
     LOG_REGISTER_CONTEXT;
 
-    USBMODED_LOCKED_ENTER;
+    g_atomic_int_inc(&usbmoded_modetable_readers);
 
-    modedata_t *modedata = modedata_copy(usbmoded_get_modedata(modename));
+    modetable_t *modetable = g_atomic_pointer_get(&usbmoded_modetable);
+    modedata_t  *modedata  = modedata_ref(modetable_lookup(modetable, modename));
 
-    USBMODED_LOCKED_LEAVE;
+    g_atomic_int_add(&usbmoded_modetable_readers, -1);
 
     return modedata;
 }
@@ -360,14 +536,117 @@ void usbmoded_set_diag_mode(bool diag_mode)
  * ACCESS_CHECKS
  * ------------------------------------------------------------------------- */
 
+/** Counter for tracking changes in mode list and mode permissions */
+static guint usbmoded_modes_generation = 0;
+
+#ifdef SAILFISH_ACCESS_CONTROL
+/** Cached dynamic mode permissions
+ *
+ * Maps uid -> bitmap indexed by modetable position.
+ */
+static GHashTable *usbmoded_permits_lut = 0;
+
+/** Evaluate dynamic mode permissions for a user
+ *
+ * @param uid  user id
+ *
+ * @return bitmap indexed by modetable position, release with g_free()
+ */
+static guint8 *
+usbmoded_build_permits(uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int         count   = modetable_get_count(usbmoded_modetable);
+    guint8     *permits = g_malloc0(count / 8 + 1);
+    GHashTable *groups  = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                g_free, 0);
+
+    for( GList *iter = usbmoded_get_modelist(); iter; iter = g_list_next(iter) ) {
+        const modedata_t *data    = iter->data;
+        int               index   = modetable_get_index(usbmoded_modetable,
+                                                        data->mode_name);
+        gpointer          allowed = 0;
+
+        /* dynamic modes are allowed based on group,
+         * which defaults to sailfish-system meaning device owner only */
+        gchar *group = config_get_group_for_mode(data->mode_name);
+
+        /* Typically most modes share the same group */
+        if( g_hash_table_lookup_extended(groups, group, 0, &allowed) ) {
+            g_free(group);
+        }
+        else {
+            allowed = GINT_TO_POINTER(sailfish_access_control_hasgroup(uid, group));
+            g_hash_table_insert(groups, group, allowed);
+        }
+
+        if( allowed )
+            permits[index / 8] |= 1 << (index % 8);
+    }
+
+    g_hash_table_unref(groups);
+    return permits;
+}
+#endif
+
+/** Forget cached mode permissions
+ *
+ * Should be called when the mode list, mode group configuration,
+ * or group memberships might have changed.
+ *
+ * Note: This function should be called only from the main thread.
+ */
+void
+usbmoded_invalidate_permissions(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    ++usbmoded_modes_generation;
+
+#ifdef SAILFISH_ACCESS_CONTROL
+    if( usbmoded_permits_lut && g_hash_table_size(usbmoded_permits_lut) ) {
+        log_debug("mode permissions invalidated");
+        g_hash_table_remove_all(usbmoded_permits_lut);
+    }
+#endif
+}
+
+/** Get mode list / mode permissions generation
+ *
+ * The value changes whenever the mode list is reloaded, or when mode
+ * permissions might have changed. Can be used for checking validity
+ * of data derived from those.
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @return generation counter value
+ */
+guint
+usbmoded_get_modes_generation(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return usbmoded_modes_generation;
+}
+
+/** Check if user is allowed to use a mode
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @param modename  Name of mode
+ * @param uid       user id
+ *
+ * @return true if mode is allowed, false otherwise
+ */
 bool usbmoded_is_mode_permitted(const char *modename, uid_t uid)
 {
 #ifdef SAILFISH_ACCESS_CONTROL
     LOG_REGISTER_CONTEXT;
 
-    bool        allowed = true;
-    modedata_t *data = 0;
-    char       *group = 0;
+    bool    allowed = true;
+    int     index   = -1;
+    guint8 *permits = 0;
 
     /* all modes are allowed for root */
     if( uid == 0 )
@@ -380,19 +659,24 @@ bool usbmoded_is_mode_permitted(const char *modename, uid_t uid)
     }
 
     /* non-dynamic modes are allowed for all */
-    if( !(data = usbmoded_dup_modedata(modename)) )
+    if( (index = modetable_get_index(usbmoded_modetable, modename)) < 0 )
         goto EXIT;
 
-    /* dynamic modes are allowed based on group,
-     * which defaults to sailfish-system meaning device owner only */
-    group = config_get_group_for_mode(modename);
-    allowed = sailfish_access_control_hasgroup(uid, group);
+    if( !usbmoded_permits_lut )
+        usbmoded_permits_lut = g_hash_table_new_full(g_direct_hash,
+                                                     g_direct_equal,
+                                                     0, g_free);
 
-EXIT:
+    permits = g_hash_table_lookup(usbmoded_permits_lut, GUINT_TO_POINTER(uid));
+    if( !permits ) {
+        permits = usbmoded_build_permits(uid);
+        g_hash_table_insert(usbmoded_permits_lut, GUINT_TO_POINTER(uid),
+                            permits);
+    }
 
-    g_free(group);
-    modedata_free(data);
+    allowed = (permits[index / 8] >> (index % 8)) & 1;
 
+EXIT:
     return allowed;
 
 #else
@@ -697,13 +981,12 @@ void usbmoded_handle_signal(int signum)
     {
         /* Reload mode list
          *
-         * Note that copy of mode data related to the current
-         * mode is stored separately and that copy is used
+         * Note that worker holds a reference to mode data
+         * related to the current mode, and that is used
          * when making exit from current mode.
          */
         log_debug("reloading dynamic mode configuration");
-        usbmoded_free_modelist();
-        usbmoded_load_modelist();
+        gchar **changed = usbmoded_reload_modelist();
 
         /* Reload appsync configuration files
          *
@@ -717,11 +1000,20 @@ void usbmoded_handle_signal(int signum)
         log_debug("reloading appsync configuration");
         appsync_load_configuration();
 #endif
+        if( !*changed ) {
+            log_debug("dynamic mode configuration unchanged");
+            g_strfreev(changed);
+            return;
+        }
+
         /* If default mode selection became invalid,
          * revert setting to "ask" */
         uid_t current_user = usbmoded_get_current_user();
         gchar *config = config_get_mode_setting(current_user);
-        if( g_strcmp0(config, MODE_ASK) &&
+        if( !config || !g_strv_contains((const gchar * const *)changed, config) ) {
+            log_debug("default mode '%s' is not affected", config);
+        }
+        else if( g_strcmp0(config, MODE_ASK) &&
             common_valid_mode(config) ) {
             log_warning("default mode '%s' is not valid, reset to '%s'",
                         config, MODE_ASK);
@@ -743,6 +1035,10 @@ void usbmoded_handle_signal(int signum)
              * file changes - no changes required. */
             log_debug("current mode '%s' is internal", current);
         }
+        else if( !current || !g_strv_contains((const gchar * const *)changed, current) ) {
+            /* Configuration of current mode was not touched */
+            log_debug("current mode '%s' is not affected", current);
+        }
         else if( common_valid_mode(current) ) {
             /* Dynamic mode that is no longer valid - choose
              * something else. */
@@ -759,6 +1055,7 @@ void usbmoded_handle_signal(int signum)
              * mode connection during upgrade, etc. */
             log_debug("current mode '%s' is still valid", current);
         }
+        g_strfreev(changed);
 
         /* Signal availability */
         log_debug("broadcast mode availability lists");
@@ -824,9 +1121,19 @@ static bool usbmoded_init(void)
     }
 #endif
 
+    /* Network listener maintains ofono / connman state used
+     * for setting up connection sharing. */
+    if( !network_start_listener() ) {
+        log_crit("network state tracking could not be started");
+        goto EXIT;
+    }
+
     /* Set daemon config/state data to sane state */
     modesetting_init();
 
+    /* Parse device identity details that do not change at runtime */
+    identity_init();
+
     /* check config, merge or create if outdated */
     if( !config_init() ) {
         log_crit("Cannot create or find a valid configuration");
@@ -877,6 +1184,9 @@ static bool usbmoded_init(void)
         common_msleep(2000);
     }
 
+    /* Create gadget functions that configured modes need */
+    modesetting_prestage();
+
     /* Allow making systemd control ipc */
     if( !systemd_control_start() ) {
         log_crit("systemd control could not be started");
@@ -978,6 +1288,9 @@ static void usbmoded_cleanup(void)
     devicelock_stop_listener();
 #endif
 
+    /* Stop tracking ofono / connman state */
+    network_stop_listener();
+
     /* Stop tracking device state */
 #ifdef MEEGOLOCK
     dsme_stop_listener();
@@ -997,21 +1310,36 @@ static void usbmoded_cleanup(void)
     /* Undo usbmoded_load_modelist() */
     usbmoded_free_modelist();
 
+#ifdef SAILFISH_ACCESS_CONTROL
+    /* Release mode permission cache */
+    if( usbmoded_permits_lut )
+        g_hash_table_unref(usbmoded_permits_lut), usbmoded_permits_lut = 0;
+#endif
+
+    /* Undo config_init() */
+    config_quit();
+
 #ifdef APP_SYNC
     /* Undo appsync_load_configuration() */
     appsync_free_configuration();
 #endif
 
     /* Release dynamic memory */
+    common_clear_mode_list_cache();
     worker_clear_kernel_module();
     worker_clear_hardware_mode();
     control_clear_cable_state();
     control_clear_internal_mode();
     control_clear_external_mode();
     control_clear_target_mode();
+    dhcpd_stop();
+    exec_quit();
 
     modesetting_quit();
 
+    /* Undo identity_init() */
+    identity_quit();
+
     /* Detach from SessionBus connection used for APP_SYNC_DBUS.
      *
      * Can be handled separately from SystemBus side wind down. */
@@ -1217,7 +1545,7 @@ int main(int argc, char* argv[])
     fprintf(stderr, "usb_moded %s starting\n", VERSION);
     fflush(stderr);
 
-    /* Silence common_system() calls */
+    /* Silence output not captured by exec_run() */
     if( log_get_type() != LOG_TO_STDERR && log_get_level() != LOG_DEBUG )
     {
         if( !freopen("/dev/null", "a", stdout) ) {
@@ -66,13 +66,16 @@
 
 GList            *usbmoded_get_modelist              (void);
 void              usbmoded_load_modelist             (void);
+gchar           **usbmoded_reload_modelist           (void);
 void              usbmoded_free_modelist             (void);
 const modedata_t *usbmoded_get_modedata              (const char *modename);
-modedata_t       *usbmoded_dup_modedata              (const char *modename);
+modedata_t       *usbmoded_ref_modedata              (const char *modename);
 bool              usbmoded_get_rescue_mode           (void);
 void              usbmoded_set_rescue_mode           (bool rescue_mode);
 bool              usbmoded_get_diag_mode             (void);
 void              usbmoded_set_diag_mode             (bool diag_mode);
+void              usbmoded_invalidate_permissions    (void);
+guint             usbmoded_get_modes_generation      (void);
 bool              usbmoded_is_mode_permitted         (const char *modename, uid_t uid);
 void              usbmoded_set_cable_connection_delay(int delay_ms);
 int               usbmoded_get_cable_connection_delay(void);